@@ -0,0 +1,1349 @@
+// HTTP load generator for webserv (built by `make bench`, see bench/run.sh)
+//
+// usage: loadgen [options]
+//   -H host        server address (127.0.0.1)
+//   -p port        server port (8080)
+//   -c n           open connections (16)
+//   -t n           threads, connections are spread over them (1)
+//   -d seconds     how long to run (5)
+//   -n n           stop after n requests (the duration still caps the run)
+//   -k             keep connections alive (default: Connection: close)
+//   -P depth       requests in flight per keep-alive connection (1)
+//   -u path        request a single path (/)
+//   -X method      method for -u (GET)
+//   -e status      status expected for -u, anything else is an error
+//   -m file        request mix, one JSON object per line:
+//                  {"name": "small", "method": "GET", "path": "/small.html",
+//                   "headers": {"Range": "bytes=0-99"}, "body": "...",
+//                   "body_file": "upload.body", "weight": 3, "expect": 206}
+//                  "random_range": {"size": 4194304, "length": 4096} sends
+//                  each request with a Range of that length at a random
+//                  offset of a file of that size
+//   -s pid         webserv pid, to report its CPU time per request, and its
+//                  system calls per request when the raw_syscalls tracepoint
+//                  can be counted (root, tracefs mounted)
+//   -l label       name printed with the results (scenario)
+//   -o file        append the results to file as a JSON line
+//   -S             speak TLS (the certificate is not checked)
+//   -R             with -S, resume each thread's last TLS session on new
+//                  connections instead of full handshakes
+//   -w bytes       WebSocket: each connection upgrades on -u, then every
+//                  request is a text message of that size, answered by the
+//                  echo (keeps -P messages in flight)
+//   -i             WebSocket: each connection upgrades on -u and stays idle;
+//                  with -s, reports the server's memory per connection
+//   -b bytes       upload: every request is a multipart/form-data POST to -u
+//                  with one generated file of that size (with -X PUT, the
+//                  file is the whole body), streamed without holding it in
+//                  memory; reports the upload throughput
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <linux/perf_event.h>
+#include <map>
+#include <netdb.h>
+#include <openssl/ssl.h>
+#include <pthread.h>
+#include <sstream>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+#define MAX_EVENTS 256
+#define RECV_SIZE 65536
+// the pseudo-random bytes -b repeats as the file
+#define PATTERN_SIZE 262144
+#define UPLOAD_BOUNDARY "loadgen-upload-7d2f9c41"
+
+struct Options
+{
+	std::string host;
+	std::string port;
+	int connections;
+	int threads;
+	double duration;
+	unsigned long maxRequests;
+	bool keepAlive;
+	int depth;
+	std::string path;
+	std::string method;
+	int expect;
+	std::string mixFile;
+	int serverPid;
+	std::string label;
+	std::string output;
+	bool tls;
+	bool resume;
+	size_t message;
+	bool idle;
+	unsigned long long upload;
+
+	Options()
+		: host("127.0.0.1"), port("8080"), connections(16), threads(1), duration(5), maxRequests(0),
+		  keepAlive(false), depth(1), path("/"), method("GET"), expect(0), serverPid(0), label("bench"), tls(false),
+		  resume(false), message(0), idle(false), upload(0)
+	{
+	}
+};
+
+struct Request
+{
+	std::string name;
+	std::string method;
+	// with random_range, the head up to the Range header, then the rest
+	std::string raw;
+	std::string rawEnd;
+	unsigned int weight;
+	int expect;
+	unsigned long long rangeSize;
+	unsigned long long rangeLength;
+
+	Request() : name(), method(), raw(), rawEnd(), weight(0), expect(0), rangeSize(0), rangeLength(0)
+	{
+	}
+};
+
+struct Pending
+{
+	size_t request;
+	double start;
+};
+
+struct Connection
+{
+	int fd;
+	SSL *ssl;
+	bool handshaking;
+	bool writing;
+	std::string out;
+	size_t sent;
+	std::string in;
+	std::deque<Pending> pending;
+	unsigned long served;
+	// a WebSocket connection past its 101
+	bool upgraded;
+	// -b: what is left of the file and closing boundary, sent after out
+	unsigned long long streamLeft;
+};
+
+struct Worker
+{
+	pthread_t thread;
+	int connections;
+	unsigned int seed;
+	std::vector<unsigned int> latencies;
+	unsigned long completed;
+	unsigned long errors;
+	unsigned long unanswered;
+	unsigned long connectionsOpened;
+	unsigned long connectErrors;
+	unsigned long bytes;
+	unsigned long long sent;
+	unsigned long status[6];
+	std::vector<unsigned long> requestErrors;
+	unsigned long handshakes;
+	unsigned long resumed;
+	// the session new connections resume with -R
+	SSL_SESSION *session;
+	double end;
+};
+
+static Options g_options;
+static std::vector<Request> g_requests;
+static unsigned int g_totalWeight = 0;
+static struct addrinfo *g_address = NULL;
+static double g_deadline = 0;
+static unsigned long g_issued = 0;
+static SSL_CTX *g_tls = NULL;
+// the masked message -w sends, and the server's memory per idle connection
+// measured by -i (-1 when it was not)
+static std::string g_frame;
+static double g_rssPerConnection = -1;
+// one counter of the raw_syscalls:sys_enter tracepoint per server thread
+static std::vector<int> g_syscallCounters;
+// the file -b sends, repeated, and what follows it
+static std::string g_pattern;
+static std::string g_uploadEnd;
+
+/*** Utils ***/
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static std::string toLower(std::string s)
+{
+	for (size_t i = 0; i < s.size(); i++)
+		s[i] = tolower(s[i]);
+	return s;
+}
+
+static void fail(const std::string &msg)
+{
+	std::cerr << "loadgen: " << msg << std::endl;
+	exit(1);
+}
+
+// reads the user + system CPU time of a process in seconds
+static double processCpu(int pid)
+{
+	std::ostringstream path;
+	path << "/proc/" << pid << "/stat";
+	std::ifstream file(path.str().c_str());
+	std::string stat;
+
+	if (!std::getline(file, stat) || stat.rfind(')') == std::string::npos)
+		return -1;
+	std::istringstream iss(stat.substr(stat.rfind(')') + 2));
+	std::string field;
+	unsigned long utime = 0, stime = 0;
+	// fields after the command name start at the state (3rd field)
+	for (int i = 3; i <= 15 && iss >> field; i++)
+	{
+		if (i == 14)
+			utime = strtoul(field.c_str(), NULL, 10);
+		else if (i == 15)
+			stime = strtoul(field.c_str(), NULL, 10);
+	}
+	return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+// resident memory of a process in kB
+static long processRss(int pid)
+{
+	std::ostringstream path;
+	path << "/proc/" << pid << "/status";
+	std::ifstream file(path.str().c_str());
+	std::string line;
+
+	while (std::getline(file, line))
+		if (line.compare(0, 6, "VmRSS:") == 0)
+			return strtol(line.c_str() + 6, NULL, 10);
+	return -1;
+}
+
+// the id perf knows the sys_enter tracepoint by, -1 without tracefs
+static long syscallTracepoint()
+{
+	static const char *paths[] = {"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+								  "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"};
+
+	for (size_t i = 0; i < sizeof(paths) / sizeof(*paths); i++)
+	{
+		std::ifstream file(paths[i]);
+		long id;
+		if (file >> id)
+			return id;
+	}
+	return -1;
+}
+
+// counts the system calls every thread of the process enters from now on;
+// threads started later are not counted. Returns false, with nothing open,
+// when the tracepoint cannot be read (not root, no tracefs)
+static bool openSyscallCounters(int pid)
+{
+	long id = syscallTracepoint();
+	std::ostringstream path;
+	path << "/proc/" << pid << "/task";
+	DIR *dir = id < 0 ? NULL : opendir(path.str().c_str());
+
+	if (!dir)
+		return false;
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_TRACEPOINT;
+	attr.size = sizeof(attr);
+	attr.config = id;
+	bool failed = false;
+	for (struct dirent *entry = readdir(dir); entry && !failed; entry = readdir(dir))
+	{
+		if (entry->d_name[0] == '.')
+			continue;
+		int fd = syscall(SYS_perf_event_open, &attr, atoi(entry->d_name), -1, -1, 0);
+		// a thread that has just exited is not an error
+		if (fd != -1)
+			g_syscallCounters.push_back(fd);
+		else
+			failed = errno != ESRCH;
+	}
+	closedir(dir);
+	if (failed || g_syscallCounters.empty())
+	{
+		for (size_t i = 0; i < g_syscallCounters.size(); i++)
+			close(g_syscallCounters[i]);
+		g_syscallCounters.clear();
+		return false;
+	}
+	return true;
+}
+
+static double closeSyscallCounters()
+{
+	unsigned long long total = 0;
+
+	for (size_t i = 0; i < g_syscallCounters.size(); i++)
+	{
+		unsigned long long count;
+		if (read(g_syscallCounters[i], &count, sizeof(count)) == sizeof(count))
+			total += count;
+		close(g_syscallCounters[i]);
+	}
+	return g_syscallCounters.empty() ? -1 : total;
+}
+
+static double selfCpu()
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec +
+		   usage.ru_stime.tv_usec / 1e6;
+}
+
+/*** Request mix ***/
+
+// just enough JSON for the mix files: objects, strings, numbers and booleans
+class JsonReader
+{
+public:
+	JsonReader(const std::string &text) : _text(text), _pos(0)
+	{
+	}
+
+	// flattens one object; nested objects become "key.inner" entries
+	void readObject(std::map<std::string, std::string> &out, const std::string &prefix)
+	{
+		expect('{');
+		skipSpace();
+		if (peek() == '}')
+		{
+			_pos++;
+			return;
+		}
+		for (;;)
+		{
+			std::string key = readString();
+			expect(':');
+			skipSpace();
+			if (peek() == '{')
+				readObject(out, prefix + key + ".");
+			else if (peek() == '"')
+				out[prefix + key] = readString();
+			else
+				out[prefix + key] = readBare();
+			skipSpace();
+			if (peek() == ',')
+			{
+				_pos++;
+				continue;
+			}
+			expect('}');
+			return;
+		}
+	}
+
+private:
+	char peek()
+	{
+		if (_pos >= _text.size())
+			throw std::string("unexpected end of line");
+		return _text[_pos];
+	}
+
+	void skipSpace()
+	{
+		while (_pos < _text.size() && isspace(_text[_pos]))
+			_pos++;
+	}
+
+	void expect(char c)
+	{
+		skipSpace();
+		if (peek() != c)
+			throw std::string("expected '") + c + "'";
+		_pos++;
+	}
+
+	std::string readString()
+	{
+		std::string out;
+
+		expect('"');
+		while (peek() != '"')
+		{
+			char c = _text[_pos++];
+			if (c != '\\')
+			{
+				out += c;
+				continue;
+			}
+			c = peek();
+			_pos++;
+			if (c == 'n')
+				out += '\n';
+			else if (c == 'r')
+				out += '\r';
+			else if (c == 't')
+				out += '\t';
+			else if (c == 'u')
+			{
+				out += (char)strtol(_text.substr(_pos, 4).c_str(), NULL, 16);
+				_pos += 4;
+			}
+			else
+				out += c;
+		}
+		_pos++;
+		return out;
+	}
+
+	std::string readBare()
+	{
+		size_t start = _pos;
+
+		while (_pos < _text.size() && _text[_pos] != ',' && _text[_pos] != '}' && !isspace(_text[_pos]))
+			_pos++;
+		return _text.substr(start, _pos - start);
+	}
+
+	std::string _text;
+	size_t _pos;
+};
+
+static std::string readFile(const std::string &path)
+{
+	std::ifstream file(path.c_str(), std::ios::binary);
+
+	if (!file.is_open())
+		fail("cannot open " + path);
+	std::ostringstream oss;
+	oss << file.rdbuf();
+	return oss.str();
+}
+
+static Request buildRequest(const std::map<std::string, std::string> &fields)
+{
+	Request request;
+	std::map<std::string, std::string>::const_iterator it;
+	std::string body;
+
+	it = fields.find("method");
+	request.method = it == fields.end() ? "GET" : it->second;
+	it = fields.find("path");
+	std::string path = it == fields.end() ? "/" : it->second;
+	it = fields.find("name");
+	request.name = it == fields.end() ? request.method + " " + path : it->second;
+	it = fields.find("weight");
+	request.weight = it == fields.end() ? 1 : strtoul(it->second.c_str(), NULL, 10);
+	it = fields.find("expect");
+	request.expect = it == fields.end() ? 0 : atoi(it->second.c_str());
+	it = fields.find("body");
+	if (it != fields.end())
+		body = it->second;
+	it = fields.find("body_file");
+	if (it != fields.end())
+		body = readFile(it->second);
+	it = fields.find("random_range.size");
+	request.rangeSize = it == fields.end() ? 0 : strtoull(it->second.c_str(), NULL, 10);
+	it = fields.find("random_range.length");
+	request.rangeLength = it == fields.end() ? 0 : strtoull(it->second.c_str(), NULL, 10);
+	if (request.rangeSize && (!request.rangeLength || request.rangeLength > request.rangeSize))
+		fail("random_range needs 0 < length <= size");
+
+	std::ostringstream raw;
+	raw << request.method << " " << path << " HTTP/1.1\r\n";
+	raw << "Host: " << g_options.host << ":" << g_options.port << "\r\n";
+	for (it = fields.begin(); it != fields.end(); it++)
+		if (it->first.compare(0, 8, "headers.") == 0)
+			raw << it->first.substr(8) << ": " << it->second << "\r\n";
+	if (!body.empty() || request.method == "POST" || request.method == "PUT")
+		raw << "Content-Length: " << body.size() << "\r\n";
+	if (!g_options.keepAlive)
+		raw << "Connection: close\r\n";
+	request.raw = raw.str();
+	request.rawEnd = "\r\n" + body;
+	if (!request.rangeSize)
+	{
+		request.raw += request.rawEnd;
+		request.rawEnd.clear();
+	}
+	return request;
+}
+
+// a client frame: masked, as RFC 6455 requires
+static std::string buildFrame(int opcode, const std::string &payload)
+{
+	static const char key[4] = {0x12, 0x34, 0x56, 0x78};
+	std::string frame(1, (char)(0x80 | opcode));
+	size_t size = payload.size();
+
+	if (size < 126)
+		frame += (char)(0x80 | size);
+	else if (size <= 0xFFFF)
+	{
+		frame += (char)(0x80 | 126);
+		frame += (char)(size >> 8);
+		frame += (char)size;
+	}
+	else
+	{
+		frame += (char)(0x80 | 127);
+		for (int shift = 56; shift >= 0; shift -= 8)
+			frame += (char)((unsigned long long)size >> shift);
+	}
+	frame.append(key, 4);
+	for (size_t i = 0; i < size; i++)
+		frame += (char)(payload[i] ^ key[i & 3]);
+	return frame;
+}
+
+// -w and -i: the upgrade is request 0, the messages request 1
+static void loadWebSocket()
+{
+	std::map<std::string, std::string> fields;
+	Request message;
+
+	fields["name"] = "upgrade";
+	fields["path"] = g_options.path;
+	fields["expect"] = "101";
+	fields["headers.Upgrade"] = "websocket";
+	fields["headers.Connection"] = "Upgrade";
+	fields["headers.Sec-WebSocket-Version"] = "13";
+	fields["headers.Sec-WebSocket-Key"] = "dGhlIHNhbXBsZSBub25jZQ==";
+	g_requests.push_back(buildRequest(fields));
+	message.name = "message";
+	message.method = "MESSAGE";
+	message.weight = 0;
+	message.expect = 200;
+	g_requests.push_back(message);
+	g_frame = buildFrame(0x1, std::string(g_options.message, 'x'));
+	g_totalWeight = 1;
+}
+
+// -b: the head and the part's headers; the file and closing boundary are
+// streamed by onWritable. A PUT sends the file alone.
+static void loadUpload()
+{
+	Request request;
+	std::ostringstream raw;
+	bool put = g_options.method == "PUT";
+	std::string part = "--" UPLOAD_BOUNDARY "\r\nContent-Disposition: form-data; name=\"file\"; "
+					   "filename=\"loadgen.bin\"\r\nContent-Type: application/octet-stream\r\n\r\n";
+	unsigned int seed = 42;
+
+	g_uploadEnd = put ? "" : "\r\n--" UPLOAD_BOUNDARY "--\r\n";
+	if (put)
+		part.clear();
+	g_pattern.resize(PATTERN_SIZE);
+	for (size_t i = 0; i < g_pattern.size(); i++)
+		g_pattern[i] = (char)rand_r(&seed);
+	request.name = "upload";
+	request.method = put ? "PUT" : "POST";
+	request.weight = 1;
+	request.expect = g_options.expect;
+	raw << request.method << " " << g_options.path << " HTTP/1.1\r\n";
+	raw << "Host: " << g_options.host << ":" << g_options.port << "\r\n";
+	if (!put)
+		raw << "Content-Type: multipart/form-data; boundary=" UPLOAD_BOUNDARY "\r\n";
+	raw << "Content-Length: " << part.size() + g_options.upload + g_uploadEnd.size() << "\r\n";
+	if (!g_options.keepAlive)
+		raw << "Connection: close\r\n";
+	raw << "\r\n" << part;
+	request.raw = raw.str();
+	g_requests.push_back(request);
+	g_totalWeight = 1;
+}
+
+static void loadRequests()
+{
+	if (g_options.message || g_options.idle)
+	{
+		loadWebSocket();
+		return;
+	}
+	if (g_options.upload)
+	{
+		loadUpload();
+		return;
+	}
+	if (g_options.mixFile.empty())
+	{
+		std::map<std::string, std::string> fields;
+		std::ostringstream expect;
+
+		fields["method"] = g_options.method;
+		fields["path"] = g_options.path;
+		if (g_options.expect)
+		{
+			expect << g_options.expect;
+			fields["expect"] = expect.str();
+		}
+		g_requests.push_back(buildRequest(fields));
+	}
+	else
+	{
+		std::ifstream file(g_options.mixFile.c_str());
+		std::string line;
+		int lineNum = 0;
+
+		if (!file.is_open())
+			fail("cannot open " + g_options.mixFile);
+		while (std::getline(file, line))
+		{
+			lineNum++;
+			if (line.find_first_not_of(" \t\r") == std::string::npos)
+				continue;
+			std::map<std::string, std::string> fields;
+			try
+			{
+				JsonReader(line).readObject(fields, "");
+			}
+			catch (const std::string &e)
+			{
+				std::ostringstream msg;
+				msg << g_options.mixFile << " line " << lineNum << ": " << e;
+				fail(msg.str());
+			}
+			g_requests.push_back(buildRequest(fields));
+		}
+	}
+	for (size_t i = 0; i < g_requests.size(); i++)
+		g_totalWeight += g_requests[i].weight;
+	if (g_requests.empty() || !g_totalWeight)
+		fail("no requests to send");
+}
+
+// the request as sent: a random_range one gets a new offset every time
+static void appendRequest(Worker &worker, const Request &request, std::string &out)
+{
+	out += request.raw;
+	if (!request.rangeSize)
+		return;
+	unsigned long long span = request.rangeSize - request.rangeLength + 1;
+	unsigned long long start = ((unsigned long long)rand_r(&worker.seed) << 31 | rand_r(&worker.seed)) % span;
+	std::ostringstream range;
+	range << "Range: bytes=" << start << "-" << start + request.rangeLength - 1 << "\r\n";
+	out += range.str();
+	out += request.rawEnd;
+}
+
+static size_t pickRequest(Worker &worker)
+{
+	unsigned int ticket = rand_r(&worker.seed) % g_totalWeight;
+	size_t i = 0;
+
+	while (ticket >= g_requests[i].weight)
+		ticket -= g_requests[i++].weight;
+	return i;
+}
+
+/*** Connections ***/
+
+static bool takeTicket()
+{
+	if (now() >= g_deadline)
+		return false;
+	if (!g_options.maxRequests)
+		return true;
+	return __sync_fetch_and_add(&g_issued, 1) < g_options.maxRequests;
+}
+
+static void updateEvents(int epfd, Connection &conn)
+{
+	bool writing = conn.sent < conn.out.size() || conn.streamLeft;
+	struct epoll_event ev;
+
+	if (writing == conn.writing)
+		return;
+	ev.events = EPOLLIN | (writing ? (unsigned int)EPOLLOUT : 0);
+	ev.data.ptr = &conn;
+	epoll_ctl(epfd, EPOLL_CTL_MOD, conn.fd, &ev);
+	conn.writing = writing;
+}
+
+// queues requests until the connection has its pipeline depth in flight; a
+// Connection: close connection only ever carries one. A WebSocket connection
+// sends its upgrade alone, then messages (none with -i).
+static void fill(Worker &worker, int epfd, Connection &conn)
+{
+	bool webSocket = g_options.message || g_options.idle;
+	size_t depth = g_options.idle ? 0 : g_options.keepAlive ? g_options.depth : 1;
+
+	if (!g_options.keepAlive && conn.served)
+		return;
+	if (conn.sent == conn.out.size())
+	{
+		conn.out.clear();
+		conn.sent = 0;
+	}
+	if (webSocket && !conn.upgraded && !conn.served && conn.pending.empty() && now() < g_deadline)
+	{
+		Pending pending;
+
+		pending.request = 0;
+		pending.start = now();
+		conn.out += g_requests[0].raw;
+		conn.pending.push_back(pending);
+	}
+	while (conn.pending.size() < depth && (!webSocket || conn.upgraded) && takeTicket())
+	{
+		Pending pending;
+
+		pending.request = webSocket ? 1 : pickRequest(worker);
+		pending.start = now();
+		if (webSocket)
+			conn.out += g_frame;
+		else
+			appendRequest(worker, g_requests[pending.request], conn.out);
+		conn.pending.push_back(pending);
+		if (g_options.upload)
+			conn.streamLeft = g_options.upload + g_uploadEnd.size();
+	}
+	updateEvents(epfd, conn);
+}
+
+static void openConnection(Worker &worker, int epfd, Connection &conn)
+{
+	struct epoll_event ev;
+
+	conn.fd = -1;
+	conn.ssl = NULL;
+	conn.handshaking = false;
+	conn.writing = true;
+	conn.out.clear();
+	conn.sent = 0;
+	conn.in.clear();
+	conn.pending.clear();
+	conn.served = 0;
+	conn.upgraded = false;
+	conn.streamLeft = 0;
+	while (now() < g_deadline)
+	{
+		int fd = socket(g_address->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		if (fd == -1)
+			fail("socket failed");
+		if (connect(fd, g_address->ai_addr, g_address->ai_addrlen) == -1 && errno != EINPROGRESS)
+		{
+			close(fd);
+			worker.connectErrors++;
+			usleep(1000);
+			continue;
+		}
+		conn.fd = fd;
+		break;
+	}
+	if (conn.fd == -1)
+		return;
+	if (g_tls)
+	{
+		conn.ssl = SSL_new(g_tls);
+		if (!conn.ssl)
+			fail("SSL_new failed");
+		SSL_set_fd(conn.ssl, conn.fd);
+		SSL_set_connect_state(conn.ssl);
+		if (worker.session)
+			SSL_set_session(conn.ssl, worker.session);
+		conn.handshaking = true;
+	}
+	worker.connectionsOpened++;
+	ev.events = EPOLLIN | EPOLLOUT;
+	ev.data.ptr = &conn;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, conn.fd, &ev);
+	fill(worker, epfd, conn);
+}
+
+// keeps the connection's session for the next ones with -R
+static void closeConnection(Worker &worker, Connection &conn)
+{
+	if (conn.ssl)
+	{
+		// freed without a close_notify, the session would be marked as not
+		// resumable
+		SSL_shutdown(conn.ssl);
+		SSL_SESSION *session = g_options.resume ? SSL_get1_session(conn.ssl) : NULL;
+		if (session && SSL_SESSION_is_resumable(session))
+		{
+			if (worker.session)
+				SSL_SESSION_free(worker.session);
+			worker.session = session;
+		}
+		else if (session)
+			SSL_SESSION_free(session);
+		SSL_free(conn.ssl);
+		conn.ssl = NULL;
+	}
+	close(conn.fd);
+	conn.fd = -1;
+}
+
+static void reopen(Worker &worker, int epfd, Connection &conn)
+{
+	worker.unanswered += conn.pending.size();
+	epoll_ctl(epfd, EPOLL_CTL_DEL, conn.fd, NULL);
+	closeConnection(worker, conn);
+	if (now() < g_deadline)
+		openConnection(worker, epfd, conn);
+}
+
+static void record(Worker &worker, Connection &conn, int status, size_t size)
+{
+	Pending pending = conn.pending.front();
+	const Request &request = g_requests[pending.request];
+
+	conn.pending.pop_front();
+	conn.served++;
+	worker.completed++;
+	worker.bytes += size;
+	worker.latencies.push_back((unsigned int)((now() - pending.start) * 1e6));
+	worker.status[status >= 100 && status < 600 ? status / 100 : 0]++;
+	if (request.expect ? status != request.expect : status >= 500)
+	{
+		worker.errors++;
+		worker.requestErrors[pending.request]++;
+	}
+}
+
+// length of a complete chunked body starting at pos, or npos while incomplete
+static size_t chunkedLength(const std::string &in, size_t pos)
+{
+	size_t start = pos;
+
+	for (;;)
+	{
+		size_t lineEnd = in.find("\r\n", pos);
+		if (lineEnd == std::string::npos)
+			return std::string::npos;
+		size_t size = strtoul(in.substr(pos, lineEnd - pos).c_str(), NULL, 16);
+		pos = lineEnd + 2;
+		if (size == 0)
+		{
+			size_t end = in.find("\r\n\r\n", lineEnd);
+			if (end == std::string::npos)
+				return std::string::npos;
+			return end + 4 - start;
+		}
+		pos += size + 2;
+		if (pos > in.size())
+			return std::string::npos;
+	}
+}
+
+// consumes the complete frames in the input buffer, each the echo of the
+// oldest message in flight; pings are answered. False once the server closes.
+static bool parseFrames(Worker &worker, Connection &conn, bool eof)
+{
+	while (conn.in.size() >= 2)
+	{
+		int opcode = conn.in[0] & 0x0F;
+		size_t length = conn.in[1] & 0x7F;
+		size_t header = 2;
+
+		if (length == 126)
+		{
+			if (conn.in.size() < 4)
+				break;
+			length = (unsigned char)conn.in[2] << 8 | (unsigned char)conn.in[3];
+			header = 4;
+		}
+		else if (length == 127)
+		{
+			if (conn.in.size() < 10)
+				break;
+			length = 0;
+			for (int i = 2; i < 10; i++)
+				length = length << 8 | (unsigned char)conn.in[i];
+			header = 10;
+		}
+		if (conn.in.size() < header + length)
+			break;
+		std::string payload = conn.in.substr(header, length);
+		conn.in.erase(0, header + length);
+		if (opcode == 0x8)
+			return false;
+		if (opcode == 0x9)
+		{
+			conn.out += buildFrame(0xA, payload);
+			continue;
+		}
+		if (conn.pending.empty())
+		{
+			worker.errors++;
+			return false;
+		}
+		record(worker, conn, 200, header + length);
+	}
+	return !eof;
+}
+
+// consumes every complete response in the input buffer. Responses without a
+// length end with the connection, so they complete only at eof. Returns false
+// once the server is done with the connection.
+static bool parseResponses(Worker &worker, Connection &conn, bool eof)
+{
+	while (!conn.in.empty())
+	{
+		if (conn.upgraded)
+			return parseFrames(worker, conn, eof);
+		if (conn.pending.empty())
+		{
+			// bytes nobody asked for
+			worker.errors++;
+			return false;
+		}
+		// CGI scripts may end their headers with bare newlines
+		size_t headerEnd = std::min(conn.in.find("\r\n\r\n"), conn.in.find("\n\n"));
+		if (headerEnd == std::string::npos)
+			return !eof;
+		size_t bodyStart = headerEnd + (conn.in.compare(headerEnd, 2, "\r\n") ? 2 : 4);
+		std::string head = toLower(conn.in.substr(0, headerEnd + 1));
+		int status = atoi(head.c_str() + head.find(' ') + 1);
+		bool hasBody = g_requests[conn.pending.front().request].method != "HEAD" && status != 204 &&
+					   status != 304 && status >= 200;
+		bool closing = head.find("\nconnection: close") != std::string::npos;
+		size_t length = 0;
+		size_t lengthPos = head.find("\ncontent-length:");
+
+		if (hasBody && head.find("\ntransfer-encoding: chunked") != std::string::npos)
+			length = chunkedLength(conn.in, bodyStart);
+		else if (hasBody && lengthPos != std::string::npos)
+			length = strtoul(head.c_str() + lengthPos + 16, NULL, 10);
+		else if (hasBody)
+		{
+			if (!eof)
+				return true;
+			length = conn.in.size() - bodyStart;
+			closing = true;
+		}
+		if (length == std::string::npos || conn.in.size() < bodyStart + length)
+			return !eof;
+		record(worker, conn, status, bodyStart + length);
+		conn.in.erase(0, bodyStart + length);
+		if (closing)
+			return false;
+		conn.upgraded = status == 101 && (g_options.message || g_options.idle);
+	}
+	return !eof;
+}
+
+// recv() and send() semantics over TLS: -1 with EAGAIN while it waits
+static ssize_t readSome(Connection &conn, char *buff, size_t size)
+{
+	if (!conn.ssl)
+		return recv(conn.fd, buff, size, 0);
+	int bytes = SSL_read(conn.ssl, buff, size);
+	if (bytes > 0)
+		return bytes;
+	int error = SSL_get_error(conn.ssl, bytes);
+	if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+	return 0;
+}
+
+static ssize_t writeSome(Connection &conn, const char *data, size_t size)
+{
+	if (!conn.ssl)
+		return send(conn.fd, data, size, MSG_NOSIGNAL);
+	int bytes = SSL_write(conn.ssl, data, size);
+	if (bytes > 0)
+		return bytes;
+	int error = SSL_get_error(conn.ssl, bytes);
+	if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+	return 0;
+}
+
+static void onHandshake(Worker &worker, int epfd, Connection &conn)
+{
+	struct epoll_event ev;
+	int result = SSL_do_handshake(conn.ssl);
+
+	if (result == 1)
+	{
+		conn.handshaking = false;
+		worker.handshakes++;
+		if (SSL_session_reused(conn.ssl))
+			worker.resumed++;
+		// the requests queued by fill wait for EPOLLOUT
+		conn.writing = !(conn.sent < conn.out.size());
+		updateEvents(epfd, conn);
+		return;
+	}
+	int error = SSL_get_error(conn.ssl, result);
+	if (error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE)
+	{
+		worker.connectErrors++;
+		reopen(worker, epfd, conn);
+		return;
+	}
+	conn.writing = error == SSL_ERROR_WANT_WRITE;
+	ev.events = EPOLLIN | (conn.writing ? (unsigned int)EPOLLOUT : 0);
+	ev.data.ptr = &conn;
+	epoll_ctl(epfd, EPOLL_CTL_MOD, conn.fd, &ev);
+}
+
+static void onReadable(Worker &worker, int epfd, Connection &conn)
+{
+	char buff[RECV_SIZE];
+	bool eof = false;
+
+	for (;;)
+	{
+		ssize_t bytes = readSome(conn, buff, sizeof(buff));
+		if (bytes > 0)
+		{
+			conn.in.append(buff, bytes);
+			continue;
+		}
+		if (bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		eof = true;
+		break;
+	}
+	if (!parseResponses(worker, conn, eof))
+		reopen(worker, epfd, conn);
+	else
+		fill(worker, epfd, conn);
+}
+
+// -b: the next bytes of the file, then of the closing boundary
+static void nextStreamChunk(const Connection &conn, const char *&data, size_t &size)
+{
+	if (conn.streamLeft > g_uploadEnd.size())
+	{
+		data = g_pattern.data();
+		size = (size_t)std::min<unsigned long long>(g_pattern.size(), conn.streamLeft - g_uploadEnd.size());
+	}
+	else
+	{
+		data = g_uploadEnd.data() + g_uploadEnd.size() - conn.streamLeft;
+		size = conn.streamLeft;
+	}
+}
+
+static void onWritable(Worker &worker, int epfd, Connection &conn)
+{
+	while (conn.sent < conn.out.size() || conn.streamLeft)
+	{
+		bool head = conn.sent < conn.out.size();
+		const char *data = conn.out.c_str() + conn.sent;
+		size_t size = conn.out.size() - conn.sent;
+
+		if (!head)
+			nextStreamChunk(conn, data, size);
+		ssize_t bytes = writeSome(conn, data, size);
+		if (bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (bytes <= 0)
+		{
+			if (!conn.served)
+				worker.connectErrors++;
+			reopen(worker, epfd, conn);
+			return;
+		}
+		if (head)
+			conn.sent += bytes;
+		else
+			conn.streamLeft -= bytes;
+		worker.sent += bytes;
+	}
+	updateEvents(epfd, conn);
+}
+
+static void *runWorker(void *arg)
+{
+	Worker &worker = *(Worker *)arg;
+	std::vector<Connection> connections(worker.connections);
+	struct epoll_event events[MAX_EVENTS];
+	int epfd = epoll_create1(0);
+
+	for (size_t i = 0; i < connections.size(); i++)
+		openConnection(worker, epfd, connections[i]);
+	for (;;)
+	{
+		double current = now();
+		if (current >= g_deadline)
+			break;
+		// with -n, stop once every ticket is used and answered
+		if (g_options.maxRequests && g_issued >= g_options.maxRequests)
+		{
+			bool busy = false;
+			for (size_t i = 0; i < connections.size() && !busy; i++)
+				busy = !connections[i].pending.empty();
+			if (!busy)
+				break;
+		}
+		int count = epoll_wait(epfd, events, MAX_EVENTS, (int)((g_deadline - current) * 1000) + 1);
+		for (int i = 0; i < count; i++)
+		{
+			Connection &conn = *(Connection *)events[i].data.ptr;
+			if (conn.fd == -1)
+				continue;
+			if (conn.handshaking)
+				onHandshake(worker, epfd, conn);
+			else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				onReadable(worker, epfd, conn);
+			else if (events[i].events & EPOLLOUT)
+				onWritable(worker, epfd, conn);
+		}
+	}
+	worker.end = now();
+	for (size_t i = 0; i < connections.size(); i++)
+		if (connections[i].fd != -1)
+			closeConnection(worker, connections[i]);
+	if (worker.session)
+		SSL_SESSION_free(worker.session);
+	close(epfd);
+	return NULL;
+}
+
+/*** Report ***/
+
+static double percentile(const std::vector<unsigned int> &sorted, double q)
+{
+	if (sorted.empty())
+		return 0;
+	size_t index = (size_t)(q * sorted.size());
+	return sorted[std::min(index, sorted.size() - 1)] / 1000.0;
+}
+
+static void report(std::vector<Worker> &workers, double elapsed, double serverCpu, double clientCpu,
+				   double serverSyscalls)
+{
+	Worker total;
+	std::vector<unsigned int> latencies;
+	std::vector<unsigned long> requestErrors(g_requests.size(), 0);
+
+	memset(total.status, 0, sizeof(total.status));
+	total.completed = total.errors = total.unanswered = total.connectionsOpened = total.connectErrors = total.bytes = 0;
+	total.handshakes = total.resumed = 0;
+	total.sent = 0;
+	for (size_t i = 0; i < workers.size(); i++)
+	{
+		total.completed += workers[i].completed;
+		total.errors += workers[i].errors;
+		total.unanswered += workers[i].unanswered;
+		total.connectionsOpened += workers[i].connectionsOpened;
+		total.connectErrors += workers[i].connectErrors;
+		total.bytes += workers[i].bytes;
+		total.handshakes += workers[i].handshakes;
+		total.resumed += workers[i].resumed;
+		total.sent += workers[i].sent;
+		for (int j = 0; j < 6; j++)
+			total.status[j] += workers[i].status[j];
+		for (size_t j = 0; j < g_requests.size(); j++)
+			requestErrors[j] += workers[i].requestErrors[j];
+		latencies.insert(latencies.end(), workers[i].latencies.begin(), workers[i].latencies.end());
+	}
+	std::sort(latencies.begin(), latencies.end());
+
+	double rps = elapsed > 0 ? total.completed / elapsed : 0;
+	double perRequest = total.completed ? 1e6 / total.completed : 0;
+	double uploadRate = g_options.upload && elapsed > 0 ? total.sent / elapsed / 1e6 : 0;
+	char line[768];
+
+	printf("%s: %d connections, %s, pipeline %d, %d thread(s)\n", g_options.label.c_str(), g_options.connections,
+		   g_options.keepAlive ? "keep-alive" : "close", g_options.keepAlive ? g_options.depth : 1, g_options.threads);
+	printf("  requests %lu in %.2fs, %.1f rps, %.2f MB/s\n", total.completed, elapsed, rps,
+		   elapsed > 0 ? total.bytes / elapsed / 1e6 : 0);
+	printf("  latency p50 %.3fms  p99 %.3fms  p999 %.3fms  max %.3fms\n", percentile(latencies, 0.5),
+		   percentile(latencies, 0.99), percentile(latencies, 0.999), percentile(latencies, 1));
+	printf("  status 2xx %lu  3xx %lu  4xx %lu  5xx %lu  other %lu\n", total.status[2], total.status[3],
+		   total.status[4], total.status[5], total.status[0] + total.status[1]);
+	printf("  errors %lu  unanswered %lu  connections %lu  connect errors %lu\n", total.errors, total.unanswered,
+		   total.connectionsOpened, total.connectErrors);
+	if (g_tls)
+		printf("  tls handshakes %lu  resumed %lu\n", total.handshakes, total.resumed);
+	for (size_t i = 0; i < g_requests.size(); i++)
+		if (requestErrors[i])
+			printf("    %s: %lu unexpected status\n", g_requests[i].name.c_str(), requestErrors[i]);
+	if (serverCpu >= 0)
+		printf("  cpu/request server %.1fus  client %.1fus\n", serverCpu * perRequest, clientCpu * perRequest);
+	else
+		printf("  cpu/request client %.1fus\n", clientCpu * perRequest);
+	if (serverSyscalls >= 0)
+		printf("  syscalls/request server %.2f\n", serverSyscalls / std::max(total.completed, 1UL));
+	if (g_rssPerConnection >= 0)
+		printf("  server memory per idle connection %.2f kB\n", g_rssPerConnection);
+	if (g_options.upload)
+		printf("  upload %.1f MB sent, %.2f MB/s\n", total.sent / 1e6, uploadRate);
+
+	if (g_options.output.empty())
+		return;
+	std::ofstream out(g_options.output.c_str(), std::ios::app);
+	if (!out.is_open())
+		fail("cannot open " + g_options.output);
+	snprintf(line, sizeof(line),
+			 "{\"label\": \"%s\", \"connections\": %d, \"keepalive\": %s, \"pipeline\": %d, \"threads\": %d, "
+			 "\"requests\": %lu, \"seconds\": %.3f, \"rps\": %.1f, \"p50_ms\": %.3f, \"p99_ms\": %.3f, "
+			 "\"p999_ms\": %.3f, \"max_ms\": %.3f, \"errors\": %lu, \"unanswered\": %lu, "
+			 "\"server_cpu_us\": %.1f, \"client_cpu_us\": %.1f, \"tls_handshakes\": %lu, \"tls_resumed\": %lu, "
+			 "\"server_syscalls\": %.2f, \"server_kb_per_connection\": %.2f, \"upload_mb_s\": %.2f}",
+			 g_options.label.c_str(), g_options.connections, g_options.keepAlive ? "true" : "false",
+			 g_options.keepAlive ? g_options.depth : 1, g_options.threads, total.completed, elapsed, rps,
+			 percentile(latencies, 0.5), percentile(latencies, 0.99), percentile(latencies, 0.999),
+			 percentile(latencies, 1), total.errors, total.unanswered, serverCpu >= 0 ? serverCpu * perRequest : -1,
+			 clientCpu * perRequest, total.handshakes, total.resumed,
+			 serverSyscalls >= 0 ? serverSyscalls / std::max(total.completed, 1UL) : -1, g_rssPerConnection, uploadRate);
+	out << line << std::endl;
+}
+
+/*** Main ***/
+
+static void parseOptions(int ac, char **av)
+{
+	int opt;
+
+	while ((opt = getopt(ac, av, "H:p:c:t:d:n:kP:u:X:e:m:s:l:o:SRw:ib:")) != -1)
+	{
+		if (opt == 'H')
+			g_options.host = optarg;
+		else if (opt == 'p')
+			g_options.port = optarg;
+		else if (opt == 'c')
+			g_options.connections = atoi(optarg);
+		else if (opt == 't')
+			g_options.threads = atoi(optarg);
+		else if (opt == 'd')
+			g_options.duration = atof(optarg);
+		else if (opt == 'n')
+			g_options.maxRequests = strtoul(optarg, NULL, 10);
+		else if (opt == 'k')
+			g_options.keepAlive = true;
+		else if (opt == 'P')
+			g_options.depth = atoi(optarg);
+		else if (opt == 'u')
+			g_options.path = optarg;
+		else if (opt == 'X')
+			g_options.method = optarg;
+		else if (opt == 'e')
+			g_options.expect = atoi(optarg);
+		else if (opt == 'm')
+			g_options.mixFile = optarg;
+		else if (opt == 's')
+			g_options.serverPid = atoi(optarg);
+		else if (opt == 'l')
+			g_options.label = optarg;
+		else if (opt == 'o')
+			g_options.output = optarg;
+		else if (opt == 'S')
+			g_options.tls = true;
+		else if (opt == 'R')
+			g_options.resume = true;
+		else if (opt == 'w')
+			g_options.message = strtoul(optarg, NULL, 10);
+		else if (opt == 'i')
+			g_options.idle = true;
+		else if (opt == 'b')
+			g_options.upload = strtoull(optarg, NULL, 10);
+		else
+			fail("see the top of bench/loadgen.cpp for the options");
+	}
+	if (g_options.connections < 1 || g_options.threads < 1 || g_options.depth < 1 || g_options.duration <= 0)
+		fail("-c, -t, -P and -d must be positive");
+	g_options.threads = std::min(g_options.threads, g_options.connections);
+	// WebSocket connections stay open
+	if (g_options.message || g_options.idle)
+		g_options.keepAlive = true;
+	// the body is streamed after the head, so one upload at a time
+	if (g_options.upload)
+		g_options.depth = 1;
+}
+
+int main(int ac, char **av)
+{
+	struct addrinfo hints;
+
+	parseOptions(ac, av);
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(g_options.host.c_str(), g_options.port.c_str(), &hints, &g_address) != 0)
+		fail("cannot resolve " + g_options.host);
+	loadRequests();
+	if (g_options.tls)
+	{
+		g_tls = SSL_CTX_new(TLS_client_method());
+		if (!g_tls)
+			fail("cannot create a TLS context");
+		SSL_CTX_set_mode(g_tls, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	}
+
+	std::vector<Worker> workers(g_options.threads);
+	double serverCpu = g_options.serverPid ? processCpu(g_options.serverPid) : -1;
+	long rss = g_options.serverPid ? processRss(g_options.serverPid) : -1;
+	if (g_options.serverPid)
+		openSyscallCounters(g_options.serverPid);
+	double clientCpu = selfCpu();
+	double start = now();
+
+	g_deadline = start + g_options.duration;
+	for (int i = 0; i < g_options.threads; i++)
+	{
+		Worker &worker = workers[i];
+
+		worker.connections = g_options.connections / g_options.threads + (i < g_options.connections % g_options.threads);
+		worker.seed = 42 + i;
+		worker.completed = worker.errors = worker.unanswered = worker.connectionsOpened = 0;
+		worker.connectErrors = worker.bytes = 0;
+		worker.handshakes = worker.resumed = 0;
+		worker.sent = 0;
+		worker.session = NULL;
+		memset(worker.status, 0, sizeof(worker.status));
+		worker.requestErrors.assign(g_requests.size(), 0);
+		worker.end = start;
+		pthread_create(&worker.thread, NULL, runWorker, &worker);
+	}
+	// the idle connections are all open just before the deadline
+	if (g_options.idle && rss >= 0)
+	{
+		double wait = g_deadline - 0.5 - now();
+		if (wait > 0)
+			usleep((useconds_t)(wait * 1e6));
+		long after = processRss(g_options.serverPid);
+		if (after >= 0)
+			g_rssPerConnection = (double)(after - rss) / g_options.connections;
+	}
+	double end = start;
+	for (int i = 0; i < g_options.threads; i++)
+	{
+		pthread_join(workers[i].thread, NULL);
+		end = std::max(end, workers[i].end);
+	}
+	if (serverCpu >= 0)
+	{
+		double after = processCpu(g_options.serverPid);
+		serverCpu = after >= 0 ? after - serverCpu : -1;
+	}
+	double serverSyscalls = closeSyscallCounters();
+	clientCpu = selfCpu() - clientCpu;
+	report(workers, end - start, serverCpu, clientCpu, serverSyscalls);
+	if (g_tls)
+		SSL_CTX_free(g_tls);
+	freeaddrinfo(g_address);
+	return 0;
+}
@@ -0,0 +1,599 @@
+// microbenchmarks for the request parsing, routing and response building hot
+// paths (built by `make microbench`)
+//
+// usage: microbench [options]
+//   -f filter      only run benchmarks whose name contains filter
+//   -c file        config file for the routing benchmarks (config_files/default.conf)
+//   -s file        save the results as a baseline
+//   -b file        compare against a saved baseline; exits with 1 on a regression
+//   -t percent     slowdown tolerated by -b before it counts as a regression (10)
+//
+// Every benchmark is run for about SAMPLE_MS milliseconds SAMPLES times and
+// the median is reported. allocs/op counts calls to operator new.
+
+#include "MethodIO.hpp"
+#include "MicroCache.hpp"
+#include "MimeTypes.hpp"
+#include "webserv.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <new>
+#include <sstream>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+#define SAMPLES 7
+#define SAMPLE_MS 50
+
+/*** Allocation counting ***/
+
+static unsigned long g_allocations = 0;
+
+void *operator new(std::size_t size) throw(std::bad_alloc)
+{
+	g_allocations++;
+	void *p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void *operator new[](std::size_t size) throw(std::bad_alloc)
+{
+	g_allocations++;
+	void *p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void *p) throw()
+{
+	free(p);
+}
+
+void operator delete[](void *p) throw()
+{
+	free(p);
+}
+
+/*** Inputs ***/
+
+static const char *g_browserRequest = "GET /autoindex/assets/app.min.js?v=3 HTTP/1.1\r\n"
+									  "Host: localhost:8080\r\n"
+									  "Connection: keep-alive\r\n"
+									  "sec-ch-ua: \"Chromium\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+									  "sec-ch-ua-mobile: ?0\r\n"
+									  "sec-ch-ua-platform: \"Linux\"\r\n"
+									  "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like "
+									  "Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+									  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,"
+									  "image/webp,*/*;q=0.8\r\n"
+									  "Sec-Fetch-Site: same-origin\r\n"
+									  "Sec-Fetch-Mode: navigate\r\n"
+									  "Sec-Fetch-Dest: document\r\n"
+									  "Referer: http://localhost:8080/\r\n"
+									  "Accept-Encoding: gzip, deflate, br\r\n"
+									  "Accept-Language: en-US,en;q=0.9\r\n"
+									  "If-None-Match: \"11e07e-48a-6630a1dd\"\r\n"
+									  "\r\n";
+
+static std::string postRequest()
+{
+	std::string body(16384, 'x');
+	std::ostringstream oss;
+
+	oss << "POST /cgi-bin/upload.py HTTP/1.1\r\n"
+		<< "Host: localhost:8080\r\n"
+		<< "User-Agent: curl/8.5.0\r\n"
+		<< "Accept: */*\r\n"
+		<< "Content-Type: application/octet-stream\r\n"
+		<< "Content-Length: " << body.size() << "\r\n"
+		<< "\r\n"
+		<< body;
+	return oss.str();
+}
+
+/*** Harness ***/
+
+struct Result
+{
+	std::string name;
+	double nsPerOp;
+	double allocsPerOp;
+};
+
+typedef void (*BenchFunction)(size_t iterations);
+
+static volatile size_t g_sink = 0;
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// doubles the iteration count until one sample takes SAMPLE_MS, then keeps
+// the median of SAMPLES samples
+static Result measure(const std::string &name, BenchFunction function)
+{
+	size_t iterations = 1;
+	double elapsed = 0;
+	Result result;
+
+	function(1);
+	for (;;)
+	{
+		double start = now();
+		function(iterations);
+		elapsed = now() - start;
+		if (elapsed >= SAMPLE_MS * 1e6 || iterations >= (1ul << 30))
+			break;
+		iterations *= 2;
+	}
+
+	std::vector<double> samples;
+	unsigned long allocations = 0;
+	for (int i = 0; i < SAMPLES; i++)
+	{
+		unsigned long before = g_allocations;
+		double start = now();
+		function(iterations);
+		samples.push_back((now() - start) / iterations);
+		allocations = g_allocations - before;
+	}
+	std::sort(samples.begin(), samples.end());
+	result.name = name;
+	result.nsPerOp = samples[SAMPLES / 2];
+	result.allocsPerOp = (double)allocations / iterations;
+	return result;
+}
+
+/*** Benchmarks ***/
+
+class MicroBench
+{
+public:
+	static MimeTypes mimeTypes;
+	static std::vector<ServerBlock> servers;
+	static std::string post;
+	static ServerBlock staticServer;
+	static std::string staticDir;
+	// a GET of 1k.html with its ETag in If-None-Match
+	static std::string conditional;
+	static MicroCache microCache;
+	static int peer[2];
+
+	static void splitRequestLine(size_t iterations)
+	{
+		std::string line = "GET /autoindex/assets/app.min.js?v=3 HTTP/1.1";
+		for (size_t i = 0; i < iterations; i++)
+			g_sink += utils::split(line, ' ').size();
+	}
+
+	static void splitHeaderLines(size_t iterations)
+	{
+		std::string head(g_browserRequest);
+		for (size_t i = 0; i < iterations; i++)
+			g_sink += utils::split(head, "\r\n").size();
+	}
+
+	static void parseHeaderGet(size_t iterations)
+	{
+		std::string request(g_browserRequest);
+		for (size_t i = 0; i < iterations; i++)
+			g_sink += WebServer::parseHeader(request).headers.size();
+	}
+
+	static void parseHeaderPost(size_t iterations)
+	{
+		for (size_t i = 0; i < iterations; i++)
+			g_sink += WebServer::parseHeader(post).body.size();
+	}
+
+	static void tokenizeGet(size_t iterations)
+	{
+		MethodIO io;
+		std::string request(g_browserRequest);
+		for (size_t i = 0; i < iterations; i++)
+		{
+			MethodIO::rInfo info;
+			io.tokenize(request, info);
+			g_sink += info.headers.size();
+		}
+	}
+
+	static void tokenizePost(size_t iterations)
+	{
+		MethodIO io;
+		for (size_t i = 0; i < iterations; i++)
+		{
+			MethodIO::rInfo info;
+			io.tokenize(post, info);
+			g_sink += info.body.size();
+		}
+	}
+
+	static void locationRoot(size_t iterations)
+	{
+		for (size_t i = 0; i < iterations; i++)
+			g_sink += servers[0].getLocationBlockPair("/index.html").first.size();
+	}
+
+	static void locationNested(size_t iterations)
+	{
+		for (size_t i = 0; i < iterations; i++)
+			g_sink += servers[0].getLocationBlockPair("/cgi-bin/uploads/archive/2024/report.py").first.size();
+	}
+
+	static void generateResponse(size_t iterations)
+	{
+		MethodIO::rInfo rsi;
+		rsi.headers["Accept-Ranges"] = "bytes";
+		rsi.headers["Cache-Control"] = "max-age=3600";
+		rsi.headers["Content-Length"] = "1162";
+		rsi.headers["Content-Type"] = "text/html";
+		rsi.headers["Date"] = "Mon, 19 Oct 2026 13:41:15 GMT";
+		rsi.headers["ETag"] = "\"11e07e-48a-6630a1dd\"";
+		rsi.headers["Last-Modified"] = "Tue, 30 Apr 2024 07:46:37 GMT";
+		rsi.headers["Vary"] = "Accept-Encoding";
+		rsi.body = std::string(1162, 'x');
+		for (size_t i = 0; i < iterations; i++)
+			g_sink += MethodIO::generateResponse(200, rsi).size();
+	}
+
+	static void errorResponse(size_t iterations)
+	{
+		for (size_t i = 0; i < iterations; i++)
+			g_sink += MethodIO::errorResponse(404, &servers[0]).size();
+	}
+
+	static void mimeType(size_t iterations)
+	{
+		std::string path = "./www/assets/app.min.js";
+		for (size_t i = 0; i < iterations; i++)
+			g_sink += mimeTypes.getType(path).size();
+	}
+
+	static void date(size_t iterations)
+	{
+		for (size_t i = 0; i < iterations; i++)
+			g_sink += MethodIO::getDate().size();
+	}
+
+	// what the event loop pays per request; the writer thread drains to /dev/null
+	// the 304 a revalidating client gets: the stat, ETag and headers only
+	static void notModified(size_t iterations)
+	{
+		MethodIO io;
+
+		for (size_t i = 0; i < iterations; i++)
+		{
+			MethodIO::rInfo rqi;
+			MethodIO::rInfo rsi;
+			io.tokenize(conditional, rqi);
+			rsi.headers["Date"] = MethodIO::getDate();
+			g_sink += MethodIO::getMethod(staticServer, rqi, rsi).size();
+		}
+	}
+
+	static void accessLog(size_t iterations, const char *path, const char *format)
+	{
+		AccessLog::Entry entry;
+
+		entry.remote = "127.0.0.1";
+		entry.requestLine = "GET /autoindex/assets/app.min.js?v=3 HTTP/1.1";
+		entry.status = 200;
+		entry.bytes = 1162;
+		entry.referer = "http://localhost:8080/autoindex/";
+		entry.userAgent = "Mozilla/5.0 (X11; Linux x86_64; rv:120.0) Gecko/20100101 Firefox/120.0";
+		entry.seconds = 0.000123;
+		AccessLog::configure(path, format);
+		for (size_t i = 0; i < iterations; i++)
+			AccessLog::log(entry);
+	}
+
+	static void accessLogCombined(size_t iterations)
+	{
+		accessLog(iterations, "/dev/null", "combined");
+	}
+
+	static void accessLogJson(size_t iterations)
+	{
+		accessLog(iterations, "/dev/null", "json");
+	}
+
+	static void accessLogOff(size_t iterations)
+	{
+		accessLog(iterations, "", "combined");
+	}
+
+	static void logDisabled(size_t iterations)
+	{
+		for (size_t i = 0; i < iterations; i++)
+			LOG(LOG_DEBUG) << "read: " << i << ", found: " << g_sink;
+	}
+
+	// the 1 KiB and 10 KiB files served by both static paths, and a socket
+	// pair to write the responses to
+	static bool setupStatic()
+	{
+		char dir[] = "/tmp/microbench.XXXXXX";
+
+		if (!mkdtemp(dir) || socketpair(AF_UNIX, SOCK_STREAM, 0, peer) == -1)
+			return false;
+		staticDir = dir;
+		std::ofstream small(std::string(staticDir + "/1k.html").c_str());
+		std::ofstream large(std::string(staticDir + "/10k.html").c_str());
+		small << std::string(1024, 'a');
+		large << std::string(10240, 'a');
+		small.close();
+		large.close();
+		LocationBlock location(staticServer);
+		location.setRootDirectory(staticDir);
+		location.addAllowedMethods("GET");
+		location.setMicroCache(true);
+		staticServer.addLocationBlock("/", location);
+		const char *files[] = {"1k.html", "10k.html"};
+		for (size_t i = 0; i < 2; i++)
+		{
+			std::string path = staticDir + "/" + files[i];
+			std::string response = readStatic(std::string("/") + files[i]);
+			struct stat st;
+			stat(path.c_str(), &st);
+			microCache.insert(files[i], path, st, response, 0);
+		}
+		std::string response = readStatic("/1k.html");
+		size_t etag = response.find("ETag: ");
+		if (etag == std::string::npos)
+			return false;
+		conditional = "GET /1k.html HTTP/1.1\r\nHost: localhost\r\nIf-None-Match: " +
+					  response.substr(etag + 6, response.find("\r\n", etag) - etag - 6) + "\r\n\r\n";
+		return true;
+	}
+
+	static void teardownStatic()
+	{
+		unlink(std::string(staticDir + "/1k.html").c_str());
+		unlink(std::string(staticDir + "/10k.html").c_str());
+		rmdir(staticDir.c_str());
+		close(peer[0]);
+		close(peer[1]);
+	}
+
+	// what a worker does for a GET of a small file
+	static std::string readStatic(const std::string &uri)
+	{
+		MethodIO io;
+		MethodIO::rInfo rqi;
+		MethodIO::rInfo rsi;
+
+		io.tokenize("GET " + uri + " HTTP/1.1\r\nHost: localhost\r\n\r\n", rqi);
+		rsi.headers["Date"] = MethodIO::getDate();
+		return MethodIO::getMethod(staticServer, rqi, rsi);
+	}
+
+	static void drain(size_t size)
+	{
+		char buffer[16384];
+
+		while (size)
+		{
+			ssize_t got = recv(peer[1], buffer, sizeof(buffer), 0);
+			if (got <= 0)
+				break;
+			size -= got;
+		}
+	}
+
+	static void staticRead(size_t iterations, const std::string &uri)
+	{
+		for (size_t i = 0; i < iterations; i++)
+		{
+			std::string response = readStatic(uri);
+			ssize_t sent = send(peer[0], response.data(), response.size(), 0);
+			drain(sent > 0 ? sent : 0);
+		}
+	}
+
+	static void staticMicro(size_t iterations, const std::string &key)
+	{
+		for (size_t i = 0; i < iterations; i++)
+		{
+			MicroCache::Buffer *buffer = microCache.find(key, 0);
+			ssize_t sent = MicroCache::send(peer[0], *buffer, 0);
+			MicroCache::release(buffer);
+			drain(sent > 0 ? sent : 0);
+		}
+	}
+
+	static void staticRead1k(size_t iterations)
+	{
+		staticRead(iterations, "/1k.html");
+	}
+
+	static void staticRead10k(size_t iterations)
+	{
+		staticRead(iterations, "/10k.html");
+	}
+
+	static void staticMicro1k(size_t iterations)
+	{
+		staticMicro(iterations, "1k.html");
+	}
+
+	static void staticMicro10k(size_t iterations)
+	{
+		staticMicro(iterations, "10k.html");
+	}
+};
+
+MimeTypes MicroBench::mimeTypes;
+std::vector<ServerBlock> MicroBench::servers;
+std::string MicroBench::post;
+ServerBlock MicroBench::staticServer;
+std::string MicroBench::staticDir;
+std::string MicroBench::conditional;
+MicroCache MicroBench::microCache;
+int MicroBench::peer[2];
+
+struct Benchmark
+{
+	const char *name;
+	BenchFunction function;
+};
+
+static const Benchmark g_benchmarks[] = {
+	{"utils::split/request_line", MicroBench::splitRequestLine},
+	{"utils::split/header_lines", MicroBench::splitHeaderLines},
+	{"WebServer::parseHeader/get", MicroBench::parseHeaderGet},
+	{"WebServer::parseHeader/post_16k", MicroBench::parseHeaderPost},
+	{"MethodIO::tokenize/get", MicroBench::tokenizeGet},
+	{"MethodIO::tokenize/post_16k", MicroBench::tokenizePost},
+	{"ServerBlock::getLocationBlockPair/root", MicroBench::locationRoot},
+	{"ServerBlock::getLocationBlockPair/nested", MicroBench::locationNested},
+	{"MethodIO::generateResponse/200_1k", MicroBench::generateResponse},
+	{"MethodIO::errorResponse/404", MicroBench::errorResponse},
+	{"MimeTypes::getType", MicroBench::mimeType},
+	{"MethodIO::getDate", MicroBench::date},
+	{"MethodIO::getMethod/304", MicroBench::notModified},
+	{"AccessLog::log/combined", MicroBench::accessLogCombined},
+	{"AccessLog::log/json", MicroBench::accessLogJson},
+	{"AccessLog::log/off", MicroBench::accessLogOff},
+	{"LOG/disabled_debug", MicroBench::logDisabled},
+	{"static/readFile_1k", MicroBench::staticRead1k},
+	{"static/readFile_10k", MicroBench::staticRead10k},
+	{"static/micro_cache_1k", MicroBench::staticMicro1k},
+	{"static/micro_cache_10k", MicroBench::staticMicro10k},
+};
+
+/*** Baselines ***/
+
+// one "name ns/op allocs/op" line per benchmark
+static std::map<std::string, Result> loadBaseline(const std::string &path)
+{
+	std::map<std::string, Result> baseline;
+	std::ifstream file(path.c_str());
+	std::string line;
+
+	if (!file.is_open())
+	{
+		std::cerr << "microbench: cannot open " << path << std::endl;
+		exit(2);
+	}
+	while (std::getline(file, line))
+	{
+		std::istringstream iss(line);
+		Result result;
+		if (iss >> result.name >> result.nsPerOp >> result.allocsPerOp)
+			baseline[result.name] = result;
+	}
+	return baseline;
+}
+
+static void saveBaseline(const std::string &path, const std::vector<Result> &results)
+{
+	std::ofstream file(path.c_str());
+
+	if (!file.is_open())
+	{
+		std::cerr << "microbench: cannot write " << path << std::endl;
+		exit(2);
+	}
+	for (size_t i = 0; i < results.size(); i++)
+		file << results[i].name << " " << results[i].nsPerOp << " " << results[i].allocsPerOp << std::endl;
+}
+
+/*** Main ***/
+
+int main(int ac, char **av)
+{
+	std::string filter, config = DEFAULT_CONFIG_FILE_PATH, savePath, baselinePath;
+	double tolerance = 10;
+	int opt;
+
+	while ((opt = getopt(ac, av, "f:c:s:b:t:")) != -1)
+	{
+		if (opt == 'f')
+			filter = optarg;
+		else if (opt == 'c')
+			config = optarg;
+		else if (opt == 's')
+			savePath = optarg;
+		else if (opt == 'b')
+			baselinePath = optarg;
+		else if (opt == 't')
+			tolerance = atof(optarg);
+		else
+		{
+			std::cerr << "see the top of bench/microbench.cpp for the options" << std::endl;
+			return 2;
+		}
+	}
+
+	// keeps the parser quiet
+	Log::setLevel(LOG_WARN);
+	try
+	{
+		Parser parser(config);
+		parser.parseServerBlocks(MicroBench::servers);
+		MicroBench::mimeTypes = MimeTypes(parser.getTypes());
+		MethodIO::loadErrorPages(MicroBench::servers[0]);
+	}
+	catch (const std::exception &e)
+	{
+		std::cerr << "microbench: " << e.what() << std::endl;
+		return 2;
+	}
+	MicroBench::post = postRequest();
+	if (!MicroBench::setupStatic())
+	{
+		std::cerr << "microbench: cannot create the static fixtures" << std::endl;
+		return 2;
+	}
+
+	std::map<std::string, Result> baseline;
+	if (!baselinePath.empty())
+		baseline = loadBaseline(baselinePath);
+
+	std::vector<Result> results;
+	bool regressed = false;
+	printf("%-44s %12s %10s %12s %8s\n", "benchmark", "ns/op", "allocs/op", "baseline", "delta");
+	for (size_t i = 0; i < sizeof(g_benchmarks) / sizeof(g_benchmarks[0]); i++)
+	{
+		if (!filter.empty() && std::string(g_benchmarks[i].name).find(filter) == std::string::npos)
+			continue;
+		Result result = measure(g_benchmarks[i].name, g_benchmarks[i].function);
+		results.push_back(result);
+		printf("%-44s %12.1f %10.2f", result.name.c_str(), result.nsPerOp, result.allocsPerOp);
+
+		std::map<std::string, Result>::iterator it = baseline.find(result.name);
+		if (it == baseline.end())
+		{
+			printf("\n");
+			continue;
+		}
+		double delta = (result.nsPerOp / it->second.nsPerOp - 1) * 100;
+		bool slower = delta > tolerance;
+		bool moreAllocations = result.allocsPerOp > it->second.allocsPerOp + 0.01;
+		printf(" %12.1f %+7.1f%%%s\n", it->second.nsPerOp, delta,
+			   slower || moreAllocations ? "  REGRESSION" : "");
+		if (moreAllocations)
+			printf("%-44s %12s %10.2f was %.2f allocs/op\n", "", "", result.allocsPerOp, it->second.allocsPerOp);
+		regressed = regressed || slower || moreAllocations;
+	}
+	AccessLog::shutdown();
+	MicroBench::teardownStatic();
+	if (!savePath.empty())
+		saveBaseline(savePath, results);
+	return regressed ? 1 : 0;
+}
@@ -0,0 +1,301 @@
+#!/bin/sh
+# Checks proxy_pass end to end against the stand-in upstream (bench/upstream).
+#
+# make proxy-test
+#
+# Starts bench/upstream and a webserv with proxy_pass locations pointing at it
+# (and at a closed port), then checks forwarding, header rewriting, chunked and
+# large responses, connection reuse and the 502/504 answers with curl. Three
+# more stand-ins (a, b and c) sit behind upstream blocks to check the weighted
+# round robin, least_conn and hash balancing, failover and health checks. The
+# response cache is checked in front of the stand-in's /cached route.
+
+set -e
+cd "$(dirname "$0")/.."
+
+PORT=8093
+UPSTREAM_PORT=8091
+DEAD_PORT=8099
+A=8094
+B=8095
+C=8096
+TMP=bench/tmp-proxy
+BASE=http://127.0.0.1:$PORT
+
+SERVER=
+UPSTREAM=
+BACKENDS=
+FAILED=0
+cleanup()
+{
+	status=$?
+	set +e
+	[ -n "$SERVER" ] && kill "$SERVER" 2>/dev/null && wait "$SERVER" 2>/dev/null
+	[ -n "$UPSTREAM" ] && kill "$UPSTREAM" 2>/dev/null && wait "$UPSTREAM" 2>/dev/null
+	for pid in $BACKENDS; do
+		kill "$pid" 2>/dev/null && wait "$pid" 2>/dev/null
+	done
+	rm -rf "$TMP"
+	exit $status
+}
+trap cleanup EXIT INT TERM
+
+wait_for()
+{
+	tries=0
+	until grep -q "$2" "$1"; do
+		tries=$((tries + 1))
+		if [ $tries -gt 50 ]; then
+			echo "timed out waiting for '$2':" >&2
+			tail -5 "$1" >&2
+			exit 1
+		fi
+		sleep 0.1
+	done
+}
+
+check()
+{
+	if [ "$2" = "$3" ]; then
+		echo "ok   $1"
+	else
+		echo "FAIL $1: expected '$3', got '$2'"
+		FAILED=1
+	fi
+}
+
+# the X-Upstream of the stand-in that answered
+backend()
+{
+	curl -s -D - -o /dev/null "$@" | tr -d '\r' | sed -n 's/^X-Upstream: //p'
+}
+
+# X-Cache (MISS without one) and the number in the body of a /cached response
+cached()
+{
+	curl -s -D - "$@" | tr -d '\r' |
+		awk '/^X-Cache:/ { c = $2 } /^response/ { b = $2 } END { printf "%s %s", c ? c : "MISS", b }'
+}
+
+# how many of n requests each stand-in answered, e.g. "a=20 b=10"
+spread()
+{
+	n=$1
+	shift
+	i=0
+	while [ $i -lt "$n" ]; do
+		backend "$@"
+		i=$((i + 1))
+	done | sort | uniq -c | awk '{ printf "%s%s=%s", sep, $2, $1; sep = " " }'
+}
+
+mkdir -p "$TMP/www" "$TMP/cache"
+echo "local" > "$TMP/www/index.html"
+echo "error" > "$TMP/www/error.html"
+cat > "$TMP/webserv.conf" <<EOF
+response_cache_path	$TMP/cache max_size=1m;
+
+upstream weighted {
+	server	127.0.0.1:$A weight=2;
+	server	127.0.0.1:$B;
+}
+
+upstream least {
+	least_conn;
+	server	127.0.0.1:$A;
+	server	127.0.0.1:$B;
+}
+
+upstream sticky {
+	hash	\$http_x_user;
+	server	127.0.0.1:$A;
+	server	127.0.0.1:$B;
+	server	127.0.0.1:$C;
+}
+
+upstream failover {
+	server	127.0.0.1:$DEAD_PORT max_fails=1 fail_timeout=30;
+	server	127.0.0.1:$A;
+}
+
+upstream checked {
+	server			127.0.0.1:$B;
+	server			127.0.0.1:$C;
+	health_check	interval=1 timeout=1 uri=/health;
+}
+
+upstream dead {
+	server	127.0.0.1:$DEAD_PORT;
+}
+
+server	{
+	listen		$PORT;
+	server_name	localhost 127.0.0.1;
+	index		index.html;
+	root		$TMP/www;
+
+	error_page	400 error.html;
+	error_page	403 error.html;
+	error_page	404 error.html;
+	error_page	405 error.html;
+	error_page	408 error.html;
+	error_page	409 error.html;
+	error_page	415 error.html;
+	error_page	500 error.html;
+
+	client_max_body_size 0;
+
+	location / {
+		limit_except	GET;
+	}
+
+	location /api/ {
+		proxy_pass	http://127.0.0.1:$UPSTREAM_PORT/;
+	}
+
+	location /slow/ {
+		proxy_pass			http://127.0.0.1:$UPSTREAM_PORT/slow;
+		proxy_read_timeout	1;
+	}
+
+	location /down/ {
+		proxy_pass				http://127.0.0.1:$DEAD_PORT/;
+		proxy_connect_timeout	1;
+	}
+
+	location /weighted/ {
+		proxy_pass	http://weighted/;
+	}
+
+	location /least/ {
+		proxy_pass	http://least/;
+	}
+
+	location /sticky/ {
+		proxy_pass	http://sticky/;
+	}
+
+	location /failover/ {
+		proxy_pass	http://failover/;
+	}
+
+	location /checked/ {
+		proxy_pass	http://checked/;
+	}
+
+	location /dead/ {
+		proxy_pass	http://dead/;
+	}
+
+	location /cache/ {
+		proxy_pass		http://127.0.0.1:$UPSTREAM_PORT/;
+		response_cache	on;
+	}
+}
+EOF
+
+bench/upstream -p $UPSTREAM_PORT > "$TMP/upstream.log" 2>&1 &
+UPSTREAM=$!
+wait_for "$TMP/upstream.log" "listening"
+for name in a b c; do
+	case $name in a) port=$A ;; b) port=$B ;; c) port=$C ;; esac
+	bench/upstream -p "$port" -n $name > "$TMP/upstream-$name.log" 2>&1 &
+	BACKENDS="$BACKENDS $!"
+	wait_for "$TMP/upstream-$name.log" "listening"
+done
+./webserv "$TMP/webserv.conf" > "$TMP/webserv.log" 2>&1 &
+SERVER=$!
+wait_for "$TMP/webserv.log" "waiting for connections"
+
+check "local files are still served" "$(curl -s $BASE/)" "local"
+check "GET is forwarded" "$(curl -s $BASE/api/)" "hello from upstream"
+check "upstream headers are passed through" \
+	"$(curl -s -D - -o /dev/null $BASE/api/ | tr -d '\r' | grep -i '^x-upstream:')" "X-Upstream: stand-in"
+check "HEAD has no body" "$(curl -s -I $BASE/api/bytes?n=100 | tr -d '\r' | grep -i '^content-length:')" "Content-Length: 100"
+
+echo=$(curl -s -H 'Connection: keep-alive' -H 'X-Custom: 1' $BASE/api/echo?a=b | tr -d '\r')
+check "the location prefix is replaced" "$(echo "$echo" | head -1)" "GET /echo?a=b HTTP/1.1"
+check "Host names the upstream" "$(echo "$echo" | grep -i '^host:')" "Host: 127.0.0.1:$UPSTREAM_PORT"
+check "X-Forwarded-For is added" "$(echo "$echo" | grep -ci '^x-forwarded-for: 127.0.0.1')" "1"
+check "other headers are kept" "$(echo "$echo" | grep -ci '^x-custom: 1')" "1"
+check "hop-by-hop headers are dropped" "$(echo "$echo" | grep -ci '^connection: keep-alive')" "0"
+check "POST bodies are forwarded" "$(curl -s -d 'name=webserv' $BASE/api/echo | tail -c 12)" "name=webserv"
+
+check "chunked responses pass through" "$(curl -s $BASE/api/chunked?n=64 | wc -c)" "65536"
+check "large responses stream with backpressure" "$(curl -s $BASE/api/bytes?n=16777216 | wc -c)" "16777216"
+check "close-delimited responses are forwarded" "$(curl -s $BASE/api/close)" "closed by upstream"
+
+before=$(curl -s $BASE/api/stats | sed 's/.*"connections": \([0-9]*\).*/\1/')
+i=0
+while [ $i -lt 20 ]; do
+	curl -s -o /dev/null $BASE/api/
+	i=$((i + 1))
+done
+after=$(curl -s $BASE/api/stats | sed 's/.*"connections": \([0-9]*\).*/\1/')
+check "upstream connections are reused" "$((after - before))" "0"
+
+check "a slow upstream times out with 504" "$(curl -s -o /dev/null -w '%{http_code}' $BASE/slow/?ms=3000)" "504"
+check "a slow upstream within the timeout answers" "$(curl -s -o /dev/null -w '%{http_code}' $BASE/slow/?ms=200)" "200"
+check "a closed upstream port answers 502" "$(curl -s -o /dev/null -w '%{http_code}' $BASE/down/)" "502"
+
+check "weighted round robin follows the weights" "$(spread 30 $BASE/weighted/)" "a=20 b=10"
+curl -s -o /dev/null "$BASE/least/slow?ms=1500" &
+slow=$!
+sleep 0.3
+check "least_conn avoids the busy peer" "$(spread 4 $BASE/least/)" "b=4"
+wait $slow
+
+sticky=yes
+seen=
+for user in 1 2 3 4 5 6 7 8; do
+	first=$(backend -H "X-User: user$user" $BASE/sticky/)
+	seen="$seen $first"
+	[ "$(spread 3 -H "X-User: user$user" $BASE/sticky/)" = "$first=3" ] || sticky=no
+done
+check "hash sends a key to the same peer" "$sticky" "yes"
+check "hash spreads the keys" "$(echo $seen | tr ' ' '\n' | sort -u | wc -l | tr -d ' ')" "3"
+
+check "a failed peer is retried on the next one" "$(spread 6 $BASE/failover/)" "a=6"
+check "the failed peer is taken out" "$(grep -c "127.0.0.1:$DEAD_PORT is down" "$TMP/webserv.log")" "1"
+check "a block without live peers answers 502" "$(curl -s -o /dev/null -w '%{http_code}' $BASE/dead/)" "502"
+
+curl -s -o /dev/null "http://127.0.0.1:$C/health/down"
+sleep 2.5
+check "a peer failing its health check gets no traffic" "$(spread 6 $BASE/checked/)" "b=6"
+curl -s -o /dev/null "http://127.0.0.1:$C/health/up"
+sleep 2.5
+check "it is back once the check passes" "$(spread 6 $BASE/checked/)" "b=3 c=3"
+check "health checks are logged" \
+	"$(grep -c 'failed its health check\|passed its health check' "$TMP/webserv.log")" "2"
+
+first=$(cached "$BASE/cache/cached?max-age=30")
+check "a cacheable response is stored" "$(cached "$BASE/cache/cached?max-age=30")" "HIT ${first#MISS }"
+check "requests with cookies bypass the cache" "$(cached -H 'Cookie: a=1' "$BASE/cache/cached?max-age=30" | cut -c1-4)" "MISS"
+check "responses without freshness are not stored" \
+	"$(cached "$BASE/cache/cached" | cut -c1-4) $(cached "$BASE/cache/cached" | cut -c1-4)" "MISS MISS"
+cached -H 'X-Variant: a' "$BASE/cache/cached?max-age=30&vary=1" > /dev/null
+cached -H 'X-Variant: b' "$BASE/cache/cached?max-age=30&vary=1" > /dev/null
+check "Vary keeps a copy per header value" \
+	"$(cached -H 'X-Variant: b' "$BASE/cache/cached?max-age=30&vary=1" | cut -c1-3)" "HIT"
+
+pids=
+for i in 1 2 3 4; do
+	cached "$BASE/cache/cached?max-age=30&ms=300" > "$TMP/coalesced-$i" &
+	pids="$pids $!"
+done
+wait $pids
+check "concurrent misses reach the upstream once" \
+	"$(cat "$TMP"/coalesced-* | sed 's/.* //' | sort -u | wc -l | tr -d ' ')" "1"
+
+first=$(cached "$BASE/cache/cached?max-age=1&swr=30")
+sleep 1.2
+check "a stale response is served while it is refreshed" \
+	"$(cached "$BASE/cache/cached?max-age=1&swr=30")" "STALE ${first#MISS }"
+sleep 0.2
+refreshed=$(cached "$BASE/cache/cached?max-age=1&swr=30")
+check "the refreshed response replaces it" "${refreshed%% *} $([ "$refreshed" != "HIT ${first#MISS }" ] && echo new)" \
+	"HIT new"
+
+check "webserv is still running" "$(kill -0 $SERVER && echo yes)" "yes"
+
+exit $FAILED
@@ -0,0 +1,169 @@
+#!/bin/sh
+# Checks the Range handling of static files end to end.
+#
+# make range-test
+#
+# Starts a webserv serving one random file and checks with curl: single,
+# open-ended and suffix ranges, 416 for a range past the end, ignored
+# malformed headers, If-Range with a matching and a stale validator, the
+# merging of overlapping and nearly touching ranges, multipart/byteranges
+# bodies, the cap of 32 ranges and HEAD answering as GET does.
+
+set -e
+cd "$(dirname "$0")/.."
+
+PORT=8098
+TMP=bench/tmp-range
+BASE=http://127.0.0.1:$PORT
+SIZE=100000
+FILE=$BASE/file.bin
+
+SERVER=
+FAILED=0
+cleanup()
+{
+	status=$?
+	set +e
+	[ -n "$SERVER" ] && kill "$SERVER" 2>/dev/null && wait "$SERVER" 2>/dev/null
+	rm -rf "$TMP"
+	exit $status
+}
+trap cleanup EXIT INT TERM
+
+wait_for()
+{
+	tries=0
+	until grep -q "$2" "$1"; do
+		tries=$((tries + 1))
+		if [ $tries -gt 50 ]; then
+			echo "timed out waiting for '$2':" >&2
+			tail -5 "$1" >&2
+			exit 1
+		fi
+		sleep 0.1
+	done
+}
+
+check()
+{
+	if [ "$2" = "$3" ]; then
+		echo "ok   $1"
+	else
+		echo "FAIL $1: expected '$3', got '$2'"
+		FAILED=1
+	fi
+}
+
+# the status of a GET of the file with the given Range and extra curl options
+status()
+{
+	range=$1
+	shift
+	curl -s -o /dev/null -w '%{http_code}' -H "Range: $range" "$@" $FILE
+}
+
+# the value of one response header
+header()
+{
+	name=$1
+	shift
+	curl -s -D - -o /dev/null "$@" | tr -d '\r' | sed -n "s/^$name: //Ip"
+}
+
+# bytes a to b (inclusive) of the served file
+slice()
+{
+	tail -c +$(($1 + 1)) "$TMP/www/file.bin" | head -c $(($2 - $1 + 1))
+}
+
+# the Content-Range lines of a multipart/byteranges body
+parts()
+{
+	curl -s -H "Range: $1" $FILE | tr -d '\r' | sed -n 's/^Content-Range: //p' | tr '\n' ' ' | sed 's/ $//'
+}
+
+mkdir -p "$TMP/www"
+head -c $SIZE /dev/urandom > "$TMP/www/file.bin"
+echo "error" > "$TMP/www/error.html"
+cat > "$TMP/webserv.conf" <<EOF
+server	{
+	listen		$PORT;
+	server_name	localhost 127.0.0.1;
+	index		index.html;
+	root		$TMP/www;
+
+	error_page	400 error.html;
+	error_page	403 error.html;
+	error_page	404 error.html;
+	error_page	405 error.html;
+	error_page	408 error.html;
+	error_page	409 error.html;
+	error_page	415 error.html;
+	error_page	500 error.html;
+
+	client_max_body_size 0;
+
+	location / {
+		limit_except	GET;
+	}
+}
+EOF
+
+./webserv "$TMP/webserv.conf" > "$TMP/webserv.log" 2>&1 &
+SERVER=$!
+wait_for "$TMP/webserv.log" "waiting for connections"
+
+check "a range gets 206" "$(status bytes=100-199)" "206"
+check "with its Content-Range" "$(header Content-Range -H 'Range: bytes=100-199' $FILE)" "bytes 100-199/$SIZE"
+check "and only its bytes" "$(curl -s -H 'Range: bytes=100-199' $FILE | od -An -tx1 | tr -d ' \n')" \
+	"$(slice 100 199 | od -An -tx1 | tr -d ' \n')"
+check "an open-ended range runs to the end" "$(header Content-Range -H 'Range: bytes=99990-' $FILE)" \
+	"bytes 99990-99999/$SIZE"
+check "an end past the file is clamped" "$(header Content-Range -H 'Range: bytes=99990-200000' $FILE)" \
+	"bytes 99990-99999/$SIZE"
+check "a suffix range is the last bytes" "$(header Content-Range -H 'Range: bytes=-10' $FILE)" \
+	"bytes 99990-99999/$SIZE"
+check "with those bytes" "$(curl -s -H 'Range: bytes=-10' $FILE | od -An -tx1 | tr -d ' \n')" \
+	"$(slice 99990 99999 | od -An -tx1 | tr -d ' \n')"
+check "a suffix longer than the file is all of it" "$(header Content-Range -H 'Range: bytes=-200000' $FILE)" \
+	"bytes 0-99999/$SIZE"
+
+check "a range past the end gets 416" "$(status bytes=$SIZE-)" "416"
+check "naming the size" "$(header Content-Range -H "Range: bytes=$SIZE-" $FILE)" "bytes */$SIZE"
+check "a zero suffix gets 416" "$(status bytes=-0)" "416"
+check "a malformed range is ignored" "$(status bytes=abc)" "200"
+check "a reversed range is ignored" "$(status bytes=200-100)" "200"
+check "another unit is ignored" "$(status items=0-1)" "200"
+
+etag=$(header ETag $FILE)
+modified=$(header Last-Modified $FILE)
+check "If-Range with the ETag gets the range" "$(status bytes=0-9 -H "If-Range: $etag")" "206"
+check "If-Range with another ETag gets the whole file" "$(status bytes=0-9 -H 'If-Range: "stale"')" "200"
+check "If-Range with the date gets the range" "$(status bytes=0-9 -H "If-Range: $modified")" "206"
+check "If-Range with another date gets the whole file" \
+	"$(status bytes=0-9 -H 'If-Range: Thu, 01 Jan 1970 00:00:00 GMT')" "200"
+
+check "overlapping ranges are merged" "$(header Content-Range -H 'Range: bytes=0-99,50-149' $FILE)" \
+	"bytes 0-149/$SIZE"
+check "nearly touching ranges are merged" "$(header Content-Range -H 'Range: bytes=0-99,150-199' $FILE)" \
+	"bytes 0-199/$SIZE"
+check "ranges are merged out of order" "$(header Content-Range -H 'Range: bytes=500-599,0-99,50-550' $FILE)" \
+	"bytes 0-599/$SIZE"
+check "distant ranges are multipart" \
+	"$(header Content-Type -H 'Range: bytes=0-9,50000-50009' $FILE | sed 's/;.*//')" "multipart/byteranges"
+check "with one part each, in order" "$(parts bytes=50000-50009,0-9)" "bytes 0-9/$SIZE bytes 50000-50009/$SIZE"
+check "ranges asking for more than the file are ignored" "$(status bytes=0-99999,0-99999)" "200"
+
+ranges=$(i=0; while [ $i -lt 32 ]; do printf '%d-%d,' $((i * 1000)) $((i * 1000 + 9)); i=$((i + 1)); done)
+ranges=${ranges%,}
+check "32 ranges are served" "$(parts "bytes=$ranges" | wc -w | tr -d ' ')" "64"
+check "33 ranges are ignored" "$(status "bytes=$ranges,40000-40009")" "200"
+
+check "HEAD answers a range as GET does" "$(header Content-Length -I -H 'Range: bytes=0-9' $FILE) \
+$(header Content-Range -I -H 'Range: bytes=0-9' $FILE)" "10 bytes 0-9/$SIZE"
+check "and a multipart range too" "$(header Content-Type -I -H 'Range: bytes=0-9,50000-50009' $FILE | sed 's/;.*//')" \
+	"multipart/byteranges"
+
+check "webserv is still running" "$(kill -0 $SERVER && echo yes)" "yes"
+
+exit $FAILED
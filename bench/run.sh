@@ -0,0 +1,169 @@
+#!/bin/sh
+# Runs the benchmark scenarios against a fresh webserv for each event backend.
+#
+# make bench [BENCH_BACKENDS="poll epoll io_uring"] [BENCH_DURATION=5]
+#            [BENCH_CONNECTIONS=32] [BENCH_THREADS=1] [BENCH_SCENARIOS="..."]
+#            [BENCH_ACCESS_LOG="off combined json"] [BENCH_IDLE_CONNECTIONS=5000]
+#            [BENCH_UPLOAD_SIZE=2147483648] [BENCH_DELETE_FILES=200000]
+#
+# Run as root with tracefs mounted to get the server's system calls per request
+# as well (see the README).
+# Every result is also appended to BENCH_OUT ($TMPDIR/webserv-bench.jsonl,
+# outside the tree) as a JSON line labelled backend/scenario, so runs can be
+# diffed. Each access log setting is a separate run, labelled
+# backend+format/scenario when not off.
+# The proxy scenarios go through bench/upstream, started on port 8091.
+# static_10k and micro_1k/micro_10k serve the same files through the worker
+# pool and from the micro-cache (/micro/, see bench.conf).
+# The tls_* scenarios go to port 8443 with a throwaway certificate:
+# tls_handshake does a full handshake per request, tls_resume resumes the
+# session and tls_large measures bulk throughput.
+# websocket_echo sends 64 byte messages to the echo location /ws, 4 in
+# flight per connection; websocket_idle holds BENCH_IDLE_CONNECTIONS upgraded
+# connections and reports the server's memory per connection (ulimit -n
+# must allow that many sockets in both processes).
+# sessions creates sessions and looks up unknown ids through the session API.
+# upload_native posts the post_upload body to the upload_store location
+# instead of upload.py; upload_large streams one BENCH_UPLOAD_SIZE file
+# (2 GiB by default, written to bench/tmp) and reports the MB/s.
+# put_large, put_large_fsync and put_large_direct PUT a file of the same size
+# with upload_fsync off, with upload_fsync full, and with upload_directio too.
+# delete_tree DELETEs a tree of BENCH_DELETE_FILES files (1000 per directory)
+# from a delete_recursive location, expecting the 202 at once, then serves
+# small.html while the tree is removed in the background.
+
+set -e
+cd "$(dirname "$0")/.."
+
+BACKENDS=${BENCH_BACKENDS:-epoll}
+DURATION=${BENCH_DURATION:-5}
+CONNECTIONS=${BENCH_CONNECTIONS:-32}
+THREADS=${BENCH_THREADS:-1}
+SCENARIOS=${BENCH_SCENARIOS:-"static_small static_small_keepalive static_10k micro_1k micro_10k static_large range not_found autoindex post_upload cgi proxy proxy_large mixed tls_handshake tls_resume tls_large websocket_echo websocket_idle sessions upload_native upload_large put_large put_large_fsync put_large_direct delete_tree"}
+ACCESS_LOGS=${BENCH_ACCESS_LOG:-off}
+IDLE_CONNECTIONS=${BENCH_IDLE_CONNECTIONS:-5000}
+UPLOAD_SIZE=${BENCH_UPLOAD_SIZE:-2147483648}
+DELETE_FILES=${BENCH_DELETE_FILES:-200000}
+OUT=${BENCH_OUT:-${TMPDIR:-/tmp}/webserv-bench.jsonl}
+PORT=8090
+TMP=bench/tmp
+LOADGEN=bench/loadgen
+
+SERVER=
+UPSTREAM=
+cleanup()
+{
+	[ -n "$SERVER" ] && kill "$SERVER" 2>/dev/null && wait "$SERVER" 2>/dev/null || true
+	[ -n "$UPSTREAM" ] && kill "$UPSTREAM" 2>/dev/null && wait "$UPSTREAM" 2>/dev/null || true
+	rm -rf "$TMP" cgi-bin/uploads/webserv_bench.bin
+}
+trap cleanup EXIT INT TERM
+
+# fixtures: a 1 KiB and a 10 KiB page, a 4 MiB file, a 500 entry directory and an upload body
+mkdir -p "$TMP/www/listing" "$TMP/uploads" "$TMP/put" "$TMP/delete"
+head -c 1024 /dev/zero | tr '\0' 'a' > "$TMP/www/small.html"
+head -c 10240 /dev/zero | tr '\0' 'a' > "$TMP/www/small10k.html"
+head -c 4194304 /dev/urandom > "$TMP/www/large.bin"
+echo "error" > "$TMP/www/error.html"
+i=0
+while [ $i -lt 500 ]; do
+	: > "$TMP/www/listing/file_$i.txt"
+	i=$((i + 1))
+done
+{
+	printf -- '--webservbench\r\n'
+	printf 'Content-Disposition: form-data; name="filename"; filename="webserv_bench.bin"\r\n'
+	printf 'Content-Type: application/octet-stream\r\n\r\n'
+	head -c 65536 /dev/urandom
+	printf '\r\n--webservbench--\r\n'
+} > "$TMP/upload.body"
+openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes -days 1 -subj /CN=localhost \
+	-keyout "$TMP/key.pem" -out "$TMP/cert.pem" 2> /dev/null
+
+bench/upstream -p 8091 > "$TMP/upstream.log" 2>&1 &
+UPSTREAM=$!
+
+# a tree of DELETE_FILES empty files for delete_tree
+make_tree()
+{
+	i=0
+	while [ $((i * 1000)) -lt "$DELETE_FILES" ]; do
+		mkdir -p "$1/dir_$i"
+		(cd "$1/dir_$i" && seq -f "file_%g" 1 1000 | xargs touch)
+		i=$((i + 1))
+	done
+}
+
+run()
+{
+	label=$1
+	shift
+	$LOADGEN -p $PORT -d "$DURATION" -t "$THREADS" -s "$SERVER" -l "$variant/$label" -o "$OUT" "$@"
+	echo
+}
+
+for backend in $BACKENDS; do
+for access_log in $ACCESS_LOGS; do
+	variant=$backend
+	{
+		echo "event_backend $backend;"
+		if [ "$access_log" != off ]; then
+			echo "access_log $TMP/access.log $access_log;"
+			variant="$backend+$access_log"
+		fi
+		cat bench/bench.conf
+	} > "$TMP/webserv.conf"
+	./webserv "$TMP/webserv.conf" > "$TMP/webserv-$backend.log" 2>&1 &
+	SERVER=$!
+	tries=0
+	until grep -q "waiting for connections" "$TMP/webserv-$backend.log"; do
+		tries=$((tries + 1))
+		if [ $tries -gt 50 ] || ! kill -0 "$SERVER" 2>/dev/null; then
+			echo "webserv did not start with event_backend $backend:" >&2
+			tail -5 "$TMP/webserv-$backend.log" >&2
+			exit 1
+		fi
+		sleep 0.1
+	done
+
+	echo "=== event_backend $backend, access_log $access_log ==="
+	for scenario in $SCENARIOS; do
+		case $scenario in
+		static_small)			run $scenario -c "$CONNECTIONS" -u /small.html -e 200 ;;
+		static_small_keepalive)	run $scenario -c "$CONNECTIONS" -k -P 4 -u /small.html -e 200 ;;
+		static_10k)				run $scenario -c "$CONNECTIONS" -u /small10k.html -e 200 ;;
+		micro_1k)				run $scenario -c "$CONNECTIONS" -u /micro/small.html -e 200 ;;
+		micro_10k)				run $scenario -c "$CONNECTIONS" -u /micro/small10k.html -e 200 ;;
+		static_large)			run $scenario -c 8 -u /large.bin -e 200 ;;
+		range)					run $scenario -c "$CONNECTIONS" -m bench/mixes/range.jsonl ;;
+		not_found)				run $scenario -c "$CONNECTIONS" -u /missing.html -e 404 ;;
+		autoindex)				run $scenario -c 8 -u /listing/ -e 200 ;;
+		post_upload)			run $scenario -c 4 -m bench/mixes/upload.jsonl ;;
+		cgi)					run $scenario -c 4 -u /cgi-bin/test.py -e 200 ;;
+		proxy)					run $scenario -c "$CONNECTIONS" -u /proxy/ -e 200 ;;
+		proxy_large)			run $scenario -c 8 -u "/proxy/bytes?n=4194304" -e 200 ;;
+		mixed)					run $scenario -c "$CONNECTIONS" -m bench/mixes/mixed.jsonl ;;
+		tls_handshake)			run $scenario -c "$CONNECTIONS" -S -p 8443 -u /small.html -e 200 ;;
+		tls_resume)				run $scenario -c "$CONNECTIONS" -S -R -p 8443 -u /small.html -e 200 ;;
+		tls_large)				run $scenario -c 8 -S -p 8443 -u /large.bin -e 200 ;;
+		websocket_echo)			run $scenario -c "$CONNECTIONS" -P 4 -u /ws -w 64 ;;
+		websocket_idle)			run $scenario -c "$IDLE_CONNECTIONS" -t 4 -u /ws -i ;;
+		sessions)				run $scenario -c "$CONNECTIONS" -m bench/mixes/sessions.jsonl ;;
+		upload_native)			run $scenario -c 4 -m bench/mixes/upload_native.jsonl ;;
+		upload_large)			run $scenario -c 1 -n 1 -d 600 -u /upload/ -b "$UPLOAD_SIZE" -e 201 ;;
+		put_large)				run $scenario -c 1 -n 1 -d 600 -X PUT -u /put/large.bin -b "$UPLOAD_SIZE" ;;
+		put_large_fsync)		run $scenario -c 1 -n 1 -d 600 -X PUT -u /put-sync/large.bin -b "$UPLOAD_SIZE" ;;
+		put_large_direct)		run $scenario -c 1 -n 1 -d 600 -X PUT -u /put-direct/large.bin -b "$UPLOAD_SIZE" ;;
+		delete_tree)
+			make_tree "$TMP/delete/tree"
+			run ${scenario}_start -c 1 -n 1 -X DELETE -u /delete/tree/ -e 202
+			run ${scenario}_static -c "$CONNECTIONS" -u /small.html -e 200 ;;
+		*)						echo "unknown scenario $scenario" >&2; exit 1 ;;
+		esac
+	done
+
+	kill "$SERVER"
+	wait "$SERVER" 2>/dev/null || true
+	SERVER=
+done
+done
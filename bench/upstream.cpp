@@ -0,0 +1,364 @@
+// Stand-in HTTP/1.1 upstream for proxy_pass (built by `make bench` and
+// `make proxy-test`, see bench/run.sh and bench/proxy_test.sh)
+//
+// usage: upstream [-p port] [-n name] [-c]
+//   -p port        port to listen on (8091)
+//   -n name        sent back in X-Upstream, to tell several apart (stand-in)
+//   -c             close every connection after its response (no keep-alive)
+//
+// Routes, all answered with keep-alive unless the request or -c says close:
+//   /stats         {"connections": accepted, "requests": served}
+//   /echo          the request head and body as text/plain
+//   /bytes?n=N     N bytes with a Content-Length
+//   /chunked?n=N   N chunks of 1 KiB with Transfer-Encoding: chunked
+//   /slow?ms=N     a short body after N milliseconds
+//   /close         a body delimited by closing the connection
+//   /health        200, or 503 after /health/down until /health/up
+//   /cached?max-age=N[&swr=N][&vary=1][&ms=N]
+//                  "response <count>" with that Cache-Control (and Vary:
+//                  X-Variant), after ms milliseconds like /slow
+//   anything else  "hello from upstream\n"
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <map>
+#include <netinet/in.h>
+#include <sstream>
+#include <string>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 256
+#define RECV_SIZE 65536
+
+struct Connection
+{
+	Connection() : closeAfter(false), due(0) {}
+
+	std::string in;
+	std::string out;
+	// response held back by /slow until due
+	std::string delayed;
+	bool closeAfter;
+	double due;
+};
+
+static int g_epoll;
+static bool g_noKeepAlive = false;
+static bool g_healthy = true;
+static std::string g_name = "stand-in";
+static unsigned long g_accepted = 0;
+static unsigned long g_served = 0;
+static std::map<int, Connection> g_conns;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static std::string number(unsigned long n)
+{
+	std::ostringstream oss;
+
+	oss << n;
+	return oss.str();
+}
+
+static unsigned long queryNumber(const std::string &target, unsigned long fallback)
+{
+	size_t pos = target.find("n=");
+
+	if (pos == std::string::npos)
+		pos = target.find("ms=");
+	if (pos == std::string::npos)
+		return fallback;
+	return strtoul(target.c_str() + target.find('=', pos) + 1, NULL, 10);
+}
+
+// the value of name= in the query string, fallback when it is missing
+static long queryParam(const std::string &target, const std::string &name, long fallback)
+{
+	size_t pos = target.find("?" + name + "=");
+
+	if (pos == std::string::npos)
+		pos = target.find("&" + name + "=");
+	if (pos == std::string::npos)
+		return fallback;
+	return strtol(target.c_str() + pos + name.size() + 2, NULL, 10);
+}
+
+static std::string header(const std::string &head, const char *name)
+{
+	size_t len = strlen(name);
+	size_t pos = head.find("\r\n");
+
+	while (pos != std::string::npos && pos + 2 < head.size())
+	{
+		size_t start = pos + 2;
+		size_t end = head.find("\r\n", start);
+
+		if (end == std::string::npos)
+			end = head.size();
+		if (end - start > len && head[start + len] == ':' && strncasecmp(head.c_str() + start, name, len) == 0)
+		{
+			size_t value = head.find_first_not_of(" \t", start + len + 1);
+			return value < end ? head.substr(value, end - value) : "";
+		}
+		pos = end;
+	}
+	return "";
+}
+
+static void watch(int fd, Connection &conn)
+{
+	struct epoll_event ev;
+
+	ev.events = conn.out.empty() ? EPOLLIN : EPOLLIN | EPOLLOUT;
+	ev.data.fd = fd;
+	epoll_ctl(g_epoll, EPOLL_CTL_MOD, fd, &ev);
+}
+
+static void drop(int fd)
+{
+	epoll_ctl(g_epoll, EPOLL_CTL_DEL, fd, NULL);
+	close(fd);
+	g_conns.erase(fd);
+}
+
+static std::string respond(Connection &conn, const std::string &head, const std::string &body)
+{
+	size_t sp = head.find(' ');
+	std::string method = head.substr(0, sp);
+	std::string target = head.substr(sp + 1, head.find(' ', sp + 1) - sp - 1);
+	std::string type = "text/plain";
+	std::string status = "200 OK";
+	std::string content;
+	std::string extra;
+	bool chunked = false;
+	bool untilClose = false;
+
+	conn.closeAfter = g_noKeepAlive || strcasecmp(header(head, "Connection").c_str(), "close") == 0;
+	++g_served;
+	if (target.compare(0, 6, "/stats") == 0)
+	{
+		type = "application/json";
+		content = "{\"connections\": " + number(g_accepted) + ", \"requests\": " + number(g_served) + "}\n";
+	}
+	else if (target == "/health/down" || target == "/health/up")
+	{
+		g_healthy = target == "/health/up";
+		content = "health check will " + std::string(g_healthy ? "pass\n" : "fail\n");
+	}
+	else if (target.compare(0, 7, "/health") == 0)
+	{
+		status = g_healthy ? "200 OK" : "503 Service Unavailable";
+		content = g_healthy ? "ok\n" : "unhealthy\n";
+	}
+	else if (target.compare(0, 5, "/echo") == 0)
+		content = head + "\r\n\r\n" + body;
+	else if (target.compare(0, 6, "/bytes") == 0)
+		content.assign(queryNumber(target, 1024), 'b');
+	else if (target.compare(0, 8, "/chunked") == 0)
+		chunked = true;
+	else if (target.compare(0, 7, "/cached") == 0)
+	{
+		long maxAge = queryParam(target, "max-age", -1);
+		long swr = queryParam(target, "swr", -1);
+		if (maxAge >= 0)
+			extra += "Cache-Control: max-age=" + number(maxAge) +
+					 (swr >= 0 ? ", stale-while-revalidate=" + number(swr) : "") + "\r\n";
+		if (queryParam(target, "vary", 0))
+			extra += "Vary: X-Variant\r\nX-Variant: " + header(head, "X-Variant") + "\r\n";
+		content = "response " + number(g_served) + "\n";
+	}
+	else if (target.compare(0, 6, "/close") == 0)
+	{
+		untilClose = true;
+		content = "closed by upstream\n";
+	}
+	else
+		content = "hello from upstream\n";
+
+	std::string res =
+		"HTTP/1.1 " + status + "\r\nContent-Type: " + type + "\r\nX-Upstream: " + g_name + "\r\n" + extra;
+	if (untilClose)
+		conn.closeAfter = true;
+	else if (chunked)
+		res += "Transfer-Encoding: chunked\r\n";
+	else
+		res += "Content-Length: " + number(content.size()) + "\r\n";
+	if (conn.closeAfter)
+		res += "Connection: close\r\n";
+	res += "\r\n";
+	if (method == "HEAD")
+		return res;
+	if (chunked)
+	{
+		unsigned long chunks = queryNumber(target, 4);
+		for (unsigned long i = 0; i < chunks; ++i)
+			res += "400\r\n" + std::string(1024, 'c') + "\r\n";
+		return res + "0\r\n\r\n";
+	}
+	return res + content;
+}
+
+// answers every complete request buffered on fd, in order
+static void serve(int fd, Connection &conn)
+{
+	for (;;)
+	{
+		size_t end = conn.in.find("\r\n\r\n");
+		if (end == std::string::npos || !conn.delayed.empty() || conn.closeAfter)
+			return;
+		std::string head = conn.in.substr(0, end);
+		size_t length = strtoul(header(head, "Content-Length").c_str(), NULL, 10);
+		if (conn.in.size() < end + 4 + length)
+			return;
+		std::string body = conn.in.substr(end + 4, length);
+		conn.in.erase(0, end + 4 + length);
+
+		std::string res = respond(conn, head, body);
+		std::string line = head.substr(0, head.find("\r\n"));
+		if (line.find(" /slow") != std::string::npos || line.find("ms=") != std::string::npos)
+		{
+			conn.delayed = res;
+			conn.due = now() + queryNumber(line, 100) / 1000.0;
+			return;
+		}
+		conn.out += res;
+		watch(fd, conn);
+	}
+}
+
+static void flush(int fd, Connection &conn)
+{
+	while (!conn.out.empty())
+	{
+		ssize_t n = send(fd, conn.out.data(), conn.out.size(), MSG_NOSIGNAL);
+		if (n < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return watch(fd, conn);
+			return drop(fd);
+		}
+		conn.out.erase(0, n);
+	}
+	if (conn.closeAfter && conn.delayed.empty())
+		return drop(fd);
+	watch(fd, conn);
+}
+
+int main(int argc, char **argv)
+{
+	int port = 8091;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "p:n:c")) != -1)
+	{
+		if (opt == 'p')
+			port = atoi(optarg);
+		else if (opt == 'n')
+			g_name = optarg;
+		else if (opt == 'c')
+			g_noKeepAlive = true;
+		else
+		{
+			fprintf(stderr, "usage: %s [-p port] [-n name] [-c]\n", argv[0]);
+			return 1;
+		}
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	int listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	int yes = 1;
+	struct sockaddr_in addr;
+
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, 512) < 0)
+	{
+		perror("upstream");
+		return 1;
+	}
+	g_epoll = epoll_create1(0);
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = listener;
+	epoll_ctl(g_epoll, EPOLL_CTL_ADD, listener, &ev);
+	printf("upstream: listening on 127.0.0.1:%d\n", port);
+	fflush(stdout);
+
+	struct epoll_event events[MAX_EVENTS];
+	char buf[RECV_SIZE];
+	for (;;)
+	{
+		// the nearest /slow response bounds the wait
+		double wake = 0;
+		for (std::map<int, Connection>::iterator it = g_conns.begin(); it != g_conns.end(); ++it)
+			if (!it->second.delayed.empty() && (wake == 0 || it->second.due < wake))
+				wake = it->second.due;
+		int timeout = wake == 0 ? -1 : (int)((wake - now()) * 1000) + 1;
+		int n = epoll_wait(g_epoll, events, MAX_EVENTS, timeout < 0 && wake != 0 ? 0 : timeout);
+
+		for (int i = 0; i < n; ++i)
+		{
+			int fd = events[i].data.fd;
+			if (fd == listener)
+			{
+				int client;
+				while ((client = accept4(listener, NULL, NULL, SOCK_NONBLOCK)) >= 0)
+				{
+					++g_accepted;
+					g_conns[client];
+					ev.events = EPOLLIN;
+					ev.data.fd = client;
+					epoll_ctl(g_epoll, EPOLL_CTL_ADD, client, &ev);
+				}
+				continue;
+			}
+			if (g_conns.find(fd) == g_conns.end())
+				continue;
+			Connection &conn = g_conns[fd];
+			if (events[i].events & EPOLLIN)
+			{
+				ssize_t r = recv(fd, buf, sizeof(buf), 0);
+				if (r <= 0)
+				{
+					drop(fd);
+					continue;
+				}
+				conn.in.append(buf, r);
+				serve(fd, conn);
+			}
+			if (events[i].events & EPOLLOUT)
+				flush(fd, conn);
+		}
+
+		double t = now();
+		for (std::map<int, Connection>::iterator it = g_conns.begin(); it != g_conns.end();)
+		{
+			int fd = it->first;
+			Connection &conn = it->second;
+			++it;
+			if (conn.delayed.empty() || conn.due > t)
+				continue;
+			conn.out += conn.delayed;
+			conn.delayed.clear();
+			flush(fd, conn);
+		}
+	}
+}
@@ -2,17 +2,26 @@
 
 import cgi
 import os
-import random
-import string
 import sys
+import urllib.request
 from datetime import datetime, timedelta, timezone
 
-def generate_cookie():
-	session_id = generate_session_id(20)
-	file = open("cookies_site/databases/sessions.txt", "a")
+# the session_api location of the server running the script, set by webserv
+# from its config. Never built from the request: the Host header is the client's
+SESSION_API = os.environ.get("SESSION_API", "")
+SESSION_API_HOST = os.environ.get("SESSION_API_HOST", "")
+
+def session_api(method, session_id="", body=None):
+	if not SESSION_API:
+		raise RuntimeError("no session_api location in the config")
+	url = SESSION_API + session_id
+	request = urllib.request.Request(url, data=body, method=method, headers={"Host": SESSION_API_HOST})
+	with urllib.request.urlopen(request) as response:
+		return response.read().decode()
 
-	# creates a session (entry) in the sessions database
-	file.write(f"{input_username},{session_id}\n")
+def generate_cookie():
+	# the server creates the session and picks its id
+	session_id = session_api("POST", body=input_username.encode())
 
 	return ("Set-Cookie: sid=" + session_id + "; Expires=" + generate_expiry_date(1) + "\r\n")
 
@@ -30,11 +39,6 @@ def generate_expiry_date(N):
 	return expiration_string
 
 
-def generate_session_id(length):
-	characters = string.ascii_letters + string.digits
-	return ''.join(random.choice(characters) for _ in range(length))
-
-
 # generates a response with the html file path
 def generate_response(body, cookies=False):
 	print("HTTP/1.1 200 OK")
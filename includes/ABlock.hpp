@@ -24,6 +24,12 @@ public:
 	void setClientMaxBodySize(int clientMaxBodySize);
 	void addErrorPage(int statusCode, std::string uri);
 	virtual void setRedirection(int statusCode, std::string path);
+	void setExpires(int seconds);
+	void setCacheControl(std::string cacheControl);
+	void setGzip(bool status);
+	void setGzipStatic(bool status);
+	void setGzipCompLevel(int level);
+	void setGzipMinLength(int length);
 
 	// getters
 	std::vector<std::string> 	getPortsListeningOn() const;
@@ -34,6 +40,12 @@ public:
 	int 						getClientMaxBodySize() const;
 	std::map<int, std::string> 	getErrorPages() const;
 	std::pair<int, std::string> getRedirection() const;
+	int 						getExpires() const;
+	std::string 				getCacheControl() const;
+	bool 						getGzip() const;
+	bool 						getGzipStatic() const;
+	int 						getGzipCompLevel() const;
+	int 						getGzipMinLength() const;
 
 protected:
 	std::vector<std::string> _portsListeningOn;
@@ -44,5 +56,11 @@ protected:
 	int 						_clientMaxBodySize;
 	std::map<int, std::string> 	_errorPages;
 	std::pair<int, std::string> _redirection;
+	int 						_expires;
+	std::string 				_cacheControl;
+	bool 						_gzip;
+	bool 						_gzipStatic;
+	int 						_gzipCompLevel;
+	int 						_gzipMinLength;
 };
 
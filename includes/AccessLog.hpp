@@ -0,0 +1,80 @@
+#pragma once
+
+#include "RequestTrace.hpp"
+#include <cstddef>
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+#define ACCESS_LOG_RING_SIZE (1 << 20)
+#define ACCESS_LOG_LINE_MAX 4096
+#define ACCESS_LOG_FLUSH_MS 100
+
+// access log set with `access_log path [combined | json];`. log() formats the
+// line on the calling thread into that thread's ring buffer (single producer,
+// single consumer, no lock) and returns; a background thread drains every
+// ring in one batched write each ACCESS_LOG_FLUSH_MS, or sooner when a ring is
+// half full. Lines that do not fit are dropped rather than blocking the event
+// loop. SIGUSR1 makes the writer reopen the file (log rotation).
+class AccessLog
+{
+public:
+	struct Entry
+	{
+		std::string remote;
+		std::string requestLine;
+		int status;
+		size_t bytes;
+		std::string referer;
+		std::string userAgent;
+		double seconds;
+		RequestTrace trace;
+	};
+
+	static void configure(const std::string &path, const std::string &format);
+	static bool isEnabled();
+	static void log(const Entry &entry);
+	static void requestReopen();
+	static void shutdown();
+
+	static bool isValidFormat(const std::string &format);
+
+	class Ring
+	{
+	public:
+		Ring(void);
+		~Ring(void);
+
+		bool push(const char *line, size_t len);
+		void drain(std::string &out);
+		size_t used() const;
+
+	private:
+		Ring(const Ring &src);
+		Ring &operator=(const Ring &rhs);
+
+		char *_data;
+		size_t _head;
+		size_t _tail;
+	};
+
+private:
+	AccessLog(void);
+	static Ring &ring();
+	static void *writer(void *arg);
+	static void reopen();
+	static size_t formatCombined(const Entry &entry, char *line);
+	static size_t formatJson(const Entry &entry, char *line);
+
+	static pthread_mutex_t _mutex;
+	static pthread_cond_t _cond;
+	static pthread_t _thread;
+	static bool _started;
+	static bool _stopping;
+	static bool _pathChanged;
+	static bool _enabled;
+	static bool _json;
+	static std::string _path;
+	static int _fd;
+	static std::vector<Ring *> _rings;
+};
@@ -1,20 +1,70 @@
 #pragma once
 
-#include <string>
+#include "ServerBlock.hpp"
+#include "ThreadPool.hpp"
+#include <ctime>
 #include <dirent.h>
+#include <list>
+#include <map>
+#include <pthread.h>
+#include <string>
+#include <sys/types.h>
+#include <vector>
 
-class AutoIndex {
+#define AUTOINDEX_CACHE_ENTRIES 256
+
+// directory listing built on a worker thread: entries are read with readdir,
+// stat'ed with fstatat, sorted (directories first) and rendered as html, json
+// or xml. Finished listings are cached until the directory's mtime changes.
+class AutoIndex : public Task
+{
 public:
-	AutoIndex(void);
-	AutoIndex(std::string path, std::string queryPath);
+	AutoIndex(std::string path, std::string queryPath, std::string format, const ServerBlock &block);
 	~AutoIndex(void);
-	AutoIndex(const AutoIndex &src);
-	AutoIndex	&operator=(const AutoIndex &rhs);
-	std::string getBody();
+
+	void run();
+	std::string complete();
+
+	static std::string getContentType(const std::string &format);
+	static bool findCached(const std::string &path, const std::string &format, std::string &body);
 
 private:
-	std::string getIndexes();
-	DIR *_dir;
-	std::string _queryPath;
+	AutoIndex(void);
+	AutoIndex(const AutoIndex &src);
+	AutoIndex &operator=(const AutoIndex &rhs);
+
+	struct Entry
+	{
+		std::string name;
+		bool isDir;
+		off_t size;
+		time_t mtime;
+	};
+	struct CacheEntry
+	{
+		time_t sec;
+		long nsec;
+		std::string body;
+		std::list<std::string>::iterator lru;
+	};
+
+	void readEntries(DIR *dir);
+	std::string getBody() const;
+	std::string getHtml() const;
+	std::string getJson() const;
+	std::string getXml() const;
+	static bool compareEntries(const Entry &a, const Entry &b);
+
 	std::string _path;
+	std::string _queryPath;
+	std::string _format;
+	ServerBlock _block;
+	std::vector<Entry> _entries;
+	std::string _body;
+	int _code;
+
+	static std::map<std::string, CacheEntry> _cache;
+	// the cache keys, most recently used first
+	static std::list<std::string> _cacheLru;
+	static pthread_mutex_t _cacheMutex;
 };
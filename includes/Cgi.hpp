@@ -25,6 +25,10 @@ private:
 	std::string body;
 	std::string path;
 	std::string query;
+	std::string sessionId;
+	std::string sessionUser;
+	std::string sessionApiUrl;
+	std::string sessionApiHost;
 	std::map<std::string, std::string> envVariables;
 	char **envV;
 	void setEnv();
@@ -39,6 +43,8 @@ public:
 	Cgi(const Cgi &src);
 	Cgi &operator=(const Cgi &rhs);
 	
+	void setSession(const std::string &id, const std::string &user);
+	void setSessionApi(const std::string &url, const std::string &host);
 	virtual int runCgi();
 	std::string getPath() const;
 	std::string getBody();
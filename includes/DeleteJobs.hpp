@@ -0,0 +1,94 @@
+#pragma once
+
+#include "ThreadPool.hpp"
+#include <cstddef>
+#include <deque>
+#include <map>
+#include <string>
+
+// the trees are removed one after the other, beside the request workers
+#define DELETE_JOB_THREADS 1
+// the nice value of that thread
+#define DELETE_JOB_NICE 19
+// finished jobs whose status can still be asked for
+#define DELETE_JOBS_KEPT 256
+
+// the recursive DELETEs of delete_recursive locations. Each tree is removed
+// on a pool of its own, so a large one never holds up the workers answering
+// requests, while the event loop hands out the job ids and reads the progress
+// for delete_status locations. Only the event loop uses the registry; the
+// counters of a running job are the only thing its worker writes.
+class DeleteJobs
+{
+public:
+	enum State
+	{
+		RUNNING,
+		DONE,
+		FAILED
+	};
+	struct Job
+	{
+		unsigned long id;
+		// the request path, for the status
+		std::string uri;
+		std::string path;
+		State state;
+		unsigned long removed;
+		unsigned long failed;
+		// the first errno the worker met
+		int error;
+		bool cancelled;
+		double started;
+		double finished;
+	};
+
+	DeleteJobs();
+	~DeleteJobs();
+
+	const Job &start(const std::string &path, const std::string &uri);
+	const Job *find(unsigned long id) const;
+	void collect();
+	int getNotifyFd() const;
+
+	static std::string render(const Job &job);
+
+private:
+	DeleteJobs(const DeleteJobs &src);
+	DeleteJobs &operator=(const DeleteJobs &rhs);
+
+	static double now();
+
+	// a pointer, to be joined before the jobs its workers use are freed
+	ThreadPool *_pool;
+	std::map<unsigned long, Job *> _jobs;
+	// the finished jobs, oldest first
+	std::deque<unsigned long> _finished;
+	unsigned long _nextId;
+};
+
+// removes one tree with openat/unlinkat from the directory fds down, so a
+// symlink is removed and never followed, and the path is not walked again for
+// every entry
+class DeleteTask : public Task
+{
+public:
+	DeleteTask(DeleteJobs::Job &job);
+	~DeleteTask(void);
+
+	void run();
+	std::string complete();
+
+	DeleteJobs::Job &getJob();
+
+private:
+	DeleteTask(void);
+	DeleteTask(const DeleteTask &src);
+	DeleteTask &operator=(const DeleteTask &rhs);
+
+	void removeTree(int fd);
+	void removeEntry(int dirFd, const char *name, int flags);
+	void fail(int error);
+
+	DeleteJobs::Job &_job;
+};
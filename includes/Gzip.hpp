@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstddef>
+#include <list>
+#include <map>
+#include <pthread.h>
+#include <string>
+#include <zlib.h>
+
+#define GZIP_CACHE_SIZE (8 * 1024 * 1024)
+
+// streaming gzip encoder: feed chunks with append() as they become available,
+// then finish() flushes the trailer. Output accumulates in getOutput().
+class Gzip
+{
+public:
+	Gzip(int level);
+	~Gzip();
+
+	void append(const char *data, size_t len);
+	void finish();
+	const std::string &getOutput() const;
+
+	static std::string compress(const std::string &data, int level);
+	static bool isCompressibleType(const std::string &contentType);
+	static bool isAccepted(const std::string &acceptEncoding, const std::string &coding);
+
+private:
+	Gzip(const Gzip &src);
+	Gzip &operator=(const Gzip &rhs);
+	void deflateInput(int flush);
+
+	z_stream _stream;
+	std::string _output;
+	bool _finished;
+};
+
+// LRU of compressed static responses keyed by ETag and level, bounded by the
+// total size of the compressed bodies; shared by the worker threads
+class GzipCache
+{
+public:
+	GzipCache(size_t maxSize);
+	~GzipCache();
+
+	bool find(const std::string &key, std::string &compressed);
+	void insert(const std::string &key, const std::string &compressed);
+
+private:
+	GzipCache(const GzipCache &src);
+	GzipCache &operator=(const GzipCache &rhs);
+
+	typedef std::list<std::string> LruList;
+	typedef std::map<std::string, std::pair<std::string, LruList::iterator> > EntryMap;
+
+	pthread_mutex_t _mutex;
+	size_t _maxSize;
+	size_t _size;
+	LruList _lru;
+	EntryMap _entries;
+};
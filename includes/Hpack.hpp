@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+// dynamic table size of both ends until SETTINGS say otherwise
+#define HPACK_TABLE_SIZE 4096
+// decoded size (names, values and 32 per field) of one header block
+#define HPACK_MAX_HEADER_LIST_SIZE (64 * 1024)
+
+// HPACK (RFC 7541) header compression for the HTTP/2 connections. Decoding
+// keeps the dynamic table the peer's encoder fills; encoding only uses the
+// static table and literals without indexing, so there is no table of
+// ours for the peer to track and responses can be encoded in any order.
+class Hpack
+{
+public:
+	typedef std::pair<std::string, std::string> Field;
+	typedef std::vector<Field> Fields;
+
+	Hpack();
+	~Hpack();
+
+	bool decode(const std::string &block, Fields &fields);
+	static void encode(const Fields &fields, std::string &block);
+
+private:
+	Hpack(const Hpack &src);
+	Hpack &operator=(const Hpack &rhs);
+
+	bool find(size_t index, Field &field) const;
+	void insert(const Field &field);
+	void evict(size_t maxSize);
+
+	static bool decodeInteger(const std::string &in, size_t &pos, int prefix, size_t &value);
+	static bool decodeString(const std::string &in, size_t &pos, std::string &value);
+	static bool decodeHuffman(const std::string &in, size_t pos, size_t size, std::string &value);
+	static void encodeInteger(size_t value, int prefix, unsigned char first, std::string &out);
+	static size_t findStatic(const Field &field, bool &exact);
+
+	// newest entry first, as the indexes count
+	std::deque<Field> _table;
+	size_t _size;
+	size_t _maxSize;
+};
@@ -0,0 +1,161 @@
+#pragma once
+
+#include "Hpack.hpp"
+#include <cstddef>
+#include <map>
+#include <string>
+#include <vector>
+
+#define HTTP2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_PREFACE_SIZE 24
+// SETTINGS_MAX_CONCURRENT_STREAMS we advertise
+#define HTTP2_MAX_STREAMS 128
+// initial flow control window and largest frame, the protocol defaults
+#define HTTP2_WINDOW 65535
+#define HTTP2_FRAME_SIZE 16384
+// response bytes taken from a stream of the default weight ahead of what its
+// window lets out; scaled by the weight
+#define HTTP2_STREAM_BUFFER (64 * 1024)
+// unsent output above which no more DATA is scheduled
+#define HTTP2_OUTPUT_LIMIT (256 * 1024)
+// weight of streams that did not send one (RFC 9113 5.3.5)
+#define HTTP2_DEFAULT_WEIGHT 16
+
+// the HTTP/2 (RFC 9113) side of one connection, h2c by prior knowledge or by
+// Upgrade: frames in, frames out, no sockets. Each stream's request comes out
+// as an HTTP/1.1 message for the existing handlers, and their HTTP/1.1
+// responses go back in through respond(), which turns the head into HEADERS
+// and the body (de-chunked) into DATA. DATA is sent as the peer's windows
+// allow, interleaving streams in proportion to their priority weight.
+class Http2
+{
+public:
+	// a whole request (END_STREAM seen), as HTTP/1.1
+	struct Request
+	{
+		unsigned int stream;
+		std::string message;
+	};
+
+	Http2();
+	~Http2();
+
+	static bool isPreface(const std::string &data);
+	static bool isUpgrade(const std::map<std::string, std::string> &headers, std::string &settings);
+
+	void upgrade(const std::string &settings, const std::string &request);
+	bool receive(const char *data, size_t size);
+	bool respond(unsigned int stream, std::string &response, bool end);
+	void schedule();
+
+	std::vector<Request> takeRequests();
+	std::vector<unsigned int> takeResets();
+	std::string &getOutput();
+	bool isFinished() const;
+
+private:
+	enum FrameType
+	{
+		FRAME_DATA,
+		FRAME_HEADERS,
+		FRAME_PRIORITY,
+		FRAME_RST_STREAM,
+		FRAME_SETTINGS,
+		FRAME_PUSH_PROMISE,
+		FRAME_PING,
+		FRAME_GOAWAY,
+		FRAME_WINDOW_UPDATE,
+		FRAME_CONTINUATION
+	};
+	enum ErrorCode
+	{
+		ERR_NONE,
+		ERR_PROTOCOL,
+		ERR_INTERNAL,
+		ERR_FLOW_CONTROL,
+		ERR_SETTINGS_TIMEOUT,
+		ERR_STREAM_CLOSED,
+		ERR_FRAME_SIZE,
+		ERR_REFUSED_STREAM,
+		ERR_CANCEL,
+		ERR_COMPRESSION,
+		ERR_CONNECT,
+		ERR_ENHANCE_YOUR_CALM
+	};
+	enum ChunkState
+	{
+		CHUNK_SIZE,
+		CHUNK_DATA,
+		CHUNK_DATA_END,
+		CHUNK_TRAILER
+	};
+
+	struct Stream
+	{
+		Stream();
+
+		// the request: its HTTP/1.1 head once HEADERS are in, then the body
+		std::string request;
+		std::string body;
+		bool requestDone;
+		size_t recvUnacked;
+		// the response: its HTTP/1.1 head until complete, then body bytes
+		// waiting for the windows
+		std::string head;
+		bool headDone;
+		bool chunked;
+		ChunkState chunkState;
+		size_t chunkRemaining;
+		std::string chunkLine;
+		std::string data;
+		bool ended;
+		long window;
+		int weight;
+		// stride scheduling: bytes sent scaled by 1/weight, lowest goes next
+		unsigned long long pass;
+	};
+
+	Http2(const Http2 &src);
+	Http2 &operator=(const Http2 &rhs);
+
+	bool process(int type, int flags, unsigned int id, const char *payload, size_t size);
+	bool processHeaders(int flags, unsigned int id, const char *payload, size_t size);
+	bool processData(int flags, unsigned int id, const char *payload, size_t size);
+	bool processSettings(int flags, unsigned int id, const char *payload, size_t size);
+	bool processWindowUpdate(unsigned int id, const char *payload, size_t size);
+	bool applySettings(const char *payload, size_t size);
+	bool endHeaders();
+	void openStream(unsigned int id, const Hpack::Fields &fields, bool end, int weight);
+	void finishRequest(unsigned int id, Stream &stream);
+	bool readResponse(Stream &stream, unsigned int id, const char *data, size_t size);
+	void readChunked(Stream &stream, const char *data, size_t size);
+	void sendHeaders(unsigned int id, const Hpack::Fields &fields);
+	void writeFrame(int type, int flags, unsigned int id, const char *payload, size_t size);
+	void writeWindowUpdate(unsigned int id, size_t increment);
+	void resetStream(unsigned int id, ErrorCode code);
+	bool fail(ErrorCode code);
+
+	static std::string canonicalName(const std::string &name);
+
+	Hpack _decoder;
+	std::map<unsigned int, Stream> _streams;
+	std::vector<Request> _requests;
+	std::vector<unsigned int> _resets;
+	std::string _input;
+	std::string _output;
+	bool _prefaceReceived;
+	bool _settingsReceived;
+	bool _goaway;
+	bool _failed;
+	unsigned int _lastStream;
+	// a HEADERS block still waiting for its CONTINUATION frames
+	unsigned int _continuation;
+	int _continuationFlags;
+	int _continuationWeight;
+	std::string _headerBlock;
+	long _sendWindow;
+	size_t _recvUnacked;
+	long _peerWindow;
+	size_t _peerFrameSize;
+	unsigned long long _pass;
+};
@@ -15,14 +15,74 @@ public:
 
 	// setters
 	void setAutoindexStatus(bool status);
+	void setAutoindexFormat(std::string format);
+	void setMetricsFormat(std::string format);
 	void addAllowedMethods(std::string path);
+	void setProxyPass(const std::string &host, const std::string &port, const std::string &uri);
+	void setProxyConnectTimeout(int seconds);
+	void setProxyReadTimeout(int seconds);
+	void setResponseCache(bool enabled);
+	void setResponseCacheValid(int seconds);
+	void setMicroCache(bool enabled);
+	void setWebSocket(const std::string &mode);
+	void setSessionApi(bool enabled);
+	void setUploadStore(const std::string &path);
+	void setUploadMaxFileSize(unsigned long long size);
+	void setUploadFsync(const std::string &policy);
+	void setUploadDirectio(unsigned long long size);
+	void setDeleteRecursive(bool enabled);
+	void setDeleteStatus(bool enabled);
 
 	// getters
 	bool getAutoindexStatus() const;
+	std::string getAutoindexFormat() const;
+	const std::string &getMetricsFormat() const;
 	std::vector<std::string> getAllowedMethods() const;
+	const std::string &getProxyHost() const;
+	const std::string &getProxyPort() const;
+	const std::string &getProxyUri() const;
+	int getProxyConnectTimeout() const;
+	int getProxyReadTimeout() const;
+	bool getResponseCache() const;
+	int getResponseCacheValid() const;
+	bool getMicroCache() const;
+	const std::string &getWebSocket() const;
+	bool getSessionApi() const;
+	const std::string &getUploadStore() const;
+	unsigned long long getUploadMaxFileSize() const;
+	const std::string &getUploadFsync() const;
+	unsigned long long getUploadDirectio() const;
+	bool getDeleteRecursive() const;
+	bool getDeleteStatus() const;
 
 private:
 	bool _autoindexStatus;
+	std::string _autoindexFormat;
+	std::string _metricsFormat;
 	std::vector<std::string> _allowedMethods;
+	std::string _proxyHost;
+	std::string _proxyPort;
+	std::string _proxyUri;
+	int _proxyConnectTimeout;
+	int _proxyReadTimeout;
+	bool _responseCache;
+	int _responseCacheValid;
+	bool _microCache;
+	// "echo" or "broadcast", empty when the location is plain HTTP
+	std::string _webSocket;
+	bool _sessionApi;
+	// the directory multipart uploads are streamed to, and the largest file
+	// they may hold (0: no limit)
+	std::string _uploadStore;
+	unsigned long long _uploadMaxFileSize;
+	// what is synced before an upload or PUT counts as stored: "off", "file"
+	// or "full" (the directory too), and the body size from which files are
+	// preallocated and written past the page cache (0: never)
+	std::string _uploadFsync;
+	unsigned long long _uploadDirectio;
+	// whether a DELETE of <dir>/ removes the tree in the background, and
+	// whether the location answers the progress of those deletes
+	bool _deleteRecursive;
+	bool _deleteStatus;
 };
 
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <sstream>
+#include <string>
+
+enum LogLevel
+{
+	LOG_ERROR,
+	LOG_WARN,
+	LOG_INFO,
+	LOG_DEBUG
+};
+
+// messages above this level are compiled out (-DLOG_COMPILE_LEVEL=LOG_INFO)
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_DEBUG
+#endif
+
+#define DEFAULT_LOG_LEVEL LOG_INFO
+
+// LOG(LOG_DEBUG) << "read " << bytes; the stream arguments are only evaluated
+// when the level is enabled. A ternary rather than an if, so the macro is safe
+// in an unbraced if / else
+#define LOG(level)                                                                                                    \
+	!((level) <= LOG_COMPILE_LEVEL && Log::isEnabled(level)) ? (void)0 : LogVoidify() & Log((level)).stream()
+
+// one log line, written with a single write(2) when it goes out of scope:
+// errors and warnings to stderr, the rest to stdout
+class Log
+{
+public:
+	Log(LogLevel level);
+	~Log(void);
+
+	std::ostringstream &stream();
+
+	static bool isEnabled(LogLevel level);
+	static void setLevel(LogLevel level);
+	static LogLevel getLevel();
+	static bool parseLevel(const std::string &name, LogLevel &level);
+
+private:
+	Log(const Log &src);
+	Log &operator=(const Log &rhs);
+
+	LogLevel _level;
+	std::ostringstream _stream;
+
+	static LogLevel _runtimeLevel;
+};
+
+// turns the stream chain into void for the LOG() ternary; & binds looser than <<
+struct LogVoidify
+{
+	void operator&(std::ostream &)
+	{
+	}
+};
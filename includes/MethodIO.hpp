@@ -2,11 +2,17 @@
 #pragma once
 
 #include "ABlock.hpp"
+#include "Gzip.hpp"
 #include "IOAdaptor.hpp"
+#include "MimeTypes.hpp"
+#include "Proxy.hpp"
 #include "ServerBlock.hpp"
+#include "ThreadPool.hpp"
 
+#include <fstream>
 #include <map>
 #include <string>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <vector>
 
@@ -18,45 +24,76 @@
 // #define MAX_CONTENT_LENGTH 1000000
 
 class WebServer;
+class SessionStore;
+class DeleteJobs;
+class Upload;
 
 class MethodIO;
 class MethodIO : public IOAdaptor
 {
 public:
 	struct rInfo;
+	typedef std::string (*MethodPointer)(ServerBlock &, struct rInfo &, struct rInfo &);
 private:
 	std::string statusLine;
-	typedef std::string (*MethodPointer)(ServerBlock &, struct rInfo &, struct rInfo &);
 	// std::map<std::string, std::string> responseHeader;
 	std::string response;
-	static const std::map<int, std::string> errCodeMessages;
+	struct StatusLine
+	{
+		int code;
+		const char *message;
+		const char *line;
+		size_t length;
+	};
+	static const StatusLine statusLines[];
+	static const size_t statusLinesCount;
 	static const std::map<std::string, MethodPointer> methods;
-	static const std::map<std::string, std::string> contentTypes;
+	// the table of the current config; the WebServer keeps a replaced one
+	// while tasks given it may still read it
+	static const MimeTypes *mimeTypes;
+	static const MimeTypes builtinMimeTypes;
+	static GzipCache gzipCache;
 
 	void tokenize(std::string s, MethodIO::rInfo &ri) const;
 
 	static std::map<std::string, MethodPointer> initMethodsMap();
-	static std::map<int, std::string> initErrCodeMessages();
-	static std::map<std::string, std::string> initContentTypes();
 	static std::string getMethod(ServerBlock &block, MethodIO::rInfo &rqi, MethodIO::rInfo &rsi);
 	static std::string postMethod(ServerBlock &block, MethodIO::rInfo &rqi, MethodIO::rInfo &rsi);
 	static std::string headMethod(ServerBlock &block, MethodIO::rInfo &rqi, MethodIO::rInfo &rsi);
 	static std::string delMethod(ServerBlock &block, MethodIO::rInfo &rqi, MethodIO::rInfo &rsi);
 	static std::string putMethod(ServerBlock &block, MethodIO::rInfo &rqi, MethodIO::rInfo &rsi);
 
-	static std::string getDate();
-	static std::string getType(std::string path);
+	static const std::string &getType(const std::string &path);
 	static std::string getPath(std::string basePath, WebServer &ws, std::string &port);
-	static ServerBlock getServerBlock(MethodIO::rInfo &rqi, WebServer &ws);
 	static std::string readFile(MethodIO::rInfo &rqi, MethodIO::rInfo &rsi, ServerBlock &block);
 	static void writeFile(MethodIO::rInfo &rqi, ServerBlock &block, bool createNew);
+	static bool isNotModified(MethodIO::rInfo &rqi, MethodIO::rInfo &rsi, const ABlock &block, const struct stat &st,
+							  const std::string &variant);
+	static std::string findStaticVariant(MethodIO::rInfo &rqi, const ABlock &block, std::string &filePath);
+	static std::string compressFile(std::ifstream &file, MethodIO::rInfo &rsi, int level);
+	static std::string compressCgiOutput(MethodIO::rInfo &rqi, ServerBlock &block, const std::string &output);
+	static bool isRangeApplicable(MethodIO::rInfo &rqi, MethodIO::rInfo &rsi);
+	static bool readRanges(std::ifstream &file, const std::string &header, off_t size, MethodIO::rInfo &rsi,
+						   std::string &body);
+	static Proxy::Request proxyRequest(MethodIO::rInfo &rqi, const std::string &prefix, const LocationBlock &location,
+									   bool upgrade);
+	static std::string sessionApi(SessionStore &sessions, MethodIO::rInfo &rqi, const std::string &prefix);
+	static std::string deleteTree(DeleteJobs &deletes, MethodIO::rInfo &rqi,
+								  const std::pair<std::string, LocationBlock> &location, const std::string &status);
+	static std::string deleteStatus(DeleteJobs &deletes, MethodIO::rInfo &rqi, const std::string &prefix);
+	static std::string locationPath(const std::string &path, const std::pair<std::string, LocationBlock> &location);
 	static std::string getMessage(int code);
+	static const StatusLine *findStatusLine(int code);
 
 	std::string getUpdatedContent(int fd);
 
+	// bench/microbench.cpp times the private hot paths
+	friend class MicroBench;
+
 public:
 	struct rInfo
 	{
+		rInfo() : code(0), exist(false), task(NULL) {}
 		int code;
 		std::vector<std::string> request;
 		std::map<std::string, std::string> headers;
@@ -65,7 +102,11 @@ public:
 		std::string path;
 		std::string queryPath;
 		std::string query;
+		// the session of the Cookie, for CGI scripts
+		std::string sessionId;
+		std::string sessionUser;
 		bool exist;
+		Task *task;
 	};
 	MethodIO(void);
 	~MethodIO(void);
@@ -73,4 +114,11 @@ public:
 	MethodIO &operator=(const MethodIO &rhs);
 	static std::string generateResponse(int code, MethodIO::rInfo &ri);
 	std::string getMessageToSend(WebServer &ws, std::string port);
+	static void loadErrorPages(ServerBlock &block);
+	static std::string errorResponse(int code, const ServerBlock *block);
+	static ServerBlock &getServerBlock(MethodIO::rInfo &rqi, WebServer &ws);
+	static std::string putTarget(const std::string &path, const std::pair<std::string, LocationBlock> &location);
+	static std::string uploadResponse(const Upload &upload, const ServerBlock *block);
+	static std::string getDate();
+	static void setMimeTypes(const MimeTypes *types);
 };
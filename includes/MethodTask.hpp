@@ -0,0 +1,46 @@
+#pragma once
+
+#include "MethodIO.hpp"
+#include "ServerBlock.hpp"
+#include "ThreadPool.hpp"
+#include <string>
+
+// env var naming a delay (ms) injected before every file task, to reproduce
+// slow storage without a slowed filesystem
+#define IO_DELAY_ENV "WEBSERV_IO_DELAY_MS"
+
+// runs a method handler (and with it every open/stat/read/write/unlink it does)
+// on a worker thread. The request and response info are copied in; the server
+// block is shared, a reload keeps it until the task has completed.
+class MethodTask : public Task
+{
+public:
+	MethodTask(MethodIO::MethodPointer method, ServerBlock &block, const MethodIO::rInfo &rqi,
+			   const MethodIO::rInfo &rsi);
+	~MethodTask(void);
+
+	void run();
+	std::string complete();
+	bool getStaticFile(std::string &path, struct stat &st) const;
+
+private:
+	MethodTask(void);
+	MethodTask(const MethodTask &src);
+	MethodTask &operator=(const MethodTask &rhs);
+
+	static unsigned int initDelay();
+	void checkStaticFile();
+
+	MethodIO::MethodPointer _method;
+	ServerBlock &_block;
+	MethodIO::rInfo _rqi;
+	MethodIO::rInfo _rsi;
+	std::string _response;
+	std::string _error;
+	int _code;
+	// set when the response is a whole small file of a micro_cache location
+	bool _static;
+	struct stat _st;
+
+	static const unsigned int _delay;
+};
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <string>
+
+#define METRICS_MAX_THREADS 64
+#define CACHE_LINE_SIZE 64
+#define METRICS_STATUS_COUNT 22
+#define METRICS_BUCKET_COUNT 14
+
+// process wide counters served by `metrics stub_status|prometheus;`
+// locations. Every thread writes to its own cache line aligned slot (the
+// event loop owns slot 0, pool workers register for the others), so the hot
+// path is a plain load and store with no lock and no shared cache line; a
+// scrape sums the slots.
+class Metrics
+{
+public:
+	enum Counter
+	{
+		CONNECTIONS_ACCEPTED,
+		CONNECTIONS_HANDLED,
+		BYTES_RECEIVED,
+		BYTES_SENT,
+		CGI_SPAWNS,
+		CGI_FAILURES,
+		GZIP_CACHE_HITS,
+		GZIP_CACHE_MISSES,
+		AUTOINDEX_CACHE_HITS,
+		AUTOINDEX_CACHE_MISSES,
+		TASKS_RUN,
+		ACCESS_LOG_DROPPED,
+		UPSTREAM_CONNECTS,
+		UPSTREAM_REUSES,
+		UPSTREAM_FAILURES,
+		HEALTH_CHECKS_PASSED,
+		HEALTH_CHECKS_FAILED,
+		RESPONSE_CACHE_HITS,
+		RESPONSE_CACHE_STALE,
+		RESPONSE_CACHE_MISSES,
+		RESPONSE_CACHE_COALESCED,
+		RESPONSE_CACHE_BYPASSES,
+		RESPONSE_CACHE_EVICTIONS,
+		MICRO_CACHE_HITS,
+		MICRO_CACHE_MISSES,
+		HTTP2_CONNECTIONS,
+		HTTP2_STREAMS,
+		TLS_HANDSHAKES,
+		TLS_HANDSHAKE_FAILURES,
+		TLS_RESUMED,
+		TLS_KTLS,
+		WEBSOCKET_UPGRADES,
+		WEBSOCKET_MESSAGES,
+		SESSIONS_CREATED,
+		SESSIONS_DELETED,
+		SESSIONS_EXPIRED,
+		UPLOAD_FILES,
+		UPLOAD_BYTES,
+		DELETE_JOBS,
+		DELETE_ENTRIES,
+		COUNTER_COUNT
+	};
+	// connection states, only changed by the event loop
+	enum Gauge
+	{
+		CONNECTIONS_READING,
+		CONNECTIONS_WRITING,
+		CONNECTIONS_WAITING,
+		GAUGE_COUNT
+	};
+	enum Histogram
+	{
+		REQUEST_DURATION,
+		CGI_DURATION,
+		PHASE_WAIT,
+		PHASE_READ,
+		PHASE_QUEUE,
+		PHASE_HANDLER,
+		PHASE_SEND,
+		HISTOGRAM_COUNT
+	};
+	enum Method
+	{
+		METHOD_GET,
+		METHOD_HEAD,
+		METHOD_POST,
+		METHOD_PUT,
+		METHOD_DELETE,
+		METHOD_OTHER,
+		METHOD_COUNT
+	};
+
+	static void registerThread();
+	static void add(Counter counter, unsigned long n = 1);
+	static void adjust(Gauge gauge, long delta);
+	static void observe(Histogram histogram, double seconds);
+	static void countRequest(const std::string &method, int status, double seconds);
+	static double now();
+
+	static std::string render(const std::string &format);
+	static const char *getContentType(const std::string &format);
+
+private:
+	struct Slot
+	{
+		unsigned long counters[COUNTER_COUNT];
+		long gauges[GAUGE_COUNT];
+		unsigned long requests[METHOD_COUNT][METRICS_STATUS_COUNT];
+		// per bucket (not cumulative), the last one is +Inf
+		unsigned long buckets[HISTOGRAM_COUNT][METRICS_BUCKET_COUNT + 1];
+		unsigned long sumMicros[HISTOGRAM_COUNT];
+	} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+	struct Totals
+	{
+		unsigned long counters[COUNTER_COUNT];
+		long gauges[GAUGE_COUNT];
+		unsigned long requests[METHOD_COUNT][METRICS_STATUS_COUNT];
+		unsigned long buckets[HISTOGRAM_COUNT][METRICS_BUCKET_COUNT + 1];
+		unsigned long sumMicros[HISTOGRAM_COUNT];
+	};
+
+	Metrics(void);
+	static Slot &slot();
+	static void collect(Totals &totals);
+	static std::string renderStubStatus(const Totals &totals);
+	static std::string renderPrometheus(const Totals &totals);
+
+	static Slot _slots[METRICS_MAX_THREADS];
+	static unsigned int _nextSlot;
+	static const int statusCodes[METRICS_STATUS_COUNT - 1];
+	static const char *const methodNames[METHOD_COUNT];
+	static const double bucketBounds[METRICS_BUCKET_COUNT];
+};
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <list>
+#include <map>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// total size of the cached responses, and the largest file taken in
+#define MICRO_CACHE_SIZE (4 * 1024 * 1024)
+#define MICRO_CACHE_MAX_FILE_SIZE (16 * 1024)
+// seconds between the stat()s that check a cached file is unchanged
+#define MICRO_CACHE_VALID 1
+
+// complete 200 responses (status line, headers and body) of the small static
+// files of micro_cache locations, keyed by port, Host and path. A hit skips
+// routing, the worker pool and header building: the connection sends straight
+// from the shared buffer, with the current Date spliced in by the same
+// sendmsg. A file whose mtime, size or inode changed is dropped at its next
+// check. Only the event loop uses it.
+class MicroCache
+{
+public:
+	// immutable once cached; connections sending it hold a reference so an
+	// entry can be dropped mid-send
+	struct Buffer
+	{
+		std::string bytes;
+		// where the Date value starts, npos without one
+		size_t dateOffset;
+		size_t bodyLength;
+		int refs;
+	};
+
+	MicroCache();
+	~MicroCache();
+
+	Buffer *find(const std::string &key, double now);
+	void insert(const std::string &key, const std::string &path, const struct stat &st, const std::string &response,
+				double now);
+	void clear();
+
+	static void release(Buffer *buffer);
+	static ssize_t send(int fd, const Buffer &buffer, size_t sent);
+	static void render(const Buffer &buffer, std::string &out);
+
+private:
+	struct Entry
+	{
+		Buffer *buffer;
+		std::string path;
+		struct stat st;
+		double checked;
+		std::list<std::string>::iterator lru;
+	};
+
+	MicroCache(const MicroCache &src);
+	MicroCache &operator=(const MicroCache &rhs);
+
+	void erase(std::map<std::string, Entry>::iterator it);
+
+	size_t _size;
+	std::list<std::string> _lru;
+	std::map<std::string, Entry> _entries;
+};
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <vector>
+
+#define DEFAULT_MIME_TYPE "text/plain"
+// how many times the table may double before the types are given up on
+#define MIME_MAX_GROWTH 8
+
+// immutable extension -> Content-Type table. The slots are laid out with a
+// perfect hash (hash and displace) built once at load time, so a lookup is two
+// hashes of the extension and a single compare, without allocating.
+class MimeTypes
+{
+public:
+	MimeTypes(void);
+	MimeTypes(const std::map<std::string, std::string> &types);
+	MimeTypes(const MimeTypes &src);
+	MimeTypes &operator=(const MimeTypes &rhs);
+	~MimeTypes(void);
+
+	const std::string *find(const char *extension, size_t len) const;
+	const std::string &getType(const std::string &path) const;
+	size_t size() const;
+
+	static std::map<std::string, std::string> builtinTypes();
+
+private:
+	struct Entry
+	{
+		std::string extension;
+		std::string type;
+	};
+
+	void build(const std::map<std::string, std::string> &types);
+	static unsigned int hash(const char *s, size_t len, unsigned int seed);
+
+	std::vector<unsigned int> _seeds;
+	std::vector<Entry> _slots;
+	unsigned int _mask;
+	size_t _size;
+	std::string _defaultType;
+};
@@ -2,7 +2,11 @@
 #pragma once
 
 #include "LocationBlock.hpp"
+#include "Log.hpp"
+#include "ResponseCache.hpp"
+#include "SessionStore.hpp"
 #include "ServerBlock.hpp"
+#include "Upstream.hpp"
 #include <fstream>
 
 class Parser
@@ -20,6 +24,7 @@ public:
 
 	void parsePortsListeningOn(std::istringstream &iss);
 	void parseServerName(std::istringstream &iss);
+	void parseSsl(std::istringstream &iss, const std::string &directive);
 
 	template <typename T>
 	void parseRoot(T &block, std::istringstream &iss);
@@ -31,13 +36,74 @@ public:
 	void parseErrorPages(T &block, std::istringstream &iss);
 	template <typename T>
 	void parseRedirection(T &block, std::istringstream &iss);
+	template <typename T>
+	void parseExpires(T &block, std::istringstream &iss);
+	template <typename T>
+	void parseCacheControl(T &block, std::istringstream &iss);
+	template <typename T>
+	void parseGzip(T &block, std::istringstream &iss, const std::string &directive);
+	template <typename T>
+	void parseGzipCompLevel(T &block, std::istringstream &iss);
+	template <typename T>
+	void parseGzipMinLength(T &block, std::istringstream &iss);
 
 	void parseAutoindexStatus(std::istringstream &iss);
+	void parseAutoindexFormat(std::istringstream &iss);
+	void parseMetrics(std::istringstream &iss);
+	void parseProxyPass(std::istringstream &iss);
+	void parseProxyTimeout(std::istringstream &iss, const std::string &directive);
+	void parseResponseCache(std::istringstream &iss, const std::string &directive);
+	void parseMicroCache(std::istringstream &iss);
+	void parseWebSocket(std::istringstream &iss);
+	void parseSessionApi(std::istringstream &iss);
+	void parseUpload(std::istringstream &iss, const std::string &directive);
+	void parseDelete(std::istringstream &iss, const std::string &directive);
 	void parseAllowedMethods(std::istringstream &iss);
 
 	// parsing the location block
 	void parseLocationBlocks(std::istringstream &iss);
 
+	// parsing the mime types (types { ... } or include [file])
+	void parseTypes(std::istream &stream, const std::string &source, int &lineNum);
+	void parseInclude(std::string line);
+	const std::map<std::string, std::string> &getTypes() const;
+
+	// parsing the event loop backend (event_backend [poll | epoll | io_uring])
+	void parseEventBackend(std::string line);
+	const std::string &getEventBackend() const;
+
+	// parsing the logging (log_level [error | warn | info | debug],
+	// access_log [path] [combined | json] or access_log off)
+	void parseLogLevel(std::string line);
+	void parseAccessLog(std::string line);
+	LogLevel getLogLevel() const;
+	const std::string &getAccessLogPath() const;
+	const std::string &getAccessLogFormat() const;
+
+	// parsing the slow request log (slow_request_log [milliseconds] or off)
+	void parseSlowRequestLog(std::string line);
+	double getSlowRequestThreshold() const;
+
+	// parsing the response cache store (response_cache_path [dir] [max_size=size])
+	void parseResponseCachePath(std::string line);
+	const std::string &getResponseCachePath() const;
+	size_t getResponseCacheSize() const;
+
+	bool parseSize(std::string number, unsigned long long &size);
+
+	// parsing the session store (session_store [memory | file] [ttl=seconds])
+	void parseSessionStore(std::string line);
+	const std::string &getSessionStorePath() const;
+	int getSessionTtl() const;
+
+	// parsing the upstream blocks (upstream [name] { server ...; })
+	void parseUpstreamBlock(const std::string &name);
+	void parseUpstreamServer(Upstream &upstream, std::istringstream &iss);
+	void parseUpstreamBalance(Upstream &upstream, const std::string &directive, std::istringstream &iss);
+	void parseHealthCheck(Upstream &upstream, std::istringstream &iss);
+	bool parseUpstreamOption(const std::string &token, const std::string &option, int &value);
+	const std::map<std::string, Upstream> &getUpstreams() const;
+
 	// utils
 	bool isSkippableLine(std::string &line);
 
@@ -46,6 +112,7 @@ public:
 	bool isLocationDirective(std::string &line);
 	bool isClosedCurlyBracket(std::string &line);
 	bool isValidPort(std::string &port);
+	bool isValidListen(std::string &listen);
 	bool isValidErrorStatusCode(int statusCode);
 	bool isValidMethod(std::string &method);
 	bool isValidNumber(std::string &num);
@@ -79,5 +146,22 @@ private:
 	std::map<std::string, int> _locationDirectiveCount;
 	std::vector<int> _validStatusCodes;
 	std::map<int, int> _errorPageCount;
+	std::map<std::string, std::string> _types;
+	std::string _eventBackend;
+	bool _hasEventBackend;
+	LogLevel _logLevel;
+	bool _hasLogLevel;
+	std::string _accessLogPath;
+	std::string _accessLogFormat;
+	bool _hasAccessLog;
+	double _slowRequestThreshold;
+	bool _hasSlowRequestLog;
+	std::map<std::string, Upstream> _upstreams;
+	std::string _responseCachePath;
+	size_t _responseCacheSize;
+	bool _hasResponseCachePath;
+	std::string _sessionStorePath;
+	int _sessionTtl;
+	bool _hasSessionStore;
 };
 
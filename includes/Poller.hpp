@@ -0,0 +1,72 @@
+#pragma once
+
+#include <map>
+#include <poll.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#define DEFAULT_EVENT_BACKEND "epoll"
+#define POLLER_MAX_EVENTS 256
+
+// readiness notification backend for the event loop. Interest uses the poll
+// flags (POLLIN / POLLOUT, 0 to pause an fd); wait() fills ready with the fds
+// and their revents and behaves like poll(): -1 with errno on failure.
+// A listening socket is reported ready like any other fd, unless the backend
+// accepts its connections itself: they are then handed out by takeAccepted,
+// as (listening fd, connection fd).
+class Poller
+{
+public:
+	Poller(void);
+	virtual ~Poller(void);
+
+	virtual void addListener(int fd);
+	virtual std::vector<std::pair<int, int> > takeAccepted();
+	virtual void add(int fd, short events) = 0;
+	virtual void modify(int fd, short events) = 0;
+	virtual void remove(int fd) = 0;
+	virtual int wait(std::vector<struct pollfd> &ready, int timeout) = 0;
+	virtual const char *getName() const = 0;
+
+	static Poller *create(const std::string &backend);
+	static bool isValidBackend(const std::string &backend);
+
+private:
+	Poller(const Poller &src);
+	Poller &operator=(const Poller &rhs);
+};
+
+class PollPoller : public Poller
+{
+public:
+	PollPoller(void);
+	~PollPoller(void);
+
+	void add(int fd, short events);
+	void modify(int fd, short events);
+	void remove(int fd);
+	int wait(std::vector<struct pollfd> &ready, int timeout);
+	const char *getName() const;
+
+private:
+	std::vector<struct pollfd> _pfds;
+	std::map<int, size_t> _indexes;
+};
+
+class EpollPoller : public Poller
+{
+public:
+	EpollPoller(void);
+	~EpollPoller(void);
+
+	void add(int fd, short events);
+	void modify(int fd, short events);
+	void remove(int fd);
+	int wait(std::vector<struct pollfd> &ready, int timeout);
+	const char *getName() const;
+
+private:
+	int _epfd;
+	std::map<int, bool> _registered;
+};
@@ -0,0 +1,199 @@
+#pragma once
+
+#include "Upstream.hpp"
+#include <cstddef>
+#include <map>
+#include <string>
+#include <sys/socket.h>
+#include <vector>
+
+// bytes a client may have queued before reading from its upstream pauses
+#define PROXY_BUFFER_SIZE (64 * 1024)
+#define PROXY_READ_SIZE 16384
+#define PROXY_MAX_HEAD_SIZE (64 * 1024)
+#define DEFAULT_PROXY_CONNECT_TIMEOUT 5
+#define DEFAULT_PROXY_READ_TIMEOUT 60
+// idle keep-alive connections kept per upstream, and for how long (seconds)
+#define UPSTREAM_KEEPALIVE_MAX 32
+#define UPSTREAM_KEEPALIVE_TIMEOUT 60
+
+class WebServer;
+
+// forwards the requests of proxy_pass locations to HTTP/1.1 upstreams. Every
+// upstream socket is non-blocking and polled by the event loop next to the
+// clients; the response is passed through to the client's send buffer as it
+// arrives, and reading pauses while the client is PROXY_BUFFER_SIZE behind.
+// Connections that end a response cleanly go back to a per-upstream pool of
+// idle keep-alive connections. A proxy_pass naming an upstream block is
+// balanced over its peers, retried on the next peer when one fails before
+// answering, and the peers' health probes run from the same loop. A
+// websocket handshake the upstream accepts turns into a two-way tunnel.
+class Proxy
+{
+public:
+	// what MethodIO hands over for a proxy_pass location
+	struct Request
+	{
+		Request();
+
+		std::string host;
+		// empty when host may name an upstream block (port 80 otherwise)
+		std::string port;
+		// request line and headers, rewritten for the upstream, without the
+		// blank line; X-Forwarded-For and Content-Length are added on start
+		std::string head;
+		std::string body;
+		bool headRequest;
+		int connectTimeout;
+		int readTimeout;
+		// keeps a copy of a response up to captureLimit bytes for the
+		// response cache
+		bool capture;
+		size_t captureLimit;
+		// a websocket handshake: on 101 the session becomes a tunnel
+		bool upgrade;
+	};
+	// progress of a client's response, drained by the event loop
+	struct Result
+	{
+		int client;
+		// set once, when the response head is forwarded
+		int status;
+		// response body bytes forwarded
+		size_t bytes;
+		// set once, when a capturing session ends; response is the whole
+		// response if it was complete and within captureLimit, or empty
+		bool done;
+		std::string response;
+	};
+
+	Proxy(WebServer &server);
+	~Proxy(void);
+
+	void setUpstreams(const std::map<std::string, Upstream> &upstreams);
+	void start(int client, const Request &request, const std::string &remote, std::map<int, std::string> &buffMap);
+	bool owns(int fd) const;
+	bool isProxying(int client) const;
+	bool isTunnel(int client) const;
+	void handle(int fd, short revents, std::map<int, std::string> &buffMap);
+	void resume(int client);
+	void forward(int client, const char *data, size_t size, std::map<int, std::string> &buffMap);
+	void updateTunnel(int client, std::map<int, std::string> &buffMap);
+	void abort(int client);
+	int getTimeout(double now) const;
+	void expire(double now, std::map<int, std::string> &buffMap);
+	std::vector<Result> takeResults();
+
+private:
+	enum BodyMode
+	{
+		BODY_NONE,
+		BODY_LENGTH,
+		BODY_CHUNKED,
+		BODY_UNTIL_CLOSE
+	};
+	enum ChunkState
+	{
+		CHUNK_SIZE,
+		CHUNK_DATA,
+		CHUNK_DATA_END,
+		CHUNK_TRAILER
+	};
+	struct Session
+	{
+		Session();
+
+		int client;
+		int upstream;
+		std::string key;
+		std::string request;
+		size_t sent;
+		size_t received;
+		bool connecting;
+		bool reused;
+		bool retried;
+		bool headRequest;
+		bool paused;
+		bool headDone;
+		bool reusable;
+		bool done;
+		std::string head;
+		BodyMode mode;
+		size_t remaining;
+		ChunkState chunkState;
+		std::string chunkLine;
+		int connectTimeout;
+		int readTimeout;
+		double deadline;
+		// upstream block, peer (its address is key) and the peers tried
+		std::string group;
+		bool hasPeer;
+		std::vector<int> tried;
+		std::string hashValue;
+		bool idempotent;
+		bool capture;
+		size_t captureLimit;
+		std::string captured;
+		// after a 101 to an upgrade, bytes flow both ways until either side
+		// closes; request then holds what the client sent and is not out yet
+		bool upgrade;
+		bool tunnel;
+	};
+	// an active health check in flight
+	struct Probe
+	{
+		Probe();
+
+		std::string group;
+		std::string key;
+		std::string request;
+		size_t sent;
+		std::string response;
+		double deadline;
+	};
+	struct Idle
+	{
+		int fd;
+		double since;
+	};
+	struct Address
+	{
+		struct sockaddr_storage addr;
+		socklen_t len;
+	};
+
+	Proxy(const Proxy &src);
+	Proxy &operator=(const Proxy &rhs);
+
+	bool attach(Session &session);
+	bool pickPeer(Session &session);
+	Upstream *groupOf(const Session &session, int &peer);
+	void peerFailed(Session &session);
+	int connectTo(const std::string &host, const std::string &port);
+	void sendRequest(Session &session, std::map<int, std::string> &buffMap);
+	void readResponse(Session &session, std::map<int, std::string> &buffMap);
+	int parseHead(Session &session, std::string &out);
+	size_t forwardBody(Session &session, const char *data, size_t len, std::string &out);
+	size_t forwardChunked(Session &session, const char *data, size_t len, std::string &out);
+	void failed(Session &session, int code, std::map<int, std::string> &buffMap);
+	void finish(Session &session, bool keepAlive);
+	void release(int fd, const std::string &key);
+	void closeIdle(int fd);
+	void wakeClient(int client);
+	short upstreamEvents(const Session &session) const;
+	void report(int client, int status, size_t bytes);
+	void reportDone(const Session &session);
+	void startProbes(double now);
+	void handleProbe(int fd, short revents);
+	void endProbe(int fd, bool ok);
+
+	WebServer &_server;
+	std::map<int, Session *> _byUpstream;
+	std::map<int, Session *> _byClient;
+	std::map<std::string, std::vector<Idle> > _idle;
+	std::map<int, std::string> _idleKeys;
+	std::map<std::string, Address> _addresses;
+	std::map<std::string, Upstream> _upstreams;
+	std::map<int, Probe> _probes;
+	std::vector<Result> _results;
+};
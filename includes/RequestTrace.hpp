@@ -0,0 +1,47 @@
+#pragma once
+
+#include <string>
+
+// monotonic timestamps (Metrics::now()) of the phases of one request, 0 until
+// the phase is reached. The event loop keeps one per connection; a task
+// carries its own while it runs on a worker and the loop merges it back.
+class RequestTrace
+{
+public:
+	enum Phase
+	{
+		ACCEPTED,
+		FIRST_BYTE_IN,
+		HEADERS_COMPLETE,
+		REQUEST_COMPLETE,
+		HANDLER_START,
+		TASK_START,
+		CGI_FORK,
+		CGI_EXIT,
+		HANDLER_END,
+		FIRST_BYTE_OUT,
+		LAST_BYTE_OUT,
+		PHASE_COUNT
+	};
+
+	RequestTrace(void);
+	RequestTrace(const RequestTrace &src);
+	RequestTrace &operator=(const RequestTrace &rhs);
+	~RequestTrace(void);
+
+	void mark(Phase phase);
+	double get(Phase phase) const;
+	double between(Phase from, Phase to) const;
+	void merge(const RequestTrace &other);
+	void clear();
+	void observe() const;
+	std::string describe() const;
+
+	// marks on the trace of the request the calling thread is serving, for
+	// code that does not see the request (CGI)
+	static void setCurrent(RequestTrace *trace);
+	static void markCurrent(Phase phase);
+
+private:
+	double _at[PHASE_COUNT];
+};
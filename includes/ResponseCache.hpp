@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstddef>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#define DEFAULT_RESPONSE_CACHE_SIZE (64 * 1024 * 1024)
+#define RESPONSE_CACHE_MIN_SIZE (64 * 1024)
+#define RESPONSE_CACHE_FILE "webserv.cache"
+// a single response may take up to this fraction of the store
+#define RESPONSE_CACHE_ENTRY_FRACTION 8
+// seconds a key whose response could not be stored goes straight to the
+// handler, so its requests are not queued behind each other
+#define RESPONSE_CACHE_PASS_TTL 10
+
+// caches whole proxied and CGI responses to GET, keyed by the host, the uri
+// and the request headers the response Varies on. The index (keys, LRU order,
+// freshness) is kept in memory, the bytes in a file mapped with mmap under
+// response_cache_path, so a large cache lives in the page cache rather than
+// on the heap. Requests for a key that is being fetched wait for that fetch
+// instead of reaching the upstream; a stale entry within its
+// stale-while-revalidate window is served while a background request
+// refreshes it. Only the event loop uses it.
+class ResponseCache
+{
+public:
+	enum Result
+	{
+		HIT,
+		// served stale, the caller refreshes the key unless it is fetching
+		STALE,
+		// the caller fetches the key and hands the response to complete()
+		MISS,
+		// the key is being fetched: wait() for it
+		WAIT,
+		BYPASS
+	};
+	typedef std::map<std::string, std::string> Headers;
+
+	ResponseCache();
+	~ResponseCache();
+
+	void configure(const std::string &dir, size_t maxSize);
+	bool isEnabled() const;
+	bool isFetching(const std::string &key) const;
+	size_t getMaxEntrySize() const;
+
+	Result lookup(const std::string &method, const std::string &uri, const Headers &headers, double now, bool refresh,
+				  std::string &key, std::string &response);
+	void begin(const std::string &key, const Headers &headers, int valid);
+	void wait(const std::string &key, int fd);
+	void forget(int fd);
+	std::vector<int> complete(const std::string &key, const std::string &response, double now);
+	std::vector<int> abandon(const std::string &key);
+
+private:
+	struct Entry
+	{
+		size_t offset;
+		size_t length;
+		// status line, headers and the blank line
+		size_t headLength;
+		double stored;
+		double fresh;
+		double stale;
+		std::list<std::string>::iterator lru;
+	};
+	// a response being fetched and the clients waiting for it
+	struct Fetch
+	{
+		Headers headers;
+		int valid;
+		std::vector<int> waiters;
+	};
+
+	ResponseCache(const ResponseCache &src);
+	ResponseCache &operator=(const ResponseCache &rhs);
+
+	void close();
+	bool store(const std::string &key, const std::string &response, const Fetch &fetch, double now);
+	std::string variantKey(const std::string &key, const Headers &headers) const;
+	bool allocate(size_t length, size_t &offset);
+	void release(size_t offset, size_t length);
+	void evict(const std::string &variant);
+	std::string serve(const Entry &entry, const char *status, double now, bool headOnly) const;
+
+	std::string _path;
+	size_t _size;
+	char *_map;
+	std::map<std::string, Entry> _entries;
+	// most recently used first
+	std::list<std::string> _lru;
+	// offset -> length of the free extents of the store
+	std::map<size_t, size_t> _free;
+	// the request headers a key's response Varies on
+	std::map<std::string, std::vector<std::string> > _vary;
+	std::map<std::string, Fetch> _fetches;
+	std::map<std::string, double> _pass;
+};
@@ -8,6 +8,14 @@ class LocationBlock;
 class ServerBlock : public ABlock
 {
 public:
+	// pre-rendered error response: head is the status line and headers,
+	// body starts with the blank line that ends the header section
+	struct ErrorResponse
+	{
+		std::string head;
+		std::string body;
+	};
+
 	ServerBlock();
 	ServerBlock(const ServerBlock &other);
 	ServerBlock &operator=(const ServerBlock &other);
@@ -15,12 +23,46 @@ public:
 
 	void addPortsListeningOn(std::string port);
 	void addServerName(std::string serverName);
+	void addSslPort(std::string port);
+	void setSslCertificate(std::string path);
+	void setSslCertificateKey(std::string path);
+	void setSslKtls(bool enabled);
+	const std::vector<std::string> &getSslPorts() const;
+	const std::string &getSslCertificate() const;
+	const std::string &getSslCertificateKey() const;
+	bool getSslKtls() const;
 
 	void addLocationBlock(std::string path, LocationBlock locationBlock);
+	bool hasProxyLocations() const;
+	bool hasWebSocketLocations() const;
+	bool hasSessionApiLocations() const;
+	bool hasUploadLocations() const;
+	bool hasDeleteJobLocations() const;
+	std::string getDeleteStatusLocation() const;
+	std::string getSessionApiLocation() const;
+	void setSessionApiAddress(const std::string &url, const std::string &host);
+	const std::string &getSessionApiUrl() const;
+	const std::string &getSessionApiHost() const;
+	bool hasResponseCacheLocations() const;
+	bool hasMicroCacheLocations() const;
 	std::pair<std::string, LocationBlock> getLocationBlockPair(std::string basePath) const;
 
+	void setErrorResponse(int statusCode, std::string head, std::string body);
+	void clearErrorResponses();
+	const ErrorResponse *findErrorResponse(int statusCode) const;
+
 private:
 	std::map<std::string, LocationBlock> _locationBlocks;
+	std::map<int, ErrorResponse> _errorResponses;
+	// the ports of listen marked ssl, and what their TLS contexts are built from
+	std::vector<std::string> _sslPorts;
+	std::string _sslCertificate;
+	std::string _sslCertificateKey;
+	bool _sslKtls;
+	// where the CGIs of this server reach the session API, set once all the
+	// server blocks are known; empty without a session_api location
+	std::string _sessionApiUrl;
+	std::string _sessionApiHost;
 };
 
 std::ostream &operator<<(std::ostream &os, const ServerBlock &serverBlock);
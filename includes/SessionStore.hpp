@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstddef>
+#include <ctime>
+#include <map>
+#include <string>
+#include <vector>
+
+#define DEFAULT_SESSION_TTL 86400
+// the cookie holding the session id
+#define SESSION_COOKIE "sid"
+#define SESSION_SHARDS 16
+#define SESSION_SHARD_BUCKETS 64
+// one slot per second; a session further out than this goes round again
+#define SESSION_WHEEL_SLOTS 4096
+#define SESSION_MAX_USER 256
+// the log is rewritten once it holds this many records and twice the live
+// sessions
+#define SESSION_COMPACT_MIN 1024
+
+// the login sessions of the CGI scripts: session id -> user, each expiring
+// ttl seconds after it was created. The ids live in SESSION_SHARDS separately
+// grown hash tables, so a rehash only ever moves a shard's worth of entries,
+// and expire through a timing wheel of one second slots instead of a scan.
+// With a path the sessions survive restarts: every change is appended to a
+// log, written once per event loop round and rewritten without the dead
+// records when it grows. Only the event loop uses it.
+class SessionStore
+{
+public:
+	SessionStore();
+	~SessionStore();
+
+	void configure(const std::string &path, int ttl);
+	std::string create(const std::string &user, time_t now);
+	const std::string *find(const std::string &id, time_t now) const;
+	bool remove(const std::string &id);
+	void tick(time_t now);
+	size_t size() const;
+
+	static bool isValidUser(const std::string &user);
+	static std::string cookieId(const std::map<std::string, std::string> &headers);
+
+private:
+	struct Entry
+	{
+		std::string id;
+		std::string user;
+		time_t expires;
+		Entry *next;
+		// the wheel slot of expires
+		Entry *wheelPrev;
+		Entry *wheelNext;
+	};
+	struct Shard
+	{
+		std::vector<Entry *> buckets;
+		size_t count;
+	};
+
+	SessionStore(const SessionStore &src);
+	SessionStore &operator=(const SessionStore &rhs);
+
+	static unsigned long hash(const std::string &id);
+	Entry **slot(const std::string &id, unsigned long h) const;
+	Entry *insert(const std::string &id, const std::string &user, time_t expires);
+	void erase(Entry **link);
+	void grow(Shard &shard);
+	void schedule(Entry *entry);
+	void unschedule(Entry *entry);
+	void clear();
+
+	void load(time_t now);
+	void append(const std::string &record);
+	void flush();
+	void compact();
+	void closeLog();
+
+	Shard _shards[SESSION_SHARDS];
+	Entry *_wheel[SESSION_WHEEL_SLOTS];
+	// the last second the wheel was turned to
+	time_t _wheelTime;
+	size_t _count;
+	int _ttl;
+	std::string _path;
+	int _fd;
+	// records appended since the last flush, and in the log in all
+	std::string _pending;
+	size_t _records;
+};
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "RequestTrace.hpp"
+#include <cstddef>
+#include <deque>
+#include <pthread.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#define THREAD_POOL_SIZE 4
+
+// unit of blocking work taken off the event loop: run() executes on a worker
+// thread and must only touch the task's own data, complete() runs back on the
+// event thread and returns the response to send
+class Task
+{
+public:
+	Task(void);
+	virtual ~Task(void);
+
+	virtual void run() = 0;
+	virtual std::string complete() = 0;
+
+	RequestTrace &getTrace();
+
+private:
+	Task(const Task &src);
+	Task &operator=(const Task &rhs);
+
+	RequestTrace _trace;
+};
+
+// fixed set of worker threads; finished tasks are queued and signalled through
+// a pipe whose read end is polled by the event loop like any other fd
+class ThreadPool
+{
+public:
+	ThreadPool(size_t threads);
+	~ThreadPool(void);
+
+	void submit(int fd, Task *task);
+	int getNotifyFd() const;
+	std::vector<std::pair<int, Task *> > takeCompleted();
+
+private:
+	ThreadPool(const ThreadPool &src);
+	ThreadPool &operator=(const ThreadPool &rhs);
+	static void *worker(void *arg);
+
+	std::vector<pthread_t> _threads;
+	pthread_mutex_t _mutex;
+	pthread_cond_t _cond;
+	std::deque<std::pair<int, Task *> > _queue;
+	std::vector<std::pair<int, Task *> > _completed;
+	int _notify[2];
+	bool _stopping;
+};
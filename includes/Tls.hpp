@@ -0,0 +1,79 @@
+#pragma once
+
+#include "ServerBlock.hpp"
+#include <cstddef>
+#include <map>
+#include <openssl/ssl.h>
+#include <set>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+// sessions kept for resumption by session id, and how long they and the
+// session tickets stay valid (seconds)
+#define TLS_SESSION_CACHE_SIZE 20480
+#define TLS_SESSION_TIMEOUT 300
+
+// TLS for the ports listed with ssl. Each server block with a certificate
+// gets a context; the first block of a port answers by default and SNI picks
+// another block of the port by its server_name. Sessions resume from the
+// context's cache or from a ticket. Everything is non-blocking: the
+// handshake, reads and writes return at once and say what to wait for, so
+// the event loop drives TLS connections like plain ones. ALPN offers h2 and
+// http/1.1. With ssl_ktls on, records are encrypted by the kernel once the
+// handshake is done, when the kernel and OpenSSL support it.
+class Tls
+{
+public:
+	enum Status
+	{
+		DONE,
+		WANT_READ,
+		WANT_WRITE,
+		FAILED
+	};
+
+	Tls();
+	~Tls();
+
+	void configure(const std::vector<ServerBlock> &blocks);
+	bool isSecure(const std::string &port) const;
+	bool owns(int fd) const;
+	bool isHandshaking(int fd) const;
+
+	bool open(int fd, const std::string &port);
+	Status handshake(int fd);
+	ssize_t read(int fd, char *buff, size_t size);
+	ssize_t write(int fd, const char *data, size_t size);
+	bool hasPending() const;
+	std::vector<int> takePending();
+	void close(int fd);
+
+private:
+	// a server block's context and the names SNI matches it by
+	struct Site
+	{
+		SSL_CTX *ctx;
+		std::vector<std::string> names;
+	};
+	struct Connection
+	{
+		SSL *ssl;
+		std::string port;
+		bool handshaking;
+	};
+
+	Tls(const Tls &src);
+	Tls &operator=(const Tls &rhs);
+
+	SSL_CTX *createContext(const ServerBlock &block);
+	static void freeSites(std::map<std::string, std::vector<Site> > &ports);
+	static int selectServerName(SSL *ssl, int *alert, void *arg);
+	static int selectProtocol(SSL *ssl, const unsigned char **out, unsigned char *outlen, const unsigned char *in,
+							  unsigned int inlen, void *arg);
+
+	std::map<std::string, std::vector<Site> > _ports;
+	std::map<int, Connection> _connections;
+	// connections with decrypted bytes left in OpenSSL that poll cannot see
+	std::set<int> _pending;
+};
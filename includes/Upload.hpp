@@ -0,0 +1,200 @@
+#pragma once
+
+#include "ThreadPool.hpp"
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// bytes read from an upload connection at a time
+#define UPLOAD_READ_SIZE 65536
+// the most a part's headers may take
+#define UPLOAD_MAX_PART_HEADERS 8192
+// O_DIRECT writes go through an aligned buffer of this size
+#define UPLOAD_DIRECT_BUFFER 1048576
+#define UPLOAD_DIRECT_ALIGN 4096
+// the parsed bytes that make a write for the pool worth its round trip, and
+// the size of the buffers they are queued in
+#define UPLOAD_WRITE_SIZE 262144
+// the most parsed bytes waiting for the disk before the connection is no
+// longer read
+#define UPLOAD_QUEUE_SIZE 1048576
+
+class LocationBlock;
+class ServerBlock;
+
+// a request body streamed to disk as it arrives: a multipart/form-data (RFC
+// 7578) POST into an upload_store directory, or a PUT of one file. Each file
+// goes to a temporary file in its directory and only the current part's
+// headers, the bytes that may start a boundary and what waits for the disk
+// are ever buffered. The boundary is looked for with memmem. Fields without a
+// filename are skipped. The files get their names once the whole body is in,
+// so a failed upload leaves nothing behind.
+// The event loop only parses and queues; the files are made and written on
+// the worker pool, one batch at a time. Only the writer touches them: the
+// event loop hands it the queue in startWrite and takes its error back in
+// endWrite.
+class Upload
+{
+public:
+	Upload(const std::string &request, const LocationBlock &location, unsigned long long length);
+	~Upload();
+
+	static bool isMultipart(const std::string &contentType, std::string &boundary);
+
+	void setBoundary(const std::string &boundary);
+	void setTarget(const std::string &path);
+	bool receive(const char *data, size_t size);
+	unsigned long long getRemaining() const;
+	bool finish();
+	size_t getQueued() const;
+	bool isWriteDue() const;
+	bool isWriting() const;
+	void startWrite();
+	void writeBatch();
+	void endWrite();
+	void abandon();
+	bool isAbandoned() const;
+	bool hasFiles() const;
+	int getError() const;
+	bool isPut() const;
+	bool isCreated() const;
+	const std::string &getRequest() const;
+	const std::vector<std::string> &getFiles() const;
+
+private:
+	enum State
+	{
+		PREAMBLE,
+		BOUNDARY,
+		HEADERS,
+		DATA,
+		EPILOGUE,
+		FAILED
+	};
+	enum Fsync
+	{
+		FSYNC_OFF,
+		FSYNC_FILE,
+		FSYNC_FULL
+	};
+	struct File
+	{
+		std::string temp;
+		std::string name;
+	};
+	// what the parser leaves the writer: a file by its name, bytes for it, its
+	// end
+	enum Step
+	{
+		FILE_OPEN,
+		FILE_DATA,
+		FILE_CLOSE
+	};
+	struct Pending
+	{
+		Step step;
+		std::string data;
+	};
+
+	Upload(const Upload &src);
+	Upload &operator=(const Upload &rhs);
+
+	size_t parse(const char *data, size_t size);
+	size_t partialDelimiter(const char *data, size_t size) const;
+	bool parseHeader(const std::string &line);
+	void beginPart();
+	bool queue(const char *data, size_t size);
+	void endPart();
+	void fail(int code);
+
+	void openPart(const std::string &name);
+	bool openFile(File &file);
+	void write(const char *data, size_t size);
+	bool writeAll(const char *data, size_t size);
+	void closePart();
+	void failWrite(int code);
+
+	static std::string fileName(const std::string &disposition);
+	static bool syncPath(const std::string &path);
+
+	// the request line and headers, for the access log
+	std::string _request;
+	std::string _store;
+	// the file a PUT replaces; empty for a multipart upload
+	std::string _target;
+	// CRLF, "--" and the boundary: what ends a part
+	std::string _delimiter;
+	unsigned long long _maxFileSize;
+	Fsync _fsync;
+	bool _direct;
+	unsigned long long _length;
+	unsigned long long _received;
+	State _state;
+	int _error;
+	bool _created;
+	// what parse() could not use yet
+	std::string _input;
+	std::string _partName;
+	unsigned long long _partSize;
+	std::vector<Pending> _queue;
+	size_t _queued;
+	// the buffers of written batches, for the next bytes
+	std::vector<std::string> _spare;
+	size_t _opens;
+	bool _writing;
+	bool _abandoned;
+	// the writer's: the batch it was handed, and the files
+	std::vector<Pending> _batch;
+	int _writeError;
+	int _fd;
+	// the bytes waiting for a full aligned block with O_DIRECT
+	char *_buffer;
+	size_t _buffered;
+	std::vector<File> _parts;
+	std::vector<std::string> _files;
+};
+
+// writes a batch of an upload on the worker pool while the event loop goes
+// on reading the body, or frees an upload that will not be finished, whose
+// temporary files are removed with it. The event loop takes the upload back
+// when a batch completes.
+class UploadWriteTask : public Task
+{
+public:
+	UploadWriteTask(Upload *upload, bool remove);
+	~UploadWriteTask(void);
+
+	void run();
+	std::string complete();
+
+	Upload *release();
+
+private:
+	UploadWriteTask(void);
+	UploadWriteTask(const UploadWriteTask &src);
+	UploadWriteTask &operator=(const UploadWriteTask &rhs);
+
+	Upload *_upload;
+	bool _remove;
+};
+
+// syncs and renames the files of an upload whose body is in on the worker
+// pool, then answers it
+class UploadTask : public Task
+{
+public:
+	UploadTask(Upload *upload, const ServerBlock &block);
+	~UploadTask(void);
+
+	void run();
+	std::string complete();
+
+private:
+	UploadTask(void);
+	UploadTask(const UploadTask &src);
+	UploadTask &operator=(const UploadTask &rhs);
+
+	Upload *_upload;
+	const ServerBlock &_block;
+	std::string _response;
+};
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#define DEFAULT_UPSTREAM_WEIGHT 1
+#define DEFAULT_UPSTREAM_MAX_FAILS 1
+#define DEFAULT_UPSTREAM_FAIL_TIMEOUT 10
+// a peer that fails again right after coming back stays out twice as long,
+// up to this many fail_timeouts
+#define UPSTREAM_MAX_BACKOFF 32
+#define DEFAULT_HEALTH_CHECK_INTERVAL 5
+#define DEFAULT_HEALTH_CHECK_TIMEOUT 2
+#define DEFAULT_HEALTH_CHECK_FAILS 1
+#define DEFAULT_HEALTH_CHECK_PASSES 1
+// points per unit of weight on the consistent hash ring
+#define UPSTREAM_HASH_POINTS 160
+
+// an upstream { } block: the peers a proxy_pass can name, how requests are
+// spread over them, and the state that takes a failing peer out and brings it
+// back. Passive checks count the errors of proxied requests; active checks
+// are health probes that Proxy sends on a timer.
+class Upstream
+{
+public:
+	enum Balance
+	{
+		ROUND_ROBIN,
+		LEAST_CONN,
+		HASH
+	};
+	struct Peer
+	{
+		Peer();
+
+		std::string host;
+		std::string port;
+		int weight;
+		int maxFails;
+		int failTimeout;
+
+		// failures since firstFail; reaching maxFails within failTimeout
+		// takes the peer out until downUntil
+		int fails;
+		double firstFail;
+		double downUntil;
+		// doubles every time the peer fails its first request back
+		int backoff;
+		bool tripped;
+		// active checks
+		bool healthy;
+		int probeFails;
+		int probePasses;
+		double nextProbe;
+		// requests in flight (least_conn) and the smooth weighted round
+		// robin counter
+		int active;
+		int currentWeight;
+	};
+	struct HealthCheck
+	{
+		HealthCheck();
+
+		bool enabled;
+		std::string uri;
+		int interval;
+		int timeout;
+		int fails;
+		int passes;
+	};
+
+	Upstream();
+	Upstream(const std::string &name);
+	Upstream(const Upstream &src);
+	Upstream &operator=(const Upstream &rhs);
+	~Upstream();
+
+	void addPeer(const Peer &peer);
+	void setBalance(Balance balance, const std::string &hashKey);
+	void setHealthCheck(const HealthCheck &check);
+	void build();
+	void inherit(const Upstream &old);
+
+	const std::string &getName() const;
+	Balance getBalance() const;
+	const std::string &getHashKey() const;
+	const HealthCheck &getHealthCheck() const;
+	std::vector<Peer> &getPeers();
+	const std::vector<Peer> &getPeers() const;
+	int find(const std::string &key) const;
+	std::string getKey(int peer) const;
+
+	int select(const std::string &hashValue, const std::vector<int> &tried, double now);
+	void connected(int peer);
+	void released(int peer);
+	void failure(int peer, double now);
+	void success(int peer);
+	void probed(int peer, bool ok, double now);
+
+private:
+	bool isUsable(int peer, const std::vector<int> &tried, double now, bool ignoreDown) const;
+	int selectRoundRobin(const std::vector<int> &tried, double now, bool ignoreDown);
+	int selectLeastConn(const std::vector<int> &tried, double now, bool ignoreDown);
+	int selectHash(const std::string &hashValue, const std::vector<int> &tried, double now, bool ignoreDown);
+	int pickWeighted(const std::vector<int> &candidates);
+	static unsigned int hash(const std::string &str);
+
+	std::string _name;
+	Balance _balance;
+	std::string _hashKey;
+	HealthCheck _check;
+	std::vector<Peer> _peers;
+	// (point, peer) sorted by point
+	std::vector<std::pair<unsigned int, int> > _ring;
+};
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "Poller.hpp"
+#include <linux/io_uring.h>
+#include <map>
+#include <vector>
+
+#define URING_ENTRIES 1024
+
+// io_uring driven through the raw syscalls (no liburing). Listening sockets
+// have a multishot IORING_OP_ACCEPT armed (Linux 5.19+), so the ring accepts
+// the connections itself; on older kernels they fall back to readiness.
+// Every other interested fd has a one-shot IORING_OP_POLL_ADD armed; fired
+// polls are re-armed on the next wait(), which re-checks readiness just like
+// poll() does, as the handlers read and write with plain syscalls and expect
+// level-triggered readiness. All re-arms, cancels and the optional timeout of
+// a loop iteration go to the kernel in a single io_uring_enter. File I/O does
+// not go through the ring; the worker pool does it with plain syscalls.
+class UringPoller : public Poller
+{
+public:
+	UringPoller(void);
+	~UringPoller(void);
+
+	void addListener(int fd);
+	std::vector<std::pair<int, int> > takeAccepted();
+	void add(int fd, short events);
+	void modify(int fd, short events);
+	void remove(int fd);
+	int wait(std::vector<struct pollfd> &ready, int timeout);
+	const char *getName() const;
+
+private:
+	struct FdState
+	{
+		short events;
+		unsigned long long token;
+	};
+
+	struct io_uring_sqe *getSqe();
+	void arm(int fd, FdState &state);
+	void armAccept(int fd, unsigned long long &token);
+	void cancel(FdState &state);
+	void cancelAccept(unsigned long long token);
+	void completeAccept(std::map<unsigned long long, int>::iterator accepting, struct io_uring_cqe *cqe);
+	int enter(unsigned int toSubmit, unsigned int minComplete);
+
+	int _ringFd;
+	void *_sqRing;
+	void *_cqRing;
+	size_t _sqRingSize;
+	size_t _cqRingSize;
+	struct io_uring_sqe *_sqes;
+	size_t _sqesSize;
+	unsigned int *_sqHead;
+	unsigned int *_sqTail;
+	unsigned int *_sqMask;
+	unsigned int *_sqArray;
+	unsigned int *_cqHead;
+	unsigned int *_cqTail;
+	unsigned int *_cqMask;
+	struct io_uring_cqe *_cqes;
+	unsigned int _entries;
+	unsigned int _pending;
+
+	std::map<int, FdState> _fds;
+	std::map<unsigned long long, int> _armed;
+	// the listening sockets and their accept's token, 0 until armed
+	std::map<int, unsigned long long> _listeners;
+	std::map<unsigned long long, int> _accepting;
+	std::vector<std::pair<int, int> > _accepted;
+	bool _multishotAccept;
+	unsigned long long _nextToken;
+	struct __kernel_timespec _timeout;
+};
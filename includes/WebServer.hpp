@@ -1,10 +1,23 @@
 
 #pragma once
 
+#include "DeleteJobs.hpp"
+#include "Http2.hpp"
 #include "IOAdaptor.hpp"
 #include "MethodIO.hpp"
+#include "MicroCache.hpp"
+#include "Poller.hpp"
+#include "Proxy.hpp"
+#include "RequestTrace.hpp"
+#include "ResponseCache.hpp"
 #include "ServerBlock.hpp"
+#include "SessionStore.hpp"
+#include "ThreadPool.hpp"
+#include "Tls.hpp"
+#include "Upload.hpp"
+#include "WebSocket.hpp"
 #include <map>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -22,21 +35,164 @@ public:
 	void printServerBlocksInfo();
 	void initSockets();
 	void loop();
-	void removePfd(int index);
-	void addPfd(int fd);
-	void addPfds(std::vector<int> fds);
+	void reload();
+	void removeFd(int fd);
+	void addFd(int fd);
+	void addFds(std::vector<int> fds);
+	void setEvents(int fd, short events);
 	std::vector<ServerBlock> &getServers();
+	void defer(Task *task);
+	void proxy(const Proxy::Request &request);
+	void webSocket(const std::string &channel);
+	bool cacheLookup(const MethodIO::rInfo &request, const ServerBlock &block, std::string &response);
+	SessionStore &getSessions();
+	DeleteJobs &getDeletes();
+	short getEvents(int fd) const;
+	bool isDetached(int fd) const;
 
 private:
+	// the request being served on a connection, for the metrics and the
+	// access log
+	struct RequestRecord
+	{
+		RequestRecord();
+		void setResponse(const std::string &response);
+
+		std::string remote;
+		std::string method;
+		std::string requestLine;
+		std::string referer;
+		std::string userAgent;
+		int status;
+		size_t bytes;
+		double start;
+		RequestTrace trace;
+	};
+	// a request on an HTTP/2 connection, served under a negative fd of its own
+	struct Http2Stream
+	{
+		int connection;
+		unsigned int id;
+		short events;
+	};
+
 	WebServer(const WebServer &other);
 	WebServer &operator=(const WebServer &other);
-	void acceptConnection(int index, std::map<int, std::string> &buffMap, std::string port);
-	void handleIO(int index, std::map<int, std::string> &buffMap);
-	MethodIO::rInfo parseHeader(std::string str);
+	void acceptConnection(int listenFd, std::map<int, std::string> &buffMap, std::string port);
+	void handleAccepted(std::map<int, std::string> &buffMap);
+	void startConnection(int newFd, const struct sockaddr_storage &theiraddr, std::map<int, std::string> &buffMap,
+						 const std::string &port);
+	void handleIO(int fd, short revents, std::map<int, std::string> &buffMap);
+	void handshake(int fd, std::map<int, std::string> &buffMap);
+	void handlePendingTls(std::map<int, std::string> &buffMap);
+	ssize_t receive(int fd, char *buff, size_t size);
+	ssize_t transmit(int fd, const char *data, size_t size);
+	void beginRequest(int fd, const MethodIO::rInfo &info, const std::string &request);
+	void dispatch(int fd, std::map<int, std::string> &buffMap);
+	void finishRequest(int fd);
+	bool microLookup(int fd, const MethodIO::rInfo &request, std::map<int, std::string> &buffMap);
+	bool sendMicro(int fd, std::map<int, std::string> &buffMap);
+	void closeConnection(int fd, std::map<int, std::string> &buffMap);
+	void releaseRequest(int fd, std::map<int, std::string> &buffMap);
+	void startHttp2(int fd, bool upgrade, const std::string &settings, std::map<int, std::string> &buffMap);
+	void handleHttp2(int fd, short revents, std::map<int, std::string> &buffMap);
+	void startStreams(int fd, std::map<int, std::string> &buffMap);
+	void pumpHttp2(std::map<int, std::string> &buffMap);
+	void startWebSocket(int fd, std::map<int, std::string> &buffMap);
+	void handleWebSocket(int fd, short revents, std::map<int, std::string> &buffMap);
+	void deliver(int fd, WebSocket *socket, std::map<int, std::string> &buffMap);
+	bool flushWebSocket(int fd, std::map<int, std::string> &buffMap);
+	void sweepWebSockets(std::map<int, std::string> &buffMap);
+	void closeWebSocket(int fd);
+	void handleTunnel(int fd, short revents, std::map<int, std::string> &buffMap);
+	bool startUpload(int fd, size_t headerEnd, std::map<int, std::string> &buffMap);
+	void handleUpload(int fd, short revents, std::map<int, std::string> &buffMap);
+	void feedUpload(int fd, const char *data, size_t size, std::map<int, std::string> &buffMap);
+	void finishUpload(int fd, std::map<int, std::string> &buffMap);
+	void wroteUpload(int fd, Upload *upload, std::map<int, std::string> &buffMap);
+	void releaseUpload(int fd, Upload *upload);
+	int getTimeout(double now) const;
+	void handleCompletions(std::map<int, std::string> &buffMap);
+	void submitTask(int fd, Task *task);
+	void releaseConfig(Task *task);
+	void logAccess(const RequestRecord &record, double seconds);
+	void logIfSlow(const RequestRecord &record);
+	void handleProxyResults(std::map<int, std::string> &buffMap);
+	void revalidate(int fd, const std::string &request, std::map<int, std::string> &buffMap);
+	void finishFetch(int fd, const std::string &response, std::map<int, std::string> &buffMap);
+	void wakeWaiters(const std::vector<int> &waiters, std::map<int, std::string> &buffMap);
+	void dropDetached(int fd, std::map<int, std::string> &buffMap);
+	static MethodIO::rInfo parseHeader(std::string str);
+
+	// bench/microbench.cpp times the private hot paths
+	friend class MicroBench;
+
+	// a config generation: its mime types, and once a reload has replaced
+	// it, its server blocks. The tasks given it keep using both.
+	struct Config
+	{
+		Config();
+
+		std::vector<ServerBlock> serverBlocks;
+		MimeTypes mimeTypes;
+		size_t tasks;
+	};
 
+	std::string _filePath;
 	std::vector<ServerBlock> _serverBlocks;
-	std::vector<struct pollfd> _pfds;
+	// generation -> config, the current one and those still used by tasks;
+	// declared before _pool, which joins its workers first
+	std::map<unsigned long, Config> _configs;
+	unsigned long _config;
+	// task in flight -> the generation it was given
+	std::map<Task *, unsigned long> _taskConfigs;
+	Poller *_poller;
+	std::map<int, short> _fds;
+	std::map<int, RequestRecord> _requests;
 	std::map<int, std::string> _socketPortmap;
 	std::map<int, std::string> _connectionsPortMap;
 	IOAdaptor &_io;
+	ThreadPool _pool;
+	Task *_deferredTask;
+	double _slowRequestThreshold;
+	Proxy _proxy;
+	Proxy::Request *_pendingProxy;
+	ResponseCache _cache;
+	SessionStore _sessions;
+	DeleteJobs _deletes;
+	// set by cacheLookup for dispatch: the key this request fetches, the key
+	// it waits for, or that its stale answer needs refreshing
+	std::string _cacheFetch;
+	std::string _cacheWait;
+	bool _cacheRevalidate;
+	bool _revalidating;
+	// connection -> key of the response it fetches for the cache
+	std::map<int, std::string> _fetching;
+	// connection -> request, parked until the response it waits for is in
+	std::map<int, std::string> _parked;
+	// background refreshes run under negative fds that no socket uses
+	int _nextDetached;
+	MicroCache _microCache;
+	bool _microEnabled;
+	// connection -> key its response is kept under if it turns out cacheable
+	std::map<int, std::string> _microCandidates;
+	// connection -> cached response it sends and how much of it went out
+	std::map<int, std::pair<MicroCache::Buffer *, size_t> > _microSends;
+	// HTTP/2 connections, and their streams by the negative fd each runs
+	// under (taken from _nextDetached)
+	std::map<int, Http2 *> _http2;
+	std::map<int, Http2Stream> _streams;
+	// TLS state of the connections accepted on ssl ports
+	Tls _tls;
+	// set by webSocket for dispatch: the request was answered with a 101
+	bool _upgradeWebSocket;
+	std::string _webSocketChannel;
+	// connections of websocket locations, and the broadcast ones by channel
+	std::map<int, WebSocket *> _webSockets;
+	std::map<std::string, std::set<int> > _channels;
+	std::map<int, std::string> _webSocketChannels;
+	double _nextSweep;
+	// multipart bodies streamed to upload_store locations, by connection
+	std::map<int, Upload *> _uploads;
+	bool _uploadEnabled;
 };
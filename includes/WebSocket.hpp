@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <vector>
+
+// largest message (all its fragments) a client may send
+#define WEBSOCKET_MAX_MESSAGE (1024 * 1024)
+// frames queued for a client above which it is not read from (echo) or is
+// dropped (broadcast) until it catches up
+#define WEBSOCKET_OUTPUT_LIMIT (256 * 1024)
+#define WEBSOCKET_READ_SIZE 16384
+// seconds of silence before a ping, and then before giving up on the pong
+#define WEBSOCKET_PING_INTERVAL 30
+#define WEBSOCKET_PONG_TIMEOUT 15
+
+// the WebSocket (RFC 6455) side of one connection after the 101: frames in,
+// frames out, no sockets. Client frames are unmasked a vector at a time and
+// fragments joined into whole messages; pings are answered and a close is
+// echoed before the connection ends. An idle connection only holds empty
+// buffers and a few words, so very many of them can stay open.
+class WebSocket
+{
+public:
+	enum Opcode
+	{
+		OP_CONTINUATION = 0x0,
+		OP_TEXT = 0x1,
+		OP_BINARY = 0x2,
+		OP_CLOSE = 0x8,
+		OP_PING = 0x9,
+		OP_PONG = 0xA
+	};
+	struct Message
+	{
+		Opcode opcode;
+		std::string data;
+	};
+
+	WebSocket(double now);
+	~WebSocket();
+
+	static bool isUpgrade(const std::map<std::string, std::string> &headers, std::string &key);
+	static std::string handshake(const std::string &key);
+	static void frame(Opcode opcode, const char *data, size_t size, std::string &out);
+	static void unmask(char *data, size_t size, const unsigned char *key);
+
+	void receive(const char *data, size_t size);
+	void send(const std::string &frame);
+	bool tick(double now);
+
+	std::vector<Message> takeMessages();
+	std::string &getOutput();
+	bool isFinished() const;
+
+private:
+	// close status codes (RFC 6455 7.4.1)
+	enum Status
+	{
+		STATUS_NORMAL = 1000,
+		STATUS_PROTOCOL_ERROR = 1002,
+		STATUS_INVALID_DATA = 1007,
+		STATUS_TOO_BIG = 1009
+	};
+
+	WebSocket(const WebSocket &src);
+	WebSocket &operator=(const WebSocket &rhs);
+
+	size_t parseFrame(const char *data, size_t size);
+	void control(Opcode opcode, char *payload, size_t size);
+	void close(int status);
+
+	static bool isUtf8(const std::string &data);
+
+	// a frame not complete yet, and the fragments of the message in progress
+	std::string _input;
+	std::string _message;
+	std::string _output;
+	std::vector<Message> _messages;
+	Opcode _messageOpcode;
+	bool _closing;
+	// for the pings: whether anything came in since the last tick, and since
+	// when nothing has
+	bool _seen;
+	bool _pinged;
+	double _idleSince;
+};
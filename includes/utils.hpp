@@ -1,6 +1,8 @@
 #pragma once
 
 #include <cstddef>
+#include <ctime>
+#include <sstream>
 #include <string>
 #include <utility>
 #include <vector>
@@ -24,6 +26,15 @@ bool find(std::vector<T> arr, T value)
 }
 
 int stoi(std::string s, int lineNum);
-std::string to_string(int value);
+template <typename T>
+std::string to_string(T value)
+{
+	std::stringstream ss;
+	ss << value;
+	return ss.str();
+}
 std::string join(std::vector<std::string> strs, std::string sep, size_t n);
+std::string trim(const std::string &s);
+std::string httpDate(time_t t);
+time_t parseHttpDate(const std::string &s);
 } // namespace utils
@@ -39,6 +39,10 @@
 #include "WebServer.hpp"
 #include "CustomException.hpp"
 #include "IOAdaptor.hpp"
+#include "Poller.hpp"
+#include "Proxy.hpp"
+#include "Log.hpp"
+#include "AccessLog.hpp"
 
 #include "utils.hpp"
 
@@ -5,7 +5,9 @@
 
 ABlock::ABlock()
 	: _portsListeningOn(), _serverName(), _rootDirectory(""), _index(),
-	  _clientMaxBodySize(0), _errorPages(), _redirection()
+	  _clientMaxBodySize(0), _errorPages(), _redirection(), _expires(-1),
+	  _cacheControl(""), _gzip(false), _gzipStatic(false), _gzipCompLevel(6),
+	  _gzipMinLength(256)
 {
 }
 
@@ -16,7 +18,13 @@ ABlock::ABlock(ServerBlock &serverBlock)
 	  _index(serverBlock.getIndex()),
 	  _clientMaxBodySize(serverBlock.getClientMaxBodySize()),
 	  _errorPages(serverBlock.getErrorPages()),
-	  _redirection(serverBlock.getRedirection())
+	  _redirection(serverBlock.getRedirection()),
+	  _expires(serverBlock.getExpires()),
+	  _cacheControl(serverBlock.getCacheControl()),
+	  _gzip(serverBlock.getGzip()),
+	  _gzipStatic(serverBlock.getGzipStatic()),
+	  _gzipCompLevel(serverBlock.getGzipCompLevel()),
+	  _gzipMinLength(serverBlock.getGzipMinLength())
 {
 }
 
@@ -31,7 +39,13 @@ ABlock::ABlock(const ABlock &other)
 	  _index(other.getIndex()),
 	  _clientMaxBodySize(other.getClientMaxBodySize()),
 	  _errorPages(other.getErrorPages()),
-	  _redirection(other.getRedirection())
+	  _redirection(other.getRedirection()),
+	  _expires(other.getExpires()),
+	  _cacheControl(other.getCacheControl()),
+	  _gzip(other.getGzip()),
+	  _gzipStatic(other.getGzipStatic()),
+	  _gzipCompLevel(other.getGzipCompLevel()),
+	  _gzipMinLength(other.getGzipMinLength())
 {
 	*this = other;
 }
@@ -47,6 +61,12 @@ ABlock &ABlock::operator=(const ABlock &other)
 		this->_clientMaxBodySize = other._clientMaxBodySize;
 		this->_errorPages = other._errorPages;
 		this->_redirection = other._redirection;
+		this->_expires = other._expires;
+		this->_cacheControl = other._cacheControl;
+		this->_gzip = other._gzip;
+		this->_gzipStatic = other._gzipStatic;
+		this->_gzipCompLevel = other._gzipCompLevel;
+		this->_gzipMinLength = other._gzipMinLength;
 	}
 	return *this;
 }
@@ -77,6 +97,36 @@ void ABlock::setRedirection(int statusCode, std::string path)
 	this->_redirection.second = path;
 }
 
+void ABlock::setExpires(int seconds)
+{
+	this->_expires = seconds;
+}
+
+void ABlock::setCacheControl(std::string cacheControl)
+{
+	this->_cacheControl = cacheControl;
+}
+
+void ABlock::setGzip(bool status)
+{
+	this->_gzip = status;
+}
+
+void ABlock::setGzipStatic(bool status)
+{
+	this->_gzipStatic = status;
+}
+
+void ABlock::setGzipCompLevel(int level)
+{
+	this->_gzipCompLevel = level;
+}
+
+void ABlock::setGzipMinLength(int length)
+{
+	this->_gzipMinLength = length;
+}
+
 std::vector<std::string> ABlock::getPortsListeningOn() const
 {
 	return this->_portsListeningOn;
@@ -111,3 +161,33 @@ std::pair<int, std::string> ABlock::getRedirection() const
 {
 	return this->_redirection;
 }
+
+int ABlock::getExpires() const
+{
+	return this->_expires;
+}
+
+std::string ABlock::getCacheControl() const
+{
+	return this->_cacheControl;
+}
+
+bool ABlock::getGzip() const
+{
+	return this->_gzip;
+}
+
+bool ABlock::getGzipStatic() const
+{
+	return this->_gzipStatic;
+}
+
+int ABlock::getGzipCompLevel() const
+{
+	return this->_gzipCompLevel;
+}
+
+int ABlock::getGzipMinLength() const
+{
+	return this->_gzipMinLength;
+}
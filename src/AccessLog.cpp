@@ -0,0 +1,405 @@
+#include "AccessLog.hpp"
+#include "Log.hpp"
+#include "Metrics.hpp"
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+pthread_mutex_t AccessLog::_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t AccessLog::_cond = PTHREAD_COND_INITIALIZER;
+pthread_t AccessLog::_thread;
+bool AccessLog::_started = false;
+bool AccessLog::_stopping = false;
+bool AccessLog::_pathChanged = false;
+bool AccessLog::_enabled = false;
+bool AccessLog::_json = false;
+std::string AccessLog::_path;
+int AccessLog::_fd = -1;
+std::vector<AccessLog::Ring *> AccessLog::_rings;
+
+static volatile sig_atomic_t g_reopenRequested = 0;
+static __thread AccessLog::Ring *t_ring = NULL;
+
+/***********************************
+ * Ring
+ ***********************************/
+
+AccessLog::Ring::Ring(void) : _data(new char[ACCESS_LOG_RING_SIZE]), _head(0), _tail(0)
+{
+}
+
+AccessLog::Ring::~Ring(void)
+{
+	delete[] _data;
+}
+
+AccessLog::Ring::Ring(const Ring &src) : _data(NULL), _head(0), _tail(0)
+{
+	(void)src;
+}
+
+AccessLog::Ring &AccessLog::Ring::operator=(const Ring &rhs)
+{
+	(void)rhs;
+	return *this;
+}
+
+// producer side; head and tail only grow, their difference is the fill level
+bool AccessLog::Ring::push(const char *line, size_t len)
+{
+	size_t tail = __atomic_load_n(&_tail, __ATOMIC_ACQUIRE);
+
+	if (ACCESS_LOG_RING_SIZE - (_head - tail) < len)
+		return false;
+	size_t start = _head % ACCESS_LOG_RING_SIZE;
+	size_t first = len < ACCESS_LOG_RING_SIZE - start ? len : ACCESS_LOG_RING_SIZE - start;
+	memcpy(_data + start, line, first);
+	memcpy(_data, line + first, len - first);
+	__atomic_store_n(&_head, _head + len, __ATOMIC_RELEASE);
+	return true;
+}
+
+// consumer side
+void AccessLog::Ring::drain(std::string &out)
+{
+	size_t head = __atomic_load_n(&_head, __ATOMIC_ACQUIRE);
+	size_t len = head - _tail;
+	size_t start = _tail % ACCESS_LOG_RING_SIZE;
+	size_t first = len < ACCESS_LOG_RING_SIZE - start ? len : ACCESS_LOG_RING_SIZE - start;
+
+	out.append(_data + start, first);
+	out.append(_data, len - first);
+	__atomic_store_n(&_tail, head, __ATOMIC_RELEASE);
+}
+
+size_t AccessLog::Ring::used() const
+{
+	return _head - __atomic_load_n(&_tail, __ATOMIC_ACQUIRE);
+}
+
+/***********************************
+ * AccessLog
+ ***********************************/
+
+AccessLog::AccessLog(void)
+{
+}
+
+bool AccessLog::isValidFormat(const std::string &format)
+{
+	return format == "combined" || format == "json";
+}
+
+// an empty path turns the log off
+void AccessLog::configure(const std::string &path, const std::string &format)
+{
+	pthread_mutex_lock(&_mutex);
+	_path = path;
+	_json = format == "json";
+	_pathChanged = true;
+	__atomic_store_n(&_enabled, !path.empty(), __ATOMIC_RELEASE);
+	if (!_started && !path.empty())
+	{
+		sigset_t signals, old;
+		// signals (SIGUSR1 rotation included) stay with the event thread
+		sigfillset(&signals);
+		pthread_sigmask(SIG_BLOCK, &signals, &old);
+		_started = pthread_create(&_thread, NULL, &AccessLog::writer, NULL) == 0;
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		if (!_started)
+			LOG(LOG_ERROR) << "access log: cannot start the writer thread";
+	}
+	pthread_cond_signal(&_cond);
+	pthread_mutex_unlock(&_mutex);
+}
+
+bool AccessLog::isEnabled()
+{
+	return __atomic_load_n(&_enabled, __ATOMIC_ACQUIRE);
+}
+
+// async-signal-safe, for the SIGUSR1 handler
+void AccessLog::requestReopen()
+{
+	g_reopenRequested = 1;
+}
+
+// flushes what is buffered and stops the writer
+void AccessLog::shutdown()
+{
+	pthread_mutex_lock(&_mutex);
+	if (!_started)
+	{
+		pthread_mutex_unlock(&_mutex);
+		return;
+	}
+	_stopping = true;
+	pthread_cond_signal(&_cond);
+	pthread_mutex_unlock(&_mutex);
+	pthread_join(_thread, NULL);
+	_started = false;
+	_stopping = false;
+}
+
+AccessLog::Ring &AccessLog::ring()
+{
+	if (!t_ring)
+	{
+		t_ring = new Ring();
+		pthread_mutex_lock(&_mutex);
+		_rings.push_back(t_ring);
+		pthread_mutex_unlock(&_mutex);
+	}
+	return *t_ring;
+}
+
+void AccessLog::log(const Entry &entry)
+{
+	char line[ACCESS_LOG_LINE_MAX];
+
+	if (!isEnabled())
+		return;
+	size_t len = _json ? formatJson(entry, line) : formatCombined(entry, line);
+	Ring &r = ring();
+	if (!r.push(line, len))
+	{
+		Metrics::add(Metrics::ACCESS_LOG_DROPPED);
+		return;
+	}
+	if (r.used() > ACCESS_LOG_RING_SIZE / 2)
+		pthread_cond_signal(&_cond);
+}
+
+// called by the writer with the mutex held
+void AccessLog::reopen()
+{
+	int fd = -1;
+
+	if (!_path.empty())
+	{
+		fd = open(_path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+		if (fd == -1)
+		{
+			LOG(LOG_ERROR) << "access log: cannot open " << _path << ": " << strerror(errno);
+			if (_fd != -1)
+				return;
+		}
+	}
+	if (_fd != -1)
+		close(_fd);
+	_fd = fd;
+}
+
+void *AccessLog::writer(void *arg)
+{
+	std::string batch;
+	bool stopping = false;
+
+	(void)arg;
+	pthread_mutex_lock(&_mutex);
+	while (!stopping)
+	{
+		struct timeval now;
+		struct timespec deadline;
+
+		gettimeofday(&now, NULL);
+		deadline.tv_sec = now.tv_sec;
+		deadline.tv_nsec = now.tv_usec * 1000 + ACCESS_LOG_FLUSH_MS * 1000000L;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+		if (!_stopping)
+			pthread_cond_timedwait(&_cond, &_mutex, &deadline);
+		stopping = _stopping;
+		if (_pathChanged || g_reopenRequested)
+		{
+			g_reopenRequested = 0;
+			_pathChanged = false;
+			reopen();
+		}
+		for (size_t i = 0; i < _rings.size(); i++)
+			_rings[i]->drain(batch);
+		int fd = _fd;
+		pthread_mutex_unlock(&_mutex);
+
+		size_t written = 0;
+		while (fd != -1 && written < batch.size())
+		{
+			ssize_t bytes = write(fd, batch.c_str() + written, batch.size() - written);
+			if (bytes == -1 && errno == EINTR)
+				continue;
+			if (bytes <= 0)
+				break;
+			written += bytes;
+		}
+		batch.clear();
+		pthread_mutex_lock(&_mutex);
+	}
+	if (_fd != -1)
+		close(_fd);
+	_fd = -1;
+	pthread_mutex_unlock(&_mutex);
+	return NULL;
+}
+
+/*** Formatting ***/
+
+// bounded appends into the fixed line buffer; the last byte is kept for '\n'
+struct LineWriter
+{
+	char *line;
+	size_t len;
+
+	LineWriter(char *buffer) : line(buffer), len(0)
+	{
+	}
+
+	void append(const char *s, size_t n)
+	{
+		if (n > ACCESS_LOG_LINE_MAX - 1 - len)
+			n = ACCESS_LOG_LINE_MAX - 1 - len;
+		memcpy(line + len, s, n);
+		len += n;
+	}
+
+	void append(const char *s)
+	{
+		append(s, strlen(s));
+	}
+
+	void appendNumber(unsigned long n)
+	{
+		char buf[24];
+		append(buf, snprintf(buf, sizeof(buf), "%lu", n));
+	}
+
+	// quotes and control characters are hex escaped (combined) or JSON escaped;
+	// runs of plain bytes are copied in one go
+	void appendEscaped(const std::string &s, bool json)
+	{
+		const char *data = s.c_str();
+		size_t run = 0;
+
+		for (size_t i = 0; i < s.size(); i++)
+		{
+			unsigned char c = data[i];
+			if (c != '"' && c != '\\' && c >= 0x20 && c != 0x7f)
+				continue;
+			char buf[8];
+			append(data + run, i - run);
+			append(buf, snprintf(buf, sizeof(buf), json ? "\\u%04x" : "\\x%02X", c));
+			run = i + 1;
+		}
+		append(data + run, s.size() - run);
+	}
+};
+
+// local time, formatted once per second per thread
+static const char *logTime(bool json)
+{
+	static __thread time_t cachedSecond = 0;
+	static __thread bool cachedJson = false;
+	static __thread char cached[64];
+	time_t now = time(NULL);
+
+	if (now != cachedSecond || json != cachedJson)
+	{
+		struct tm tm;
+		localtime_r(&now, &tm);
+		strftime(cached, sizeof(cached), json ? "%Y-%m-%dT%H:%M:%S%z" : "%d/%b/%Y:%H:%M:%S %z", &tm);
+		cachedSecond = now;
+		cachedJson = json;
+	}
+	return cached;
+}
+
+// $remote_addr - - [$time_local] "$request" $status $body_bytes_sent
+// "$http_referer" "$http_user_agent" $request_time
+size_t AccessLog::formatCombined(const Entry &entry, char *line)
+{
+	LineWriter w(line);
+	char seconds[32];
+
+	w.append(entry.remote.c_str(), entry.remote.size());
+	w.append(" - - [");
+	w.append(logTime(false));
+	w.append("] \"");
+	w.appendEscaped(entry.requestLine, false);
+	w.append("\" ");
+	w.appendNumber(entry.status);
+	w.append(" ");
+	w.appendNumber(entry.bytes);
+	w.append(" \"");
+	if (entry.referer.empty())
+		w.append("-");
+	w.appendEscaped(entry.referer, false);
+	w.append("\" \"");
+	if (entry.userAgent.empty())
+		w.append("-");
+	w.appendEscaped(entry.userAgent, false);
+	w.append("\" ");
+	w.append(seconds, snprintf(seconds, sizeof(seconds), "%.3f", entry.seconds));
+	line[w.len++] = '\n';
+	return w.len;
+}
+
+// the "phases" object of a JSON line, in seconds (0 when not reached)
+static const struct
+{
+	const char *name;
+	RequestTrace::Phase from;
+	RequestTrace::Phase to;
+} phaseSpans[] = {
+	{"wait", RequestTrace::ACCEPTED, RequestTrace::FIRST_BYTE_IN},
+	{"read", RequestTrace::FIRST_BYTE_IN, RequestTrace::REQUEST_COMPLETE},
+	{"queue", RequestTrace::HANDLER_START, RequestTrace::TASK_START},
+	{"handler", RequestTrace::HANDLER_START, RequestTrace::HANDLER_END},
+	{"cgi", RequestTrace::CGI_FORK, RequestTrace::CGI_EXIT},
+	{"send", RequestTrace::HANDLER_END, RequestTrace::LAST_BYTE_OUT},
+};
+
+size_t AccessLog::formatJson(const Entry &entry, char *line)
+{
+	LineWriter w(line);
+	char seconds[32];
+
+	w.append("{\"time\":\"");
+	w.append(logTime(true));
+	w.append("\",\"remote\":\"");
+	w.appendEscaped(entry.remote, true);
+	size_t uri = entry.requestLine.find(' ');
+	size_t protocol = entry.requestLine.find(' ', uri == std::string::npos ? uri : uri + 1);
+	w.append("\",\"method\":\"");
+	w.appendEscaped(entry.requestLine.substr(0, uri), true);
+	w.append("\",\"uri\":\"");
+	if (uri != std::string::npos)
+		w.appendEscaped(entry.requestLine.substr(uri + 1, protocol - uri - 1), true);
+	w.append("\",\"protocol\":\"");
+	if (protocol != std::string::npos)
+		w.appendEscaped(entry.requestLine.substr(protocol + 1), true);
+	w.append("\",\"status\":");
+	w.appendNumber(entry.status);
+	w.append(",\"bytes\":");
+	w.appendNumber(entry.bytes);
+	w.append(",\"referer\":\"");
+	w.appendEscaped(entry.referer, true);
+	w.append("\",\"user_agent\":\"");
+	w.appendEscaped(entry.userAgent, true);
+	w.append("\",\"request_time\":");
+	w.append(seconds, snprintf(seconds, sizeof(seconds), "%.6f", entry.seconds));
+	w.append(",\"phases\":{");
+	for (size_t i = 0; i < sizeof(phaseSpans) / sizeof(phaseSpans[0]); i++)
+	{
+		w.append(i ? ",\"" : "\"");
+		w.append(phaseSpans[i].name);
+		w.append(seconds, snprintf(seconds, sizeof(seconds), "\":%.6f",
+								   entry.trace.between(phaseSpans[i].from, phaseSpans[i].to)));
+	}
+	w.append("}}");
+	line[w.len++] = '\n';
+	return w.len;
+}
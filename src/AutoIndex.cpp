@@ -1,29 +1,36 @@
 #include "AutoIndex.hpp"
+#include "MethodIO.hpp"
+#include "Metrics.hpp"
 #include "RequestException.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <cstdio>
 #include <dirent.h>
+#include <fcntl.h>
 #include <iostream>
 #include <ostream>
 #include <sstream>
 #include <string>
+#include <sys/stat.h>
+
+std::map<std::string, AutoIndex::CacheEntry> AutoIndex::_cache;
+std::list<std::string> AutoIndex::_cacheLru;
+pthread_mutex_t AutoIndex::_cacheMutex = PTHREAD_MUTEX_INITIALIZER;
 
 /***********************************
  * Constructors
  ***********************************/
 
-AutoIndex::AutoIndex(void)
+AutoIndex::AutoIndex(void) : Task()
 {
 }
-AutoIndex::AutoIndex(std::string path, std::string queryPath)
+
+AutoIndex::AutoIndex(std::string path, std::string queryPath, std::string format, const ServerBlock &block)
+	: Task(), _path(path), _queryPath(queryPath), _format(format), _block(block), _entries(), _body(), _code(200)
 {
-	_dir = opendir(path.c_str());
-	std::cout << path << std::endl;
-	if (!_dir)
-		throw RequestException("Failed to open Dir", 301);
-	_path = path;
-	_queryPath = queryPath;
 }
 
-AutoIndex::AutoIndex(const AutoIndex &src)
+AutoIndex::AutoIndex(const AutoIndex &src) : Task()
 {
 	(void)src;
 }
@@ -40,44 +47,247 @@ AutoIndex &AutoIndex::operator=(const AutoIndex &rhs)
 
 AutoIndex::~AutoIndex(void)
 {
-	closedir(_dir);
 }
 
 /***********************************
  * Others
  ***********************************/
-std::string AutoIndex::getIndexes()
+
+std::string AutoIndex::getContentType(const std::string &format)
+{
+	if (format == "json")
+		return "application/json";
+	if (format == "xml")
+		return "text/xml";
+	return "text/html";
+}
+
+// answers from the cache when the directory has not changed since the listing
+// was built; this stat is the only filesystem access left on the event thread
+bool AutoIndex::findCached(const std::string &path, const std::string &format, std::string &body)
+{
+	struct stat st;
+	bool found = false;
+
+	if (stat(path.c_str(), &st) == -1)
+		return false;
+	pthread_mutex_lock(&_cacheMutex);
+	std::map<std::string, CacheEntry>::iterator it = _cache.find(format + ":" + path);
+	if (it != _cache.end() && it->second.sec == st.st_mtim.tv_sec && it->second.nsec == st.st_mtim.tv_nsec)
+	{
+		body = it->second.body;
+		_cacheLru.splice(_cacheLru.begin(), _cacheLru, it->second.lru);
+		found = true;
+	}
+	pthread_mutex_unlock(&_cacheMutex);
+	Metrics::add(found ? Metrics::AUTOINDEX_CACHE_HITS : Metrics::AUTOINDEX_CACHE_MISSES);
+	return found;
+}
+
+bool AutoIndex::compareEntries(const Entry &a, const Entry &b)
+{
+	if (a.isDir != b.isDir)
+		return a.isDir;
+	return a.name < b.name;
+}
+
+void AutoIndex::readEntries(DIR *dir)
 {
 	struct dirent *entry;
-	std::ostringstream ss;
+	int fd = dirfd(dir);
 
-	while ((entry = readdir(_dir)) != NULL)
+	while ((entry = readdir(dir)) != NULL)
 	{
-		std::string name(entry->d_name);
-		name = name + (entry->d_type == DT_DIR ? "/" : "");
-		ss << "<p><a href=\"" << _queryPath << name << "\">" << name << "</a></p>\n";
+		Entry e;
+		struct stat st;
+
+		e.name = entry->d_name;
+		if (e.name == ".")
+			continue;
+		e.isDir = entry->d_type == DT_DIR;
+		e.size = 0;
+		e.mtime = 0;
+		if (fstatat(fd, entry->d_name, &st, 0) == 0)
+		{
+			e.isDir = S_ISDIR(st.st_mode);
+			e.size = st.st_size;
+			e.mtime = st.st_mtime;
+		}
+		_entries.push_back(e);
 	}
-	return ss.str();
+	std::sort(_entries.begin(), _entries.end(), compareEntries);
 }
 
-std::string AutoIndex::getBody()
+void AutoIndex::run()
 {
-	std::ostringstream ss;
+	struct stat before;
+
+	if (stat(_path.c_str(), &before) == -1)
+	{
+		_code = 404;
+		return;
+	}
+	DIR *dir = opendir(_path.c_str());
+	if (!dir)
+	{
+		_code = 403;
+		return;
+	}
+	readEntries(dir);
+	closedir(dir);
+	_body = getBody();
 
-	ss << "<!DOCTYPE html>\n"
-	   << "<html lang=\"en\">\n"
-	   << "<head>\n"
-	   << "<title>" << _queryPath << "</title>\n"
-	   << "<meta charset=\"UTF-8\">\n"
-	   << "<meta name=\"viewport\" content=\"width=device-width, initial-scale=1\">\n"
-	   << "</head>\n"
-	   << "<body>\n";
-	ss << "<h1>" << _path << "</h1>\n";
-	// ss << "<p>\n";
-	ss << getIndexes();
-	// ss << "</p>\n";
-	ss << "</body>\n"
-	   << "</html>\n";
+	// a full cache drops the listing used least recently
+	std::string key = _format + ":" + _path;
+	pthread_mutex_lock(&_cacheMutex);
+	std::map<std::string, CacheEntry>::iterator it = _cache.find(key);
+	if (it != _cache.end())
+		_cacheLru.splice(_cacheLru.begin(), _cacheLru, it->second.lru);
+	else
+	{
+		if (_cache.size() >= AUTOINDEX_CACHE_ENTRIES)
+		{
+			_cache.erase(_cacheLru.back());
+			_cacheLru.pop_back();
+		}
+		_cacheLru.push_front(key);
+		it = _cache.insert(std::make_pair(key, CacheEntry())).first;
+		it->second.lru = _cacheLru.begin();
+	}
+	CacheEntry &cached = it->second;
+	cached.sec = before.st_mtim.tv_sec;
+	cached.nsec = before.st_mtim.tv_nsec;
+	cached.body = _body;
+	pthread_mutex_unlock(&_cacheMutex);
+}
+
+std::string AutoIndex::complete()
+{
+	MethodIO::rInfo rsi;
+
+	if (_code != 200)
+		return MethodIO::errorResponse(_code, &_block);
+	rsi.body = _body;
+	rsi.headers["Date"] = MethodIO::getDate();
+	rsi.headers["Content-Type"] = getContentType(_format);
+	rsi.headers["Content-Length"] = utils::to_string(_body.size());
+	return MethodIO::generateResponse(200, rsi);
+}
+
+static std::string escape(const std::string &s, bool json)
+{
+	std::string ret;
 
-	return ss.str();
+	for (size_t i = 0; i < s.size(); i++)
+	{
+		if (json && (s[i] == '"' || s[i] == '\\'))
+			ret.append(1, '\\').append(1, s[i]);
+		else if (json && (unsigned char)s[i] < 0x20)
+		{
+			char buff[8];
+			snprintf(buff, sizeof(buff), "\\u%04x", s[i]);
+			ret.append(buff);
+		}
+		else if (!json && s[i] == '&')
+			ret.append("&amp;");
+		else if (!json && s[i] == '<')
+			ret.append("&lt;");
+		else if (!json && s[i] == '>')
+			ret.append("&gt;");
+		else if (!json && s[i] == '"')
+			ret.append("&quot;");
+		else
+			ret.append(1, s[i]);
+	}
+	return ret;
+}
+
+static std::string urlEncode(const std::string &s)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	std::string ret;
+
+	for (size_t i = 0; i < s.size(); i++)
+	{
+		unsigned char c = s[i];
+		if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' || c == '/')
+			ret.append(1, c);
+		else
+			ret.append(1, '%').append(1, hex[c >> 4]).append(1, hex[c & 15]);
+	}
+	return ret;
+}
+
+std::string AutoIndex::getBody() const
+{
+	if (_format == "json")
+		return getJson();
+	if (_format == "xml")
+		return getXml();
+	return getHtml();
+}
+
+std::string AutoIndex::getHtml() const
+{
+	std::string body;
+	std::string title = escape(_queryPath, false);
+
+	body.reserve(512 + _entries.size() * 128);
+	body.append("<!DOCTYPE html>\n<html lang=\"en\">\n<head>\n<title>Index of ").append(title);
+	body.append("</title>\n<meta charset=\"UTF-8\">\n"
+				"<meta name=\"viewport\" content=\"width=device-width, initial-scale=1\">\n"
+				"</head>\n<body>\n<h1>Index of ");
+	body.append(title).append("</h1>\n<table>\n");
+	for (size_t i = 0; i < _entries.size(); i++)
+	{
+		const Entry &e = _entries[i];
+		std::string name = e.name + (e.isDir ? "/" : "");
+		body.append("<tr><td><a href=\"").append(urlEncode(_queryPath + name)).append("\">");
+		body.append(escape(name, false)).append("</a></td><td>");
+		body.append(utils::httpDate(e.mtime)).append("</td><td>");
+		body.append(e.isDir ? "-" : utils::to_string(e.size)).append("</td></tr>\n");
+	}
+	body.append("</table>\n</body>\n</html>\n");
+	return body;
+}
+
+std::string AutoIndex::getJson() const
+{
+	std::string body = "[";
+
+	for (size_t i = 0; i < _entries.size(); i++)
+	{
+		const Entry &e = _entries[i];
+		if (e.name == "..")
+			continue;
+		body.append(body.size() > 1 ? ",\n" : "\n");
+		body.append("{\"name\":\"").append(escape(e.name, true));
+		body.append("\",\"type\":\"").append(e.isDir ? "directory" : "file");
+		body.append("\",\"mtime\":\"").append(utils::httpDate(e.mtime)).append("\"");
+		if (!e.isDir)
+			body.append(",\"size\":").append(utils::to_string(e.size));
+		body.append("}");
+	}
+	body.append("\n]\n");
+	return body;
+}
+
+std::string AutoIndex::getXml() const
+{
+	std::string body = "<?xml version=\"1.0\"?>\n<list>\n";
+
+	for (size_t i = 0; i < _entries.size(); i++)
+	{
+		const Entry &e = _entries[i];
+		if (e.name == "..")
+			continue;
+		body.append(e.isDir ? "<directory" : "<file");
+		body.append(" mtime=\"").append(utils::httpDate(e.mtime)).append("\"");
+		if (!e.isDir)
+			body.append(" size=\"").append(utils::to_string(e.size)).append("\"");
+		body.append(">").append(escape(e.name, false));
+		body.append(e.isDir ? "</directory>\n" : "</file>\n");
+	}
+	body.append("</list>\n");
+	return body;
 }
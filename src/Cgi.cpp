@@ -1,8 +1,13 @@
 #include "Cgi.hpp"
 #include "IOAdaptor.hpp"
+#include "Metrics.hpp"
+#include "RequestTrace.hpp"
 #include "colors.h"
 #include "utils.hpp"
+#include <cerrno>
 #include <cstring>
+#include <fcntl.h>
+#include <poll.h>
 #include <sstream>
 #include <stdlib.h>
 #include <signal.h>
@@ -22,6 +27,18 @@ Cgi::Cgi(std::vector<std::string> request, std::map<std::string, std::string> he
 	setPath(path);
 }
 
+void Cgi::setSession(const std::string &id, const std::string &user)
+{
+	this->sessionId = id;
+	this->sessionUser = user;
+}
+
+void Cgi::setSessionApi(const std::string &url, const std::string &host)
+{
+	this->sessionApiUrl = url;
+	this->sessionApiHost = host;
+}
+
 Cgi::~Cgi()
 {
 	if (!envV)
@@ -72,6 +89,21 @@ void Cgi::setEnv()
 	{
 		this->envVariables[replace(it->first, '-', '_')] = it->second;
 	}
+	// set by the server only, never from a Session-User request header
+	this->envVariables.erase("SESSION_ID");
+	this->envVariables.erase("SESSION_USER");
+	this->envVariables.erase("SESSION_API");
+	this->envVariables.erase("SESSION_API_HOST");
+	if (!this->sessionApiUrl.empty())
+	{
+		this->envVariables["SESSION_API"] = this->sessionApiUrl;
+		this->envVariables["SESSION_API_HOST"] = this->sessionApiHost;
+	}
+	if (!this->sessionId.empty())
+	{
+		this->envVariables["SESSION_ID"] = this->sessionId;
+		this->envVariables["SESSION_USER"] = this->sessionUser;
+	}
 	
 	this->envV = (char **)calloc(sizeof(char *), this->envVariables.size() + 1);
 	it = this->envVariables.begin(); 
@@ -88,6 +120,15 @@ Cgi &Cgi::operator=(const Cgi &rhs)
 	return *this;
 }
 
+// every started script counts towards the duration histogram, failed or not
+static void recordRun(double start, bool failed)
+{
+	RequestTrace::markCurrent(RequestTrace::CGI_EXIT);
+	Metrics::observe(Metrics::CGI_DURATION, Metrics::now() - start);
+	if (failed)
+		Metrics::add(Metrics::CGI_FAILURES);
+}
+
 int Cgi::runCgi()
 {
 	pid_t pid;
@@ -106,9 +147,23 @@ int Cgi::runCgi()
 	// if (pipe(fd) == -1)
 	if (access(this->path.c_str(), X_OK))
 		throw RequestException("File read forbidden", 403);
-	if (pipe(input) == -1 || pipe(output) == -1)
+	// close-on-exec so a CGI forked by another worker meanwhile does not keep
+	// this one's stdin open
+	if (pipe2(input, O_CLOEXEC) == -1 || pipe2(output, O_CLOEXEC) == -1)
+	{
+		Metrics::add(Metrics::CGI_FAILURES);
 		return (500);
+	}
 	pid = fork();
+	if (pid == -1)
+	{
+		close(input[0]);
+		close(input[1]);
+		close(output[0]);
+		close(output[1]);
+		Metrics::add(Metrics::CGI_FAILURES);
+		return (500);
+	}
 	if (pid == 0)
 	{
 		close(output[0]);
@@ -118,43 +173,64 @@ int Cgi::runCgi()
 		dup2(input[0], STDIN_FILENO);
 		close(input[0]);
 		execve(this->path.c_str(), av, this->envV);
-		exit(127);
+		// forked from a worker thread: no atexit handlers, static destructors
+		// or stdio buffers of the server, and no locks other threads held
+		_exit(127);
 	}
 	else
 	{
+		double start = Metrics::now();
+		RequestTrace::markCurrent(RequestTrace::CGI_FORK);
+		Metrics::add(Metrics::CGI_SPAWNS);
 		close(input[0]);
+		close(output[1]);
 		if (write(input[1], this->body.c_str() ,this->body.size()) == -1)
+		{
+			close(input[1]);
+			close(output[0]);
+			kill(pid, SIGKILL);
+			waitpid(pid, &status, 0);
+			recordRun(start, true);
 			return (500);
+		}
 		close(input[1]);
-		close(output[1]);
 
-		int limit = 0;
-		while (limit < TIMEOUT)
+		// the output is read as it comes, until the script closes it or
+		// TIMEOUT seconds have passed; the worker sleeps in poll meanwhile
+		// instead of waking up every second
+		double deadline = start + TIMEOUT;
+		char buf[4096];
+		for (;;)
 		{
-			sleep(1);
-			int lim = waitpid(pid, &status, WNOHANG);
-			if (lim < 0)
+			int remaining = (int)((deadline - Metrics::now()) * 1000);
+			struct pollfd pfd = {output[0], POLLIN, 0};
+			int ready = remaining > 0 ? poll(&pfd, 1, remaining) : 0;
+			if (ready == -1 && errno == EINTR)
+				continue;
+			if (ready <= 0)
+			{
+				close(output[0]);
+				kill(pid, SIGKILL);
+				waitpid(pid, &status, 0);
+				recordRun(start, true);
+				if (ready == 0)
+					throw RequestException("Request Timeout",  408);
 				throw RequestException("Internal Server Error",  500);
-			if (WIFEXITED(status))
+			}
+			ssize_t read_bytes = read(output[0], buf, sizeof(buf));
+			if (read_bytes == -1 && errno == EINTR)
+				continue;
+			if (read_bytes <= 0)
 				break;
-			limit++;
-		}
-		if (limit == TIMEOUT)
-		{
-			kill(pid, 9);
-			throw RequestException("Request Timeout",  408);
-		}
-		int read_bytes;
-
-		read_bytes = 1;
-		char buf[1024];
-		while (read_bytes > 0)
-		{
-			memset(buf, 0, 1024);
-			read_bytes = read(output[0], buf, 1024);
 			outputString.append(buf, read_bytes);
 		}
 		close(output[0]);
+		if (waitpid(pid, &status, 0) == -1)
+		{
+			recordRun(start, true);
+			throw RequestException("Internal Server Error",  500);
+		}
+		recordRun(start, false);
 	}
 	setBody(outputString);
 	return (200);
@@ -0,0 +1,259 @@
+#include "DeleteJobs.hpp"
+#include "Log.hpp"
+#include "Metrics.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sstream>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+/***********************************
+ * DeleteJobs
+ ***********************************/
+
+DeleteJobs::DeleteJobs() : _pool(new ThreadPool(DELETE_JOB_THREADS)), _jobs(), _finished(), _nextId(1)
+{
+}
+
+// a tree still being removed is left as it is at the next entry
+DeleteJobs::~DeleteJobs()
+{
+	for (std::map<unsigned long, Job *>::iterator it = _jobs.begin(); it != _jobs.end(); it++)
+		__atomic_store_n(&it->second->cancelled, true, __ATOMIC_RELAXED);
+	delete _pool;
+	for (std::map<unsigned long, Job *>::iterator it = _jobs.begin(); it != _jobs.end(); it++)
+		delete it->second;
+}
+
+DeleteJobs::DeleteJobs(const DeleteJobs &src)
+{
+	(void)src;
+}
+
+DeleteJobs &DeleteJobs::operator=(const DeleteJobs &rhs)
+{
+	(void)rhs;
+	return *this;
+}
+
+const DeleteJobs::Job &DeleteJobs::start(const std::string &path, const std::string &uri)
+{
+	Job *job = new Job();
+
+	job->id = _nextId++;
+	job->uri = uri;
+	job->path = path;
+	job->state = RUNNING;
+	job->removed = 0;
+	job->failed = 0;
+	job->error = 0;
+	job->cancelled = false;
+	job->started = now();
+	job->finished = 0;
+	_jobs[job->id] = job;
+	_pool->submit(-1, new DeleteTask(*job));
+	Metrics::add(Metrics::DELETE_JOBS);
+	LOG(LOG_DEBUG) << "delete job " << job->id << " started: " << path;
+	return *job;
+}
+
+const DeleteJobs::Job *DeleteJobs::find(unsigned long id) const
+{
+	std::map<unsigned long, Job *>::const_iterator it = _jobs.find(id);
+
+	return it == _jobs.end() ? NULL : it->second;
+}
+
+// called by the event loop when the notify fd is readable: the finished jobs
+// keep their status until DELETE_JOBS_KEPT newer ones have finished
+void DeleteJobs::collect()
+{
+	std::vector<std::pair<int, Task *> > completed = _pool->takeCompleted();
+
+	for (size_t i = 0; i < completed.size(); i++)
+	{
+		Job &job = static_cast<DeleteTask *>(completed[i].second)->getJob();
+
+		job.state = job.failed || job.error ? FAILED : DONE;
+		job.finished = now();
+		LOG(LOG_DEBUG) << "delete job " << job.id << " finished: " << job.removed << " removed, " << job.failed
+					   << " failed";
+		delete completed[i].second;
+		_finished.push_back(job.id);
+	}
+	while (_finished.size() > DELETE_JOBS_KEPT)
+	{
+		std::map<unsigned long, Job *>::iterator it = _jobs.find(_finished.front());
+		delete it->second;
+		_jobs.erase(it);
+		_finished.pop_front();
+	}
+}
+
+int DeleteJobs::getNotifyFd() const
+{
+	return _pool->getNotifyFd();
+}
+
+// the status document of a job
+std::string DeleteJobs::render(const Job &job)
+{
+	static const char *states[] = {"running", "done", "failed"};
+	std::ostringstream oss;
+	std::string uri;
+	char seconds[32];
+
+	for (size_t i = 0; i < job.uri.size(); i++)
+	{
+		if (job.uri[i] == '"' || job.uri[i] == '\\')
+			uri.append(1, '\\');
+		if ((unsigned char)job.uri[i] >= 0x20)
+			uri.append(1, job.uri[i]);
+	}
+	snprintf(seconds, sizeof(seconds), "%.3f", (job.state == RUNNING ? now() : job.finished) - job.started);
+	oss << "{\"id\":" << job.id << ",\"path\":\"" << uri << "\",\"state\":\"" << states[job.state]
+		<< "\",\"removed\":" << __atomic_load_n(&job.removed, __ATOMIC_RELAXED)
+		<< ",\"failed\":" << __atomic_load_n(&job.failed, __ATOMIC_RELAXED) << ",\"seconds\":" << seconds;
+	if (job.state != RUNNING && job.error)
+		oss << ",\"error\":\"" << strerror(job.error) << "\"";
+	oss << "}\n";
+	return oss.str();
+}
+
+double DeleteJobs::now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/***********************************
+ * DeleteTask
+ ***********************************/
+
+DeleteTask::DeleteTask(DeleteJobs::Job &job) : Task(), _job(job)
+{
+}
+
+DeleteTask::~DeleteTask(void)
+{
+}
+
+DeleteTask::DeleteTask(const DeleteTask &src) : Task(), _job(src._job)
+{
+}
+
+DeleteTask &DeleteTask::operator=(const DeleteTask &rhs)
+{
+	(void)rhs;
+	return *this;
+}
+
+// the directory is opened without following a symlink, and is removed last.
+// The worker runs at the lowest priority, so the tree only takes the CPU the
+// requests leave.
+void DeleteTask::run()
+{
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), DELETE_JOB_NICE);
+	int fd = open(_job.path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+	if (fd == -1)
+	{
+		_job.error = errno;
+		return;
+	}
+	removeTree(fd);
+	if (__atomic_load_n(&_job.cancelled, __ATOMIC_RELAXED))
+		return;
+	removeEntry(AT_FDCWD, _job.path.c_str(), AT_REMOVEDIR);
+}
+
+// the event loop only looks at the job
+std::string DeleteTask::complete()
+{
+	return "";
+}
+
+DeleteJobs::Job &DeleteTask::getJob()
+{
+	return _job;
+}
+
+// depth first without recursion: one open directory per level, each removed
+// from its parent once it has been read to the end
+void DeleteTask::removeTree(int fd)
+{
+	std::vector<std::pair<DIR *, std::string> > stack;
+	DIR *dir = fdopendir(fd);
+
+	if (!dir)
+	{
+		close(fd);
+		fail(errno);
+		return;
+	}
+	stack.push_back(std::make_pair(dir, std::string()));
+	while (!stack.empty() && !__atomic_load_n(&_job.cancelled, __ATOMIC_RELAXED))
+	{
+		dir = stack.back().first;
+		struct dirent *entry = readdir(dir);
+		if (!entry)
+		{
+			std::string name = stack.back().second;
+			closedir(dir);
+			stack.pop_back();
+			if (!stack.empty())
+				removeEntry(dirfd(stack.back().first), name.c_str(), AT_REMOVEDIR);
+			continue;
+		}
+		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+			continue;
+		bool isDir = entry->d_type == DT_DIR;
+		if (entry->d_type == DT_UNKNOWN)
+		{
+			struct stat st;
+			isDir = !fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) && S_ISDIR(st.st_mode);
+		}
+		if (!isDir)
+		{
+			removeEntry(dirfd(dir), entry->d_name, 0);
+			continue;
+		}
+		int child = openat(dirfd(dir), entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		DIR *childDir = child == -1 ? NULL : fdopendir(child);
+		if (!childDir)
+		{
+			fail(errno);
+			if (child != -1)
+				close(child);
+			continue;
+		}
+		stack.push_back(std::make_pair(childDir, std::string(entry->d_name)));
+	}
+	for (size_t i = 0; i < stack.size(); i++)
+		closedir(stack[i].first);
+}
+
+void DeleteTask::removeEntry(int dirFd, const char *name, int flags)
+{
+	if (unlinkat(dirFd, name, flags))
+		return fail(errno);
+	__atomic_store_n(&_job.removed, _job.removed + 1, __ATOMIC_RELAXED);
+	Metrics::add(Metrics::DELETE_ENTRIES);
+}
+
+// the count goes on; the first error is kept for the status
+void DeleteTask::fail(int error)
+{
+	__atomic_store_n(&_job.failed, _job.failed + 1, __ATOMIC_RELAXED);
+	if (!_job.error)
+		_job.error = error;
+}
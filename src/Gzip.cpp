@@ -0,0 +1,182 @@
+#include "Gzip.hpp"
+#include "Metrics.hpp"
+#include "RequestException.hpp"
+#include "utils.hpp"
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include <string>
+#include <vector>
+
+/***********************************
+ * Gzip
+ ***********************************/
+
+Gzip::Gzip(int level) : _output(), _finished(false)
+{
+	memset(&_stream, 0, sizeof(_stream));
+	// 15 bits of window + 16 selects the gzip wrapper instead of raw zlib
+	if (deflateInit2(&_stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		throw RequestException("Failed to initialise gzip", 500);
+}
+
+Gzip::~Gzip()
+{
+	deflateEnd(&_stream);
+}
+
+Gzip::Gzip(const Gzip &src)
+{
+	(void)src;
+}
+
+Gzip &Gzip::operator=(const Gzip &rhs)
+{
+	(void)rhs;
+	return *this;
+}
+
+void Gzip::deflateInput(int flush)
+{
+	char buff[16384];
+	int ret;
+
+	do
+	{
+		_stream.next_out = (Bytef *)buff;
+		_stream.avail_out = sizeof(buff);
+		ret = deflate(&_stream, flush);
+		if (ret == Z_STREAM_ERROR)
+			throw RequestException("Failed to gzip response", 500);
+		_output.append(buff, sizeof(buff) - _stream.avail_out);
+	} while (_stream.avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+}
+
+void Gzip::append(const char *data, size_t len)
+{
+	if (_finished || len == 0)
+		return;
+	_stream.next_in = (Bytef *)data;
+	_stream.avail_in = len;
+	deflateInput(Z_NO_FLUSH);
+}
+
+void Gzip::finish()
+{
+	if (_finished)
+		return;
+	_stream.next_in = NULL;
+	_stream.avail_in = 0;
+	deflateInput(Z_FINISH);
+	_finished = true;
+}
+
+const std::string &Gzip::getOutput() const
+{
+	return _output;
+}
+
+std::string Gzip::compress(const std::string &data, int level)
+{
+	Gzip gzip(level);
+
+	gzip.append(data.data(), data.size());
+	gzip.finish();
+	return gzip.getOutput();
+}
+
+bool Gzip::isCompressibleType(const std::string &contentType)
+{
+	std::string type = utils::trim(utils::splitPair(contentType, ";").first);
+
+	return type.compare(0, 5, "text/") == 0 || type == "application/javascript" || type == "application/json" ||
+		   type == "application/xml" || type == "image/svg+xml";
+}
+
+// true if the Accept-Encoding list names the coding with a non-zero q, or
+// has no entry for it and a * with a non-zero q. q=0 refuses the coding.
+bool Gzip::isAccepted(const std::string &acceptEncoding, const std::string &coding)
+{
+	std::vector<std::string> codings = utils::split(acceptEncoding, ',');
+	int wildcard = -1;
+
+	for (size_t i = 0; i < codings.size(); i++)
+	{
+		std::vector<std::string> params = utils::split(codings[i], ';');
+		std::string name = params.empty() ? "" : utils::trim(params[0]);
+		bool accepted = true;
+		if (strcasecmp(name.c_str(), coding.c_str()) && name != "*")
+			continue;
+		for (size_t j = 1; j < params.size(); j++)
+		{
+			std::string q = utils::trim(params[j]);
+			if ((q.compare(0, 2, "q=") == 0 || q.compare(0, 2, "Q=") == 0) && strtod(q.c_str() + 2, NULL) <= 0)
+				accepted = false;
+		}
+		if (name != "*")
+			return accepted;
+		wildcard = accepted;
+	}
+	return wildcard == 1;
+}
+
+/***********************************
+ * GzipCache
+ ***********************************/
+
+GzipCache::GzipCache(size_t maxSize) : _maxSize(maxSize), _size(0), _lru(), _entries()
+{
+	pthread_mutex_init(&_mutex, NULL);
+}
+
+GzipCache::~GzipCache()
+{
+	pthread_mutex_destroy(&_mutex);
+}
+
+GzipCache::GzipCache(const GzipCache &src)
+{
+	(void)src;
+}
+
+GzipCache &GzipCache::operator=(const GzipCache &rhs)
+{
+	(void)rhs;
+	return *this;
+}
+
+bool GzipCache::find(const std::string &key, std::string &compressed)
+{
+	pthread_mutex_lock(&_mutex);
+	EntryMap::iterator it = _entries.find(key);
+	bool found = it != _entries.end();
+	if (found)
+	{
+		_lru.splice(_lru.begin(), _lru, it->second.second);
+		compressed = it->second.first;
+	}
+	pthread_mutex_unlock(&_mutex);
+	Metrics::add(found ? Metrics::GZIP_CACHE_HITS : Metrics::GZIP_CACHE_MISSES);
+	return found;
+}
+
+void GzipCache::insert(const std::string &key, const std::string &compressed)
+{
+	pthread_mutex_lock(&_mutex);
+	if (compressed.size() > _maxSize || _entries.count(key))
+	{
+		pthread_mutex_unlock(&_mutex);
+		return;
+	}
+	while (_size + compressed.size() > _maxSize && !_lru.empty())
+	{
+		EntryMap::iterator oldest = _entries.find(_lru.back());
+		_size -= oldest->second.first.size();
+		_entries.erase(oldest);
+		_lru.pop_back();
+	}
+	_lru.push_front(key);
+	_entries[key] = std::make_pair(compressed, _lru.begin());
+	_size += compressed.size();
+	pthread_mutex_unlock(&_mutex);
+}
@@ -0,0 +1,384 @@
+#include "Hpack.hpp"
+
+// RFC 7541 appendix A, index 1 first
+static const struct
+{
+	const char *name;
+	const char *value;
+} g_staticTable[] = {
+	{":authority", ""},
+	{":method", "GET"},
+	{":method", "POST"},
+	{":path", "/"},
+	{":path", "/index.html"},
+	{":scheme", "http"},
+	{":scheme", "https"},
+	{":status", "200"},
+	{":status", "204"},
+	{":status", "206"},
+	{":status", "304"},
+	{":status", "400"},
+	{":status", "404"},
+	{":status", "500"},
+	{"accept-charset", ""},
+	{"accept-encoding", "gzip, deflate"},
+	{"accept-language", ""},
+	{"accept-ranges", ""},
+	{"accept", ""},
+	{"access-control-allow-origin", ""},
+	{"age", ""},
+	{"allow", ""},
+	{"authorization", ""},
+	{"cache-control", ""},
+	{"content-disposition", ""},
+	{"content-encoding", ""},
+	{"content-language", ""},
+	{"content-length", ""},
+	{"content-location", ""},
+	{"content-range", ""},
+	{"content-type", ""},
+	{"cookie", ""},
+	{"date", ""},
+	{"etag", ""},
+	{"expect", ""},
+	{"expires", ""},
+	{"from", ""},
+	{"host", ""},
+	{"if-match", ""},
+	{"if-modified-since", ""},
+	{"if-none-match", ""},
+	{"if-range", ""},
+	{"if-unmodified-since", ""},
+	{"last-modified", ""},
+	{"link", ""},
+	{"location", ""},
+	{"max-forwards", ""},
+	{"proxy-authenticate", ""},
+	{"proxy-authorization", ""},
+	{"range", ""},
+	{"referer", ""},
+	{"refresh", ""},
+	{"retry-after", ""},
+	{"server", ""},
+	{"set-cookie", ""},
+	{"strict-transport-security", ""},
+	{"transfer-encoding", ""},
+	{"user-agent", ""},
+	{"vary", ""},
+	{"via", ""},
+	{"www-authenticate", ""},
+};
+static const size_t g_staticSize = sizeof(g_staticTable) / sizeof(g_staticTable[0]);
+
+// RFC 7541 appendix B code lengths, symbol 256 being EOS. The code is
+// canonical (codes of a length are consecutive and follow the shorter ones),
+// so the lengths are enough to decode it.
+static const unsigned char g_huffmanLengths[257] = {
+	13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+	28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+	6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+	5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+	13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+	15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+	6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+	20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+	24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+	22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+	21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+	26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+	19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+	20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+	26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+	30,
+};
+
+#define HUFFMAN_MAX_LENGTH 30
+
+// first code, number of codes and first symbol (in g_huffmanSymbols) of each
+// code length, filled on first use
+static unsigned int g_huffmanFirst[HUFFMAN_MAX_LENGTH + 1];
+static unsigned int g_huffmanCount[HUFFMAN_MAX_LENGTH + 1];
+static unsigned int g_huffmanOffset[HUFFMAN_MAX_LENGTH + 1];
+static unsigned short g_huffmanSymbols[257];
+
+static void initHuffman()
+{
+	static bool done = false;
+	unsigned int code = 0;
+	unsigned int index = 0;
+
+	if (done)
+		return;
+	for (int length = 1; length <= HUFFMAN_MAX_LENGTH; length++)
+	{
+		g_huffmanCount[length] = 0;
+		g_huffmanOffset[length] = index;
+		for (unsigned short symbol = 0; symbol < 257; symbol++)
+		{
+			if (g_huffmanLengths[symbol] == length)
+			{
+				g_huffmanSymbols[index++] = symbol;
+				g_huffmanCount[length]++;
+			}
+		}
+		g_huffmanFirst[length] = code;
+		code = (code + g_huffmanCount[length]) << 1;
+	}
+	done = true;
+}
+
+/***********************************
+ * Constructors
+ ***********************************/
+
+Hpack::Hpack() : _table(), _size(0), _maxSize(HPACK_TABLE_SIZE)
+{
+}
+
+Hpack::Hpack(const Hpack &src) : _table(), _size(0), _maxSize(HPACK_TABLE_SIZE)
+{
+	(void)src;
+}
+
+Hpack &Hpack::operator=(const Hpack &rhs)
+{
+	(void)rhs;
+	return *this;
+}
+
+/***********************************
+ * Destructors
+ ***********************************/
+
+Hpack::~Hpack()
+{
+}
+
+/***********************************
+ * Decoding
+ ***********************************/
+
+// a whole header block; false on any compression error, after which the
+// table is out of step with the peer's and the connection has to go
+bool Hpack::decode(const std::string &block, Fields &fields)
+{
+	size_t pos = 0;
+	size_t listSize = 0;
+
+	while (pos < block.size())
+	{
+		unsigned char first = block[pos];
+		size_t index;
+		Field field;
+
+		if (first & 0x80)
+		{
+			if (!decodeInteger(block, pos, 7, index) || !find(index, field))
+				return false;
+		}
+		else if ((first & 0xe0) == 0x20)
+		{
+			// dynamic table size update, up to what our SETTINGS allow
+			if (!decodeInteger(block, pos, 5, index) || index > HPACK_TABLE_SIZE)
+				return false;
+			_maxSize = index;
+			evict(_maxSize);
+			continue;
+		}
+		else
+		{
+			// literal, with incremental indexing (01) or without (0000, 0001)
+			bool indexing = (first & 0xc0) == 0x40;
+			if (!decodeInteger(block, pos, indexing ? 6 : 4, index))
+				return false;
+			if (index ? !find(index, field) : !decodeString(block, pos, field.first))
+				return false;
+			if (!decodeString(block, pos, field.second))
+				return false;
+			if (indexing)
+				insert(field);
+		}
+		listSize += field.first.size() + field.second.size() + 32;
+		if (listSize > HPACK_MAX_HEADER_LIST_SIZE)
+			return false;
+		fields.push_back(field);
+	}
+	return true;
+}
+
+// an integer with a prefix bits wide first byte (RFC 7541 5.1)
+bool Hpack::decodeInteger(const std::string &in, size_t &pos, int prefix, size_t &value)
+{
+	size_t mask = (1u << prefix) - 1;
+
+	if (pos >= in.size())
+		return false;
+	value = (unsigned char)in[pos++] & mask;
+	if (value < mask)
+		return true;
+	for (int shift = 0; pos < in.size() && shift <= 28; shift += 7)
+	{
+		unsigned char byte = in[pos++];
+		value += (size_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return true;
+	}
+	return false;
+}
+
+bool Hpack::decodeString(const std::string &in, size_t &pos, std::string &value)
+{
+	bool huffman;
+	size_t size;
+
+	if (pos >= in.size())
+		return false;
+	huffman = (unsigned char)in[pos] & 0x80;
+	if (!decodeInteger(in, pos, 7, size) || size > in.size() - pos)
+		return false;
+	if (huffman && !decodeHuffman(in, pos, size, value))
+		return false;
+	if (!huffman)
+		value.assign(in, pos, size);
+	pos += size;
+	return true;
+}
+
+// the padding after the last symbol has to be the (at most 7 bit) start of EOS
+bool Hpack::decodeHuffman(const std::string &in, size_t pos, size_t size, std::string &value)
+{
+	unsigned int code = 0;
+	int length = 0;
+
+	initHuffman();
+	value.clear();
+	for (size_t i = pos; i < pos + size; i++)
+	{
+		for (int bit = 7; bit >= 0; bit--)
+		{
+			code = (code << 1) | (((unsigned char)in[i] >> bit) & 1);
+			if (++length > HUFFMAN_MAX_LENGTH)
+				return false;
+			if (code - g_huffmanFirst[length] >= g_huffmanCount[length])
+				continue;
+			unsigned short symbol = g_huffmanSymbols[g_huffmanOffset[length] + code - g_huffmanFirst[length]];
+			if (symbol == 256)
+				return false;
+			value += (char)symbol;
+			code = 0;
+			length = 0;
+		}
+	}
+	return length < 8 && code == (1u << length) - 1;
+}
+
+/***********************************
+ * Dynamic table
+ ***********************************/
+
+bool Hpack::find(size_t index, Field &field) const
+{
+	if (index == 0)
+		return false;
+	if (index <= g_staticSize)
+	{
+		field = Field(g_staticTable[index - 1].name, g_staticTable[index - 1].value);
+		return true;
+	}
+	if (index - g_staticSize > _table.size())
+		return false;
+	field = _table[index - g_staticSize - 1];
+	return true;
+}
+
+// an entry larger than the whole table empties it (RFC 7541 4.4)
+void Hpack::insert(const Field &field)
+{
+	size_t size = field.first.size() + field.second.size() + 32;
+
+	if (size > _maxSize)
+	{
+		evict(0);
+		return;
+	}
+	evict(_maxSize - size);
+	_table.push_front(field);
+	_size += size;
+}
+
+void Hpack::evict(size_t maxSize)
+{
+	while (_size > maxSize && !_table.empty())
+	{
+		_size -= _table.back().first.size() + _table.back().second.size() + 32;
+		_table.pop_back();
+	}
+}
+
+/***********************************
+ * Encoding
+ ***********************************/
+
+void Hpack::encode(const Fields &fields, std::string &block)
+{
+	for (size_t i = 0; i < fields.size(); i++)
+	{
+		bool exact = false;
+		size_t index = findStatic(fields[i], exact);
+
+		if (exact)
+		{
+			encodeInteger(index, 7, 0x80, block);
+			continue;
+		}
+		// literal without indexing, name from the static table when it has it
+		encodeInteger(index, 4, 0x00, block);
+		if (!index)
+		{
+			encodeInteger(fields[i].first.size(), 7, 0x00, block);
+			block += fields[i].first;
+		}
+		encodeInteger(fields[i].second.size(), 7, 0x00, block);
+		block += fields[i].second;
+	}
+}
+
+void Hpack::encodeInteger(size_t value, int prefix, unsigned char first, std::string &out)
+{
+	size_t mask = (1u << prefix) - 1;
+
+	if (value < mask)
+	{
+		out += (char)(first | value);
+		return;
+	}
+	out += (char)(first | mask);
+	value -= mask;
+	while (value >= 0x80)
+	{
+		out += (char)((value & 0x7f) | 0x80);
+		value >>= 7;
+	}
+	out += (char)value;
+}
+
+// index of the static entry with the field's name (and value, when exact)
+size_t Hpack::findStatic(const Field &field, bool &exact)
+{
+	size_t byName = 0;
+
+	for (size_t i = 0; i < g_staticSize; i++)
+	{
+		if (field.first != g_staticTable[i].name)
+			continue;
+		if (field.second == g_staticTable[i].value)
+		{
+			exact = true;
+			return i + 1;
+		}
+		if (!byName)
+			byName = i + 1;
+	}
+	return byName;
+}
@@ -0,0 +1,843 @@
+#include "Http2.hpp"
+#include "Log.hpp"
+#include "Metrics.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <strings.h>
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+#define SETTINGS_ENABLE_PUSH 0x2
+#define SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define SETTINGS_MAX_FRAME_SIZE 0x5
+#define SETTINGS_MAX_HEADER_LIST_SIZE 0x6
+
+#define HTTP2_MAX_WINDOW 0x7fffffffL
+#define HTTP2_MAX_FRAME_SIZE 0xffffff
+
+static unsigned int read32(const char *p)
+{
+	return ((unsigned int)(unsigned char)p[0] << 24) | ((unsigned char)p[1] << 16) | ((unsigned char)p[2] << 8) |
+		   (unsigned char)p[3];
+}
+
+static void write32(std::string &out, unsigned int value)
+{
+	out += (char)(value >> 24);
+	out += (char)(value >> 16);
+	out += (char)(value >> 8);
+	out += (char)value;
+}
+
+// headers that only mean something to one HTTP/1.1 hop (RFC 9113 8.2.2);
+// dropped in both directions
+static bool isConnectionHeader(const std::string &name)
+{
+	static const char *names[] = {"connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade", "te"};
+
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+		if (!strcasecmp(name.c_str(), names[i]))
+			return true;
+	return false;
+}
+
+// what would break the HTTP/1.1 message a request is rewritten into
+static bool isFieldSafe(const std::string &value)
+{
+	for (size_t i = 0; i < value.size(); i++)
+		if (value[i] == '\r' || value[i] == '\n' || value[i] == '\0')
+			return false;
+	return true;
+}
+
+static std::string toLower(const std::string &s)
+{
+	std::string lower(s);
+
+	for (size_t i = 0; i < lower.size(); i++)
+		lower[i] = std::tolower((unsigned char)lower[i]);
+	return lower;
+}
+
+// HTTP2-Settings is base64url without padding (RFC 7540 3.2.1)
+static std::string decodeBase64Url(const std::string &in)
+{
+	std::string out;
+	unsigned int bits = 0;
+	int count = 0;
+
+	for (size_t i = 0; i < in.size(); i++)
+	{
+		char c = in[i];
+		int value;
+		if (c >= 'A' && c <= 'Z')
+			value = c - 'A';
+		else if (c >= 'a' && c <= 'z')
+			value = c - 'a' + 26;
+		else if (c >= '0' && c <= '9')
+			value = c - '0' + 52;
+		else if (c == '-' || c == '+')
+			value = 62;
+		else if (c == '_' || c == '/')
+			value = 63;
+		else
+			break;
+		bits = (bits << 6) | value;
+		count += 6;
+		if (count >= 8)
+		{
+			count -= 8;
+			out += (char)((bits >> count) & 0xff);
+		}
+	}
+	return out;
+}
+
+/***********************************
+ * Constructors
+ ***********************************/
+
+Http2::Stream::Stream()
+	: request(), body(), requestDone(false), recvUnacked(0), head(), headDone(false), chunked(false),
+	  chunkState(CHUNK_SIZE), chunkRemaining(0), chunkLine(), data(), ended(false), window(HTTP2_WINDOW),
+	  weight(HTTP2_DEFAULT_WEIGHT), pass(0)
+{
+}
+
+// the server preface, our SETTINGS, goes out first
+Http2::Http2()
+	: _decoder(), _streams(), _requests(), _resets(), _input(), _output(), _prefaceReceived(false),
+	  _settingsReceived(false), _goaway(false), _failed(false), _lastStream(0), _continuation(0),
+	  _continuationFlags(0), _continuationWeight(HTTP2_DEFAULT_WEIGHT), _headerBlock(), _sendWindow(HTTP2_WINDOW),
+	  _recvUnacked(0), _peerWindow(HTTP2_WINDOW), _peerFrameSize(HTTP2_FRAME_SIZE), _pass(0)
+{
+	std::string settings;
+
+	settings += (char)0;
+	settings += (char)SETTINGS_MAX_CONCURRENT_STREAMS;
+	write32(settings, HTTP2_MAX_STREAMS);
+	settings += (char)0;
+	settings += (char)SETTINGS_MAX_HEADER_LIST_SIZE;
+	write32(settings, HPACK_MAX_HEADER_LIST_SIZE);
+	writeFrame(FRAME_SETTINGS, 0, 0, settings.data(), settings.size());
+}
+
+Http2::Http2(const Http2 &src)
+{
+	(void)src;
+}
+
+Http2 &Http2::operator=(const Http2 &rhs)
+{
+	(void)rhs;
+	return *this;
+}
+
+/***********************************
+ * Destructors
+ ***********************************/
+
+Http2::~Http2()
+{
+}
+
+/***********************************
+ * Connection setup
+ ***********************************/
+
+// true while data could still become the client preface
+bool Http2::isPreface(const std::string &data)
+{
+	size_t size = std::min(data.size(), (size_t)HTTP2_PREFACE_SIZE);
+
+	return size && data.compare(0, size, HTTP2_PREFACE, size) == 0;
+}
+
+// an HTTP/1.1 request asking to switch to h2c: Upgrade: h2c, Connection
+// naming Upgrade, and the client's SETTINGS in HTTP2-Settings
+bool Http2::isUpgrade(const std::map<std::string, std::string> &headers, std::string &settings)
+{
+	std::string upgrade, connection;
+	bool hasSettings = false;
+
+	for (std::map<std::string, std::string>::const_iterator it = headers.begin(); it != headers.end(); it++)
+	{
+		if (!strcasecmp(it->first.c_str(), "Upgrade"))
+			upgrade = toLower(utils::trim(it->second));
+		else if (!strcasecmp(it->first.c_str(), "Connection"))
+			connection = toLower(it->second);
+		else if (!strcasecmp(it->first.c_str(), "HTTP2-Settings"))
+		{
+			settings = utils::trim(it->second);
+			hasSettings = true;
+		}
+	}
+	return hasSettings && upgrade == "h2c" && connection.find("upgrade") != std::string::npos;
+}
+
+// answers the Upgrade with 101 ahead of our SETTINGS; the request that asked
+// becomes stream 1, already closed on the client's side
+void Http2::upgrade(const std::string &settings, const std::string &request)
+{
+	std::string payload = decodeBase64Url(settings);
+	Request upgraded;
+
+	_output.insert(0, "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n");
+	if (!applySettings(payload.data(), payload.size() - payload.size() % 6))
+		return;
+	Stream &stream = _streams[1];
+	stream.window = _peerWindow;
+	stream.requestDone = true;
+	stream.pass = _pass;
+	_lastStream = 1;
+	upgraded.stream = 1;
+	upgraded.message = request;
+	_requests.push_back(upgraded);
+	Metrics::add(Metrics::HTTP2_STREAMS);
+}
+
+/***********************************
+ * Frames in
+ ***********************************/
+
+// false once the connection failed: GOAWAY is queued and nothing more is read
+bool Http2::receive(const char *data, size_t size)
+{
+	size_t pos = 0;
+
+	if (_failed)
+		return false;
+	_input.append(data, size);
+	if (!_prefaceReceived)
+	{
+		if (_input.size() < HTTP2_PREFACE_SIZE)
+			return true;
+		if (_input.compare(0, HTTP2_PREFACE_SIZE, HTTP2_PREFACE) != 0)
+			return fail(ERR_PROTOCOL);
+		_prefaceReceived = true;
+		pos = HTTP2_PREFACE_SIZE;
+	}
+	while (_input.size() - pos >= 9)
+	{
+		const char *frame = _input.data() + pos;
+		size_t length = ((unsigned char)frame[0] << 16) | ((unsigned char)frame[1] << 8) | (unsigned char)frame[2];
+		int type = (unsigned char)frame[3];
+		int flags = (unsigned char)frame[4];
+		unsigned int id = read32(frame + 5) & 0x7fffffff;
+
+		if (length > HTTP2_FRAME_SIZE)
+			return fail(ERR_FRAME_SIZE);
+		if (_input.size() - pos - 9 < length)
+			break;
+		// the client preface ends with its SETTINGS, and a header block
+		// may not be interrupted
+		if (!_settingsReceived && type != FRAME_SETTINGS)
+			return fail(ERR_PROTOCOL);
+		if (_continuation && (type != FRAME_CONTINUATION || id != _continuation))
+			return fail(ERR_PROTOCOL);
+		if (!process(type, flags, id, frame + 9, length))
+			return false;
+		pos += 9 + length;
+	}
+	_input.erase(0, pos);
+	return true;
+}
+
+bool Http2::process(int type, int flags, unsigned int id, const char *payload, size_t size)
+{
+	std::map<unsigned int, Stream>::iterator it;
+
+	switch (type)
+	{
+	case FRAME_DATA:
+		return processData(flags, id, payload, size);
+	case FRAME_HEADERS:
+		return processHeaders(flags, id, payload, size);
+	case FRAME_CONTINUATION:
+		if (!_continuation)
+			return fail(ERR_PROTOCOL);
+		_headerBlock.append(payload, size);
+		if (_headerBlock.size() > HPACK_MAX_HEADER_LIST_SIZE)
+			return fail(ERR_ENHANCE_YOUR_CALM);
+		return (flags & FLAG_END_HEADERS) ? endHeaders() : true;
+	case FRAME_PRIORITY:
+		if (id == 0)
+			return fail(ERR_PROTOCOL);
+		if (size != 5)
+			resetStream(id, ERR_FRAME_SIZE);
+		else if ((it = _streams.find(id)) != _streams.end())
+			it->second.weight = (unsigned char)payload[4] + 1;
+		return true;
+	case FRAME_RST_STREAM:
+		if (id == 0 || id > _lastStream)
+			return fail(ERR_PROTOCOL);
+		if (size != 4)
+			return fail(ERR_FRAME_SIZE);
+		if ((it = _streams.find(id)) != _streams.end())
+		{
+			if (it->second.requestDone)
+				_resets.push_back(id);
+			_streams.erase(it);
+		}
+		return true;
+	case FRAME_SETTINGS:
+		return processSettings(flags, id, payload, size);
+	case FRAME_PUSH_PROMISE:
+		return fail(ERR_PROTOCOL);
+	case FRAME_PING:
+		if (id != 0)
+			return fail(ERR_PROTOCOL);
+		if (size != 8)
+			return fail(ERR_FRAME_SIZE);
+		if (!(flags & FLAG_ACK))
+			writeFrame(FRAME_PING, FLAG_ACK, 0, payload, size);
+		return true;
+	case FRAME_GOAWAY:
+		if (id != 0)
+			return fail(ERR_PROTOCOL);
+		// no new streams; the open ones are still answered
+		_goaway = true;
+		return true;
+	case FRAME_WINDOW_UPDATE:
+		return processWindowUpdate(id, payload, size);
+	default:
+		// unknown frame types are ignored (RFC 9113 4.1)
+		return true;
+	}
+}
+
+bool Http2::processHeaders(int flags, unsigned int id, const char *payload, size_t size)
+{
+	size_t pad = 0;
+	int weight = HTTP2_DEFAULT_WEIGHT;
+
+	if (id == 0 || !(id & 1))
+		return fail(ERR_PROTOCOL);
+	if (flags & FLAG_PADDED)
+	{
+		if (size < 1)
+			return fail(ERR_FRAME_SIZE);
+		pad = (unsigned char)payload[0];
+		payload++;
+		size--;
+	}
+	if (flags & FLAG_PRIORITY)
+	{
+		// the dependency is ignored: RFC 9113 deprecated the tree, weights
+		// alone decide the share of each stream
+		if (size < 5)
+			return fail(ERR_FRAME_SIZE);
+		weight = (unsigned char)payload[4] + 1;
+		payload += 5;
+		size -= 5;
+	}
+	if (pad > size)
+		return fail(ERR_PROTOCOL);
+	_headerBlock.assign(payload, size - pad);
+	_continuation = id;
+	_continuationFlags = flags;
+	_continuationWeight = weight;
+	return (flags & FLAG_END_HEADERS) ? endHeaders() : true;
+}
+
+// a complete header block. It is decoded even for streams that are refused
+// or already closed, to keep the HPACK table in step with the client.
+bool Http2::endHeaders()
+{
+	unsigned int id = _continuation;
+	bool end = _continuationFlags & FLAG_END_STREAM;
+	Hpack::Fields fields;
+
+	_continuation = 0;
+	if (!_decoder.decode(_headerBlock, fields))
+		return fail(ERR_COMPRESSION);
+	_headerBlock.clear();
+	std::map<unsigned int, Stream>::iterator it = _streams.find(id);
+	if (it != _streams.end())
+	{
+		// trailers: they end the request and are not passed on
+		if (it->second.requestDone)
+			resetStream(id, ERR_STREAM_CLOSED);
+		else if (!end)
+			return fail(ERR_PROTOCOL);
+		else
+			finishRequest(id, it->second);
+		return true;
+	}
+	if (id <= _lastStream)
+		return true;
+	_lastStream = id;
+	if (_streams.size() >= HTTP2_MAX_STREAMS)
+	{
+		resetStream(id, ERR_REFUSED_STREAM);
+		return true;
+	}
+	openStream(id, fields, end, _continuationWeight);
+	return true;
+}
+
+// writes the request head as HTTP/1.1: :authority becomes Host, the cookie
+// fields are joined again, names get their usual capitals (the handlers
+// look headers up by exact name)
+void Http2::openStream(unsigned int id, const Hpack::Fields &fields, bool end, int weight)
+{
+	std::string method, path, scheme, authority, cookies, headers;
+	bool regular = false;
+	bool malformed = false;
+
+	for (size_t i = 0; i < fields.size() && !malformed; i++)
+	{
+		const std::string &name = fields[i].first;
+		const std::string &value = fields[i].second;
+
+		malformed = !isFieldSafe(name) || !isFieldSafe(value) || name.empty();
+		if (!malformed && name[0] == ':')
+		{
+			malformed = regular;
+			if (name == ":method")
+				method = value;
+			else if (name == ":path")
+				path = value;
+			else if (name == ":scheme")
+				scheme = value;
+			else if (name == ":authority")
+				authority = value;
+			else
+				malformed = true;
+			continue;
+		}
+		regular = true;
+		if (malformed || toLower(name) != name)
+			malformed = true;
+		else if (name == "cookie")
+			cookies += (cookies.empty() ? "" : "; ") + value;
+		else if (!isConnectionHeader(name) && name != "content-length" && (name != "host" || authority.empty()))
+			headers += canonicalName(name) + ": " + value + "\r\n";
+	}
+	if (malformed || method.empty() || scheme.empty() || path.empty() || path.find(' ') != std::string::npos ||
+		method.find(' ') != std::string::npos)
+	{
+		resetStream(id, ERR_PROTOCOL);
+		return;
+	}
+	Stream &stream = _streams[id];
+	stream.window = _peerWindow;
+	stream.weight = weight;
+	stream.pass = _pass;
+	stream.request = method + " " + path + " HTTP/1.1\r\n";
+	if (!authority.empty())
+		stream.request += "Host: " + authority + "\r\n";
+	stream.request += headers;
+	if (!cookies.empty())
+		stream.request += "Cookie: " + cookies + "\r\n";
+	Metrics::add(Metrics::HTTP2_STREAMS);
+	if (end)
+		finishRequest(id, stream);
+}
+
+// the body is whole now, so it gets an exact Content-Length
+void Http2::finishRequest(unsigned int id, Stream &stream)
+{
+	Request request;
+
+	request.stream = id;
+	request.message = stream.request;
+	if (!stream.body.empty())
+		request.message += "Content-Length: " + utils::to_string(stream.body.size()) + "\r\n";
+	request.message += "\r\n" + stream.body;
+	_requests.push_back(request);
+	stream.requestDone = true;
+	std::string().swap(stream.request);
+	std::string().swap(stream.body);
+}
+
+// request bodies are taken in as they come, so the windows are reopened once
+// half of them is used
+bool Http2::processData(int flags, unsigned int id, const char *payload, size_t size)
+{
+	size_t length = size;
+	size_t pad = 0;
+
+	if (id == 0)
+		return fail(ERR_PROTOCOL);
+	if (flags & FLAG_PADDED)
+	{
+		if (size < 1)
+			return fail(ERR_FRAME_SIZE);
+		pad = (unsigned char)payload[0];
+		payload++;
+		size--;
+		if (pad > size)
+			return fail(ERR_PROTOCOL);
+		size -= pad;
+	}
+	_recvUnacked += length;
+	if (_recvUnacked >= HTTP2_WINDOW / 2)
+	{
+		writeWindowUpdate(0, _recvUnacked);
+		_recvUnacked = 0;
+	}
+	std::map<unsigned int, Stream>::iterator it = _streams.find(id);
+	if (it == _streams.end() || it->second.requestDone)
+	{
+		if (id > _lastStream)
+			return fail(ERR_PROTOCOL);
+		resetStream(id, ERR_STREAM_CLOSED);
+		return true;
+	}
+	Stream &stream = it->second;
+	stream.body.append(payload, size);
+	if (flags & FLAG_END_STREAM)
+	{
+		finishRequest(id, stream);
+		return true;
+	}
+	stream.recvUnacked += length;
+	if (stream.recvUnacked >= HTTP2_WINDOW / 2)
+	{
+		writeWindowUpdate(id, stream.recvUnacked);
+		stream.recvUnacked = 0;
+	}
+	return true;
+}
+
+bool Http2::processSettings(int flags, unsigned int id, const char *payload, size_t size)
+{
+	if (id != 0)
+		return fail(ERR_PROTOCOL);
+	if (flags & FLAG_ACK)
+		return size == 0 ? true : fail(ERR_FRAME_SIZE);
+	if (size % 6)
+		return fail(ERR_FRAME_SIZE);
+	if (!applySettings(payload, size))
+		return false;
+	_settingsReceived = true;
+	writeFrame(FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+	return true;
+}
+
+// the client's limits on what we send; a new initial window moves the
+// windows of the open streams by the difference
+bool Http2::applySettings(const char *payload, size_t size)
+{
+	for (size_t i = 0; i + 6 <= size; i += 6)
+	{
+		unsigned int setting = ((unsigned char)payload[i] << 8) | (unsigned char)payload[i + 1];
+		unsigned int value = read32(payload + i + 2);
+
+		if (setting == SETTINGS_ENABLE_PUSH && value > 1)
+			return fail(ERR_PROTOCOL);
+		if (setting == SETTINGS_INITIAL_WINDOW_SIZE)
+		{
+			if (value > HTTP2_MAX_WINDOW)
+				return fail(ERR_FLOW_CONTROL);
+			for (std::map<unsigned int, Stream>::iterator it = _streams.begin(); it != _streams.end(); it++)
+				it->second.window += (long)value - _peerWindow;
+			_peerWindow = value;
+		}
+		if (setting == SETTINGS_MAX_FRAME_SIZE)
+		{
+			if (value < HTTP2_FRAME_SIZE || value > HTTP2_MAX_FRAME_SIZE)
+				return fail(ERR_PROTOCOL);
+			_peerFrameSize = value;
+		}
+	}
+	return true;
+}
+
+bool Http2::processWindowUpdate(unsigned int id, const char *payload, size_t size)
+{
+	if (size != 4)
+		return fail(ERR_FRAME_SIZE);
+	long increment = read32(payload) & 0x7fffffff;
+	if (id == 0)
+	{
+		if (!increment)
+			return fail(ERR_PROTOCOL);
+		_sendWindow += increment;
+		return _sendWindow > HTTP2_MAX_WINDOW ? fail(ERR_FLOW_CONTROL) : true;
+	}
+	std::map<unsigned int, Stream>::iterator it = _streams.find(id);
+	if (it == _streams.end())
+		return id > _lastStream ? fail(ERR_PROTOCOL) : true;
+	if (!increment)
+		resetStream(id, ERR_PROTOCOL);
+	else if ((it->second.window += increment) > HTTP2_MAX_WINDOW)
+		resetStream(id, ERR_FLOW_CONTROL);
+	return true;
+}
+
+/***********************************
+ * Frames out
+ ***********************************/
+
+// takes what fits of the HTTP/1.1 response to stream (it is erased from
+// response) and reports whether the stream needs nothing more: end says no
+// more bytes follow. A stream that is gone takes everything.
+bool Http2::respond(unsigned int id, std::string &response, bool end)
+{
+	std::map<unsigned int, Stream>::iterator it = _streams.find(id);
+
+	if (it == _streams.end() || _failed)
+	{
+		response.clear();
+		return true;
+	}
+	Stream &stream = it->second;
+	// heavier streams buffer more, or they would only get an even share of
+	// what each pass of the loop takes in
+	size_t buffer = (size_t)HTTP2_STREAM_BUFFER * stream.weight / HTTP2_DEFAULT_WEIGHT;
+	size_t room = stream.data.size() < buffer ? buffer - stream.data.size() : 0;
+	size_t size = std::min(room, response.size());
+	if (!readResponse(stream, id, response.data(), size))
+	{
+		response.clear();
+		return true;
+	}
+	response.erase(0, size);
+	if (!end || !response.empty())
+		return false;
+	if (!stream.headDone)
+		resetStream(id, ERR_INTERNAL);
+	else
+		stream.ended = true;
+	return true;
+}
+
+// the head goes out as HEADERS as soon as it is complete (interim 1xx
+// heads as well); false when it is not HTTP and the stream was reset
+bool Http2::readResponse(Stream &stream, unsigned int id, const char *data, size_t size)
+{
+	while (!stream.headDone && size)
+	{
+		size_t before = stream.head.size();
+		stream.head.append(data, size);
+		size_t end = stream.head.find("\r\n\r\n", before < 3 ? 0 : before - 3);
+		if (end == std::string::npos)
+		{
+			if (stream.head.size() <= HPACK_MAX_HEADER_LIST_SIZE)
+				return true;
+			resetStream(id, ERR_INTERNAL);
+			return false;
+		}
+		data += end + 4 - before;
+		size -= end + 4 - before;
+		if (stream.head.compare(0, 5, "HTTP/") != 0 || stream.head.size() < 12)
+		{
+			resetStream(id, ERR_INTERNAL);
+			return false;
+		}
+
+		Hpack::Fields fields;
+		std::string status = stream.head.substr(9, 3);
+		size_t pos = stream.head.find("\r\n") + 2;
+		fields.push_back(Hpack::Field(":status", status));
+		while (pos < end + 2)
+		{
+			size_t next = stream.head.find("\r\n", pos);
+			std::string line = stream.head.substr(pos, next - pos);
+			size_t colon = line.find(':');
+			pos = next + 2;
+			if (colon == std::string::npos)
+				continue;
+			std::string name = toLower(line.substr(0, colon));
+			std::string value = utils::trim(line.substr(colon + 1));
+			if (name == "transfer-encoding" && toLower(value).find("chunked") != std::string::npos)
+				stream.chunked = true;
+			if (!isConnectionHeader(name))
+				fields.push_back(Hpack::Field(name, value));
+		}
+		sendHeaders(id, fields);
+		stream.head.clear();
+		stream.headDone = status[0] != '1';
+	}
+	if (stream.chunked)
+		readChunked(stream, data, size);
+	else
+		stream.data.append(data, size);
+	return true;
+}
+
+// HTTP/2 frames the body itself, so a chunked one is unwrapped; trailers are
+// dropped
+void Http2::readChunked(Stream &stream, const char *data, size_t size)
+{
+	size_t i = 0;
+
+	while (i < size)
+	{
+		if (stream.chunkState == CHUNK_DATA)
+		{
+			size_t n = std::min(size - i, stream.chunkRemaining);
+			stream.data.append(data + i, n);
+			i += n;
+			stream.chunkRemaining -= n;
+			if (!stream.chunkRemaining)
+				stream.chunkState = CHUNK_DATA_END;
+			continue;
+		}
+		char c = data[i++];
+		if (c != '\n')
+		{
+			if (c != '\r' && stream.chunkLine.size() < 1024)
+				stream.chunkLine += c;
+			continue;
+		}
+		std::string line = stream.chunkLine;
+		stream.chunkLine.clear();
+		if (stream.chunkState == CHUNK_DATA_END)
+			stream.chunkState = CHUNK_SIZE;
+		else if (stream.chunkState == CHUNK_SIZE)
+		{
+			stream.chunkRemaining = strtoul(line.c_str(), NULL, 16);
+			stream.chunkState = stream.chunkRemaining ? CHUNK_DATA : CHUNK_TRAILER;
+		}
+	}
+}
+
+void Http2::sendHeaders(unsigned int id, const Hpack::Fields &fields)
+{
+	std::string block;
+	size_t pos = 0;
+
+	Hpack::encode(fields, block);
+	do
+	{
+		size_t size = std::min(block.size() - pos, _peerFrameSize);
+		bool last = pos + size == block.size();
+		writeFrame(pos ? FRAME_CONTINUATION : FRAME_HEADERS, last ? FLAG_END_HEADERS : 0, id, block.data() + pos, size);
+		pos += size;
+	} while (pos < block.size());
+}
+
+// moves response bodies into DATA frames while the output is short and the
+// windows allow: each frame goes to the ready stream that got the least so
+// far relative to its weight. A stream is done with its last frame.
+void Http2::schedule()
+{
+	while (_output.size() < HTTP2_OUTPUT_LIMIT && !_failed)
+	{
+		std::map<unsigned int, Stream>::iterator next = _streams.end();
+		for (std::map<unsigned int, Stream>::iterator it = _streams.begin(); it != _streams.end(); it++)
+		{
+			Stream &stream = it->second;
+			bool ready = stream.data.empty() ? stream.ended : stream.window > 0 && _sendWindow > 0;
+			if (stream.headDone && ready && (next == _streams.end() || stream.pass < next->second.pass))
+				next = it;
+		}
+		if (next == _streams.end())
+			break;
+		Stream &stream = next->second;
+		size_t size = std::min(stream.data.size(), _peerFrameSize);
+		if (size)
+			size = std::min(size, (size_t)std::min(stream.window, _sendWindow));
+		bool last = stream.ended && size == stream.data.size();
+		writeFrame(FRAME_DATA, last ? FLAG_END_STREAM : 0, next->first, stream.data.data(), size);
+		stream.data.erase(0, size);
+		stream.window -= size;
+		_sendWindow -= size;
+		stream.pass += (unsigned long long)size * 256 / stream.weight;
+		_pass = stream.pass;
+		if (last)
+			_streams.erase(next);
+	}
+}
+
+void Http2::writeFrame(int type, int flags, unsigned int id, const char *payload, size_t size)
+{
+	_output += (char)(size >> 16);
+	_output += (char)(size >> 8);
+	_output += (char)size;
+	_output += (char)type;
+	_output += (char)flags;
+	write32(_output, id & 0x7fffffff);
+	if (size)
+		_output.append(payload, size);
+}
+
+void Http2::writeWindowUpdate(unsigned int id, size_t increment)
+{
+	std::string payload;
+
+	write32(payload, increment);
+	writeFrame(FRAME_WINDOW_UPDATE, 0, id, payload.data(), payload.size());
+}
+
+// a stream error: the stream is closed and, if its request was handed out,
+// reported so its work is dropped
+void Http2::resetStream(unsigned int id, ErrorCode code)
+{
+	std::string payload;
+
+	write32(payload, code);
+	writeFrame(FRAME_RST_STREAM, 0, id, payload.data(), payload.size());
+	std::map<unsigned int, Stream>::iterator it = _streams.find(id);
+	if (it == _streams.end())
+		return;
+	if (it->second.requestDone)
+		_resets.push_back(id);
+	_streams.erase(it);
+}
+
+// a connection error: GOAWAY and the connection closes once that is sent
+bool Http2::fail(ErrorCode code)
+{
+	std::string payload;
+
+	write32(payload, _lastStream);
+	write32(payload, code);
+	writeFrame(FRAME_GOAWAY, 0, 0, payload.data(), payload.size());
+	_failed = true;
+	LOG(LOG_DEBUG) << "http2: connection error " << code;
+	return false;
+}
+
+/***********************************
+ * Getters
+ ***********************************/
+
+std::vector<Http2::Request> Http2::takeRequests()
+{
+	std::vector<Request> requests;
+
+	requests.swap(_requests);
+	return requests;
+}
+
+// streams the client reset, or we did, after their request was handed out
+std::vector<unsigned int> Http2::takeResets()
+{
+	std::vector<unsigned int> resets;
+
+	resets.swap(_resets);
+	return resets;
+}
+
+std::string &Http2::getOutput()
+{
+	return _output;
+}
+
+// nothing more will be sent once the output is out: after a connection
+// error, or a GOAWAY from the client once its open streams are answered
+bool Http2::isFinished() const
+{
+	return _failed || (_goaway && _streams.empty());
+}
+
+std::string Http2::canonicalName(const std::string &name)
+{
+	std::string canonical(name);
+
+	for (size_t i = 0; i < canonical.size(); i++)
+		if (i == 0 || canonical[i - 1] == '-')
+			canonical[i] = std::toupper((unsigned char)canonical[i]);
+	return canonical;
+}
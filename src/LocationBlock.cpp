@@ -4,17 +4,32 @@
 #include <ostream>
 
 LocationBlock::LocationBlock()
-	: ABlock(), _autoindexStatus(false), _allowedMethods()
+	: ABlock(), _autoindexStatus(false), _autoindexFormat("html"), _metricsFormat(), _allowedMethods(),
+	  _proxyHost(), _proxyPort(), _proxyUri(), _proxyConnectTimeout(DEFAULT_PROXY_CONNECT_TIMEOUT),
+	  _proxyReadTimeout(DEFAULT_PROXY_READ_TIMEOUT), _responseCache(false), _responseCacheValid(0),
+	  _microCache(false), _webSocket(), _sessionApi(false), _uploadStore(),
+	  _uploadMaxFileSize(0), _uploadFsync("off"), _uploadDirectio(0),
+	  _deleteRecursive(false), _deleteStatus(false)
 {
 }
 
 LocationBlock::LocationBlock(ServerBlock &serverBlock)
-	: ABlock(serverBlock), _autoindexStatus(false), _allowedMethods()
+	: ABlock(serverBlock), _autoindexStatus(false), _autoindexFormat("html"), _metricsFormat(), _allowedMethods(),
+	  _proxyHost(), _proxyPort(), _proxyUri(), _proxyConnectTimeout(DEFAULT_PROXY_CONNECT_TIMEOUT),
+	  _proxyReadTimeout(DEFAULT_PROXY_READ_TIMEOUT), _responseCache(false), _responseCacheValid(0),
+	  _microCache(false), _webSocket(), _sessionApi(false), _uploadStore(),
+	  _uploadMaxFileSize(0), _uploadFsync("off"), _uploadDirectio(0),
+	  _deleteRecursive(false), _deleteStatus(false)
 {
 }
 
 LocationBlock::LocationBlock(const ServerBlock &serverBlock)
-	: ABlock(serverBlock), _autoindexStatus(false), _allowedMethods()
+	: ABlock(serverBlock), _autoindexStatus(false), _autoindexFormat("html"), _metricsFormat(), _allowedMethods(),
+	  _proxyHost(), _proxyPort(), _proxyUri(), _proxyConnectTimeout(DEFAULT_PROXY_CONNECT_TIMEOUT),
+	  _proxyReadTimeout(DEFAULT_PROXY_READ_TIMEOUT), _responseCache(false), _responseCacheValid(0),
+	  _microCache(false), _webSocket(), _sessionApi(false), _uploadStore(),
+	  _uploadMaxFileSize(0), _uploadFsync("off"), _uploadDirectio(0),
+	  _deleteRecursive(false), _deleteStatus(false)
 {
 }
 
@@ -35,7 +50,25 @@ LocationBlock &LocationBlock::operator=(const LocationBlock &other)
 		ABlock::operator=(other);
 
 		this->_autoindexStatus = other._autoindexStatus;
+		this->_autoindexFormat = other._autoindexFormat;
+		this->_metricsFormat = other._metricsFormat;
 		this->_allowedMethods = other._allowedMethods;
+		this->_proxyHost = other._proxyHost;
+		this->_proxyPort = other._proxyPort;
+		this->_proxyUri = other._proxyUri;
+		this->_proxyConnectTimeout = other._proxyConnectTimeout;
+		this->_proxyReadTimeout = other._proxyReadTimeout;
+		this->_responseCache = other._responseCache;
+		this->_responseCacheValid = other._responseCacheValid;
+		this->_microCache = other._microCache;
+		this->_webSocket = other._webSocket;
+		this->_sessionApi = other._sessionApi;
+		this->_uploadStore = other._uploadStore;
+		this->_uploadMaxFileSize = other._uploadMaxFileSize;
+		this->_uploadFsync = other._uploadFsync;
+		this->_uploadDirectio = other._uploadDirectio;
+		this->_deleteRecursive = other._deleteRecursive;
+		this->_deleteStatus = other._deleteStatus;
 	}
 	return *this;
 }
@@ -45,17 +78,194 @@ void LocationBlock::setAutoindexStatus(bool status)
 	this->_autoindexStatus = status;
 }
 
+void LocationBlock::setAutoindexFormat(std::string format)
+{
+	this->_autoindexFormat = format;
+}
+
+// empty unless the location serves the metrics (stub_status or prometheus)
+void LocationBlock::setMetricsFormat(std::string format)
+{
+	this->_metricsFormat = format;
+}
+
 void LocationBlock::addAllowedMethods(std::string method)
 {
 	this->_allowedMethods.push_back(method);
 }
 
+// empty host unless the location forwards to an upstream; uri replaces the
+// location prefix when set
+void LocationBlock::setProxyPass(const std::string &host, const std::string &port, const std::string &uri)
+{
+	this->_proxyHost = host;
+	this->_proxyPort = port;
+	this->_proxyUri = uri;
+}
+
+void LocationBlock::setProxyConnectTimeout(int seconds)
+{
+	this->_proxyConnectTimeout = seconds;
+}
+
+void LocationBlock::setProxyReadTimeout(int seconds)
+{
+	this->_proxyReadTimeout = seconds;
+}
+
+void LocationBlock::setResponseCache(bool enabled)
+{
+	this->_responseCache = enabled;
+}
+
+// how long a response without Cache-Control freshness is kept; 0 leaves
+// those uncached
+void LocationBlock::setResponseCacheValid(int seconds)
+{
+	this->_responseCacheValid = seconds;
+}
+
+void LocationBlock::setMicroCache(bool enabled)
+{
+	this->_microCache = enabled;
+}
+
+void LocationBlock::setWebSocket(const std::string &mode)
+{
+	this->_webSocket = mode;
+}
+
+void LocationBlock::setSessionApi(bool enabled)
+{
+	this->_sessionApi = enabled;
+}
+
+void LocationBlock::setUploadStore(const std::string &path)
+{
+	this->_uploadStore = path;
+}
+
+void LocationBlock::setUploadMaxFileSize(unsigned long long size)
+{
+	this->_uploadMaxFileSize = size;
+}
+
+void LocationBlock::setUploadFsync(const std::string &policy)
+{
+	this->_uploadFsync = policy;
+}
+
+void LocationBlock::setUploadDirectio(unsigned long long size)
+{
+	this->_uploadDirectio = size;
+}
+
+void LocationBlock::setDeleteRecursive(bool enabled)
+{
+	this->_deleteRecursive = enabled;
+}
+
+void LocationBlock::setDeleteStatus(bool enabled)
+{
+	this->_deleteStatus = enabled;
+}
+
 bool LocationBlock::getAutoindexStatus() const
 {
 	return this->_autoindexStatus;
 }
 
+std::string LocationBlock::getAutoindexFormat() const
+{
+	return this->_autoindexFormat;
+}
+
+const std::string &LocationBlock::getMetricsFormat() const
+{
+	return this->_metricsFormat;
+}
+
 std::vector<std::string> LocationBlock::getAllowedMethods() const
 {
 	return this->_allowedMethods;
 }
+
+const std::string &LocationBlock::getProxyHost() const
+{
+	return this->_proxyHost;
+}
+
+const std::string &LocationBlock::getProxyPort() const
+{
+	return this->_proxyPort;
+}
+
+const std::string &LocationBlock::getProxyUri() const
+{
+	return this->_proxyUri;
+}
+
+int LocationBlock::getProxyConnectTimeout() const
+{
+	return this->_proxyConnectTimeout;
+}
+
+int LocationBlock::getProxyReadTimeout() const
+{
+	return this->_proxyReadTimeout;
+}
+
+bool LocationBlock::getResponseCache() const
+{
+	return this->_responseCache;
+}
+
+int LocationBlock::getResponseCacheValid() const
+{
+	return this->_responseCacheValid;
+}
+
+bool LocationBlock::getMicroCache() const
+{
+	return this->_microCache;
+}
+
+const std::string &LocationBlock::getWebSocket() const
+{
+	return this->_webSocket;
+}
+
+bool LocationBlock::getSessionApi() const
+{
+	return this->_sessionApi;
+}
+
+const std::string &LocationBlock::getUploadStore() const
+{
+	return this->_uploadStore;
+}
+
+unsigned long long LocationBlock::getUploadMaxFileSize() const
+{
+	return this->_uploadMaxFileSize;
+}
+
+const std::string &LocationBlock::getUploadFsync() const
+{
+	return this->_uploadFsync;
+}
+
+unsigned long long LocationBlock::getUploadDirectio() const
+{
+	return this->_uploadDirectio;
+}
+
+bool LocationBlock::getDeleteRecursive() const
+{
+	return this->_deleteRecursive;
+}
+
+bool LocationBlock::getDeleteStatus() const
+{
+	return this->_deleteStatus;
+}
@@ -0,0 +1,68 @@
+#include "Log.hpp"
+#include <unistd.h>
+
+LogLevel Log::_runtimeLevel = DEFAULT_LOG_LEVEL;
+
+/*** Constructors ***/
+
+Log::Log(LogLevel level) : _level(level), _stream()
+{
+}
+
+Log::Log(const Log &src) : _level(src._level), _stream()
+{
+}
+
+Log &Log::operator=(const Log &rhs)
+{
+	(void)rhs;
+	return *this;
+}
+
+/*** Destructors ***/
+
+Log::~Log(void)
+{
+	std::string line = _stream.str();
+
+	line += '\n';
+	if (write(_level <= LOG_WARN ? STDERR_FILENO : STDOUT_FILENO, line.c_str(), line.size()) == -1)
+		return;
+}
+
+/*** Others ***/
+
+std::ostringstream &Log::stream()
+{
+	return _stream;
+}
+
+bool Log::isEnabled(LogLevel level)
+{
+	return level <= _runtimeLevel;
+}
+
+void Log::setLevel(LogLevel level)
+{
+	_runtimeLevel = level;
+}
+
+LogLevel Log::getLevel()
+{
+	return _runtimeLevel;
+}
+
+bool Log::parseLevel(const std::string &name, LogLevel &level)
+{
+	const char *names[] = {"error", "warn", "info", "debug"};
+
+	for (int i = LOG_ERROR; i <= LOG_DEBUG; i++)
+	{
+		if (name == names[i])
+		{
+			level = static_cast<LogLevel>(i);
+			return true;
+		}
+	}
+	return false;
+}
@@ -2,13 +2,26 @@
 #include "ABlock.hpp"
 #include "AutoIndex.hpp"
 #include "Cgi.hpp"
+#include "DeleteJobs.hpp"
+#include "Gzip.hpp"
 #include "LocationBlock.hpp"
+#include "Log.hpp"
+#include "MethodTask.hpp"
+#include "Metrics.hpp"
 #include "RequestException.hpp"
 #include "ServerBlock.hpp"
+#include "SessionStore.hpp"
+#include "Upload.hpp"
 #include "WebServer.hpp"
+#include "WebSocket.hpp"
 #include "colors.h"
 #include "utils.hpp"
+#include <algorithm>
+#include <cerrno>
 #include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
 #include <ctime>
 #include <fcntl.h>
 #include <fstream>
@@ -17,14 +30,16 @@
 #include <ostream>
 #include <sstream>
 #include <string>
+#include <sys/stat.h>
 #include <typeinfo>
 #include <unistd.h>
 #include <utility>
 #include <vector>
 
 const std::map<std::string, MethodIO::MethodPointer> MethodIO::methods = initMethodsMap();
-const std::map<int, std::string> MethodIO::errCodeMessages = initErrCodeMessages();
-const std::map<std::string, std::string> MethodIO::contentTypes = initContentTypes();
+const MimeTypes MethodIO::builtinMimeTypes;
+const MimeTypes *MethodIO::mimeTypes = &MethodIO::builtinMimeTypes;
+GzipCache MethodIO::gzipCache(GZIP_CACHE_SIZE);
 
 std::map<std::string, MethodIO::MethodPointer> MethodIO::initMethodsMap()
 {
@@ -33,43 +48,42 @@ std::map<std::string, MethodIO::MethodPointer> MethodIO::initMethodsMap()
 	m["POST"] = &MethodIO::postMethod;
 	m["HEAD"] = &MethodIO::headMethod;
 	m["DELETE"] = &MethodIO::delMethod;
+	m["PUT"] = &MethodIO::putMethod;
 	return m;
 }
 
-std::map<int, std::string> MethodIO::initErrCodeMessages()
-{
-	std::map<int, std::string> m;
-	m[200] = "OK";
-	m[201] = "Created";
-	m[204] = "No Content";
-	m[301] = "Moved Permanently";
-	m[302] = "Found";
-	m[303] = "See Other";
-	m[400] = "Bad Request";
-	m[403] = "Forbidden";
-	m[404] = "Not Found";
-	m[405] = "Method Not Allowed";
-	m[408] = "Request Timeout";
-	m[409] = "Conflict";
-	m[413] = "Payload Too Large";
-	m[415] = "Unsupported Media Type";
-	m[500] = "Internal Server Error";
-	return m;
-}
+// status lines are fully rendered at compile time, sorted by code
+#define STATUS_LINE(code, msg) {code, msg, "HTTP/1.1 " #code " " msg "\r\n", sizeof("HTTP/1.1 " #code " " msg "\r\n") - 1}
 
-std::map<std::string, std::string> MethodIO::initContentTypes()
-{
-	std::map<std::string, std::string> m;
-	m["txt"] = "text/plain";
-	m["html"] = "text/html";
-	m["css"] = "text/css";
-	m["js"] = "text/javascript";
-	m["png"] = "image/png";
-	m["ico"] = "image/ico";
-	m["cpp"] = "text/cpp";
+const MethodIO::StatusLine MethodIO::statusLines[] = {
+	STATUS_LINE(200, "OK"),
+	STATUS_LINE(201, "Created"),
+	STATUS_LINE(202, "Accepted"),
+	STATUS_LINE(204, "No Content"),
+	STATUS_LINE(206, "Partial Content"),
+	STATUS_LINE(301, "Moved Permanently"),
+	STATUS_LINE(302, "Found"),
+	STATUS_LINE(303, "See Other"),
+	STATUS_LINE(304, "Not Modified"),
+	STATUS_LINE(400, "Bad Request"),
+	STATUS_LINE(403, "Forbidden"),
+	STATUS_LINE(404, "Not Found"),
+	STATUS_LINE(405, "Method Not Allowed"),
+	STATUS_LINE(408, "Request Timeout"),
+	STATUS_LINE(409, "Conflict"),
+	STATUS_LINE(411, "Length Required"),
+	STATUS_LINE(413, "Payload Too Large"),
+	STATUS_LINE(415, "Unsupported Media Type"),
+	STATUS_LINE(416, "Range Not Satisfiable"),
+	STATUS_LINE(500, "Internal Server Error"),
+	STATUS_LINE(502, "Bad Gateway"),
+	STATUS_LINE(503, "Service Unavailable"),
+	STATUS_LINE(504, "Gateway Timeout"),
+};
 
-	return m;
-}
+#undef STATUS_LINE
+
+const size_t MethodIO::statusLinesCount = sizeof(MethodIO::statusLines) / sizeof(MethodIO::statusLines[0]);
 
 MethodIO::MethodIO(void) : IOAdaptor()
 {
@@ -93,26 +107,47 @@ MethodIO::~MethodIO(void)
 std::string MethodIO::getMethod(ServerBlock &block, MethodIO::rInfo &rqi, MethodIO::rInfo &rsi)
 {
 	rsi.body = readFile(rqi, rsi, block);
-	rsi.headers["Content-Length"] = utils::to_string(rsi.body.size());
+	if (rsi.task)
+		return "";
+	if (rsi.code != 304)
+		rsi.headers["Content-Length"] = utils::to_string(rsi.body.size());
 	std::string ext = rqi.path.substr(rqi.path.find_last_of(".") + 1);
 	if (rqi.exist == true && (ext == "py" || ext == "cgi"))
-		return rsi.body;
+		return compressCgiOutput(rqi, block, rsi.body);
 	return (generateResponse(rsi.code, rsi));
 }
 
 std::string MethodIO::headMethod(ServerBlock &block, MethodIO::rInfo &rqi, MethodIO::rInfo &rsi)
 {
 	std::string body = readFile(rqi, rsi, block);
-	rsi.headers["Content-Type"] = getType(rqi.path);
+	if (rsi.task)
+		return "";
+	if (rsi.code == 304)
+		return (generateResponse(304, rsi));
+	// the status and headers a GET gets, 206 and 416 included
+	if (!rsi.code && !rsi.headers.count("Content-Type"))
+		rsi.headers["Content-Type"] = getType(rqi.path);
 	rsi.headers["Content-Length"] = utils::to_string(body.size());
-	return (generateResponse(200, rsi));
+	return (generateResponse(rsi.code ? rsi.code : 200, rsi));
 }
 
+// unlinks the file (or link) without opening it, or removes an empty
+// directory; the trees of delete_recursive locations are removed by the event
+// loop's DeleteJobs instead
 std::string MethodIO::delMethod(ServerBlock &block, MethodIO::rInfo &rqi, MethodIO::rInfo &rsi)
 {
-	writeFile(rqi, block, false);
-	if (std::remove(rqi.path.c_str()))
+	std::pair<std::string, LocationBlock> location = block.getLocationBlockPair(rqi.queryPath);
+	struct stat st;
+
+	if (!utils::find(location.second.getAllowedMethods(), rqi.request[0]))
+		throw RequestException("Method Not Allowed", 405);
+	rqi.path = locationPath(rqi.queryPath, location);
+	if (rqi.path.empty())
 		throw RequestException("Cannot Delete File", 403);
+	if (lstat(rqi.path.c_str(), &st))
+		throw RequestException("File doesn't exist", errno == ENOENT || errno == ENOTDIR ? 404 : 403);
+	if (S_ISDIR(st.st_mode) ? rmdir(rqi.path.c_str()) : unlink(rqi.path.c_str()))
+		throw RequestException("Cannot Delete File", errno == ENOTEMPTY || errno == EEXIST ? 409 : 403);
 	return generateResponse(204, rsi);
 }
 
@@ -132,15 +167,17 @@ std::string MethodIO::postMethod(ServerBlock &block, MethodIO::rInfo &rqi, Metho
 			for (std::map<std::string, std::string>::const_iterator it = rqi.headers.begin(); it != rqi.headers.end();
 				 it++)
 			{
-				std::cout << "head: " << it->first << ": " << it->second << std::endl;
+				LOG(LOG_DEBUG) << "head: " << it->first << ": " << it->second;
 			}
 
 			Cgi cgi(rqi.request, rqi.headers, rqi.path, rqi.body, rqi.query);
+			cgi.setSession(rqi.sessionId, rqi.sessionUser);
+			cgi.setSessionApi(block.getSessionApiUrl(), block.getSessionApiHost());
 			if (cgi.runCgi() == 200)
 			{
 				rqi.exist = true;
 				rsi.body = cgi.getBody();
-				return rsi.body;
+				return compressCgiOutput(rqi, block, rsi.body);
 			}
 			else
 				throw RequestException("Internal Server Error", 500);
@@ -153,12 +190,100 @@ std::string MethodIO::postMethod(ServerBlock &block, MethodIO::rInfo &rqi, Metho
 	return generateResponse(200, rsi);
 }
 
+// a body that was buffered whole, e.g. over HTTP/2; on HTTP/1.1 the event
+// loop streams it to the file instead. Only a body whose Content-Length
+// arrived whole replaces the file: a chunked one is not decoded, and would
+// otherwise leave the target empty.
+std::string MethodIO::putMethod(ServerBlock &block, MethodIO::rInfo &rqi, MethodIO::rInfo &rsi)
+{
+	std::pair<std::string, LocationBlock> location = block.getLocationBlockPair(rqi.queryPath);
+	const std::string *contentLength = NULL;
+	(void)rsi;
+
+	if (!utils::find(location.second.getAllowedMethods(), rqi.request[0]))
+		throw RequestException("Method Not Allowed", 405);
+	for (std::map<std::string, std::string>::const_iterator it = rqi.headers.begin(); it != rqi.headers.end(); it++)
+	{
+		if (!strcasecmp(it->first.c_str(), "Transfer-Encoding"))
+			throw RequestException("Length Required", 411);
+		if (!strcasecmp(it->first.c_str(), "Content-Length"))
+			contentLength = &it->second;
+	}
+	if (!contentLength || contentLength->empty() || contentLength->find_first_not_of("0123456789") != std::string::npos)
+		throw RequestException("Length Required", 411);
+	if (strtoull(contentLength->c_str(), NULL, 10) != rqi.body.size())
+		throw RequestException("Incomplete body", 400);
+	std::string target = putTarget(rqi.queryPath, location);
+	if (target.empty())
+		throw RequestException("Not a file path", 409);
+	Upload upload(rqi.request[0] + " " + rqi.request[1], location.second, rqi.body.size());
+	upload.setTarget(target);
+	upload.receive(rqi.body.data(), rqi.body.size());
+	upload.finish();
+	return uploadResponse(upload, &block);
+}
+
+// the file a PUT writes: the path under the location's root, as a GET reads
+// it. Empty for a directory or a path that climbs out of the root.
+std::string MethodIO::putTarget(const std::string &path, const std::pair<std::string, LocationBlock> &location)
+{
+	std::string target = locationPath(path.substr(0, path.find('?')), location);
+	struct stat st;
+
+	if (target.empty() || target[target.size() - 1] == '/' || (!stat(target.c_str(), &st) && S_ISDIR(st.st_mode)))
+		return "";
+	return target;
+}
+
+// the path under the location's root, as a GET reads it; empty for the root
+// itself (however many "/" and "." segments name it) or a path that climbs
+// out of it
+std::string MethodIO::locationPath(const std::string &path, const std::pair<std::string, LocationBlock> &location)
+{
+	std::string file = utils::splitPair(path, location.first).second;
+	std::string segments = "/" + file + "/";
+	bool named = false;
+
+	if (segments.find("/../") != std::string::npos)
+		return "";
+	for (size_t start = 1; start < segments.size(); start = segments.find('/', start) + 1)
+	{
+		size_t end = segments.find('/', start);
+		if (end > start && segments.compare(start, end - start, ".") != 0)
+			named = true;
+	}
+	if (!named)
+		return "";
+	return location.second.getRootDirectory() + "/" + file;
+}
+
+// 201 with the stored names, one per line, for a multipart upload; 201 or
+// 204 for a PUT, as the file was made or replaced
+std::string MethodIO::uploadResponse(const Upload &upload, const ServerBlock *block)
+{
+	MethodIO::rInfo rsi;
+
+	if (upload.getError())
+		return errorResponse(upload.getError(), block);
+	rsi.headers["Date"] = getDate();
+	if (upload.isPut() && !upload.isCreated())
+		return generateResponse(204, rsi);
+	if (!upload.isPut())
+	{
+		const std::vector<std::string> &files = upload.getFiles();
+		for (size_t i = 0; i < files.size(); i++)
+			rsi.body += files[i] + "\n";
+		rsi.headers["Content-Type"] = "text/plain";
+	}
+	rsi.headers["Content-Length"] = utils::to_string(rsi.body.size());
+	return generateResponse(201, rsi);
+}
 
 std::string MethodIO::getMessageToSend(WebServer &ws, std::string port)
 {
 	MethodIO::rInfo requestInfo;
 	MethodIO::rInfo responseInfo;
-	ServerBlock block;
+	ServerBlock *block = NULL;
 
 	try
 	{
@@ -166,82 +291,355 @@ std::string MethodIO::getMessageToSend(WebServer &ws, std::string port)
 		if (requestInfo.request[2] != "HTTP/1.1")
 			return generateResponse(400, responseInfo);
 		requestInfo.port = port;
-		block = getServerBlock(requestInfo, ws);
-		if (block.getClientMaxBodySize() < (int)requestInfo.body.size() && block.getClientMaxBodySize() != 0)
+		block = &getServerBlock(requestInfo, ws);
+		if (block->getClientMaxBodySize() < (int)requestInfo.body.size() && block->getClientMaxBodySize() != 0)
 			throw RequestException("Payload Too Large", 413);
 		std::string method = requestInfo.request[0];
+		std::string key;
+		bool upgrade = (block->hasWebSocketLocations() || block->hasProxyLocations()) &&
+					   WebSocket::isUpgrade(requestInfo.headers, key);
+		if ((method == "GET" || method == "HEAD") && !upgrade && block->hasResponseCacheLocations())
+		{
+			std::string cached;
+			// a cached copy, or nothing while the same response is fetched
+			if (ws.cacheLookup(requestInfo, *block, cached))
+				return cached;
+		}
+		if (block->hasProxyLocations())
+		{
+			std::pair<std::string, LocationBlock> location = block->getLocationBlockPair(requestInfo.queryPath);
+			if (!location.second.getProxyHost().empty())
+			{
+				std::vector<std::string> allowed = location.second.getAllowedMethods();
+				if (!allowed.empty() && !utils::find(allowed, method))
+					throw RequestException("Method Not Allowed", 405);
+				// the event loop talks to the upstream and streams its answer
+				ws.proxy(proxyRequest(requestInfo, location.first, location.second, upgrade));
+				return "";
+			}
+		}
+		if (block->hasWebSocketLocations())
+		{
+			std::pair<std::string, LocationBlock> location = block->getLocationBlockPair(requestInfo.queryPath);
+			const std::string &mode = location.second.getWebSocket();
+			if (!mode.empty())
+			{
+				std::vector<std::string> allowed = location.second.getAllowedMethods();
+				if (!allowed.empty() && !utils::find(allowed, method))
+					throw RequestException("Method Not Allowed", 405);
+				if (method != "GET" || !upgrade)
+					throw RequestException("Bad Request", 400);
+				// the event loop takes the connection over once the 101 is out;
+				// a broadcast reaches the connections of the same location
+				ws.webSocket(mode == "broadcast" ? port + " " + location.first : "");
+				return WebSocket::handshake(key);
+			}
+		}
+		if (block->hasSessionApiLocations())
+		{
+			std::pair<std::string, LocationBlock> location = block->getLocationBlockPair(requestInfo.queryPath);
+			if (location.second.getSessionApi())
+			{
+				std::vector<std::string> allowed = location.second.getAllowedMethods();
+				if (!allowed.empty() && !utils::find(allowed, method))
+					throw RequestException("Method Not Allowed", 405);
+				return sessionApi(ws.getSessions(), requestInfo, location.first);
+			}
+		}
+		if (block->hasDeleteJobLocations())
+		{
+			std::pair<std::string, LocationBlock> location = block->getLocationBlockPair(requestInfo.queryPath);
+			const std::string &path = requestInfo.queryPath;
+			std::vector<std::string> allowed = location.second.getAllowedMethods();
+			if (location.second.getDeleteStatus())
+			{
+				if (!allowed.empty() && !utils::find(allowed, method))
+					throw RequestException("Method Not Allowed", 405);
+				return deleteStatus(ws.getDeletes(), requestInfo, location.first);
+			}
+			// the jobs belong to the event loop
+			if (method == "DELETE" && location.second.getDeleteRecursive() && path[path.size() - 1] == '/')
+			{
+				if (!utils::find(allowed, method))
+					throw RequestException("Method Not Allowed", 405);
+				return deleteTree(ws.getDeletes(), requestInfo, location, block->getDeleteStatusLocation());
+			}
+		}
+		// looked up here, the store belongs to the event loop; a CGI script
+		// reads them as SESSION_ID and SESSION_USER
+		if (ws.getSessions().size())
+		{
+			std::string id = SessionStore::cookieId(requestInfo.headers);
+			const std::string *user = id.empty() ? NULL : ws.getSessions().find(id, time(NULL));
+			if (user)
+			{
+				requestInfo.sessionId = id;
+				requestInfo.sessionUser = *user;
+			}
+		}
 		responseInfo.headers["Date"] = getDate();
 		std::map<std::string, MethodPointer>::const_iterator it = methods.find(method);
-		if (it != methods.end())
-			return (it->second)(block, requestInfo, responseInfo);
-		throw RequestException("Method Not Allowed", 405);
+		if (it == methods.end())
+			throw RequestException("Method Not Allowed", 405);
+		// the handler touches the filesystem, so it runs on the worker pool and
+		// its response comes back through the event loop
+		ws.defer(new MethodTask(it->second, *block, requestInfo, responseInfo));
+		return "";
 	}
 	catch (RequestException &e)
 	{
 		int code = e.getCode();
-		std::cerr << BRED << "Error: " << e.what() << std::endl
-				  << "Error Code: " << code << " " << errCodeMessages.find(code)->second << RESET << std::endl;
-		if (block.getRootDirectory() == "")
-			return generateResponse(code, responseInfo);
-		std::string path = block.getRootDirectory() + "/" + block.getErrorPages()[code];
+		LOG(LOG_DEBUG) << BRED << "Error: " << e.what() << ", code: " << code << " " << getMessage(code) << RESET;
+		return errorResponse(code, block);
+	}
+}
+
+// the request as the upstream gets it: the location prefix replaced by the
+// proxy_pass uri (when it has one), Host set to the upstream (its name for an
+// upstream block) and the hop-by-hop headers dropped. A websocket handshake
+// keeps asking for the upgrade, and the connection becomes a tunnel on 101.
+Proxy::Request MethodIO::proxyRequest(MethodIO::rInfo &rqi, const std::string &prefix, const LocationBlock &location,
+									  bool upgrade)
+{
+	static const char *hopByHop[] = {"Connection", "Keep-Alive", "Proxy-Connection", "TE",	   "Trailer",
+									 "Upgrade",	   "Transfer-Encoding", "Expect",	  "Host", "Content-Length"};
+	Proxy::Request request;
+	std::string uri = rqi.request[1];
+
+	if (!location.getProxyUri().empty())
+		uri = location.getProxyUri() + uri.substr(prefix.size() < uri.size() ? prefix.size() : uri.size());
+	request.host = location.getProxyHost();
+	request.port = location.getProxyPort();
+	request.connectTimeout = location.getProxyConnectTimeout();
+	request.readTimeout = location.getProxyReadTimeout();
+	request.headRequest = rqi.request[0] == "HEAD";
+	request.head = rqi.request[0] + " " + uri + " HTTP/1.1\r\nHost: " + request.host;
+	if (!request.port.empty() && request.port != "80")
+		request.head += ":" + request.port;
+	for (std::map<std::string, std::string>::iterator it = rqi.headers.begin(); it != rqi.headers.end(); it++)
+	{
+		size_t i = 0;
+		while (i < sizeof(hopByHop) / sizeof(hopByHop[0]) && strcasecmp(it->first.c_str(), hopByHop[i]))
+			i++;
+		if (i == sizeof(hopByHop) / sizeof(hopByHop[0]))
+			request.head += "\r\n" + it->first + ": " + it->second;
+	}
+	if (upgrade)
+		request.head += "\r\nUpgrade: websocket\r\nConnection: Upgrade";
+	request.upgrade = upgrade;
+	request.body = rqi.body;
+	return request;
+}
+
+// a session_api location: POST to it with the user name as the body starts
+// a session and answers its id, GET and DELETE of <location>/<id> read and end
+// one
+std::string MethodIO::sessionApi(SessionStore &sessions, MethodIO::rInfo &rqi, const std::string &prefix)
+{
+	MethodIO::rInfo rsi;
+	const std::string &method = rqi.request[0];
+	std::string id = rqi.queryPath.substr(prefix.size() < rqi.queryPath.size() ? prefix.size() : rqi.queryPath.size());
+	int code = 200;
+
+	if (!id.empty() && id[0] == '/')
+		id.erase(0, 1);
+	if (id.empty() ? method != "POST" : method != "GET" && method != "DELETE")
+		throw RequestException("Method Not Allowed", 405);
+	rsi.headers["Date"] = getDate();
+	rsi.headers["Cache-Control"] = "no-store";
+	if (method == "POST")
+	{
+		if (!SessionStore::isValidUser(rqi.body))
+			throw RequestException("Invalid user name", 400);
+		id = sessions.create(rqi.body, time(NULL));
+		if (id.empty())
+			throw RequestException("Cannot generate a session id", 500);
+		rsi.headers["Location"] = prefix + (prefix[prefix.size() - 1] == '/' ? "" : "/") + id;
+		rsi.body = id;
+		code = 201;
+	}
+	else if (method == "GET")
+	{
+		const std::string *user = sessions.find(id, time(NULL));
+		if (!user)
+			throw RequestException("No such session", 404);
+		rsi.body = *user;
+	}
+	else if (!sessions.remove(id))
+		throw RequestException("No such session", 404);
+	else
+		return generateResponse(204, rsi);
+	rsi.headers["Content-Type"] = "text/plain";
+	rsi.headers["Content-Length"] = utils::to_string(rsi.body.size());
+	return generateResponse(code, rsi);
+}
+
+// a DELETE of <dir>/ on a delete_recursive location: the tree is removed in
+// the background and the 202 points to its status on the server's
+// delete_status location, when there is one
+std::string MethodIO::deleteTree(DeleteJobs &deletes, MethodIO::rInfo &rqi,
+								 const std::pair<std::string, LocationBlock> &location, const std::string &status)
+{
+	MethodIO::rInfo rsi;
+	std::string path = locationPath(rqi.queryPath, location);
+
+	if (path.empty())
+		throw RequestException("Cannot Delete File", 403);
+	const DeleteJobs::Job &job = deletes.start(path.substr(0, path.size() - 1), rqi.queryPath);
+	rsi.headers["Date"] = getDate();
+	rsi.headers["Cache-Control"] = "no-store";
+	if (!status.empty())
+		rsi.headers["Location"] = status + (status[status.size() - 1] == '/' ? "" : "/") + utils::to_string(job.id);
+	rsi.body = DeleteJobs::render(job);
+	rsi.headers["Content-Type"] = "application/json";
+	rsi.headers["Content-Length"] = utils::to_string(rsi.body.size());
+	return generateResponse(202, rsi);
+}
+
+// a delete_status location: GET of <location>/<id> answers the progress of a
+// recursive DELETE
+std::string MethodIO::deleteStatus(DeleteJobs &deletes, MethodIO::rInfo &rqi, const std::string &prefix)
+{
+	MethodIO::rInfo rsi;
+	std::string id = rqi.queryPath.substr(prefix.size() < rqi.queryPath.size() ? prefix.size() : rqi.queryPath.size());
+
+	if (!id.empty() && id[0] == '/')
+		id.erase(0, 1);
+	if (rqi.request[0] != "GET")
+		throw RequestException("Method Not Allowed", 405);
+	char *end = NULL;
+	unsigned long n = id.empty() || id[0] == '-' ? 0 : strtoul(id.c_str(), &end, 10);
+	const DeleteJobs::Job *job = n && !*end ? deletes.find(n) : NULL;
+	if (!job)
+		throw RequestException("No such delete job", 404);
+	rsi.headers["Date"] = getDate();
+	rsi.headers["Cache-Control"] = "no-store";
+	rsi.body = DeleteJobs::render(*job);
+	rsi.headers["Content-Type"] = "application/json";
+	rsi.headers["Content-Length"] = utils::to_string(rsi.body.size());
+	return generateResponse(200, rsi);
+}
+
+std::string MethodIO::errorResponse(int code, const ServerBlock *block)
+{
+	const ServerBlock::ErrorResponse *page = block ? block->findErrorResponse(code) : NULL;
+	if (!page)
+	{
+		MethodIO::rInfo rsi;
+		return generateResponse(code, rsi);
+	}
+	std::string res;
+	std::string date = getDate();
+	res.reserve(page->head.size() + date.size() + page->body.size() + 8);
+	res.append(page->head).append("Date: ").append(date).append("\r\n").append(page->body);
+	return res;
+}
+
+// renders every configured error page into a ready-to-send response once, so
+// bad requests are answered from memory; only the Date header is added later
+void MethodIO::loadErrorPages(ServerBlock &block)
+{
+	std::map<int, std::string> pages = block.getErrorPages();
+
+	block.clearErrorResponses();
+	for (std::map<int, std::string>::iterator it = pages.begin(); it != pages.end(); it++)
+	{
+		MethodIO::rInfo rsi;
+		std::string path = block.getRootDirectory() + "/" + it->second;
 		std::ifstream file(path.c_str());
 		std::ostringstream oss;
-		oss << file.rdbuf();
-		responseInfo.body = oss.str();
-		responseInfo.headers["Content-Type"] = getType(path);
-		responseInfo.headers["Content-Length"] = utils::to_string(responseInfo.body.size());
-		return generateResponse(code, responseInfo);
+
+		if (!file.is_open())
+			LOG(LOG_WARN) << BRED << "Error page not found: " << path << RESET;
+		else
+			oss << file.rdbuf();
+		rsi.body = oss.str();
+		rsi.headers["Content-Type"] = getType(path);
+		rsi.headers["Content-Length"] = utils::to_string(rsi.body.size());
+		std::string res = generateResponse(it->first, rsi);
+		size_t headEnd = res.find("\r\n\r\n") + 2;
+		block.setErrorResponse(it->first, res.substr(0, headEnd), res.substr(headEnd));
+	}
+}
+
+const MethodIO::StatusLine *MethodIO::findStatusLine(int code)
+{
+	size_t low = 0;
+	size_t high = statusLinesCount;
+
+	while (low < high)
+	{
+		size_t mid = (low + high) / 2;
+		if (statusLines[mid].code == code)
+			return &statusLines[mid];
+		if (statusLines[mid].code < code)
+			low = mid + 1;
+		else
+			high = mid;
 	}
+	return NULL;
 }
 
 std::string MethodIO::getMessage(int code)
 {
-	std::map<int, std::string>::const_iterator val = errCodeMessages.find(code);
-	if (val != errCodeMessages.end())
-		return val->second;
+	const StatusLine *status = findStatusLine(code);
+	if (status)
+		return status->message;
 	return "Undefined";
 }
 
+// HTTP dates are always GMT; the string only changes once per second so each
+// thread caches it and rebuilds it lazily when the clock moves on, without a
+// lock shared by the workers
 std::string MethodIO::getDate()
 {
-	char date[100];
-
+	static __thread time_t cachedTime = -1;
+	static __thread char cachedDate[32];
 	time_t now = time(0);
-	tm *t = localtime(&now);
-	std::strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S %Z", t);
-	std::string dateStr(date);
-	return (dateStr);
+
+	if (now != cachedTime)
+	{
+		std::string date = utils::httpDate(now);
+		date.copy(cachedDate, sizeof(cachedDate) - 1);
+		cachedDate[std::min(date.size(), sizeof(cachedDate) - 1)] = '\0';
+		cachedTime = now;
+	}
+	return cachedDate;
 }
 
-std::string MethodIO::getType(std::string path)
+const std::string &MethodIO::getType(const std::string &path)
 {
-	std::string p;
-	std::vector<std::string> tokens = utils::split(path, '.');
-	std::string extension = tokens[tokens.size() - 1];
+	return __atomic_load_n(&mimeTypes, __ATOMIC_ACQUIRE)->getType(path);
+}
 
-	if (tokens.size() == 1)
-		extension = "txt";
-	std::map<std::string, std::string>::const_iterator it = contentTypes.find(extension);
-	if (it == contentTypes.end())
-		return "text/plain";
-	return it->second;
+void MethodIO::setMimeTypes(const MimeTypes *types)
+{
+	__atomic_store_n(&mimeTypes, types, __ATOMIC_RELEASE);
 }
 
 std::string MethodIO::generateResponse(int code, MethodIO::rInfo &rsi)
 {
-	std::ostringstream ss;
+	std::string res;
+	const StatusLine *status = findStatusLine(code);
 	std::map<std::string, std::string>::iterator it;
+	size_t size = 64 + rsi.body.size();
 
-	ss << "HTTP/1.1 " << code << " " << getMessage(code) << "\r\n";
 	for (it = rsi.headers.begin(); it != rsi.headers.end(); it++)
-		ss << it->first << ": " << it->second << "\r\n";
-	ss << "\r\n" << rsi.body;
-	return (ss.str());
+		size += it->first.size() + it->second.size() + 4;
+	res.reserve(size);
+	if (status)
+		res.append(status->line, status->length);
+	else
+		res.append("HTTP/1.1 ").append(utils::to_string(code)).append(" Undefined\r\n");
+	for (it = rsi.headers.begin(); it != rsi.headers.end(); it++)
+		res.append(it->first).append(": ", 2).append(it->second).append("\r\n", 2);
+	res.append("\r\n", 2).append(rsi.body);
+	return res;
 }
 
-ServerBlock MethodIO::getServerBlock(MethodIO::rInfo &rqi, WebServer &ws)
+ServerBlock &MethodIO::getServerBlock(MethodIO::rInfo &rqi, WebServer &ws)
 {
-	std::vector<ServerBlock> servers = ws.getServers();
+	std::vector<ServerBlock> &servers = ws.getServers();
 	std::string host = utils::splitPair(rqi.headers["Host"], ":").first;
 	for (std::vector<ServerBlock>::iterator it = servers.begin(); it != servers.end(); it++)
 	{
@@ -256,13 +654,14 @@ std::string MethodIO::readFile(MethodIO::rInfo &rqi, MethodIO::rInfo &rsi, Serve
 	// try all indexes in the config
 	std::pair<std::string, LocationBlock> blockPair = block.getLocationBlockPair(rqi.queryPath);
 	ABlock *ablock = &blockPair.second;
-	std::cout << "a:" << ablock << std::endl;
+	LOG(LOG_DEBUG) << "a:" << ablock;
 	LocationBlock *locationBLock = dynamic_cast<LocationBlock *>(ablock);
 	ServerBlock *serverBLock = dynamic_cast<ServerBlock *>(ablock);
-	std::cout << "a:" << locationBLock << std::endl;
-	std::cout << "a:" << serverBLock << std::endl;
+	LOG(LOG_DEBUG) << "a:" << locationBLock;
+	LOG(LOG_DEBUG) << "a:" << serverBLock;
+	// HEAD is allowed where GET is
 	if (locationBLock)
-		if (!utils::find(locationBLock->getAllowedMethods(), rqi.request[0]))
+		if (!utils::find(locationBLock->getAllowedMethods(), rqi.request[0] == "HEAD" ? "GET" : rqi.request[0]))
 			throw RequestException("Method Not Allowed", 405);
 	std::vector<std::string> index = blockPair.second.getIndex();
 	std::string root = blockPair.second.getRootDirectory();
@@ -278,16 +677,26 @@ std::string MethodIO::readFile(MethodIO::rInfo &rqi, MethodIO::rInfo &rsi, Serve
 		rsi.code = redir.first;
 		return "";
 	}
+	else if (!blockPair.second.getMetricsFormat().empty())
+	{
+		rsi.headers["Content-Type"] = Metrics::getContentType(blockPair.second.getMetricsFormat());
+		rsi.headers["Cache-Control"] = "no-store";
+		return Metrics::render(blockPair.second.getMetricsFormat());
+	}
 	else if (rqi.queryPath.at(rqi.queryPath.length() - 1) == '/' && rqi.queryPath.length() > 1)
 	{
-		AutoIndex indexes(path, rqi.queryPath);
-		rsi.headers["Content-Type"] = "text/html";
-		return indexes.getBody();
+		std::string format = blockPair.second.getAutoindexFormat();
+		std::string body;
+		rsi.headers["Content-Type"] = AutoIndex::getContentType(format);
+		if (AutoIndex::findCached(path, format, body))
+			return body;
+		rsi.task = new AutoIndex(path, rqi.queryPath, format, block);
+		return "";
 	}
 	else if (rqi.queryPath != blockPair.first)
 	{
 		rqi.path = path;
-		std::cout << "path: " << path << std::endl;
+		LOG(LOG_DEBUG) << "path: " << path;
 		if (access(path.c_str(), F_OK))
 			throw RequestException("File doesn't exist", 404);
 		if (access(path.c_str(), R_OK))
@@ -297,6 +706,8 @@ std::string MethodIO::readFile(MethodIO::rInfo &rqi, MethodIO::rInfo &rsi, Serve
 		if (access(path.c_str(), R_OK) == 0 && (ext == "py" || ext == "cgi"))
 		{
 			Cgi cgi(rqi.request, rqi.headers, rqi.path, rqi.body, rqi.query);
+			cgi.setSession(rqi.sessionId, rqi.sessionUser);
+			cgi.setSessionApi(block.getSessionApiUrl(), block.getSessionApiHost());
 			if (cgi.runCgi() == 200)
 			{
 				rqi.exist = true;
@@ -325,14 +736,357 @@ std::string MethodIO::readFile(MethodIO::rInfo &rqi, MethodIO::rInfo &rsi, Serve
 		if (i == index.size())
 			throw RequestException("File doesn't exist", 404);
 	}
+	LocationBlock &location = blockPair.second;
+	std::string filePath = rqi.path;
+	std::string encoding = findStaticVariant(rqi, location, filePath);
 	std::ostringstream oss;
+	struct stat st;
 
+	if (!encoding.empty())
+	{
+		file.close();
+		file.clear();
+		file.open(filePath.c_str());
+		rsi.headers["Content-Encoding"] = encoding;
+	}
+	bool compressible = (location.getGzip() || location.getGzipStatic()) && Gzip::isCompressibleType(getType(rqi.path));
+	if (compressible)
+		rsi.headers["Vary"] = "Accept-Encoding";
+	if (stat(filePath.c_str(), &st) == 0)
+	{
+		std::map<std::string, std::string>::iterator range = rqi.headers.find("Range");
+		bool gzip = compressible && encoding.empty() && location.getGzip() && range == rqi.headers.end() &&
+					st.st_size >= location.getGzipMinLength() && Gzip::isAccepted(rqi.headers["Accept-Encoding"], "gzip");
+		if (isNotModified(rqi, rsi, location, st, gzip ? "-gzip" : ""))
+			return "";
+		rsi.headers["Content-Type"] = getType(rqi.path);
+		if (gzip)
+			return compressFile(file, rsi, location.getGzipCompLevel());
+		rsi.headers["Accept-Ranges"] = "bytes";
+		std::string body;
+		if (range != rqi.headers.end() && (rqi.request[0] == "GET" || rqi.request[0] == "HEAD") &&
+			isRangeApplicable(rqi, rsi) &&
+			readRanges(file, range->second, st.st_size, rsi, body))
+			return body;
+	}
 	rsi.headers["Content-Type"] = getType(rqi.path);
 	oss << file.rdbuf();
 
 	return oss.str();
 }
 
+// gzip_static: swaps filePath for a precompressed sibling (file.br, then
+// file.gz) when the client accepts it and returns the Content-Encoding to send
+std::string MethodIO::findStaticVariant(MethodIO::rInfo &rqi, const ABlock &block, std::string &filePath)
+{
+	if (!block.getGzipStatic() || !Gzip::isCompressibleType(getType(filePath)))
+		return "";
+	std::map<std::string, std::string>::iterator it = rqi.headers.find("Accept-Encoding");
+	if (it == rqi.headers.end())
+		return "";
+	if (Gzip::isAccepted(it->second, "br") && access((filePath + ".br").c_str(), R_OK) == 0)
+	{
+		filePath += ".br";
+		return "br";
+	}
+	if (Gzip::isAccepted(it->second, "gzip") && access((filePath + ".gz").c_str(), R_OK) == 0)
+	{
+		filePath += ".gz";
+		return "gzip";
+	}
+	return "";
+}
+
+// compressed bodies are cached by ETag so hot files are only deflated once
+std::string MethodIO::compressFile(std::ifstream &file, MethodIO::rInfo &rsi, int level)
+{
+	std::string key = rsi.headers["ETag"] + utils::to_string(level);
+	std::string cached;
+
+	rsi.headers["Content-Encoding"] = "gzip";
+	if (gzipCache.find(key, cached))
+		return cached;
+	std::ostringstream oss;
+	oss << file.rdbuf();
+	std::string compressed = Gzip::compress(oss.str(), level);
+	gzipCache.insert(key, compressed);
+	return compressed;
+}
+
+// CGI output arrives as a complete HTTP response; when gzip is on its body is
+// run through the gzip encoder and the framing headers are rewritten. Output
+// whose header block cannot be parsed is passed through untouched.
+std::string MethodIO::compressCgiOutput(MethodIO::rInfo &rqi, ServerBlock &block, const std::string &output)
+{
+	LocationBlock location = block.getLocationBlockPair(rqi.queryPath).second;
+	if (!location.getGzip() || !Gzip::isAccepted(rqi.headers["Accept-Encoding"], "gzip"))
+		return output;
+
+	size_t headerEnd = std::string::npos;
+	size_t bodyStart = 0;
+	const char *separators[3] = {"\r\n\r\n", "\n\r\n", "\n\n"};
+	for (int i = 0; i < 3; i++)
+	{
+		size_t pos = output.find(separators[i]);
+		if (pos != std::string::npos && pos < headerEnd)
+		{
+			headerEnd = pos;
+			bodyStart = pos + strlen(separators[i]);
+		}
+	}
+	if (headerEnd == std::string::npos ||
+		output.size() - bodyStart < (size_t)location.getGzipMinLength())
+		return output;
+
+	std::vector<std::string> lines = utils::split(output.substr(0, headerEnd), '\n');
+	std::string headers;
+	bool compressible = false;
+	for (size_t i = 0; i < lines.size(); i++)
+	{
+		std::string line = lines[i];
+		if (!line.empty() && line[line.size() - 1] == '\r')
+			line.erase(line.size() - 1);
+		size_t colon = line.find(':');
+		std::string name = line.substr(0, colon);
+		for (size_t j = 0; j < name.size(); j++)
+			name[j] = tolower(name[j]);
+		if (i > 0 && (colon == std::string::npos || name.find(' ') != std::string::npos || name == "content-encoding"))
+			return output;
+		if (name == "content-length")
+			continue;
+		if (name == "content-type" && Gzip::isCompressibleType(utils::trim(line.substr(colon + 1))))
+			compressible = true;
+		headers.append(line).append("\r\n");
+	}
+	if (!compressible)
+		return output;
+
+	Gzip gzip(location.getGzipCompLevel());
+	gzip.append(output.data() + bodyStart, output.size() - bodyStart);
+	gzip.finish();
+	headers.append("Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n");
+	headers.append("Content-Length: ").append(utils::to_string(gzip.getOutput().size())).append("\r\n\r\n");
+	return headers + gzip.getOutput();
+}
+
+static bool matchesEtag(const std::string &ifNoneMatch, const std::string &etag)
+{
+	std::vector<std::string> tags = utils::split(ifNoneMatch, ',');
+
+	for (size_t i = 0; i < tags.size(); i++)
+	{
+		std::string tag = utils::trim(tags[i]);
+		if (tag.compare(0, 2, "W/") == 0)
+			tag = tag.substr(2);
+		if (tag == "*" || tag == etag)
+			return true;
+	}
+	return false;
+}
+
+// adds ETag, Last-Modified and the configured caching headers for the static
+// file described by st (variant tags encoded representations), then checks
+// the request's validators (If-None-Match wins over If-Modified-Since).
+// Returns true when a 304 should be sent instead.
+bool MethodIO::isNotModified(MethodIO::rInfo &rqi, MethodIO::rInfo &rsi, const ABlock &block, const struct stat &st,
+							 const std::string &variant)
+{
+	std::ostringstream etag;
+	etag << std::hex << "\"" << st.st_ino << "-" << st.st_size << "-" << st.st_mtime << variant << "\"";
+	rsi.headers["ETag"] = etag.str();
+	rsi.headers["Last-Modified"] = utils::httpDate(st.st_mtime);
+	if (block.getExpires() >= 0)
+	{
+		rsi.headers["Expires"] = utils::httpDate(time(0) + block.getExpires());
+		rsi.headers["Cache-Control"] = "max-age=" + utils::to_string(block.getExpires());
+	}
+	if (!block.getCacheControl().empty())
+		rsi.headers["Cache-Control"] = block.getCacheControl();
+
+	std::map<std::string, std::string>::iterator it = rqi.headers.find("If-None-Match");
+	if (it != rqi.headers.end())
+	{
+		if (!matchesEtag(it->second, etag.str()))
+			return false;
+	}
+	else
+	{
+		it = rqi.headers.find("If-Modified-Since");
+		if (it == rqi.headers.end())
+			return false;
+		time_t since = utils::parseHttpDate(it->second);
+		if (since == -1 || st.st_mtime > since)
+			return false;
+	}
+	rsi.code = 304;
+	return true;
+}
+
+// If-Range makes the Range conditional: only a strong ETag or the exact
+// Last-Modified date of the current file lets the partial response through
+bool MethodIO::isRangeApplicable(MethodIO::rInfo &rqi, MethodIO::rInfo &rsi)
+{
+	std::map<std::string, std::string>::iterator it = rqi.headers.find("If-Range");
+	if (it == rqi.headers.end())
+		return true;
+	std::string validator = utils::trim(it->second);
+	if (!validator.empty() && validator[0] == '"')
+		return validator == rsi.headers["ETag"];
+	return validator == rsi.headers["Last-Modified"];
+}
+
+static bool parseOffset(const std::string &s, off_t &offset)
+{
+	if (s.empty() || s.size() > 18 || s.find_first_not_of("0123456789") != std::string::npos)
+		return false;
+	offset = 0;
+	for (size_t i = 0; i < s.size(); i++)
+		offset = offset * 10 + (s[i] - '0');
+	return true;
+}
+
+#define MAX_RANGES 32
+// ranges closer than this are sent as one part, about what a part's headers
+// take
+#define RANGE_COALESCE_GAP 80
+
+// multipart/byteranges boundaries, unique across the workers
+static unsigned int g_boundaryCount = 0;
+
+// sorts the ranges and joins those that overlap or nearly touch (RFC 7233
+// 4.1), so no byte is sent twice
+static void mergeRanges(std::vector<std::pair<off_t, off_t> > &ranges)
+{
+	size_t n = 0;
+
+	std::sort(ranges.begin(), ranges.end());
+	for (size_t i = 1; i < ranges.size(); i++)
+	{
+		if (ranges[i].first <= ranges[n].second + 1 + RANGE_COALESCE_GAP)
+			ranges[n].second = std::max(ranges[n].second, ranges[i].second);
+		else
+			ranges[++n] = ranges[i];
+	}
+	if (!ranges.empty())
+		ranges.resize(n + 1);
+}
+
+// parses "bytes=a-b, c-, -n" into inclusive ranges clamped to the file size,
+// merged. Returns false if the header is malformed or asks for more bytes
+// than the file has (it is then ignored and the whole file sent);
+// unsatisfiable ranges are dropped, so a valid header can leave the list
+// empty.
+static bool parseRanges(const std::string &header, off_t size, std::vector<std::pair<off_t, off_t> > &ranges)
+{
+	off_t total = 0;
+
+	std::string spec = utils::trim(header);
+	if (spec.compare(0, 6, "bytes=") != 0)
+		return false;
+	std::vector<std::string> parts = utils::split(spec.substr(6), ',');
+	if (parts.empty() || parts.size() > MAX_RANGES)
+		return false;
+	for (size_t i = 0; i < parts.size(); i++)
+	{
+		std::pair<std::string, std::string> bounds = utils::splitPair(utils::trim(parts[i]), "-");
+		off_t start;
+		off_t end;
+
+		if (utils::trim(parts[i]).find('-') == std::string::npos)
+			return false;
+		if (bounds.first.empty())
+		{
+			if (!parseOffset(bounds.second, end))
+				return false;
+			if (end == 0 || size == 0)
+				continue;
+			start = end >= size ? 0 : size - end;
+			end = size - 1;
+		}
+		else
+		{
+			if (!parseOffset(bounds.first, start))
+				return false;
+			if (bounds.second.empty())
+				end = size - 1;
+			else if (!parseOffset(bounds.second, end) || end < start)
+				return false;
+			if (start >= size)
+				continue;
+			if (end >= size)
+				end = size - 1;
+		}
+		ranges.push_back(std::make_pair(start, end));
+		total += end - start + 1;
+	}
+	if (ranges.size() > 1 && total > size)
+		return false;
+	mergeRanges(ranges);
+	return true;
+}
+
+static std::string contentRange(off_t start, off_t end, off_t size)
+{
+	std::ostringstream oss;
+	oss << "bytes " << start << "-" << end << "/" << size;
+	return oss.str();
+}
+
+// answers a Range request with 206 (one range as-is, several as
+// multipart/byteranges) or 416; only the requested bytes are read from disk.
+// Returns false when the Range header should be ignored. A file that shrank
+// since it was stat()ed is a 500, never a 206 padded with zeros.
+bool MethodIO::readRanges(std::ifstream &file, const std::string &header, off_t size, MethodIO::rInfo &rsi,
+						  std::string &body)
+{
+	std::vector<std::pair<off_t, off_t> > ranges;
+
+	if (!parseRanges(header, size, ranges))
+		return false;
+	if (ranges.empty())
+	{
+		rsi.code = 416;
+		rsi.headers.erase("Content-Type");
+		rsi.headers["Content-Range"] = "bytes */" + utils::to_string(size);
+		body = "";
+		return true;
+	}
+	rsi.code = 206;
+	if (ranges.size() == 1)
+	{
+		off_t len = ranges[0].second - ranges[0].first + 1;
+		body.resize(len);
+		file.seekg(ranges[0].first);
+		file.read(&body[0], len);
+		if (file.gcount() != len)
+			throw RequestException("File changed while read", 500);
+		rsi.headers["Content-Range"] = contentRange(ranges[0].first, ranges[0].second, size);
+		return true;
+	}
+	std::ostringstream boundary;
+	boundary << std::hex << "webserv" << time(0) << __sync_add_and_fetch(&g_boundaryCount, 1);
+	std::string type = rsi.headers["Content-Type"];
+	for (size_t i = 0; i < ranges.size(); i++)
+	{
+		off_t len = ranges[i].second - ranges[i].first + 1;
+		size_t offset;
+
+		body.append("\r\n--").append(boundary.str()).append("\r\nContent-Type: ").append(type);
+		body.append("\r\nContent-Range: ").append(contentRange(ranges[i].first, ranges[i].second, size));
+		body.append("\r\n\r\n");
+		offset = body.size();
+		body.resize(offset + len);
+		file.clear();
+		file.seekg(ranges[i].first);
+		file.read(&body[offset], len);
+		if (file.gcount() != len)
+			throw RequestException("File changed while read", 500);
+	}
+	body.append("\r\n--").append(boundary.str()).append("--\r\n");
+	rsi.headers["Content-Type"] = "multipart/byteranges; boundary=" + boundary.str();
+	return true;
+}
+
 void MethodIO::writeFile(MethodIO::rInfo &rqi, ServerBlock &block, bool createNew)
 {
 	// try all indexes in the config
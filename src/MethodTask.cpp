@@ -0,0 +1,110 @@
+#include "MethodTask.hpp"
+#include "LocationBlock.hpp"
+#include "Log.hpp"
+#include "MicroCache.hpp"
+#include "RequestException.hpp"
+#include "colors.h"
+#include <cstdlib>
+#include <iostream>
+#include <unistd.h>
+
+const unsigned int MethodTask::_delay = MethodTask::initDelay();
+
+/***********************************
+ * Constructors
+ ***********************************/
+
+MethodTask::MethodTask(MethodIO::MethodPointer method, ServerBlock &block, const MethodIO::rInfo &rqi,
+					   const MethodIO::rInfo &rsi)
+	: Task(), _method(method), _block(block), _rqi(rqi), _rsi(rsi), _response(), _error(), _code(0), _static(false),
+	  _st()
+{
+}
+
+MethodTask::MethodTask(const MethodTask &src) : Task(), _block(src._block)
+{
+	(void)src;
+}
+
+MethodTask &MethodTask::operator=(const MethodTask &rhs)
+{
+	(void)rhs;
+	return *this;
+}
+
+/***********************************
+ * Destructors
+ ***********************************/
+
+MethodTask::~MethodTask(void)
+{
+	delete _rsi.task;
+}
+
+/***********************************
+ * Others
+ ***********************************/
+
+unsigned int MethodTask::initDelay()
+{
+	const char *delay = getenv(IO_DELAY_ENV);
+
+	if (!delay)
+		return 0;
+	return strtoul(delay, NULL, 10);
+}
+
+void MethodTask::run()
+{
+	if (_delay)
+		usleep(_delay * 1000);
+	try
+	{
+		_response = _method(_block, _rqi, _rsi);
+		// already off the event thread, so nested work runs right here
+		if (_rsi.task)
+			_rsi.task->run();
+		else
+			checkStaticFile();
+	}
+	catch (RequestException &e)
+	{
+		_code = e.getCode();
+		_error = e.what();
+	}
+}
+
+// stat()s the file a plain GET read so the event loop can keep the response
+// in the micro-cache; the size check rejects a file changed since the read
+void MethodTask::checkStaticFile()
+{
+	std::string ext = _rqi.path.substr(_rqi.path.find_last_of(".") + 1);
+
+	if (_rsi.code != 200 || _rqi.request[0] != "GET" || _rqi.exist || ext == "py" || ext == "cgi" ||
+		_rsi.headers.count("Content-Encoding") || _rsi.headers.count("Content-Range") ||
+		!_block.getLocationBlockPair(_rqi.queryPath).second.getMicroCache())
+		return;
+	_static = stat(_rqi.path.c_str(), &_st) == 0 && S_ISREG(_st.st_mode) && _st.st_size <= MICRO_CACHE_MAX_FILE_SIZE &&
+			  (size_t)_st.st_size == _rsi.body.size();
+}
+
+bool MethodTask::getStaticFile(std::string &path, struct stat &st) const
+{
+	if (!_static || _code)
+		return false;
+	path = _rqi.path;
+	st = _st;
+	return true;
+}
+
+std::string MethodTask::complete()
+{
+	if (_code)
+	{
+		LOG(LOG_DEBUG) << BRED << "Error: " << _error << ", code: " << _code << RESET;
+		return MethodIO::errorResponse(_code, &_block);
+	}
+	if (_rsi.task)
+		return _rsi.task->complete();
+	return _response;
+}
@@ -0,0 +1,318 @@
+#include "Metrics.hpp"
+#include "utils.hpp"
+#include <cstring>
+#include <ctime>
+#include <sstream>
+
+Metrics::Slot Metrics::_slots[METRICS_MAX_THREADS];
+unsigned int Metrics::_nextSlot = 1;
+
+// the last status slot counts every other code
+const int Metrics::statusCodes[METRICS_STATUS_COUNT - 1] = {200, 201, 204, 206, 301, 302, 303, 304, 400, 403, 404,
+															405, 408, 409, 413, 415, 416, 500, 502, 503, 504};
+
+const char *const Metrics::methodNames[METHOD_COUNT] = {"GET", "HEAD", "POST", "PUT", "DELETE", "OTHER"};
+
+const double Metrics::bucketBounds[METRICS_BUCKET_COUNT] = {0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05,
+															0.1,	0.25,  0.5,	   1,	  2.5,	 5,		10};
+
+// slot of the calling thread, 0 (the event loop) until registerThread()
+static __thread unsigned int t_slot = 0;
+
+static const char *const phaseNames[] = {"wait", "read", "queue", "handler", "send"};
+
+/*** Constructors ***/
+
+Metrics::Metrics(void)
+{
+}
+
+/*** Recording ***/
+
+// single writer per slot: a relaxed load and store is enough for the scraper
+// to read a torn-free value, and avoids a locked instruction
+static inline void bump(unsigned long &value, unsigned long n)
+{
+	__atomic_store_n(&value, __atomic_load_n(&value, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+Metrics::Slot &Metrics::slot()
+{
+	return _slots[t_slot];
+}
+
+// gives a worker thread its own slot; past METRICS_MAX_THREADS threads share
+// the last one and their counts may race
+void Metrics::registerThread()
+{
+	unsigned int index = __sync_fetch_and_add(&_nextSlot, 1);
+
+	t_slot = index < METRICS_MAX_THREADS ? index : METRICS_MAX_THREADS - 1;
+}
+
+void Metrics::add(Counter counter, unsigned long n)
+{
+	bump(slot().counters[counter], n);
+}
+
+void Metrics::adjust(Gauge gauge, long delta)
+{
+	long &value = slot().gauges[gauge];
+
+	__atomic_store_n(&value, __atomic_load_n(&value, __ATOMIC_RELAXED) + delta, __ATOMIC_RELAXED);
+}
+
+void Metrics::observe(Histogram histogram, double seconds)
+{
+	Slot &s = slot();
+	size_t bucket = 0;
+
+	while (bucket < METRICS_BUCKET_COUNT && seconds > bucketBounds[bucket])
+		bucket++;
+	bump(s.buckets[histogram][bucket], 1);
+	bump(s.sumMicros[histogram], (unsigned long)(seconds * 1e6));
+}
+
+void Metrics::countRequest(const std::string &method, int status, double seconds)
+{
+	size_t m = 0;
+	size_t code = 0;
+
+	while (m < METHOD_OTHER && method != methodNames[m])
+		m++;
+	while (code < METRICS_STATUS_COUNT - 1 && statusCodes[code] != status)
+		code++;
+	bump(slot().requests[m][code], 1);
+	observe(REQUEST_DURATION, seconds);
+}
+
+double Metrics::now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*** Scraping ***/
+
+void Metrics::collect(Totals &totals)
+{
+	memset(&totals, 0, sizeof(totals));
+	for (size_t i = 0; i < METRICS_MAX_THREADS; i++)
+	{
+		Slot &s = _slots[i];
+		for (size_t c = 0; c < COUNTER_COUNT; c++)
+			totals.counters[c] += __atomic_load_n(&s.counters[c], __ATOMIC_RELAXED);
+		for (size_t g = 0; g < GAUGE_COUNT; g++)
+			totals.gauges[g] += __atomic_load_n(&s.gauges[g], __ATOMIC_RELAXED);
+		for (size_t m = 0; m < METHOD_COUNT; m++)
+			for (size_t code = 0; code < METRICS_STATUS_COUNT; code++)
+				totals.requests[m][code] += __atomic_load_n(&s.requests[m][code], __ATOMIC_RELAXED);
+		for (size_t h = 0; h < HISTOGRAM_COUNT; h++)
+		{
+			for (size_t b = 0; b <= METRICS_BUCKET_COUNT; b++)
+				totals.buckets[h][b] += __atomic_load_n(&s.buckets[h][b], __ATOMIC_RELAXED);
+			totals.sumMicros[h] += __atomic_load_n(&s.sumMicros[h], __ATOMIC_RELAXED);
+		}
+	}
+}
+
+std::string Metrics::render(const std::string &format)
+{
+	Totals totals;
+
+	collect(totals);
+	if (format == "prometheus")
+		return renderPrometheus(totals);
+	return renderStubStatus(totals);
+}
+
+const char *Metrics::getContentType(const std::string &format)
+{
+	if (format == "prometheus")
+		return "text/plain; version=0.0.4";
+	return "text/plain";
+}
+
+static unsigned long totalRequests(const unsigned long requests[][METRICS_STATUS_COUNT])
+{
+	unsigned long total = 0;
+
+	for (size_t m = 0; m < Metrics::METHOD_COUNT; m++)
+		for (size_t code = 0; code < METRICS_STATUS_COUNT; code++)
+			total += requests[m][code];
+	return total;
+}
+
+// same layout as nginx's stub_status; Waiting counts connections whose
+// request is running on a worker
+std::string Metrics::renderStubStatus(const Totals &totals)
+{
+	std::ostringstream oss;
+	long active = 0;
+
+	for (size_t g = 0; g < GAUGE_COUNT; g++)
+		active += totals.gauges[g];
+	oss << "Active connections: " << active << " \n"
+		<< "server accepts handled requests\n"
+		<< " " << totals.counters[CONNECTIONS_ACCEPTED] << " " << totals.counters[CONNECTIONS_HANDLED] << " "
+		<< totalRequests(totals.requests) << " \n"
+		<< "Reading: " << totals.gauges[CONNECTIONS_READING] << " Writing: " << totals.gauges[CONNECTIONS_WRITING]
+		<< " Waiting: " << totals.gauges[CONNECTIONS_WAITING] << " \n";
+	return oss.str();
+}
+
+static void header(std::ostringstream &oss, const char *name, const char *type, const char *help)
+{
+	oss << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+}
+
+// labels is empty or a label list like `phase="read"`
+static void histogram(std::ostringstream &oss, const char *name, const unsigned long *buckets,
+					  unsigned long sumMicros, const double *bounds, const std::string &labels = "")
+{
+	unsigned long cumulative = 0;
+	std::string prefix = labels.empty() ? "" : labels + ",";
+	std::string suffix = labels.empty() ? "" : "{" + labels + "}";
+
+	for (size_t b = 0; b < METRICS_BUCKET_COUNT; b++)
+	{
+		cumulative += buckets[b];
+		oss << name << "_bucket{" << prefix << "le=\"" << bounds[b] << "\"} " << cumulative << "\n";
+	}
+	cumulative += buckets[METRICS_BUCKET_COUNT];
+	oss << name << "_bucket{" << prefix << "le=\"+Inf\"} " << cumulative << "\n";
+	oss << name << "_sum" << suffix << " " << sumMicros / 1e6 << "\n";
+	oss << name << "_count" << suffix << " " << cumulative << "\n";
+}
+
+std::string Metrics::renderPrometheus(const Totals &totals)
+{
+	std::ostringstream oss;
+	const char *states[GAUGE_COUNT] = {"reading", "writing", "waiting"};
+	long active = 0;
+
+	for (size_t g = 0; g < GAUGE_COUNT; g++)
+		active += totals.gauges[g];
+	header(oss, "webserv_connections_active", "gauge", "Open client connections.");
+	oss << "webserv_connections_active " << active << "\n";
+	header(oss, "webserv_connections", "gauge", "Open client connections by state.");
+	for (size_t g = 0; g < GAUGE_COUNT; g++)
+		oss << "webserv_connections{state=\"" << states[g] << "\"} " << totals.gauges[g] << "\n";
+	header(oss, "webserv_connections_accepted_total", "counter", "Accepted client connections.");
+	oss << "webserv_connections_accepted_total " << totals.counters[CONNECTIONS_ACCEPTED] << "\n";
+	header(oss, "webserv_connections_handled_total", "counter", "Connections closed after a full response.");
+	oss << "webserv_connections_handled_total " << totals.counters[CONNECTIONS_HANDLED] << "\n";
+	header(oss, "webserv_http2_connections_total", "counter", "Connections switched to HTTP/2.");
+	oss << "webserv_http2_connections_total " << totals.counters[HTTP2_CONNECTIONS] << "\n";
+	header(oss, "webserv_http2_streams_total", "counter", "HTTP/2 streams opened by clients.");
+	oss << "webserv_http2_streams_total " << totals.counters[HTTP2_STREAMS] << "\n";
+	header(oss, "webserv_tls_handshakes_total", "counter",
+		   "TLS handshakes by result: completed, of which resumed, and failed.");
+	oss << "webserv_tls_handshakes_total{result=\"completed\"} " << totals.counters[TLS_HANDSHAKES] << "\n"
+		<< "webserv_tls_handshakes_total{result=\"resumed\"} " << totals.counters[TLS_RESUMED] << "\n"
+		<< "webserv_tls_handshakes_total{result=\"failed\"} " << totals.counters[TLS_HANDSHAKE_FAILURES] << "\n";
+	header(oss, "webserv_tls_ktls_connections_total", "counter", "TLS connections whose records the kernel encrypts.");
+	oss << "webserv_tls_ktls_connections_total " << totals.counters[TLS_KTLS] << "\n";
+	header(oss, "webserv_websocket_upgrades_total", "counter", "Connections switched to a websocket location.");
+	oss << "webserv_websocket_upgrades_total " << totals.counters[WEBSOCKET_UPGRADES] << "\n";
+	header(oss, "webserv_websocket_messages_total", "counter", "Messages received on websocket locations.");
+	oss << "webserv_websocket_messages_total " << totals.counters[WEBSOCKET_MESSAGES] << "\n";
+	header(oss, "webserv_sessions_total", "counter", "Sessions created, deleted through the API and expired.");
+	oss << "webserv_sessions_total{event=\"created\"} " << totals.counters[SESSIONS_CREATED] << "\n"
+		<< "webserv_sessions_total{event=\"deleted\"} " << totals.counters[SESSIONS_DELETED] << "\n"
+		<< "webserv_sessions_total{event=\"expired\"} " << totals.counters[SESSIONS_EXPIRED] << "\n";
+	header(oss, "webserv_upload_files_total", "counter", "Files stored by upload_store locations.");
+	oss << "webserv_upload_files_total " << totals.counters[UPLOAD_FILES] << "\n";
+	header(oss, "webserv_upload_bytes_total", "counter", "Bytes written to upload_store directories.");
+	oss << "webserv_upload_bytes_total " << totals.counters[UPLOAD_BYTES] << "\n";
+	header(oss, "webserv_delete_jobs_total", "counter", "Recursive DELETEs started on delete_recursive locations.");
+	oss << "webserv_delete_jobs_total " << totals.counters[DELETE_JOBS] << "\n";
+	header(oss, "webserv_delete_entries_total", "counter", "Files and directories removed by recursive DELETEs.");
+	oss << "webserv_delete_entries_total " << totals.counters[DELETE_ENTRIES] << "\n";
+
+	header(oss, "webserv_requests_total", "counter", "Responses sent by method and status code.");
+	for (size_t m = 0; m < METHOD_COUNT; m++)
+		for (size_t code = 0; code < METRICS_STATUS_COUNT; code++)
+			if (totals.requests[m][code])
+				oss << "webserv_requests_total{method=\"" << methodNames[m] << "\",code=\""
+					<< (code < METRICS_STATUS_COUNT - 1 ? utils::to_string(statusCodes[code]) : "other") << "\"} "
+					<< totals.requests[m][code] << "\n";
+	header(oss, "webserv_request_duration_seconds", "histogram",
+		   "Time from the full request being read to the last response byte being sent.");
+	histogram(oss, "webserv_request_duration_seconds", totals.buckets[REQUEST_DURATION],
+			  totals.sumMicros[REQUEST_DURATION], bucketBounds);
+	header(oss, "webserv_request_phase_seconds", "histogram",
+		   "Time spent in each phase of a request: waiting for the first byte, reading it, queued for a "
+		   "worker, in the handler and sending the response.");
+	for (size_t h = PHASE_WAIT; h <= PHASE_SEND; h++)
+		histogram(oss, "webserv_request_phase_seconds", totals.buckets[h], totals.sumMicros[h], bucketBounds,
+				  std::string("phase=\"") + phaseNames[h - PHASE_WAIT] + "\"");
+
+	header(oss, "webserv_received_bytes_total", "counter", "Bytes read from clients.");
+	oss << "webserv_received_bytes_total " << totals.counters[BYTES_RECEIVED] << "\n";
+	header(oss, "webserv_sent_bytes_total", "counter", "Bytes written to clients.");
+	oss << "webserv_sent_bytes_total " << totals.counters[BYTES_SENT] << "\n";
+
+	header(oss, "webserv_cgi_spawns_total", "counter", "CGI processes started.");
+	oss << "webserv_cgi_spawns_total " << totals.counters[CGI_SPAWNS] << "\n";
+	header(oss, "webserv_cgi_failures_total", "counter", "CGI runs that failed or timed out.");
+	oss << "webserv_cgi_failures_total " << totals.counters[CGI_FAILURES] << "\n";
+	header(oss, "webserv_cgi_duration_seconds", "histogram", "Wall time of CGI runs.");
+	histogram(oss, "webserv_cgi_duration_seconds", totals.buckets[CGI_DURATION], totals.sumMicros[CGI_DURATION],
+			  bucketBounds);
+
+	header(oss, "webserv_cache_lookups_total", "counter", "Cache lookups by cache and result.");
+	oss << "webserv_cache_lookups_total{cache=\"gzip\",result=\"hit\"} " << totals.counters[GZIP_CACHE_HITS] << "\n"
+		<< "webserv_cache_lookups_total{cache=\"gzip\",result=\"miss\"} " << totals.counters[GZIP_CACHE_MISSES]
+		<< "\n"
+		<< "webserv_cache_lookups_total{cache=\"autoindex\",result=\"hit\"} "
+		<< totals.counters[AUTOINDEX_CACHE_HITS] << "\n"
+		<< "webserv_cache_lookups_total{cache=\"autoindex\",result=\"miss\"} "
+		<< totals.counters[AUTOINDEX_CACHE_MISSES] << "\n"
+		<< "webserv_cache_lookups_total{cache=\"response\",result=\"hit\"} "
+		<< totals.counters[RESPONSE_CACHE_HITS] << "\n"
+		<< "webserv_cache_lookups_total{cache=\"response\",result=\"stale\"} "
+		<< totals.counters[RESPONSE_CACHE_STALE] << "\n"
+		<< "webserv_cache_lookups_total{cache=\"response\",result=\"miss\"} "
+		<< totals.counters[RESPONSE_CACHE_MISSES] << "\n"
+		<< "webserv_cache_lookups_total{cache=\"response\",result=\"coalesced\"} "
+		<< totals.counters[RESPONSE_CACHE_COALESCED] << "\n"
+		<< "webserv_cache_lookups_total{cache=\"response\",result=\"bypass\"} "
+		<< totals.counters[RESPONSE_CACHE_BYPASSES] << "\n"
+		<< "webserv_cache_lookups_total{cache=\"micro\",result=\"hit\"} " << totals.counters[MICRO_CACHE_HITS]
+		<< "\n"
+		<< "webserv_cache_lookups_total{cache=\"micro\",result=\"miss\"} " << totals.counters[MICRO_CACHE_MISSES]
+		<< "\n";
+
+	// stale answers count as hits, coalesced requests as misses
+	unsigned long served = totals.counters[RESPONSE_CACHE_HITS] + totals.counters[RESPONSE_CACHE_STALE];
+	unsigned long lookups =
+		served + totals.counters[RESPONSE_CACHE_MISSES] + totals.counters[RESPONSE_CACHE_COALESCED];
+	header(oss, "webserv_response_cache_hit_ratio", "gauge",
+		   "Share of cacheable requests answered from the response cache.");
+	oss << "webserv_response_cache_hit_ratio " << (lookups ? (double)served / lookups : 0) << "\n";
+	header(oss, "webserv_response_cache_evictions_total", "counter",
+		   "Responses evicted to make room in the response cache.");
+	oss << "webserv_response_cache_evictions_total " << totals.counters[RESPONSE_CACHE_EVICTIONS] << "\n";
+
+	header(oss, "webserv_upstream_connections_total", "counter",
+		   "Upstream connections by outcome: opened, reused from the keep-alive pool, failed.");
+	oss << "webserv_upstream_connections_total{result=\"opened\"} " << totals.counters[UPSTREAM_CONNECTS] << "\n"
+		<< "webserv_upstream_connections_total{result=\"reused\"} " << totals.counters[UPSTREAM_REUSES] << "\n"
+		<< "webserv_upstream_connections_total{result=\"failed\"} " << totals.counters[UPSTREAM_FAILURES] << "\n";
+
+	header(oss, "webserv_upstream_health_checks_total", "counter", "Upstream health probes by outcome.");
+	oss << "webserv_upstream_health_checks_total{result=\"passed\"} " << totals.counters[HEALTH_CHECKS_PASSED] << "\n"
+		<< "webserv_upstream_health_checks_total{result=\"failed\"} " << totals.counters[HEALTH_CHECKS_FAILED] << "\n";
+
+	header(oss, "webserv_access_log_dropped_total", "counter", "Access log lines dropped on a full buffer.");
+	oss << "webserv_access_log_dropped_total " << totals.counters[ACCESS_LOG_DROPPED] << "\n";
+
+	header(oss, "webserv_worker_tasks_total", "counter", "Tasks run by each worker thread.");
+	for (size_t i = 1; i < METRICS_MAX_THREADS && i < _nextSlot; i++)
+		oss << "webserv_worker_tasks_total{worker=\"" << i << "\"} "
+			<< __atomic_load_n(&_slots[i].counters[TASKS_RUN], __ATOMIC_RELAXED) << "\n";
+	return oss.str();
+}
@@ -0,0 +1,190 @@
+#include "MicroCache.hpp"
+#include "MethodIO.hpp"
+#include "Metrics.hpp"
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// an IMF-fixdate, the only Date format the responses are built with
+#define HTTP_DATE_LENGTH (sizeof("Thu, 01 Jan 1970 00:00:00 GMT") - 1)
+
+/***********************************
+ * Constructors
+ ***********************************/
+
+MicroCache::MicroCache() : _size(0), _lru(), _entries()
+{
+}
+
+MicroCache::MicroCache(const MicroCache &src) : _size(0), _lru(), _entries()
+{
+	(void)src;
+}
+
+MicroCache &MicroCache::operator=(const MicroCache &rhs)
+{
+	(void)rhs;
+	return *this;
+}
+
+/***********************************
+ * Destructors
+ ***********************************/
+
+MicroCache::~MicroCache()
+{
+	clear();
+}
+
+/***********************************
+ * Lookups
+ ***********************************/
+
+// the response for key with a reference taken, or NULL; the file is stat()ed
+// again once MICRO_CACHE_VALID seconds have passed since the last check
+MicroCache::Buffer *MicroCache::find(const std::string &key, double now)
+{
+	std::map<std::string, Entry>::iterator it = _entries.find(key);
+
+	if (it == _entries.end())
+	{
+		Metrics::add(Metrics::MICRO_CACHE_MISSES);
+		return NULL;
+	}
+	Entry &entry = it->second;
+	if (now - entry.checked >= MICRO_CACHE_VALID)
+	{
+		struct stat st;
+		if (stat(entry.path.c_str(), &st) == -1 || st.st_mtime != entry.st.st_mtime ||
+			st.st_mtim.tv_nsec != entry.st.st_mtim.tv_nsec || st.st_size != entry.st.st_size ||
+			st.st_ino != entry.st.st_ino)
+		{
+			erase(it);
+			Metrics::add(Metrics::MICRO_CACHE_MISSES);
+			return NULL;
+		}
+		entry.checked = now;
+	}
+	_lru.splice(_lru.begin(), _lru, entry.lru);
+	entry.buffer->refs++;
+	Metrics::add(Metrics::MICRO_CACHE_HITS);
+	return entry.buffer;
+}
+
+// takes a response built for the file at path (st from when it was read);
+// anything that depends on the request or on the time it was built besides
+// Date (an encoding, Vary, Expires, cookies) keeps it out
+void MicroCache::insert(const std::string &key, const std::string &path, const struct stat &st,
+						const std::string &response, double now)
+{
+	size_t headEnd = response.find("\r\n\r\n");
+
+	if (response.size() > MICRO_CACHE_SIZE || response.compare(0, 13, "HTTP/1.1 200 ") != 0 ||
+		headEnd == std::string::npos)
+		return;
+	std::string head = response.substr(0, headEnd + 2);
+	if (head.find("\r\nContent-Encoding:") != std::string::npos || head.find("\r\nVary:") != std::string::npos ||
+		head.find("\r\nExpires:") != std::string::npos || head.find("\r\nSet-Cookie:") != std::string::npos)
+		return;
+
+	std::map<std::string, Entry>::iterator old = _entries.find(key);
+	if (old != _entries.end())
+		erase(old);
+	while (_size + response.size() > MICRO_CACHE_SIZE && !_lru.empty())
+		erase(_entries.find(_lru.back()));
+
+	Buffer *buffer = new Buffer();
+	size_t date = head.find("\r\nDate: ");
+	buffer->bytes = response;
+	buffer->dateOffset = std::string::npos;
+	if (date != std::string::npos && head.find("\r\n", date + 8) == date + 8 + HTTP_DATE_LENGTH)
+		buffer->dateOffset = date + 8;
+	buffer->bodyLength = response.size() - headEnd - 4;
+	buffer->refs = 1;
+
+	Entry entry;
+	entry.buffer = buffer;
+	entry.path = path;
+	entry.st = st;
+	entry.checked = now;
+	_lru.push_front(key);
+	entry.lru = _lru.begin();
+	_entries[key] = entry;
+	_size += response.size();
+}
+
+// entries being sent are freed when their last connection releases them
+void MicroCache::clear()
+{
+	while (!_entries.empty())
+		erase(_entries.begin());
+}
+
+void MicroCache::erase(std::map<std::string, Entry>::iterator it)
+{
+	_size -= it->second.buffer->bytes.size();
+	_lru.erase(it->second.lru);
+	release(it->second.buffer);
+	_entries.erase(it);
+}
+
+/***********************************
+ * Sending
+ ***********************************/
+
+void MicroCache::release(Buffer *buffer)
+{
+	if (--buffer->refs == 0)
+		delete buffer;
+}
+
+// writes what is left of the response after sent bytes in one sendmsg: the
+// bytes before the Date value, the current date and the rest
+ssize_t MicroCache::send(int fd, const Buffer &buffer, size_t sent)
+{
+	std::string date = MethodIO::getDate();
+	const char *data = buffer.bytes.data();
+	size_t size = buffer.bytes.size();
+	size_t dateOffset = buffer.dateOffset;
+	const char *parts[3];
+	size_t lengths[3];
+	struct iovec iov[3];
+	struct msghdr msg;
+	int count = 0;
+
+	if (dateOffset == std::string::npos || date.size() != HTTP_DATE_LENGTH)
+		dateOffset = size;
+	parts[0] = data;
+	lengths[0] = dateOffset;
+	parts[1] = date.data();
+	lengths[1] = dateOffset == size ? 0 : HTTP_DATE_LENGTH;
+	parts[2] = data + dateOffset + lengths[1];
+	lengths[2] = size - dateOffset - lengths[1];
+	for (int i = 0; i < 3; i++)
+	{
+		if (sent >= lengths[i])
+		{
+			sent -= lengths[i];
+			continue;
+		}
+		iov[count].iov_base = const_cast<char *>(parts[i]) + sent;
+		iov[count].iov_len = lengths[i] - sent;
+		sent = 0;
+		count++;
+	}
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = count;
+	return sendmsg(fd, &msg, MSG_NOSIGNAL);
+}
+
+// the response with the current date, for connections that cannot take it
+// straight from the buffer (TLS encrypts a copy anyway)
+void MicroCache::render(const Buffer &buffer, std::string &out)
+{
+	std::string date = MethodIO::getDate();
+
+	out = buffer.bytes;
+	if (buffer.dateOffset != std::string::npos && date.size() == HTTP_DATE_LENGTH)
+		out.replace(buffer.dateOffset, HTTP_DATE_LENGTH, date);
+}
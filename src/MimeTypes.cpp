@@ -0,0 +1,197 @@
+#include "MimeTypes.hpp"
+#include "CustomException.hpp"
+#include <algorithm>
+#include <cctype>
+#include <strings.h>
+#include <utility>
+
+/***********************************
+ * Constructors
+ ***********************************/
+
+MimeTypes::MimeTypes(void) : _seeds(), _slots(), _mask(0), _size(0), _defaultType(DEFAULT_MIME_TYPE)
+{
+	build(builtinTypes());
+}
+
+MimeTypes::MimeTypes(const std::map<std::string, std::string> &types)
+	: _seeds(), _slots(), _mask(0), _size(0), _defaultType(DEFAULT_MIME_TYPE)
+{
+	build(types.empty() ? builtinTypes() : types);
+}
+
+MimeTypes::MimeTypes(const MimeTypes &src)
+{
+	*this = src;
+}
+
+MimeTypes &MimeTypes::operator=(const MimeTypes &rhs)
+{
+	if (this != &rhs)
+	{
+		this->_seeds = rhs._seeds;
+		this->_slots = rhs._slots;
+		this->_mask = rhs._mask;
+		this->_size = rhs._size;
+		this->_defaultType = rhs._defaultType;
+	}
+	return *this;
+}
+
+/***********************************
+ * Destructors
+ ***********************************/
+
+MimeTypes::~MimeTypes(void)
+{
+}
+
+/***********************************
+ * Others
+ ***********************************/
+
+// used when the config has no types block or include
+std::map<std::string, std::string> MimeTypes::builtinTypes()
+{
+	std::map<std::string, std::string> m;
+	m["txt"] = "text/plain";
+	m["html"] = "text/html";
+	m["css"] = "text/css";
+	m["js"] = "text/javascript";
+	m["png"] = "image/png";
+	m["ico"] = "image/ico";
+	m["cpp"] = "text/cpp";
+
+	return m;
+}
+
+// case-insensitive FNV-1a, seeded so each bucket can pick its own function
+unsigned int MimeTypes::hash(const char *s, size_t len, unsigned int seed)
+{
+	unsigned int h = 2166136261u ^ (seed * 16777619u);
+
+	for (size_t i = 0; i < len; i++)
+	{
+		h ^= (unsigned char)tolower((unsigned char)s[i]);
+		h *= 16777619u;
+	}
+	h ^= h >> 15;
+	return h;
+}
+
+static bool biggerBucket(const std::vector<std::string> *a, const std::vector<std::string> *b)
+{
+	return a->size() > b->size();
+}
+
+// hash and displace: keys are grouped into buckets by a first hash, then the
+// largest buckets are placed first, each searching for a seed that sends all
+// of its keys to free slots. The seed per bucket is all a lookup needs.
+// Extensions differing only in case would collide for every seed, so they
+// are folded first; a table that still cannot be laid out is an error.
+void MimeTypes::build(const std::map<std::string, std::string> &mixedTypes)
+{
+	std::map<std::string, std::string> types;
+	size_t tableSize = 1;
+
+	for (std::map<std::string, std::string>::const_iterator it = mixedTypes.begin(); it != mixedTypes.end(); it++)
+	{
+		std::string extension = it->first;
+		for (size_t c = 0; c < extension.size(); c++)
+			extension[c] = tolower((unsigned char)extension[c]);
+		types[extension] = it->second;
+	}
+	while (tableSize < types.size() * 2)
+		tableSize <<= 1;
+	for (int growth = 0;; growth++)
+	{
+		if (growth > MIME_MAX_GROWTH)
+			throw CustomException("Error: the types table cannot be laid out");
+		size_t bucketCount = types.size() / 2 + 1;
+		std::vector<std::vector<std::string> > buckets(bucketCount);
+		std::vector<const std::vector<std::string> *> order;
+		std::vector<bool> used(tableSize, false);
+		bool placed = true;
+
+		_mask = tableSize - 1;
+		_seeds.assign(bucketCount, 0);
+		_slots.assign(tableSize, Entry());
+		for (std::map<std::string, std::string>::const_iterator it = types.begin(); it != types.end(); it++)
+			buckets[hash(it->first.data(), it->first.size(), 0) % bucketCount].push_back(it->first);
+		for (size_t i = 0; i < bucketCount; i++)
+			order.push_back(&buckets[i]);
+		std::stable_sort(order.begin(), order.end(), biggerBucket);
+		for (size_t i = 0; i < order.size() && placed && !order[i]->empty(); i++)
+		{
+			const std::vector<std::string> &keys = *order[i];
+			size_t bucket = hash(keys[0].data(), keys[0].size(), 0) % bucketCount;
+			unsigned int seed;
+			std::vector<size_t> slots;
+
+			for (seed = 1; seed < 100000; seed++)
+			{
+				slots.clear();
+				for (size_t k = 0; k < keys.size(); k++)
+				{
+					size_t slot = hash(keys[k].data(), keys[k].size(), seed) & _mask;
+					if (used[slot] || std::find(slots.begin(), slots.end(), slot) != slots.end())
+						break;
+					slots.push_back(slot);
+				}
+				if (slots.size() == keys.size())
+					break;
+			}
+			if (slots.size() != keys.size())
+			{
+				placed = false;
+				break;
+			}
+			_seeds[bucket] = seed;
+			for (size_t k = 0; k < keys.size(); k++)
+			{
+				used[slots[k]] = true;
+				_slots[slots[k]].extension = keys[k];
+				_slots[slots[k]].type = types.find(keys[k])->second;
+			}
+		}
+		if (placed)
+			break;
+		tableSize <<= 1;
+	}
+	_size = types.size();
+}
+
+const std::string *MimeTypes::find(const char *extension, size_t len) const
+{
+	if (_seeds.empty() || len == 0)
+		return NULL;
+	unsigned int seed = _seeds[hash(extension, len, 0) % _seeds.size()];
+	if (seed == 0)
+		return NULL;
+	const Entry &entry = _slots[hash(extension, len, seed) & _mask];
+	if (entry.extension.size() != len || strncasecmp(entry.extension.data(), extension, len) != 0)
+		return NULL;
+	return &entry.type;
+}
+
+// the extension is whatever follows the last '.' of the last path segment;
+// files without one are treated as plain text like before
+const std::string &MimeTypes::getType(const std::string &path) const
+{
+	size_t slash = path.find_last_of('/');
+	size_t dot = path.find_last_of('.');
+	const std::string *type;
+
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+		type = find("txt", 3);
+	else
+		type = find(path.data() + dot + 1, path.size() - dot - 1);
+	if (!type)
+		return _defaultType;
+	return *type;
+}
+
+size_t MimeTypes::size() const
+{
+	return _size;
+}
@@ -5,7 +5,13 @@ Parser::Parser(const std::string &filePath)
 	: _filePath(filePath), _fileStream(filePath.c_str()), _tempLine(""),
 	  _lineNum(1), _serverBlockNum(1), _locationBlockNum(1), _bracketPairing(0),
 	  _isFileEmpty(true), _hasDirectives(false), _serverNames(), 
-	  _tempServerBlock(), _tempLocationBlock(this->_tempServerBlock)
+	  _tempServerBlock(), _tempLocationBlock(this->_tempServerBlock), _types(),
+	  _eventBackend(DEFAULT_EVENT_BACKEND), _hasEventBackend(false),
+	  _logLevel(DEFAULT_LOG_LEVEL), _hasLogLevel(false), _accessLogPath(),
+	  _accessLogFormat("combined"), _hasAccessLog(false), _slowRequestThreshold(0),
+	  _hasSlowRequestLog(false), _upstreams(), _responseCachePath(),
+	  _responseCacheSize(DEFAULT_RESPONSE_CACHE_SIZE), _hasResponseCachePath(false), _sessionStorePath(),
+	  _sessionTtl(DEFAULT_SESSION_TTL), _hasSessionStore(false)
 {
 	int validStatusCodes[8] = {400, 403, 404, 405, 408, 409, 415, 500};
 
@@ -15,9 +21,16 @@ Parser::Parser(const std::string &filePath)
 }
 
 /*
-Server:		listen, server_name
-Location:	autoindex, limit_except, cgi_pass
-Both:		root, index, client_max_body_size, error_page, return
+Top level:	server, upstream, types, include, event_backend, log_level, access_log,
+			slow_request_log, response_cache_path, session_store
+Upstream:	server, least_conn, hash, health_check
+Server:		listen, server_name, ssl_certificate, ssl_certificate_key, ssl_ktls
+Location:	autoindex, autoindex_format, limit_except, cgi_pass, metrics, proxy_pass,
+			proxy_connect_timeout, proxy_read_timeout, response_cache, response_cache_valid,
+			micro_cache, websocket, session_api, upload_store, upload_max_file_size,
+			upload_fsync, upload_directio, delete_recursive, delete_status
+Both:		root, index, client_max_body_size, error_page, return, expires,
+			cache_control, gzip, gzip_static, gzip_comp_level, gzip_min_length
 */
 
 Parser::~Parser()
@@ -60,11 +73,55 @@ void Parser::parseServerBlocks(std::vector<ServerBlock> &serverBlocks)
 			this->_lineNum++;
 			continue;
 		}
-		if (str1 == "server" && str2 == "{" && str3.empty())
+		if (str1 == "types" && str2 == "{" && str3.empty())
 		{
-			std::cout << std::endl
-					  << HYELLOW "Creating server block "
-					  << this->_serverBlockNum << RESET << std::endl;
+			this->_lineNum++;
+			parseTypes(this->_fileStream, "", this->_lineNum);
+		}
+		else if (str1 == "include")
+		{
+			parseInclude(this->_tempLine);
+			this->_lineNum++;
+		}
+		else if (str1 == "event_backend")
+		{
+			parseEventBackend(this->_tempLine);
+			this->_lineNum++;
+		}
+		else if (str1 == "log_level")
+		{
+			parseLogLevel(this->_tempLine);
+			this->_lineNum++;
+		}
+		else if (str1 == "access_log")
+		{
+			parseAccessLog(this->_tempLine);
+			this->_lineNum++;
+		}
+		else if (str1 == "slow_request_log")
+		{
+			parseSlowRequestLog(this->_tempLine);
+			this->_lineNum++;
+		}
+		else if (str1 == "response_cache_path")
+		{
+			parseResponseCachePath(this->_tempLine);
+			this->_lineNum++;
+		}
+		else if (str1 == "session_store")
+		{
+			parseSessionStore(this->_tempLine);
+			this->_lineNum++;
+		}
+		else if (str1 == "upstream" && !str2.empty() && str3 == "{" && !(iss >> str3))
+		{
+			this->_lineNum++;
+			parseUpstreamBlock(str2);
+		}
+		else if (str1 == "server" && str2 == "{" && str3.empty())
+		{
+			LOG(LOG_DEBUG) << HYELLOW "Creating server block "
+						   << this->_serverBlockNum << RESET;
 			this->_locationBlockNum = 1;
 			this->_lineNum++;
 			this->_serverBlockNum++;
@@ -118,9 +175,8 @@ void Parser::parseLocationBlocks(std::istringstream &iss)
 
 	if (str1 == "{" && str2.empty())
 	{
-		std::cout << HYELLOW "Creating location block "
-				  << this->_locationBlockNum << " (" << path << ")" << RESET
-				  << std::endl;
+		LOG(LOG_DEBUG) << HYELLOW "Creating location block "
+					   << this->_locationBlockNum << " (" << path << ")" << RESET;
 
 		this->_tempLocationBlock = LocationBlock(this->_tempServerBlock);
 
@@ -132,16 +188,577 @@ void Parser::parseLocationBlocks(std::istringstream &iss)
 		parseLocationBlockDirectives(this->_tempLocationBlock);
 		checkLocationDirectiveCount();
 
-		this->_tempServerBlock.addLocationBlock(path, this->_tempLocationBlock);
+		this->_tempServerBlock.addLocationBlock(path, this->_tempLocationBlock);
+	}
+	else
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum
+		   << "): Location blocks must be in the enclosed in this "
+			  "format:\nlocation [path] {\n...\n}";
+		throw CustomException(ss.str());
+	}
+}
+
+/*
+parse the body of a types block, one entry per line:
+types {
+	[mimeType] [extension1] [extension2] ...;
+}
+*/
+void Parser::parseTypes(std::istream &stream, const std::string &source, int &lineNum)
+{
+	std::string line;
+	std::string where = source.empty() ? "line " : source + " line ";
+
+	while (std::getline(stream, line))
+	{
+		if (isClosedCurlyBracket(line))
+		{
+			lineNum++;
+			LOG(LOG_INFO) << CYAN "loaded " << this->_types.size() << " mime types" << RESET;
+			return;
+		}
+		if (isSkippableLine(line))
+		{
+			lineNum++;
+			continue;
+		}
+		if (!isValidSemicolonFormat(line))
+		{
+			std::stringstream ss;
+			ss << "Error (" << where << lineNum << "): The types entry should end with one ;";
+			throw CustomException(ss.str());
+		}
+		std::istringstream iss(line.substr(0, line.length() - 1));
+		std::string type;
+		std::string extension;
+
+		iss >> type >> extension;
+		if (type.find('/') == std::string::npos || extension.empty())
+		{
+			std::stringstream ss;
+			ss << "Error (" << where << lineNum << "): [type/subtype] [extension1] [extension2] ...";
+			throw CustomException(ss.str());
+		}
+		while (!extension.empty())
+		{
+			// looked up without case, so JPG and jpg are the same entry
+			for (size_t i = 0; i < extension.size(); i++)
+				extension[i] = tolower((unsigned char)extension[i]);
+			this->_types[extension] = type;
+			if (!(iss >> extension))
+				break;
+		}
+		lineNum++;
+	}
+	std::stringstream ss;
+	ss << "Error (" << where << lineNum << "): types block is not closed with }";
+	throw CustomException(ss.str());
+}
+
+/*
+include [file] (relative paths start from the config file's directory); the
+file holds a types block, e.g. config_files/mime.types
+*/
+void Parser::parseInclude(std::string line)
+{
+	if (!isValidSemicolonFormat(line))
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum << "): The directive line should end with one ;";
+		throw CustomException(ss.str());
+	}
+	std::istringstream iss(line.substr(0, line.length() - 1));
+	std::string directive, path, temp;
+
+	iss >> directive >> path >> temp;
+	if (path.empty() || !temp.empty())
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum << "): include [filePath]";
+		throw CustomException(ss.str());
+	}
+	size_t slash = this->_filePath.find_last_of('/');
+	if (path[0] != '/' && slash != std::string::npos)
+		path = this->_filePath.substr(0, slash + 1) + path;
+
+	std::ifstream file(path.c_str());
+	if (!file.is_open())
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum << "): Cannot open included file " << path;
+		throw CustomException(ss.str());
+	}
+	std::string included;
+	int lineNum = 1;
+	bool hasTypes = false;
+	while (std::getline(file, included))
+	{
+		std::istringstream includedIss(included);
+		std::string str1, str2, str3;
+
+		includedIss >> str1 >> str2 >> str3;
+		if (isSkippableLine(str1))
+		{
+			lineNum++;
+			continue;
+		}
+		if (str1 != "types" || str2 != "{" || !str3.empty())
+		{
+			std::stringstream ss;
+			ss << "Error (" << path << " line " << lineNum << "): included files can only contain types { ... }";
+			throw CustomException(ss.str());
+		}
+		lineNum++;
+		parseTypes(file, path, lineNum);
+		hasTypes = true;
+	}
+	if (!hasTypes)
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum << "): " << path << " has no types block";
+		throw CustomException(ss.str());
+	}
+}
+
+const std::map<std::string, std::string> &Parser::getTypes() const
+{
+	return this->_types;
+}
+
+// event_backend [poll | epoll | io_uring]
+void Parser::parseEventBackend(std::string line)
+{
+	if (!isValidSemicolonFormat(line))
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum << "): The directive line should end with one ;";
+		throw CustomException(ss.str());
+	}
+	std::istringstream iss(line.substr(0, line.length() - 1));
+	std::string directive, backend, temp;
+
+	iss >> directive >> backend >> temp;
+	if (!Poller::isValidBackend(backend) || !temp.empty())
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum << "): event_backend [poll | epoll | io_uring]";
+		throw CustomException(ss.str());
+	}
+	if (this->_hasEventBackend)
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum << "): Duplicate event_backend directive";
+		throw CustomException(ss.str());
+	}
+	this->_hasEventBackend = true;
+	this->_eventBackend = backend;
+}
+
+const std::string &Parser::getEventBackend() const
+{
+	return this->_eventBackend;
+}
+
+// log_level [error | warn | info | debug]
+void Parser::parseLogLevel(std::string line)
+{
+	if (!isValidSemicolonFormat(line))
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum << "): The directive line should end with one ;";
+		throw CustomException(ss.str());
+	}
+	std::istringstream iss(line.substr(0, line.length() - 1));
+	std::string directive, level, temp;
+
+	iss >> directive >> level >> temp;
+	if (!Log::parseLevel(level, this->_logLevel) || !temp.empty())
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum << "): log_level [error | warn | info | debug]";
+		throw CustomException(ss.str());
+	}
+	if (this->_hasLogLevel)
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum << "): Duplicate log_level directive";
+		throw CustomException(ss.str());
+	}
+	this->_hasLogLevel = true;
+}
+
+// access_log [path] [combined | json] or access_log off
+void Parser::parseAccessLog(std::string line)
+{
+	if (!isValidSemicolonFormat(line))
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum << "): The directive line should end with one ;";
+		throw CustomException(ss.str());
+	}
+	std::istringstream iss(line.substr(0, line.length() - 1));
+	std::string directive, path, format, temp;
+
+	iss >> directive >> path >> format >> temp;
+	if (format.empty())
+		format = "combined";
+	if (path.empty() || !AccessLog::isValidFormat(format) || !temp.empty() || (path == "off" && format != "combined"))
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum << "): access_log [path] [combined | json] or access_log off";
+		throw CustomException(ss.str());
+	}
+	if (this->_hasAccessLog)
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum << "): Duplicate access_log directive";
+		throw CustomException(ss.str());
+	}
+	this->_hasAccessLog = true;
+	this->_accessLogPath = path == "off" ? "" : path;
+	this->_accessLogFormat = format;
+}
+
+LogLevel Parser::getLogLevel() const
+{
+	return this->_logLevel;
+}
+
+const std::string &Parser::getAccessLogPath() const
+{
+	return this->_accessLogPath;
+}
+
+const std::string &Parser::getAccessLogFormat() const
+{
+	return this->_accessLogFormat;
+}
+
+// slow_request_log [milliseconds] or slow_request_log off
+void Parser::parseSlowRequestLog(std::string line)
+{
+	if (!isValidSemicolonFormat(line))
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum << "): The directive line should end with one ;";
+		throw CustomException(ss.str());
+	}
+	std::istringstream iss(line.substr(0, line.length() - 1));
+	std::string directive, threshold, temp;
+
+	iss >> directive >> threshold >> temp;
+	if (threshold.empty() || !temp.empty() ||
+		(threshold != "off" && (!isValidNumber(threshold) || utils::stoi(threshold, this->_lineNum) <= 0)))
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum << "): slow_request_log [milliseconds] or slow_request_log off";
+		throw CustomException(ss.str());
+	}
+	if (this->_hasSlowRequestLog)
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum << "): Duplicate slow_request_log directive";
+		throw CustomException(ss.str());
+	}
+	this->_hasSlowRequestLog = true;
+	this->_slowRequestThreshold = threshold == "off" ? 0 : utils::stoi(threshold, this->_lineNum) / 1000.0;
+}
+
+double Parser::getSlowRequestThreshold() const
+{
+	return this->_slowRequestThreshold;
+}
+
+// response_cache_path [directory] [max_size=size], size in bytes or with a
+// k, m or g suffix
+void Parser::parseResponseCachePath(std::string line)
+{
+	if (!isValidSemicolonFormat(line))
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum << "): The directive line should end with one ;";
+		throw CustomException(ss.str());
+	}
+	std::istringstream iss(line.substr(0, line.length() - 1));
+	std::string directive, path, option, temp;
+	size_t size = DEFAULT_RESPONSE_CACHE_SIZE;
+	unsigned long long value = 0;
+
+	iss >> directive >> path >> option >> temp;
+	if (!option.empty())
+	{
+		if (option.compare(0, 9, "max_size=") || !parseSize(option.substr(9), value) || !value)
+			path.clear();
+		else
+			size = (size_t)value;
+	}
+	if (path.empty() || !temp.empty() || size < RESPONSE_CACHE_MIN_SIZE)
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum << "): response_cache_path [directory] [max_size=size]";
+		throw CustomException(ss.str());
+	}
+	if (this->_hasResponseCachePath)
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum << "): Duplicate response_cache_path directive";
+		throw CustomException(ss.str());
+	}
+	this->_hasResponseCachePath = true;
+	this->_responseCachePath = path;
+	this->_responseCacheSize = size;
+}
+
+const std::string &Parser::getResponseCachePath() const
+{
+	return this->_responseCachePath;
+}
+
+size_t Parser::getResponseCacheSize() const
+{
+	return this->_responseCacheSize;
+}
+
+// a size in bytes, or with a k, m or g suffix
+bool Parser::parseSize(std::string number, unsigned long long &size)
+{
+	char suffix = number.empty() ? 0 : number[number.size() - 1];
+	unsigned long long unit = 1;
+
+	if (suffix == 'k' || suffix == 'K')
+		unit = 1024;
+	else if (suffix == 'm' || suffix == 'M')
+		unit = 1024 * 1024;
+	else if (suffix == 'g' || suffix == 'G')
+		unit = 1024 * 1024 * 1024;
+	if (unit > 1)
+		number.erase(number.size() - 1);
+	if (number.empty() || number.size() > 15 || !isValidNumber(number) || number[0] == '-')
+		return false;
+	size = strtoull(number.c_str(), NULL, 10) * unit;
+	return true;
+}
+
+// session_store [memory | file] [ttl=seconds]
+void Parser::parseSessionStore(std::string line)
+{
+	if (!isValidSemicolonFormat(line))
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum << "): The directive line should end with one ;";
+		throw CustomException(ss.str());
+	}
+	std::istringstream iss(line.substr(0, line.length() - 1));
+	std::string directive, path, option, temp;
+	int ttl = DEFAULT_SESSION_TTL;
+
+	iss >> directive >> path >> option >> temp;
+	if (!option.empty())
+	{
+		std::string number = option.compare(0, 4, "ttl=") == 0 ? option.substr(4) : "";
+		if (number.empty() || !isValidNumber(number) || number[0] == '-' ||
+			(ttl = utils::stoi(number, this->_lineNum)) <= 0)
+			path.clear();
+	}
+	if (path.empty() || !temp.empty())
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum << "): session_store [memory | file] [ttl=seconds]";
+		throw CustomException(ss.str());
+	}
+	if (this->_hasSessionStore)
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum << "): Duplicate session_store directive";
+		throw CustomException(ss.str());
+	}
+	this->_hasSessionStore = true;
+	this->_sessionStorePath = path == "memory" ? "" : path;
+	this->_sessionTtl = ttl;
+}
+
+const std::string &Parser::getSessionStorePath() const
+{
+	return this->_sessionStorePath;
+}
+
+int Parser::getSessionTtl() const
+{
+	return this->_sessionTtl;
+}
+
+/*
+parse an upstream block, one directive per line:
+upstream [name] {
+	server [host]:[port] [weight=n] [max_fails=n] [fail_timeout=seconds];
+	least_conn; or hash [$remote_addr | $request_uri | $http_name];
+	health_check [interval=seconds] [timeout=seconds] [fails=n] [passes=n] [uri=/path];
+}
+a proxy_pass without a port names an upstream block, e.g. proxy_pass http://name/;
+*/
+void Parser::parseUpstreamBlock(const std::string &name)
+{
+	Upstream upstream(name);
+	bool hasBalance = false;
+	bool hasHealthCheck = false;
+
+	if (this->_upstreams.count(name))
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum - 1 << "): Duplicate upstream " << name;
+		throw CustomException(ss.str());
+	}
+	while (std::getline(this->_fileStream, this->_tempLine))
+	{
+		if (isClosedCurlyBracket(this->_tempLine))
+		{
+			if (upstream.getPeers().empty())
+			{
+				std::stringstream ss;
+				ss << "Error (line " << this->_lineNum << "): upstream " << name << " needs at least one server";
+				throw CustomException(ss.str());
+			}
+			this->_lineNum++;
+			upstream.build();
+			this->_upstreams[name] = upstream;
+			LOG(LOG_DEBUG) << CYAN "upstream " << name << " with " << upstream.getPeers().size() << " servers" << RESET;
+			return;
+		}
+		if (isSkippableLine(this->_tempLine))
+		{
+			this->_lineNum++;
+			continue;
+		}
+		if (!isValidSemicolonFormat(this->_tempLine))
+		{
+			std::stringstream ss;
+			ss << "Error (line " << this->_lineNum << "): The directive line should end with one ;";
+			throw CustomException(ss.str());
+		}
+		std::istringstream iss(this->_tempLine.substr(0, this->_tempLine.length() - 1));
+		std::string directive;
+
+		iss >> directive;
+		if (directive == "server")
+			parseUpstreamServer(upstream, iss);
+		else if ((directive == "least_conn" || directive == "hash") && !hasBalance)
+		{
+			parseUpstreamBalance(upstream, directive, iss);
+			hasBalance = true;
+		}
+		else if (directive == "health_check" && !hasHealthCheck)
+		{
+			parseHealthCheck(upstream, iss);
+			hasHealthCheck = true;
+		}
+		else
+		{
+			std::stringstream ss;
+			ss << "Error (line " << this->_lineNum << "): " << directive
+			   << " is not an upstream directive (server, least_conn or hash, health_check; once each but server)";
+			throw CustomException(ss.str());
+		}
+		this->_lineNum++;
+	}
+	std::stringstream ss;
+	ss << "Error (line " << this->_lineNum << "): upstream block is not closed with }";
+	throw CustomException(ss.str());
+}
+
+// server [host]:[port] [weight=n] [max_fails=n] [fail_timeout=seconds]
+void Parser::parseUpstreamServer(Upstream &upstream, std::istringstream &iss)
+{
+	Upstream::Peer peer;
+	std::string address, option;
+
+	iss >> address;
+	size_t colon = address.rfind(':');
+	peer.host = address.substr(0, colon);
+	peer.port = colon == std::string::npos ? "80" : address.substr(colon + 1);
+	bool valid = !peer.host.empty() && !peer.port.empty() && isValidPort(peer.port) && upstream.find(peer.host + ":" + peer.port) == -1;
+	while (valid && iss >> option)
+		valid = parseUpstreamOption(option, "weight", peer.weight) ||
+				parseUpstreamOption(option, "max_fails", peer.maxFails) ||
+				parseUpstreamOption(option, "fail_timeout", peer.failTimeout);
+	if (!valid)
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum
+		   << "): server [host]:[port] [weight=n] [max_fails=n] [fail_timeout=seconds] (each server once)";
+		throw CustomException(ss.str());
+	}
+	upstream.addPeer(peer);
+}
+
+// least_conn or hash [$remote_addr | $request_uri | $http_name]
+void Parser::parseUpstreamBalance(Upstream &upstream, const std::string &directive, std::istringstream &iss)
+{
+	std::string key, temp;
+
+	iss >> key >> temp;
+	if (directive == "least_conn" && key.empty())
+	{
+		upstream.setBalance(Upstream::LEAST_CONN, "");
+		return;
+	}
+	if (directive != "hash" || !temp.empty() ||
+		(key != "$remote_addr" && key != "$request_uri" && (key.compare(0, 6, "$http_") != 0 || key.size() == 6)))
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum << "): least_conn or hash [$remote_addr | $request_uri | $http_name]";
+		throw CustomException(ss.str());
+	}
+	upstream.setBalance(Upstream::HASH, key);
+}
+
+// health_check [interval=seconds] [timeout=seconds] [fails=n] [passes=n] [uri=/path]
+void Parser::parseHealthCheck(Upstream &upstream, std::istringstream &iss)
+{
+	Upstream::HealthCheck check;
+	std::string option;
+	bool valid = true;
+
+	check.enabled = true;
+	while (valid && iss >> option)
+	{
+		if (option.compare(0, 4, "uri=") == 0)
+		{
+			check.uri = option.substr(4);
+			valid = !check.uri.empty() && check.uri[0] == '/';
+		}
+		else
+			valid = parseUpstreamOption(option, "interval", check.interval) ||
+					parseUpstreamOption(option, "timeout", check.timeout) ||
+					parseUpstreamOption(option, "fails", check.fails) ||
+					parseUpstreamOption(option, "passes", check.passes);
 	}
-	else
+	if (!valid)
 	{
 		std::stringstream ss;
 		ss << "Error (line " << this->_lineNum
-		   << "): Location blocks must be in the enclosed in this "
-			  "format:\nlocation [path] {\n...\n}";
+		   << "): health_check [interval=seconds] [timeout=seconds] [fails=n] [passes=n] [uri=/path]";
 		throw CustomException(ss.str());
 	}
+	upstream.setHealthCheck(check);
+}
+
+// [option]=[positive number]; false when the token is not that option
+bool Parser::parseUpstreamOption(const std::string &token, const std::string &option, int &value)
+{
+	if (token.compare(0, option.size() + 1, option + "=") != 0)
+		return false;
+	std::string num = token.substr(option.size() + 1);
+	if (num.empty() || num[0] == '-' || !isValidNumber(num) || utils::stoi(num, this->_lineNum) <= 0)
+		return false;
+	value = utils::stoi(num, this->_lineNum);
+	return true;
+}
+
+const std::map<std::string, Upstream> &Parser::getUpstreams() const
+{
+	return this->_upstreams;
 }
 
 // parses the individual directives like: listen, server_name and so on
@@ -190,6 +807,11 @@ void Parser::parseServerBlockDirectives(ServerBlock &block)
 			parseServerName(iss);
 			this->_serverDirectiveCount["server_name"]++;
 		}
+		else if (directive == "ssl_certificate" || directive == "ssl_certificate_key" || directive == "ssl_ktls")
+		{
+			parseSsl(iss, directive);
+			this->_serverDirectiveCount[directive]++;
+		}
 		else if (directive == "root")
 		{
 			parseRoot(block, iss);
@@ -215,11 +837,42 @@ void Parser::parseServerBlockDirectives(ServerBlock &block)
 			parseRedirection(block, iss);
 			this->_serverDirectiveCount["return"]++;
 		}
+		else if (directive == "expires")
+		{
+			parseExpires(block, iss);
+			this->_serverDirectiveCount["expires"]++;
+		}
+		else if (directive == "cache_control")
+		{
+			parseCacheControl(block, iss);
+			this->_serverDirectiveCount["cache_control"]++;
+		}
+		else if (directive == "gzip" || directive == "gzip_static")
+		{
+			parseGzip(block, iss, directive);
+			this->_serverDirectiveCount[directive]++;
+		}
+		else if (directive == "gzip_comp_level")
+		{
+			parseGzipCompLevel(block, iss);
+			this->_serverDirectiveCount["gzip_comp_level"]++;
+		}
+		else if (directive == "gzip_min_length")
+		{
+			parseGzipMinLength(block, iss);
+			this->_serverDirectiveCount["gzip_min_length"]++;
+		}
 		else if (directive == "location")
 		{
 			parseLocationBlocks(iss);
 		}
-		else if (directive == "autoindex" || directive == "limit_except")
+		else if (directive == "autoindex" || directive == "autoindex_format" || directive == "limit_except" ||
+				 directive == "metrics" || directive == "proxy_pass" || directive == "proxy_connect_timeout" ||
+				 directive == "proxy_read_timeout" || directive == "response_cache" ||
+				 directive == "response_cache_valid" || directive == "micro_cache" || directive == "websocket" ||
+				 directive == "session_api" || directive == "upload_store" || directive == "upload_max_file_size" ||
+				 directive == "upload_fsync" || directive == "upload_directio" || directive == "delete_recursive" ||
+				 directive == "delete_status")
 		{
 			std::stringstream ss;
 			ss << "Error (line " << this->_lineNum
@@ -283,7 +936,8 @@ void Parser::parseLocationBlockDirectives(LocationBlock &block)
 		std::string directive;
 
 		iss >> directive;
-		if (directive == "listen" || directive == "server_name" || directive == "location")
+		if (directive == "listen" || directive == "server_name" || directive == "location" ||
+			directive == "ssl_certificate" || directive == "ssl_certificate_key" || directive == "ssl_ktls")
 		{
 			std::stringstream ss;
 			ss << "Error (line " << this->_lineNum
@@ -316,11 +970,87 @@ void Parser::parseLocationBlockDirectives(LocationBlock &block)
 			parseRedirection(block, iss);
 			this->_locationDirectiveCount["return"]++;
 		}
+		else if (directive == "expires")
+		{
+			parseExpires(block, iss);
+			this->_locationDirectiveCount["expires"]++;
+		}
+		else if (directive == "cache_control")
+		{
+			parseCacheControl(block, iss);
+			this->_locationDirectiveCount["cache_control"]++;
+		}
+		else if (directive == "gzip" || directive == "gzip_static")
+		{
+			parseGzip(block, iss, directive);
+			this->_locationDirectiveCount[directive]++;
+		}
+		else if (directive == "gzip_comp_level")
+		{
+			parseGzipCompLevel(block, iss);
+			this->_locationDirectiveCount["gzip_comp_level"]++;
+		}
+		else if (directive == "gzip_min_length")
+		{
+			parseGzipMinLength(block, iss);
+			this->_locationDirectiveCount["gzip_min_length"]++;
+		}
 		else if (directive == "autoindex")
 		{
 			parseAutoindexStatus(iss);
 			this->_locationDirectiveCount["autoindex"]++;
 		}
+		else if (directive == "autoindex_format")
+		{
+			parseAutoindexFormat(iss);
+			this->_locationDirectiveCount["autoindex_format"]++;
+		}
+		else if (directive == "metrics")
+		{
+			parseMetrics(iss);
+			this->_locationDirectiveCount["metrics"]++;
+		}
+		else if (directive == "proxy_pass")
+		{
+			parseProxyPass(iss);
+			this->_locationDirectiveCount["proxy_pass"]++;
+		}
+		else if (directive == "proxy_connect_timeout" || directive == "proxy_read_timeout")
+		{
+			parseProxyTimeout(iss, directive);
+			this->_locationDirectiveCount[directive]++;
+		}
+		else if (directive == "response_cache" || directive == "response_cache_valid")
+		{
+			parseResponseCache(iss, directive);
+			this->_locationDirectiveCount[directive]++;
+		}
+		else if (directive == "micro_cache")
+		{
+			parseMicroCache(iss);
+			this->_locationDirectiveCount["micro_cache"]++;
+		}
+		else if (directive == "websocket")
+		{
+			parseWebSocket(iss);
+			this->_locationDirectiveCount["websocket"]++;
+		}
+		else if (directive == "session_api")
+		{
+			parseSessionApi(iss);
+			this->_locationDirectiveCount["session_api"]++;
+		}
+		else if (directive == "upload_store" || directive == "upload_max_file_size" || directive == "upload_fsync" ||
+				 directive == "upload_directio")
+		{
+			parseUpload(iss, directive);
+			this->_locationDirectiveCount[directive]++;
+		}
+		else if (directive == "delete_recursive" || directive == "delete_status")
+		{
+			parseDelete(iss, directive);
+			this->_locationDirectiveCount[directive]++;
+		}
 		else if (directive == "limit_except")
 		{
 			parseAllowedMethods(iss);
@@ -365,6 +1095,8 @@ bool Parser::isValidSemicolonFormat(std::string &line)
 /*
 - check if there's at least 1 port
 - check if the port's within range, and does not have any special symbols
+- an address before it ([address]:[port]) binds only that address
+- ssl after a port makes it a TLS port
 */
 void Parser::parsePortsListeningOn(std::istringstream &iss)
 {
@@ -375,15 +1107,21 @@ void Parser::parsePortsListeningOn(std::istringstream &iss)
 	{
 		std::stringstream ss;
 		ss << "Error (line " << this->_lineNum
-			<< "): listen [port1] [port2] ... (needs at least one port number)";
+			<< "): listen [[address]:port1] [port2] ... (needs at least one port number)";
 		throw CustomException(ss.str());
 	}
 
 	while (!port.empty())
 	{
-		if (isValidPort(port))
+		std::vector<std::string> ports = this->_tempServerBlock.getPortsListeningOn();
+		if (port == "ssl" && !ports.empty() && !utils::find(this->_tempServerBlock.getSslPorts(), ports.back()))
+		{
+			LOG(LOG_DEBUG) << CYAN "port " << ports.back() << " uses ssl" << RESET;
+			this->_tempServerBlock.addSslPort(ports.back());
+		}
+		else if (isValidListen(port))
 		{
-			std::cout << CYAN "added port: " << port << RESET << std::endl;
+			LOG(LOG_DEBUG) << CYAN "added port: " << port << RESET;
 			this->_tempServerBlock.addPortsListeningOn(port);
 		}
 		else
@@ -398,6 +1136,30 @@ void Parser::parsePortsListeningOn(std::istringstream &iss)
 	}
 }
 
+// ssl_certificate [file], ssl_certificate_key [file] (PEM) and
+// ssl_ktls [on | off]
+void Parser::parseSsl(std::istringstream &iss, const std::string &directive)
+{
+	std::string value, temp;
+
+	iss >> value >> temp;
+	if (directive == "ssl_ktls" ? (value != "on" && value != "off") || !temp.empty()
+								: value.empty() || !temp.empty())
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum << "): " << directive
+		   << (directive == "ssl_ktls" ? " [on | off]" : " [file]");
+		throw CustomException(ss.str());
+	}
+	if (directive == "ssl_certificate")
+		this->_tempServerBlock.setSslCertificate(value);
+	else if (directive == "ssl_certificate_key")
+		this->_tempServerBlock.setSslCertificateKey(value);
+	else
+		this->_tempServerBlock.setSslKtls(value == "on");
+	LOG(LOG_DEBUG) << CYAN "set " << directive << ": " << value << RESET;
+}
+
 void Parser::parseServerName(std::istringstream &iss)
 {
 	std::string serverName;
@@ -421,7 +1183,7 @@ void Parser::parseServerName(std::istringstream &iss)
 		}
 		this->_tempServerBlock.addServerName(serverName);
 		this->_serverNames.push_back(serverName);
-		std::cout << CYAN "added server name: " << serverName << RESET << std::endl;
+		LOG(LOG_DEBUG) << CYAN "added server name: " << serverName << RESET;
 		if (!(iss >> serverName))
 			break;
 	}
@@ -442,8 +1204,7 @@ void Parser::parseRoot(T &block, std::istringstream &iss)
 		throw CustomException(ss.str());
 	}
 	block.setRootDirectory(rootDirectory);
-	std::cout << MAGENTA "set root directory: " << rootDirectory << RESET
-			  << std::endl;
+	LOG(LOG_DEBUG) << MAGENTA "set root directory: " << rootDirectory << RESET;
 }
 
 template <typename T>
@@ -462,7 +1223,7 @@ void Parser::parseIndex(T &block, std::istringstream &iss)
 	while (!index.empty())
 	{
 		block.addIndex(index);
-		std::cout << MAGENTA "added index: " << index << RESET << std::endl;
+		LOG(LOG_DEBUG) << MAGENTA "added index: " << index << RESET;
 		if (!(iss >> index))
 			break;
 	}
@@ -485,8 +1246,8 @@ void Parser::parseClientMaxBodySize(T &block, std::istringstream &iss)
 	}
 	num = utils::stoi(clientMaxBodySize, this->_lineNum);
 	block.setClientMaxBodySize(num);
-	std::cout << MAGENTA "set client max body size: " << num
-			  << RESET << std::endl;
+	LOG(LOG_DEBUG) << MAGENTA "set client max body size: " << num
+				   << RESET;
 }
 
 template <typename T>
@@ -501,8 +1262,8 @@ void Parser::parseErrorPages(T &block, std::istringstream &iss)
 	{
 		block.addErrorPage(statusCode, filePath);
 		this->_errorPageCount[statusCode]++;
-		std::cout << MAGENTA "added error page: " << statusCode << " " << filePath
-				<< RESET << std::endl;
+		LOG(LOG_DEBUG) << MAGENTA "added error page: " << statusCode << " " << filePath
+					   << RESET;
 	}
 	else
 	{
@@ -530,8 +1291,137 @@ void Parser::parseRedirection(T &block, std::istringstream &iss)
 		throw CustomException(ss.str());
 	}
 	block.setRedirection(statusCode, path);
-	std::cout << MAGENTA "added redirection: " << statusCode << " " << path
-			  << RESET << std::endl;
+	LOG(LOG_DEBUG) << MAGENTA "added redirection: " << statusCode << " " << path
+				   << RESET;
+}
+
+/*
+expires off | [seconds] | [number][s/m/h/d]
+sets both the Expires and Cache-Control: max-age headers of static files
+*/
+template <typename T>
+void Parser::parseExpires(T &block, std::istringstream &iss)
+{
+	std::string value;
+	std::string temp;
+	int seconds;
+
+	iss >> value >> temp;
+	if (value == "off" && temp.empty())
+	{
+		block.setExpires(-1);
+		LOG(LOG_DEBUG) << MAGENTA "set expires: off" << RESET;
+		return;
+	}
+	int unit = 1;
+	std::string num = value;
+	if (!num.empty())
+	{
+		char suffix = num[num.length() - 1];
+		if (suffix == 's' || suffix == 'm' || suffix == 'h' || suffix == 'd')
+		{
+			unit = suffix == 's' ? 1 : suffix == 'm' ? 60 : suffix == 'h' ? 3600 : 86400;
+			num = num.substr(0, num.length() - 1);
+		}
+	}
+	if (num.empty() || num[0] == '-' || !isValidNumber(num) || !temp.empty())
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum
+			<< "): expires [off / seconds / number followed by s, m, h or d]";
+		throw CustomException(ss.str());
+	}
+	seconds = utils::stoi(num, this->_lineNum);
+	if (seconds > 2147483647 / unit)
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum << "): expires is too large";
+		throw CustomException(ss.str());
+	}
+	block.setExpires(seconds * unit);
+	LOG(LOG_DEBUG) << MAGENTA "set expires: " << seconds * unit << "s" << RESET;
+}
+
+/*
+cache_control [value] (sent as-is, overrides the max-age set by expires)
+*/
+template <typename T>
+void Parser::parseCacheControl(T &block, std::istringstream &iss)
+{
+	std::string value;
+
+	std::getline(iss, value);
+	value = utils::trim(value);
+	if (value.empty())
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum
+			<< "): cache_control [value] (e.g. cache_control public, max-age=3600)";
+		throw CustomException(ss.str());
+	}
+	block.setCacheControl(value);
+	LOG(LOG_DEBUG) << MAGENTA "set cache control: " << value << RESET;
+}
+
+/*
+gzip on | off			compress responses on the fly
+gzip_static on | off	serve file.br / file.gz siblings when accepted
+*/
+template <typename T>
+void Parser::parseGzip(T &block, std::istringstream &iss, const std::string &directive)
+{
+	std::string status;
+	std::string temp;
+
+	iss >> status >> temp;
+	if ((status != "on" && status != "off") || !temp.empty())
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum
+			<< "): " << directive << " [on / off]";
+		throw CustomException(ss.str());
+	}
+	if (directive == "gzip")
+		block.setGzip(status == "on");
+	else
+		block.setGzipStatic(status == "on");
+	LOG(LOG_DEBUG) << MAGENTA "set " << directive << ": " << status << RESET;
+}
+
+template <typename T>
+void Parser::parseGzipCompLevel(T &block, std::istringstream &iss)
+{
+	std::string level;
+	std::string temp;
+
+	iss >> level >> temp;
+	if (level.length() != 1 || level[0] < '1' || level[0] > '9' || !temp.empty())
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum
+			<< "): gzip_comp_level [1-9]";
+		throw CustomException(ss.str());
+	}
+	block.setGzipCompLevel(level[0] - '0');
+	LOG(LOG_DEBUG) << MAGENTA "set gzip compression level: " << level << RESET;
+}
+
+template <typename T>
+void Parser::parseGzipMinLength(T &block, std::istringstream &iss)
+{
+	std::string length;
+	std::string temp;
+
+	iss >> length >> temp;
+	if (length.empty() || length[0] == '-' || !isValidNumber(length) || !temp.empty())
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum
+			<< "): gzip_min_length [bytes] (needs only one positive integer)";
+		throw CustomException(ss.str());
+	}
+	block.setGzipMinLength(utils::stoi(length, this->_lineNum));
+	LOG(LOG_DEBUG) << MAGENTA "set gzip min length: " << length << RESET;
 }
 
 void Parser::parseAutoindexStatus(std::istringstream &iss)
@@ -548,7 +1438,224 @@ void Parser::parseAutoindexStatus(std::istringstream &iss)
 		throw CustomException(ss.str());
 	}
 	this->_tempLocationBlock.setAutoindexStatus(true);
-	std::cout << CYAN "autoindex set to on" << RESET << std::endl;
+	LOG(LOG_DEBUG) << CYAN "autoindex set to on" << RESET;
+}
+
+void Parser::parseAutoindexFormat(std::istringstream &iss)
+{
+	std::string format;
+	std::string temp;
+
+	iss >> format >> temp;
+	if ((format != "html" && format != "json" && format != "xml") || !temp.empty())
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum
+			<< "): autoindex_format [html / json / xml]";
+		throw CustomException(ss.str());
+	}
+	this->_tempLocationBlock.setAutoindexFormat(format);
+	LOG(LOG_DEBUG) << CYAN "autoindex format set to " << format << RESET;
+}
+
+void Parser::parseMetrics(std::istringstream &iss)
+{
+	std::string format;
+	std::string temp;
+
+	iss >> format >> temp;
+	if ((format != "stub_status" && format != "prometheus") || !temp.empty())
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum
+			<< "): metrics [stub_status / prometheus]";
+		throw CustomException(ss.str());
+	}
+	this->_tempLocationBlock.setMetricsFormat(format);
+	LOG(LOG_DEBUG) << CYAN "metrics format set to " << format << RESET;
+}
+
+// proxy_pass http://host[:port][/uri]; without a port the host can name an
+// upstream block, otherwise port 80 is used
+void Parser::parseProxyPass(std::istringstream &iss)
+{
+	std::string url, temp;
+
+	iss >> url >> temp;
+	size_t hostEnd = url.find('/', 7);
+	std::string authority = url.substr(url.compare(0, 7, "http://") ? 0 : 7, hostEnd - 7);
+	std::string uri = hostEnd == std::string::npos ? "" : url.substr(hostEnd);
+	size_t colon = authority.rfind(':');
+	std::string host = authority.substr(0, colon);
+	std::string port = colon == std::string::npos ? "" : authority.substr(colon + 1);
+	if (url.compare(0, 7, "http://") != 0 || host.empty() || !temp.empty() ||
+		(colon != std::string::npos && (port.empty() || !isValidPort(port))))
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum
+			<< "): proxy_pass http://[host][:port][/uri]";
+		throw CustomException(ss.str());
+	}
+	this->_tempLocationBlock.setProxyPass(host, port, uri);
+	LOG(LOG_DEBUG) << CYAN "proxy_pass set to " << authority << uri << RESET;
+}
+
+// proxy_connect_timeout [seconds] / proxy_read_timeout [seconds]
+void Parser::parseProxyTimeout(std::istringstream &iss, const std::string &directive)
+{
+	std::string seconds, temp;
+
+	iss >> seconds >> temp;
+	if (seconds.empty() || !isValidNumber(seconds) || seconds[0] == '-' || !temp.empty() ||
+		utils::stoi(seconds, this->_lineNum) <= 0)
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum
+			<< "): " << directive << " [seconds]";
+		throw CustomException(ss.str());
+	}
+	if (directive == "proxy_connect_timeout")
+		this->_tempLocationBlock.setProxyConnectTimeout(utils::stoi(seconds, this->_lineNum));
+	else
+		this->_tempLocationBlock.setProxyReadTimeout(utils::stoi(seconds, this->_lineNum));
+	LOG(LOG_DEBUG) << CYAN "set " << directive << ": " << seconds << "s" RESET;
+}
+
+// response_cache [on | off] / response_cache_valid [seconds]
+void Parser::parseResponseCache(std::istringstream &iss, const std::string &directive)
+{
+	std::string value, temp;
+
+	iss >> value >> temp;
+	if (directive == "response_cache")
+	{
+		if ((value != "on" && value != "off") || !temp.empty())
+		{
+			std::stringstream ss;
+			ss << "Error (line " << this->_lineNum << "): response_cache [on | off]";
+			throw CustomException(ss.str());
+		}
+		this->_tempLocationBlock.setResponseCache(value == "on");
+	}
+	else
+	{
+		if (value.empty() || !isValidNumber(value) || value[0] == '-' || !temp.empty() ||
+			utils::stoi(value, this->_lineNum) <= 0)
+		{
+			std::stringstream ss;
+			ss << "Error (line " << this->_lineNum << "): response_cache_valid [seconds]";
+			throw CustomException(ss.str());
+		}
+		this->_tempLocationBlock.setResponseCacheValid(utils::stoi(value, this->_lineNum));
+	}
+	LOG(LOG_DEBUG) << CYAN "set " << directive << ": " << value << RESET;
+}
+
+// micro_cache [on | off]
+void Parser::parseMicroCache(std::istringstream &iss)
+{
+	std::string value, temp;
+
+	iss >> value >> temp;
+	if ((value != "on" && value != "off") || !temp.empty())
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum << "): micro_cache [on | off]";
+		throw CustomException(ss.str());
+	}
+	this->_tempLocationBlock.setMicroCache(value == "on");
+	LOG(LOG_DEBUG) << CYAN "set micro_cache: " << value << RESET;
+}
+
+// websocket [echo | broadcast]
+void Parser::parseWebSocket(std::istringstream &iss)
+{
+	std::string value, temp;
+
+	iss >> value >> temp;
+	if ((value != "echo" && value != "broadcast") || !temp.empty())
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum << "): websocket [echo | broadcast]";
+		throw CustomException(ss.str());
+	}
+	this->_tempLocationBlock.setWebSocket(value);
+	LOG(LOG_DEBUG) << CYAN "set websocket: " << value << RESET;
+}
+
+// session_api [on | off]
+void Parser::parseSessionApi(std::istringstream &iss)
+{
+	std::string value, temp;
+
+	iss >> value >> temp;
+	if ((value != "on" && value != "off") || !temp.empty())
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum << "): session_api [on | off]";
+		throw CustomException(ss.str());
+	}
+	this->_tempLocationBlock.setSessionApi(value == "on");
+	LOG(LOG_DEBUG) << CYAN "set session_api: " << value << RESET;
+}
+
+// delete_recursive [on | off], delete_status [on | off]
+void Parser::parseDelete(std::istringstream &iss, const std::string &directive)
+{
+	std::string value, temp;
+
+	iss >> value >> temp;
+	if ((value != "on" && value != "off") || !temp.empty())
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum << "): " << directive << " [on | off]";
+		throw CustomException(ss.str());
+	}
+	if (directive == "delete_recursive")
+		this->_tempLocationBlock.setDeleteRecursive(value == "on");
+	else
+		this->_tempLocationBlock.setDeleteStatus(value == "on");
+	LOG(LOG_DEBUG) << CYAN "set " << directive << ": " << value << RESET;
+}
+
+// upload_store [directory], upload_max_file_size [size] (0: no limit),
+// upload_fsync [off | file | full], upload_directio [off | size]
+void Parser::parseUpload(std::istringstream &iss, const std::string &directive)
+{
+	std::string value, temp;
+	unsigned long long size = 0;
+	bool valid;
+
+	iss >> value >> temp;
+	if (directive == "upload_fsync")
+		valid = value == "off" || value == "file" || value == "full";
+	else if (directive == "upload_directio")
+		valid = value == "off" || (parseSize(value, size) && size);
+	else
+		valid = directive == "upload_store" ? !value.empty() : parseSize(value, size);
+	if (!valid || !temp.empty())
+	{
+		std::stringstream ss;
+		ss << "Error (line " << this->_lineNum << "): " << directive;
+		if (directive == "upload_store")
+			ss << " [directory]";
+		else if (directive == "upload_fsync")
+			ss << " [off | file | full]";
+		else if (directive == "upload_directio")
+			ss << " [off | size]";
+		else
+			ss << " [size]";
+		throw CustomException(ss.str());
+	}
+	if (directive == "upload_store")
+		this->_tempLocationBlock.setUploadStore(value);
+	else if (directive == "upload_fsync")
+		this->_tempLocationBlock.setUploadFsync(value);
+	else if (directive == "upload_directio")
+		this->_tempLocationBlock.setUploadDirectio(size);
+	else
+		this->_tempLocationBlock.setUploadMaxFileSize(size);
+	LOG(LOG_DEBUG) << CYAN "set " << directive << ": " << value << RESET;
 }
 
 void Parser::parseAllowedMethods(std::istringstream &iss)
@@ -560,21 +1667,21 @@ void Parser::parseAllowedMethods(std::istringstream &iss)
 	{
 		std::stringstream ss;
 		ss << "Error (line " << this->_lineNum
-			<< "): limit_except [method1] [method2] ... (needs at least one method: GET, POST, DELETE)";
+			<< "): limit_except [method1] [method2] ... (needs at least one method: GET, POST, PUT, DELETE)";
 		throw CustomException(ss.str());
 	}
 	while (!method.empty())
 	{
 		if (isValidMethod(method))
 		{
-			std::cout << CYAN "added method: " << method << RESET << std::endl;
+			LOG(LOG_DEBUG) << CYAN "added method: " << method << RESET;
 			this->_tempLocationBlock.addAllowedMethods(method);
 		}
 		else
 		{
 			std::stringstream ss;
 			ss << "Error (line " << this->_lineNum
-				<< "): " << method << " is an invalid method (valid methods: GET, POST, DELETE)";
+				<< "): " << method << " is an invalid method (valid methods: GET, POST, PUT, DELETE)";
 			throw CustomException(ss.str());
 		}
 		if (!(iss >> method))
@@ -621,6 +1728,17 @@ bool Parser::isValidPort(std::string &port)
 	return (true);
 }
 
+// [port] or [address]:[port]; the address is resolved when it is bound
+bool Parser::isValidListen(std::string &listen)
+{
+	size_t colon = listen.rfind(':');
+
+	if (colon == std::string::npos)
+		return (isValidPort(listen));
+	std::string port = listen.substr(colon + 1);
+	return (colon > 0 && isValidPort(port));
+}
+
 bool Parser::isClosedCurlyBracket(std::string &line)
 {
 	std::istringstream iss(line);
@@ -646,9 +1764,9 @@ bool Parser::isValidErrorStatusCode(int statusCode)
 
 bool Parser::isValidMethod(std::string &method)
 {
-	std::string validMethods[3] = {"GET", "POST", "DELETE"};
+	std::string validMethods[4] = {"GET", "POST", "PUT", "DELETE"};
 	
-	for (int i = 0; i < 3; i++)
+	for (int i = 0; i < 4; i++)
 	{
 		if (method == validMethods[i])
 		{
@@ -687,18 +1805,25 @@ bool Parser::isUniqueServerName(std::string &serverName)
 
 void Parser::initServerDirectiveCount()
 {
-	std::string dir[7] = {"listen", "server_name", "root", "index", "client_max_body_size", "error_page", "return"};
+	std::string dir[16] = {"listen", "server_name", "root", "index", "client_max_body_size", "error_page", "return",
+						   "expires", "cache_control", "gzip", "gzip_static", "gzip_comp_level", "gzip_min_length",
+						   "ssl_certificate", "ssl_certificate_key", "ssl_ktls"};
 
-	for (int i = 0; i < 7; i++) {
+	for (int i = 0; i < 16; i++) {
 		this->_serverDirectiveCount[dir[i]] = 0;
 	}
 }
 
 void Parser::initLocationDirectiveCount()
 {
-	std::string dir[7] = {"root", "index", "client_max_body_size", "error_page", "return", "autoindex", "limit_except"};
-
-	for (int i = 0; i < 7; i++) {
+	std::string dir[29] = {"root", "index", "client_max_body_size", "error_page", "return", "autoindex", "limit_except",
+						   "expires", "cache_control", "gzip", "gzip_static", "gzip_comp_level", "gzip_min_length",
+						   "autoindex_format", "metrics", "proxy_pass", "proxy_connect_timeout", "proxy_read_timeout",
+						   "response_cache", "response_cache_valid", "micro_cache", "websocket",
+						   "session_api", "upload_store", "upload_max_file_size", "upload_fsync",
+						   "upload_directio", "delete_recursive", "delete_status"};
+
+	for (int i = 0; i < 29; i++) {
 		this->_locationDirectiveCount[dir[i]] = 0;
 	}
 }
@@ -745,6 +1870,27 @@ void Parser::checkServerDirectiveCount()
 		throw CustomException(ss.str());
 	}
 
+	std::string optional[9] = {"expires", "cache_control", "gzip", "gzip_static", "gzip_comp_level", "gzip_min_length",
+							   "ssl_certificate", "ssl_certificate_key", "ssl_ktls"};
+	for (int i = 0; i < 9; i++)
+	{
+		if (_serverDirectiveCount[optional[i]] > 1)
+		{
+			ss << "Error (server block " << _serverBlockNum - 1 << "): The directive " << optional[i] << " can only be used once";
+			throw CustomException(ss.str());
+		}
+	}
+
+	// ssl ports need both, and the files are only useful with one
+	bool hasSslPorts = !_tempServerBlock.getSslPorts().empty();
+	if (hasSslPorts != (_serverDirectiveCount["ssl_certificate"] == 1) ||
+		hasSslPorts != (_serverDirectiveCount["ssl_certificate_key"] == 1))
+	{
+		ss << "Error (server block " << _serverBlockNum - 1
+		   << "): listen [port] ssl needs ssl_certificate and ssl_certificate_key, and they need an ssl port";
+		throw CustomException(ss.str());
+	}
+
 	for (unsigned int i = 0; i < _validStatusCodes.size(); i++)
 	{
 		if (_errorPageCount[_validStatusCodes[i]] != 1)
@@ -763,11 +1909,33 @@ void Parser::checkLocationDirectiveCount()
 	directives.push_back("index");
 	directives.push_back("client_max_body_size");
 	directives.push_back("autoindex");
+	directives.push_back("autoindex_format");
+	directives.push_back("metrics");
+	directives.push_back("proxy_pass");
+	directives.push_back("proxy_connect_timeout");
+	directives.push_back("proxy_read_timeout");
+	directives.push_back("response_cache");
+	directives.push_back("response_cache_valid");
+	directives.push_back("micro_cache");
+	directives.push_back("websocket");
+	directives.push_back("session_api");
+	directives.push_back("upload_store");
+	directives.push_back("upload_max_file_size");
+	directives.push_back("upload_fsync");
+	directives.push_back("upload_directio");
+	directives.push_back("delete_recursive");
+	directives.push_back("delete_status");
 	directives.push_back("limit_except");
 	directives.push_back("return");
-
-	// check if the 6 directives have no more than one
-	for (int i = 0; i < 6; i++)
+	directives.push_back("expires");
+	directives.push_back("cache_control");
+	directives.push_back("gzip");
+	directives.push_back("gzip_static");
+	directives.push_back("gzip_comp_level");
+	directives.push_back("gzip_min_length");
+
+	// check if the directives have no more than one
+	for (size_t i = 0; i < directives.size(); i++)
 	{
 		int count = _locationDirectiveCount[directives[i]];
 		if (count > 1) {
@@ -0,0 +1,223 @@
+#include "Poller.hpp"
+#include "CustomException.hpp"
+#include "UringPoller.hpp"
+#include <cerrno>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+/***********************************
+ * Poller
+ ***********************************/
+
+Poller::Poller(void)
+{
+}
+
+Poller::~Poller(void)
+{
+}
+
+Poller::Poller(const Poller &src)
+{
+	(void)src;
+}
+
+Poller &Poller::operator=(const Poller &rhs)
+{
+	(void)rhs;
+	return *this;
+}
+
+void Poller::addListener(int fd)
+{
+	add(fd, POLLIN);
+}
+
+std::vector<std::pair<int, int> > Poller::takeAccepted()
+{
+	return std::vector<std::pair<int, int> >();
+}
+
+bool Poller::isValidBackend(const std::string &backend)
+{
+	return backend == "poll" || backend == "epoll" || backend == "io_uring";
+}
+
+Poller *Poller::create(const std::string &backend)
+{
+	if (backend == "poll")
+		return new PollPoller();
+	if (backend == "epoll")
+		return new EpollPoller();
+	if (backend == "io_uring")
+		return new UringPoller();
+	throw CustomException("Error: unknown event backend " + backend);
+}
+
+/***********************************
+ * PollPoller
+ ***********************************/
+
+PollPoller::PollPoller(void) : Poller(), _pfds(), _indexes()
+{
+}
+
+PollPoller::~PollPoller(void)
+{
+}
+
+// paused fds (events 0) are stored as -fd - 1 so poll() skips them instead of
+// reporting POLLHUP on them over and over
+static int pollSlot(int fd, short events)
+{
+	return events ? fd : -fd - 1;
+}
+
+void PollPoller::add(int fd, short events)
+{
+	struct pollfd pfd;
+
+	pfd.fd = pollSlot(fd, events);
+	pfd.events = events;
+	pfd.revents = 0;
+	_indexes[fd] = _pfds.size();
+	_pfds.push_back(pfd);
+}
+
+void PollPoller::modify(int fd, short events)
+{
+	std::map<int, size_t>::iterator it = _indexes.find(fd);
+	if (it == _indexes.end())
+		return;
+	_pfds[it->second].fd = pollSlot(fd, events);
+	_pfds[it->second].events = events;
+}
+
+// the last pollfd takes the removed one's place so indexes stay dense
+void PollPoller::remove(int fd)
+{
+	std::map<int, size_t>::iterator it = _indexes.find(fd);
+	if (it == _indexes.end())
+		return;
+	size_t index = it->second;
+	_indexes.erase(it);
+	if (index != _pfds.size() - 1)
+	{
+		_pfds[index] = _pfds.back();
+		_indexes[_pfds[index].fd < 0 ? -_pfds[index].fd - 1 : _pfds[index].fd] = index;
+	}
+	_pfds.pop_back();
+}
+
+int PollPoller::wait(std::vector<struct pollfd> &ready, int timeout)
+{
+	ready.clear();
+	int count = poll(_pfds.empty() ? NULL : &_pfds[0], _pfds.size(), timeout);
+	if (count <= 0)
+		return count;
+	for (size_t i = 0; i < _pfds.size(); i++)
+		if (_pfds[i].revents)
+			ready.push_back(_pfds[i]);
+	return ready.size();
+}
+
+const char *PollPoller::getName() const
+{
+	return "poll";
+}
+
+/***********************************
+ * EpollPoller
+ ***********************************/
+
+// like poll, epoll reports EPOLLHUP even with no interest, so paused fds
+// (events 0) are taken out of the set and added back on the next modify
+
+static unsigned int toEpollEvents(short events)
+{
+	return (events & POLLIN ? (unsigned int)EPOLLIN : 0) | (events & POLLOUT ? (unsigned int)EPOLLOUT : 0);
+}
+
+static short toPollEvents(unsigned int events)
+{
+	return (events & EPOLLIN ? POLLIN : 0) | (events & EPOLLOUT ? POLLOUT : 0) | (events & EPOLLHUP ? POLLHUP : 0) |
+		   (events & EPOLLERR ? POLLERR : 0);
+}
+
+EpollPoller::EpollPoller(void) : Poller(), _registered()
+{
+	_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (_epfd == -1)
+		throw CustomException("Error: epoll_create1 failed");
+}
+
+EpollPoller::~EpollPoller(void)
+{
+	close(_epfd);
+}
+
+void EpollPoller::add(int fd, short events)
+{
+	struct epoll_event ev;
+
+	_registered[fd] = events != 0;
+	if (!events)
+		return;
+	ev.events = toEpollEvents(events);
+	ev.data.fd = fd;
+	epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+void EpollPoller::modify(int fd, short events)
+{
+	struct epoll_event ev;
+	std::map<int, bool>::iterator it = _registered.find(fd);
+
+	if (it == _registered.end())
+		return;
+	if (!events)
+	{
+		if (it->second)
+			epoll_ctl(_epfd, EPOLL_CTL_DEL, fd, NULL);
+		it->second = false;
+		return;
+	}
+	ev.events = toEpollEvents(events);
+	ev.data.fd = fd;
+	epoll_ctl(_epfd, it->second ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev);
+	it->second = true;
+}
+
+void EpollPoller::remove(int fd)
+{
+	std::map<int, bool>::iterator it = _registered.find(fd);
+
+	if (it == _registered.end())
+		return;
+	if (it->second)
+		epoll_ctl(_epfd, EPOLL_CTL_DEL, fd, NULL);
+	_registered.erase(it);
+}
+
+int EpollPoller::wait(std::vector<struct pollfd> &ready, int timeout)
+{
+	struct epoll_event events[POLLER_MAX_EVENTS];
+
+	ready.clear();
+	int count = epoll_wait(_epfd, events, POLLER_MAX_EVENTS, timeout);
+	for (int i = 0; i < count; i++)
+	{
+		struct pollfd pfd;
+
+		pfd.fd = events[i].data.fd;
+		pfd.events = 0;
+		pfd.revents = toPollEvents(events[i].events);
+		ready.push_back(pfd);
+	}
+	return count;
+}
+
+const char *EpollPoller::getName() const
+{
+	return "epoll";
+}
@@ -0,0 +1,985 @@
+#include "Proxy.hpp"
+#include "Log.hpp"
+#include "MethodIO.hpp"
+#include "Metrics.hpp"
+#include "WebServer.hpp"
+#include "utils.hpp"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <netdb.h>
+#include <poll.h>
+#include <sstream>
+#include <strings.h>
+#include <unistd.h>
+
+/***********************************
+ * Constructors
+ ***********************************/
+
+Proxy::Request::Request()
+	: host(), port(), head(), body(), headRequest(false), connectTimeout(DEFAULT_PROXY_CONNECT_TIMEOUT),
+	  readTimeout(DEFAULT_PROXY_READ_TIMEOUT), capture(false), captureLimit(0), upgrade(false)
+{
+}
+
+Proxy::Session::Session()
+	: client(-1), upstream(-1), key(), request(), sent(0), received(0), connecting(false), reused(false),
+	  retried(false), headRequest(false), paused(false), headDone(false), reusable(false), done(false), head(),
+	  mode(BODY_NONE), remaining(0), chunkState(CHUNK_SIZE), chunkLine(), connectTimeout(0), readTimeout(0),
+	  deadline(0), group(), hasPeer(false), tried(), hashValue(), idempotent(false), capture(false),
+	  captureLimit(0), captured(), upgrade(false), tunnel(false)
+{
+}
+
+Proxy::Probe::Probe() : group(), key(), request(), sent(0), response(), deadline(0)
+{
+}
+
+Proxy::Proxy(WebServer &server) : _server(server)
+{
+}
+
+Proxy::Proxy(const Proxy &src) : _server(src._server)
+{
+}
+
+Proxy &Proxy::operator=(const Proxy &rhs)
+{
+	(void)rhs;
+	return *this;
+}
+
+/***********************************
+ * Destructors
+ ***********************************/
+
+Proxy::~Proxy(void)
+{
+	for (std::map<int, Session *>::iterator it = _byClient.begin(); it != _byClient.end(); it++)
+	{
+		if (it->second->upstream != -1)
+			close(it->second->upstream);
+		delete it->second;
+	}
+	for (std::map<int, std::string>::iterator it = _idleKeys.begin(); it != _idleKeys.end(); it++)
+		close(it->first);
+	for (std::map<int, Probe>::iterator it = _probes.begin(); it != _probes.end(); it++)
+		close(it->first);
+}
+
+/***********************************
+ * Helpers
+ ***********************************/
+
+// the value an upstream block with hash [key] spreads its requests by
+static std::string hashValue(const std::string &key, const Proxy::Request &request, const std::string &remote)
+{
+	if (key == "$remote_addr")
+		return remote;
+	size_t uri = request.head.find(' ') + 1;
+	if (key == "$request_uri")
+		return request.head.substr(uri, request.head.find(' ', uri) - uri);
+
+	// $http_x_user_id is the X-User-Id header
+	std::string name = key.substr(6);
+	for (size_t i = 0; i < name.size(); i++)
+		if (name[i] == '_')
+			name[i] = '-';
+	for (size_t pos = request.head.find("\r\n"); pos != std::string::npos; pos = request.head.find("\r\n", pos + 2))
+	{
+		const char *line = request.head.c_str() + pos + 2;
+		if (!strncasecmp(line, name.c_str(), name.size()) && line[name.size()] == ':')
+		{
+			size_t end = request.head.find("\r\n", pos + 2);
+			return utils::trim(request.head.substr(pos + 3 + name.size(), end == std::string::npos ? std::string::npos : end - pos - 3 - name.size()));
+		}
+	}
+	return "";
+}
+
+static bool isIdempotent(const std::string &head)
+{
+	static const char *methods[] = {"GET", "HEAD", "PUT", "DELETE", "OPTIONS", "TRACE"};
+	std::string method = head.substr(0, head.find(' '));
+
+	for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); i++)
+		if (method == methods[i])
+			return true;
+	return false;
+}
+
+/***********************************
+ * Event loop interface
+ ***********************************/
+
+// takes over the upstream blocks of a (re)loaded config; the peers that are
+// still listed keep their failure and health state
+void Proxy::setUpstreams(const std::map<std::string, Upstream> &upstreams)
+{
+	std::map<std::string, Upstream> next = upstreams;
+
+	for (std::map<std::string, Upstream>::iterator it = next.begin(); it != next.end(); it++)
+	{
+		std::map<std::string, Upstream>::iterator old = _upstreams.find(it->first);
+		if (old != _upstreams.end())
+			it->second.inherit(old->second);
+	}
+	_upstreams.swap(next);
+}
+
+void Proxy::start(int client, const Request &request, const std::string &remote, std::map<int, std::string> &buffMap)
+{
+	Session *session = new Session();
+	std::map<std::string, Upstream>::iterator group = _upstreams.find(request.host);
+
+	session->client = client;
+	session->key = request.host + ":" + (request.port.empty() ? "80" : request.port);
+	if (request.port.empty() && group != _upstreams.end())
+	{
+		session->group = request.host;
+		if (group->second.getBalance() == Upstream::HASH)
+			session->hashValue = hashValue(group->second.getHashKey(), request, remote);
+	}
+	session->idempotent = isIdempotent(request.head);
+	session->request = request.head + "\r\nX-Forwarded-For: " + remote + "\r\n";
+	if (!request.body.empty())
+		session->request += "Content-Length: " + utils::to_string(request.body.size()) + "\r\n";
+	session->request += "\r\n" + request.body;
+	session->headRequest = request.headRequest;
+	session->connectTimeout = request.connectTimeout;
+	session->readTimeout = request.readTimeout;
+	session->capture = request.capture;
+	session->captureLimit = request.captureLimit;
+	session->upgrade = request.upgrade;
+	_byClient[client] = session;
+	if (!attach(*session))
+		failed(*session, 502, buffMap);
+}
+
+// upstream fds, busy or idle, and health probes
+bool Proxy::owns(int fd) const
+{
+	return _byUpstream.count(fd) || _idleKeys.count(fd) || _probes.count(fd);
+}
+
+bool Proxy::isProxying(int client) const
+{
+	return _byClient.count(client);
+}
+
+bool Proxy::isTunnel(int client) const
+{
+	std::map<int, Session *>::const_iterator it = _byClient.find(client);
+
+	return it != _byClient.end() && it->second->tunnel;
+}
+
+void Proxy::handle(int fd, short revents, std::map<int, std::string> &buffMap)
+{
+	// an idle connection only becomes readable when the upstream closes it
+	// (or misbehaves); either way it is not reusable
+	if (_idleKeys.count(fd))
+	{
+		closeIdle(fd);
+		return;
+	}
+	if (_probes.count(fd))
+	{
+		handleProbe(fd, revents);
+		return;
+	}
+	Session &session = *_byUpstream[fd];
+	if (session.tunnel)
+	{
+		if (revents & POLLOUT && session.sent < session.request.size())
+		{
+			sendRequest(session, buffMap);
+			if (!_byUpstream.count(fd))
+				return;
+		}
+		if (revents & (POLLIN | POLLHUP | POLLERR))
+			readResponse(session, buffMap);
+	}
+	else if (!session.headDone && session.sent < session.request.size())
+	{
+		if (revents & (POLLOUT | POLLHUP | POLLERR))
+			sendRequest(session, buffMap);
+	}
+	else if (revents & (POLLIN | POLLHUP | POLLERR))
+		readResponse(session, buffMap);
+}
+
+// called as the client's send buffer drains
+void Proxy::resume(int client)
+{
+	std::map<int, Session *>::iterator it = _byClient.find(client);
+
+	if (it == _byClient.end() || !it->second->paused)
+		return;
+	it->second->paused = false;
+	_server.setEvents(it->second->upstream, upstreamEvents(*it->second));
+}
+
+// bytes the client of a tunnel sent, queued for the upstream
+void Proxy::forward(int client, const char *data, size_t size, std::map<int, std::string> &buffMap)
+{
+	Session &session = *_byClient[client];
+
+	session.request.append(data, size);
+	session.deadline = Metrics::now() + session.readTimeout;
+	_server.setEvents(session.upstream, upstreamEvents(session));
+	updateTunnel(client, buffMap);
+}
+
+// a tunnel's client is read while the upstream keeps up with it, and written
+// while it has bytes from the upstream
+void Proxy::updateTunnel(int client, std::map<int, std::string> &buffMap)
+{
+	std::map<int, Session *>::iterator it = _byClient.find(client);
+
+	if (it == _byClient.end())
+		return;
+	Session &session = *it->second;
+	short events = session.request.size() - session.sent < PROXY_BUFFER_SIZE ? POLLIN : 0;
+	if (!buffMap[client].empty())
+		events |= POLLOUT;
+	if (_server.getEvents(client) != events)
+		_server.setEvents(client, events);
+}
+
+// the client went away; the upstream is mid-response, so it is closed
+void Proxy::abort(int client)
+{
+	std::map<int, Session *>::iterator it = _byClient.find(client);
+
+	if (it == _byClient.end())
+		return;
+	finish(*it->second, false);
+}
+
+// milliseconds until the next deadline (a stalled upstream, an idle
+// connection to drop or a health probe to send or give up on), -1 when there
+// is none
+int Proxy::getTimeout(double now) const
+{
+	double next = -1;
+
+	for (std::map<std::string, Upstream>::const_iterator it = _upstreams.begin(); it != _upstreams.end(); it++)
+	{
+		if (!it->second.getHealthCheck().enabled)
+			continue;
+		const std::vector<Upstream::Peer> &peers = it->second.getPeers();
+		for (size_t i = 0; i < peers.size(); i++)
+			if (next < 0 || peers[i].nextProbe < next)
+				next = peers[i].nextProbe;
+	}
+	for (std::map<int, Probe>::const_iterator it = _probes.begin(); it != _probes.end(); it++)
+		if (next < 0 || it->second.deadline < next)
+			next = it->second.deadline;
+
+	for (std::map<int, Session *>::const_iterator it = _byUpstream.begin(); it != _byUpstream.end(); it++)
+		if (!it->second->paused && (next < 0 || it->second->deadline < next))
+			next = it->second->deadline;
+	for (std::map<std::string, std::vector<Idle> >::const_iterator it = _idle.begin(); it != _idle.end(); it++)
+		for (size_t i = 0; i < it->second.size(); i++)
+			if (next < 0 || it->second[i].since + UPSTREAM_KEEPALIVE_TIMEOUT < next)
+				next = it->second[i].since + UPSTREAM_KEEPALIVE_TIMEOUT;
+	if (next < 0)
+		return -1;
+	if (next <= now)
+		return 0;
+	return (int)((next - now) * 1000) + 1;
+}
+
+// 504 for upstreams that did not connect or answer in time; a response that
+// stalls halfway is cut off
+void Proxy::expire(double now, std::map<int, std::string> &buffMap)
+{
+	std::vector<Session *> expired;
+
+	for (std::map<int, Session *>::iterator it = _byUpstream.begin(); it != _byUpstream.end(); it++)
+		if (!it->second->paused && it->second->deadline <= now)
+			expired.push_back(it->second);
+	for (size_t i = 0; i < expired.size(); i++)
+	{
+		LOG(LOG_WARN) << "upstream " << expired[i]->key << " timed out";
+		failed(*expired[i], 504, buffMap);
+	}
+
+	std::vector<int> stale;
+	for (std::map<std::string, std::vector<Idle> >::iterator it = _idle.begin(); it != _idle.end(); it++)
+		for (size_t i = 0; i < it->second.size(); i++)
+			if (it->second[i].since + UPSTREAM_KEEPALIVE_TIMEOUT <= now)
+				stale.push_back(it->second[i].fd);
+	for (size_t i = 0; i < stale.size(); i++)
+		closeIdle(stale[i]);
+
+	std::vector<int> late;
+	for (std::map<int, Probe>::iterator it = _probes.begin(); it != _probes.end(); it++)
+		if (it->second.deadline <= now)
+			late.push_back(it->first);
+	for (size_t i = 0; i < late.size(); i++)
+		endProbe(late[i], false);
+	startProbes(now);
+}
+
+std::vector<Proxy::Result> Proxy::takeResults()
+{
+	std::vector<Result> results;
+
+	results.swap(_results);
+	return results;
+}
+
+/***********************************
+ * Upstream connections
+ ***********************************/
+
+// takes the most recently used idle connection, or starts a new one; for an
+// upstream block the balancer picks the peer first, and a peer refusing the
+// connection outright is skipped for the next one
+bool Proxy::attach(Session &session)
+{
+	for (;;)
+	{
+		if (!session.group.empty() && !session.hasPeer && !pickPeer(session))
+			return false;
+
+		std::vector<Idle> &idle = _idle[session.key];
+		session.sent = 0;
+		session.received = 0;
+		if (!idle.empty())
+		{
+			session.upstream = idle.back().fd;
+			idle.pop_back();
+			_idleKeys.erase(session.upstream);
+			session.reused = true;
+			session.connecting = false;
+			_server.setEvents(session.upstream, POLLOUT);
+			Metrics::add(Metrics::UPSTREAM_REUSES);
+			break;
+		}
+		size_t colon = session.key.rfind(':');
+		session.upstream = connectTo(session.key.substr(0, colon), session.key.substr(colon + 1));
+		if (session.upstream != -1)
+		{
+			session.reused = false;
+			session.connecting = true;
+			_server.addFd(session.upstream);
+			_server.setEvents(session.upstream, POLLOUT);
+			Metrics::add(Metrics::UPSTREAM_CONNECTS);
+			break;
+		}
+		if (!session.hasPeer)
+			return false;
+		peerFailed(session);
+	}
+	session.deadline = Metrics::now() + session.connectTimeout;
+	_byUpstream[session.upstream] = &session;
+	return true;
+}
+
+// asks the session's upstream block for a peer it has not tried yet
+bool Proxy::pickPeer(Session &session)
+{
+	std::map<std::string, Upstream>::iterator it = _upstreams.find(session.group);
+
+	if (it == _upstreams.end())
+		return false;
+	int peer = it->second.select(session.hashValue, session.tried, Metrics::now());
+	if (peer == -1)
+	{
+		LOG(LOG_ERROR) << "upstream " << session.group << ": no live servers left";
+		return false;
+	}
+	session.hasPeer = true;
+	session.tried.push_back(peer);
+	session.key = it->second.getKey(peer);
+	it->second.connected(peer);
+	return true;
+}
+
+// the session's upstream block and peer index, looked up by name and address
+// since a reload can reorder them; NULL for plain host:port sessions
+Upstream *Proxy::groupOf(const Session &session, int &peer)
+{
+	std::map<std::string, Upstream>::iterator it = _upstreams.find(session.group);
+
+	if (!session.hasPeer || it == _upstreams.end())
+		return NULL;
+	peer = it->second.find(session.key);
+	return peer == -1 ? NULL : &it->second;
+}
+
+// passive check: counts the failure against the peer and lets go of it
+void Proxy::peerFailed(Session &session)
+{
+	int peer;
+	Upstream *group = groupOf(session, peer);
+
+	if (group)
+	{
+		group->failure(peer, Metrics::now());
+		group->released(peer);
+	}
+	session.hasPeer = false;
+}
+
+// non-blocking connect; the address is resolved once per upstream
+int Proxy::connectTo(const std::string &host, const std::string &port)
+{
+	std::map<std::string, Address>::iterator it = _addresses.find(host + ":" + port);
+
+	if (it == _addresses.end())
+	{
+		struct addrinfo hints, *info;
+		Address address;
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(host.c_str(), port.c_str(), &hints, &info) != 0)
+		{
+			LOG(LOG_ERROR) << "upstream " << host << ":" << port << ": cannot resolve";
+			return -1;
+		}
+		memcpy(&address.addr, info->ai_addr, info->ai_addrlen);
+		address.len = info->ai_addrlen;
+		freeaddrinfo(info);
+		it = _addresses.insert(std::make_pair(host + ":" + port, address)).first;
+	}
+
+	int fd = socket(it->second.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -1;
+	if (connect(fd, (struct sockaddr *)&it->second.addr, it->second.len) == -1 && errno != EINPROGRESS)
+	{
+		LOG(LOG_ERROR) << "upstream " << host << ":" << port << ": " << strerror(errno);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+void Proxy::sendRequest(Session &session, std::map<int, std::string> &buffMap)
+{
+	if (session.connecting)
+	{
+		int error = 0;
+		socklen_t len = sizeof(error);
+
+		getsockopt(session.upstream, SOL_SOCKET, SO_ERROR, &error, &len);
+		if (error)
+		{
+			LOG(LOG_ERROR) << "upstream " << session.key << ": " << strerror(error);
+			failed(session, 502, buffMap);
+			return;
+		}
+		session.connecting = false;
+	}
+	ssize_t bytes = send(session.upstream, session.request.c_str() + session.sent,
+						 session.request.size() - session.sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return;
+	if (bytes <= 0)
+	{
+		failed(session, 502, buffMap);
+		return;
+	}
+	session.sent += bytes;
+	session.deadline = Metrics::now() + session.readTimeout;
+	if (session.tunnel)
+	{
+		if (session.sent == session.request.size())
+		{
+			session.request.clear();
+			session.sent = 0;
+		}
+		_server.setEvents(session.upstream, upstreamEvents(session));
+		updateTunnel(session.client, buffMap);
+	}
+	else if (session.sent == session.request.size())
+		_server.setEvents(session.upstream, POLLIN);
+}
+
+void Proxy::readResponse(Session &session, std::map<int, std::string> &buffMap)
+{
+	char buff[PROXY_READ_SIZE];
+	std::string &out = buffMap[session.client];
+	size_t queued = out.size();
+	ssize_t bytes = recv(session.upstream, buff, sizeof(buff), MSG_DONTWAIT);
+
+	if (bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return;
+	if (bytes == 0 && session.headDone && session.mode == BODY_UNTIL_CLOSE)
+	{
+		session.done = true;
+		// a tunnel's client may only be polled for reading
+		wakeClient(session.client);
+		finish(session, false);
+		return;
+	}
+	if (bytes <= 0)
+	{
+		failed(session, 502, buffMap);
+		return;
+	}
+	session.received += bytes;
+	session.deadline = Metrics::now() + session.readTimeout;
+
+	const char *data = buff;
+	size_t len = bytes;
+	if (!session.headDone)
+	{
+		session.head.append(buff, bytes);
+		int parsed = parseHead(session, out);
+		if (parsed == -1 || (parsed == 0 && session.head.size() > PROXY_MAX_HEAD_SIZE))
+			failed(session, 502, buffMap);
+		if (parsed != 1)
+			return;
+		// what followed the head in this read is the start of the body
+		data = session.head.c_str();
+		len = session.head.size();
+	}
+	size_t forwarded = forwardBody(session, data, len, out);
+	if (forwarded)
+		report(session.client, 0, forwarded);
+	session.head.clear();
+	if (session.capture && session.captureLimit)
+	{
+		session.captured.append(out, queued, std::string::npos);
+		// too large to cache: stop copying
+		if (session.captured.size() > session.captureLimit)
+		{
+			session.captureLimit = 0;
+			std::string().swap(session.captured);
+		}
+	}
+	// a background refresh has nobody to send to
+	if (_server.isDetached(session.client))
+		out.clear();
+	if (session.tunnel)
+		updateTunnel(session.client, buffMap);
+	else
+		wakeClient(session.client);
+	if (session.done)
+		finish(session, session.reusable);
+	else if (out.size() >= PROXY_BUFFER_SIZE)
+	{
+		session.paused = true;
+		_server.setEvents(session.upstream, upstreamEvents(session));
+	}
+}
+
+// once the whole head is in: picks the body framing, decides whether the
+// connection can be reused, and queues the head for the client with the
+// hop-by-hop headers replaced. Leaves the bytes after the head in
+// session.head. 0 while the head is incomplete, -1 when it is not HTTP.
+int Proxy::parseHead(Session &session, std::string &out)
+{
+	size_t end;
+
+	for (;;)
+	{
+		end = session.head.find("\r\n\r\n");
+		if (end == std::string::npos)
+			return 0;
+		// 1xx interim responses (100 Continue) are dropped
+		if (session.head.compare(0, 10, "HTTP/1.1 1") == 0 && session.head.compare(9, 3, "101") != 0)
+		{
+			session.head.erase(0, end + 4);
+			continue;
+		}
+		break;
+	}
+
+	std::vector<std::string> lines = utils::split(session.head.substr(0, end), "\r\n");
+	std::string version = lines[0].substr(0, lines[0].find(' '));
+	int status = lines[0].size() > 9 ? std::atoi(lines[0].c_str() + 9) : 0;
+	bool chunked = false;
+	bool hasLength = false;
+	bool closeRequested = version != "HTTP/1.1";
+	size_t length = 0;
+	std::string head = lines[0] + "\r\n";
+
+	if (version.compare(0, 5, "HTTP/") != 0 || status < 100)
+		return -1;
+	for (size_t i = 1; i < lines.size(); i++)
+	{
+		std::string name = lines[i].substr(0, lines[i].find(':'));
+		std::string value = lines[i].find(':') == std::string::npos ? "" : utils::trim(lines[i].substr(name.size() + 1));
+
+		if (!strcasecmp(name.c_str(), "Connection"))
+		{
+			if (value.find("close") != std::string::npos)
+				closeRequested = true;
+			continue;
+		}
+		if (!strcasecmp(name.c_str(), "Keep-Alive") || !strcasecmp(name.c_str(), "Proxy-Connection"))
+			continue;
+		if (!strcasecmp(name.c_str(), "Transfer-Encoding") && value.find("chunked") != std::string::npos)
+			chunked = true;
+		if (!strcasecmp(name.c_str(), "Content-Length"))
+		{
+			hasLength = true;
+			length = std::strtoul(value.c_str(), NULL, 10);
+		}
+		head += lines[i] + "\r\n";
+	}
+	// the client connection closes after every response, or is tunnelled to
+	// the upstream once it accepted an upgrade
+	session.tunnel = session.upgrade && status == 101;
+	head += session.tunnel ? "Connection: Upgrade\r\n\r\n" : "Connection: close\r\n\r\n";
+	out += head;
+	if (session.tunnel)
+	{
+		session.request.erase(0, session.sent);
+		session.sent = 0;
+	}
+
+	session.headDone = true;
+	if (session.tunnel)
+		session.mode = BODY_UNTIL_CLOSE;
+	else if (session.headRequest || status == 204 || status == 304 || (status >= 100 && status < 200))
+		session.mode = BODY_NONE;
+	else if (chunked)
+		session.mode = BODY_CHUNKED;
+	else if (hasLength)
+		session.mode = BODY_LENGTH;
+	else
+		session.mode = BODY_UNTIL_CLOSE;
+	session.remaining = length;
+	int peer;
+	if (Upstream *group = groupOf(session, peer))
+		group->success(peer);
+	session.reusable = !closeRequested && session.mode != BODY_UNTIL_CLOSE && status != 101;
+	session.done = session.mode == BODY_NONE || (session.mode == BODY_LENGTH && length == 0);
+	session.head.erase(0, end + 4);
+	report(session.client, status, 0);
+	return 1;
+}
+
+// appends the body bytes that belong to this response to the client's buffer
+// and returns how many; anything past the end means the upstream is out of
+// sync, so its connection is not reused
+size_t Proxy::forwardBody(Session &session, const char *data, size_t len, std::string &out)
+{
+	size_t used = 0;
+
+	if (session.done || session.mode == BODY_NONE)
+		used = 0;
+	else if (session.mode == BODY_UNTIL_CLOSE)
+		used = len;
+	else if (session.mode == BODY_LENGTH)
+	{
+		used = len < session.remaining ? len : session.remaining;
+		session.remaining -= used;
+		session.done = session.remaining == 0;
+	}
+	else
+		return forwardChunked(session, data, len, out);
+	out.append(data, used);
+	if (used < len)
+		session.reusable = false;
+	return used;
+}
+
+// passes the chunked encoding through unchanged, following it only to find
+// where the response ends
+size_t Proxy::forwardChunked(Session &session, const char *data, size_t len, std::string &out)
+{
+	size_t i = 0;
+
+	while (i < len && !session.done)
+	{
+		if (session.chunkState == CHUNK_DATA)
+		{
+			size_t take = len - i < session.remaining ? len - i : session.remaining;
+			i += take;
+			session.remaining -= take;
+			if (!session.remaining)
+				session.chunkState = CHUNK_DATA_END;
+			continue;
+		}
+		char c = data[i++];
+		if (session.chunkState == CHUNK_DATA_END)
+		{
+			if (c == '\n')
+				session.chunkState = CHUNK_SIZE;
+			continue;
+		}
+		if (c != '\n')
+		{
+			session.chunkLine += c;
+			continue;
+		}
+		// a full size or trailer line
+		std::string line = session.chunkLine;
+		session.chunkLine.clear();
+		if (!line.empty() && line[line.size() - 1] == '\r')
+			line.erase(line.size() - 1);
+		if (session.chunkState == CHUNK_TRAILER)
+			session.done = line.empty();
+		else
+		{
+			session.remaining = std::strtoul(line.c_str(), NULL, 16);
+			session.chunkState = session.remaining ? CHUNK_DATA : CHUNK_TRAILER;
+		}
+	}
+	out.append(data, i);
+	if (i < len)
+		session.reusable = false;
+	return i;
+}
+
+// a reused connection the upstream had already closed is retried once on a
+// fresh one. A peer of an upstream block that failed before answering is
+// counted against it, and the request goes to the next peer unless it was
+// not idempotent and already sent. Otherwise the client gets the error page
+// if nothing was sent yet, or a cut-off response.
+void Proxy::failed(Session &session, int code, std::map<int, std::string> &buffMap)
+{
+	if (session.upstream != -1 && session.reused && !session.retried && !session.received && code == 502)
+	{
+		_byUpstream.erase(session.upstream);
+		_server.removeFd(session.upstream);
+		close(session.upstream);
+		session.upstream = -1;
+		session.retried = true;
+		if (attach(session))
+			return;
+	}
+	if (session.hasPeer)
+	{
+		bool retry = !session.received && (session.idempotent || !session.sent);
+		peerFailed(session);
+		if (session.upstream != -1)
+		{
+			_byUpstream.erase(session.upstream);
+			_server.removeFd(session.upstream);
+			close(session.upstream);
+			session.upstream = -1;
+		}
+		if (retry && attach(session))
+			return;
+	}
+	if (!session.headDone)
+	{
+		MethodIO::rInfo rsi;
+		std::string title = code == 504 ? "504 Gateway Timeout" : "502 Bad Gateway";
+		rsi.body = "<html><head><title>" + title + "</title></head><body><h1>" + title + "</h1></body></html>\n";
+		rsi.headers["Date"] = MethodIO::getDate();
+		rsi.headers["Content-Type"] = "text/html";
+		rsi.headers["Content-Length"] = utils::to_string(rsi.body.size());
+		rsi.headers["Connection"] = "close";
+		buffMap[session.client] = MethodIO::generateResponse(code, rsi);
+		report(session.client, code, 0);
+	}
+	Metrics::add(Metrics::UPSTREAM_FAILURES);
+	wakeClient(session.client);
+	finish(session, false);
+}
+
+// ends the session: the upstream goes back to the pool or is closed
+void Proxy::finish(Session &session, bool keepAlive)
+{
+	int peer;
+	if (Upstream *group = groupOf(session, peer))
+		group->released(peer);
+	if (session.upstream != -1)
+	{
+		_byUpstream.erase(session.upstream);
+		if (keepAlive)
+			release(session.upstream, session.key);
+		else
+		{
+			_server.removeFd(session.upstream);
+			close(session.upstream);
+		}
+	}
+	reportDone(session);
+	_byClient.erase(session.client);
+	delete &session;
+}
+
+void Proxy::release(int fd, const std::string &key)
+{
+	std::vector<Idle> &idle = _idle[key];
+
+	if (idle.size() >= UPSTREAM_KEEPALIVE_MAX)
+	{
+		_server.removeFd(fd);
+		close(fd);
+		return;
+	}
+	Idle entry;
+	entry.fd = fd;
+	entry.since = Metrics::now();
+	idle.push_back(entry);
+	_idleKeys[fd] = key;
+	// polled so an upstream closing it is noticed before it is handed out
+	_server.setEvents(fd, POLLIN);
+}
+
+void Proxy::closeIdle(int fd)
+{
+	std::vector<Idle> &idle = _idle[_idleKeys[fd]];
+
+	for (size_t i = 0; i < idle.size(); i++)
+	{
+		if (idle[i].fd == fd)
+		{
+			idle.erase(idle.begin() + i);
+			break;
+		}
+	}
+	_idleKeys.erase(fd);
+	_server.removeFd(fd);
+	close(fd);
+}
+
+// the client is polled for writing while it has something to send or the
+// session is over (so it gets closed)
+void Proxy::wakeClient(int client)
+{
+	if (_server.getEvents(client) != POLLOUT)
+		_server.setEvents(client, POLLOUT);
+}
+
+// the upstream is read unless the client is too far behind; a tunnel's
+// upstream is also written while the client's bytes wait
+short Proxy::upstreamEvents(const Session &session) const
+{
+	short events = session.paused ? 0 : POLLIN;
+
+	if (session.tunnel && session.sent < session.request.size())
+		events |= POLLOUT;
+	return events;
+}
+
+void Proxy::report(int client, int status, size_t bytes)
+{
+	Result result;
+
+	result.client = client;
+	result.status = status;
+	result.bytes = bytes;
+	result.done = false;
+	_results.push_back(result);
+}
+
+// a session asked to capture always ends with a done result, so the response
+// cache hears about fetches that failed as well
+void Proxy::reportDone(const Session &session)
+{
+	Result result;
+
+	if (!session.capture)
+		return;
+	result.client = session.client;
+	result.status = 0;
+	result.bytes = 0;
+	result.done = true;
+	if (session.done && session.captureLimit)
+		result.response = session.captured;
+	_results.push_back(result);
+}
+
+/***********************************
+ * Health checks
+ ***********************************/
+
+// probes every peer of the upstream blocks with a health_check whose turn has
+// come, over a fresh connection each time
+void Proxy::startProbes(double now)
+{
+	for (std::map<std::string, Upstream>::iterator it = _upstreams.begin(); it != _upstreams.end(); it++)
+	{
+		const Upstream::HealthCheck &check = it->second.getHealthCheck();
+		std::vector<Upstream::Peer> &peers = it->second.getPeers();
+
+		if (!check.enabled)
+			continue;
+		for (size_t i = 0; i < peers.size(); i++)
+		{
+			if (peers[i].nextProbe > now)
+				continue;
+			// pushed back until the probe ends, so it is not sent twice
+			peers[i].nextProbe = now + check.interval + check.timeout;
+			int fd = connectTo(peers[i].host, peers[i].port);
+			if (fd == -1)
+			{
+				Metrics::add(Metrics::HEALTH_CHECKS_FAILED);
+				it->second.probed(i, false, now);
+				continue;
+			}
+			Probe &probe = _probes[fd];
+			probe.group = it->first;
+			probe.key = it->second.getKey(i);
+			probe.request = "GET " + check.uri + " HTTP/1.1\r\nHost: " + probe.key +
+							"\r\nUser-Agent: webserv-health-check\r\nConnection: close\r\n\r\n";
+			probe.deadline = now + check.timeout;
+			_server.addFd(fd);
+			_server.setEvents(fd, POLLOUT);
+		}
+	}
+}
+
+// sends the probe, then waits for a 2xx or 3xx status line
+void Proxy::handleProbe(int fd, short revents)
+{
+	Probe &probe = _probes[fd];
+
+	if (probe.sent < probe.request.size())
+	{
+		int error = 0;
+		socklen_t len = sizeof(error);
+
+		getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len);
+		ssize_t bytes = error ? -1
+							  : send(fd, probe.request.c_str() + probe.sent, probe.request.size() - probe.sent,
+									 MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (bytes == -1 && !error && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (bytes <= 0)
+			return endProbe(fd, false);
+		probe.sent += bytes;
+		if (probe.sent == probe.request.size())
+			_server.setEvents(fd, POLLIN);
+		return;
+	}
+	if (!(revents & (POLLIN | POLLHUP | POLLERR)))
+		return;
+
+	char buff[512];
+	ssize_t bytes = recv(fd, buff, sizeof(buff), MSG_DONTWAIT);
+	if (bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return;
+	if (bytes > 0)
+		probe.response.append(buff, bytes);
+	if (probe.response.find("\r\n") == std::string::npos)
+	{
+		if (bytes <= 0)
+			endProbe(fd, false);
+		return;
+	}
+	int status = probe.response.compare(0, 5, "HTTP/") == 0 && probe.response.size() > 9
+					 ? std::atoi(probe.response.c_str() + 9)
+					 : 0;
+	endProbe(fd, status >= 200 && status < 400);
+}
+
+void Proxy::endProbe(int fd, bool ok)
+{
+	Probe probe = _probes[fd];
+	std::map<std::string, Upstream>::iterator it = _upstreams.find(probe.group);
+
+	_probes.erase(fd);
+	_server.removeFd(fd);
+	close(fd);
+	Metrics::add(ok ? Metrics::HEALTH_CHECKS_PASSED : Metrics::HEALTH_CHECKS_FAILED);
+	// the peer may be gone after a reload
+	if (it != _upstreams.end() && it->second.find(probe.key) != -1)
+		it->second.probed(it->second.find(probe.key), ok, Metrics::now());
+}
@@ -0,0 +1,110 @@
+#include "RequestTrace.hpp"
+#include "Metrics.hpp"
+#include <cstdio>
+
+static __thread RequestTrace *t_current = NULL;
+
+/*** Constructors ***/
+
+RequestTrace::RequestTrace(void)
+{
+	clear();
+}
+
+RequestTrace::RequestTrace(const RequestTrace &src)
+{
+	*this = src;
+}
+
+RequestTrace &RequestTrace::operator=(const RequestTrace &rhs)
+{
+	for (int i = 0; i < PHASE_COUNT; i++)
+		_at[i] = rhs._at[i];
+	return *this;
+}
+
+/*** Destructors ***/
+
+RequestTrace::~RequestTrace(void)
+{
+}
+
+/*** Others ***/
+
+// the first mark wins, so a phase reached again (a second recv) keeps its
+// earliest time
+void RequestTrace::mark(Phase phase)
+{
+	if (!_at[phase])
+		_at[phase] = Metrics::now();
+}
+
+double RequestTrace::get(Phase phase) const
+{
+	return _at[phase];
+}
+
+// 0 when either end was not reached
+double RequestTrace::between(Phase from, Phase to) const
+{
+	if (!_at[from] || !_at[to] || _at[to] < _at[from])
+		return 0;
+	return _at[to] - _at[from];
+}
+
+void RequestTrace::merge(const RequestTrace &other)
+{
+	for (int i = 0; i < PHASE_COUNT; i++)
+		if (other._at[i])
+			_at[i] = other._at[i];
+}
+
+void RequestTrace::clear()
+{
+	for (int i = 0; i < PHASE_COUNT; i++)
+		_at[i] = 0;
+}
+
+// wait: accept to first byte, read: first byte to full request, queue: worker
+// pick-up delay, handler: routing and the method, send: response out
+void RequestTrace::observe() const
+{
+	Metrics::observe(Metrics::PHASE_WAIT, between(ACCEPTED, FIRST_BYTE_IN));
+	Metrics::observe(Metrics::PHASE_READ, between(FIRST_BYTE_IN, REQUEST_COMPLETE));
+	if (_at[TASK_START])
+		Metrics::observe(Metrics::PHASE_QUEUE, between(HANDLER_START, TASK_START));
+	Metrics::observe(Metrics::PHASE_HANDLER, between(HANDLER_START, HANDLER_END));
+	Metrics::observe(Metrics::PHASE_SEND, between(HANDLER_END, LAST_BYTE_OUT));
+}
+
+// "first_byte_in=+0.012ms headers=+0.101ms ...": every phase reached, as an
+// offset from the accept, for the slow request log
+std::string RequestTrace::describe() const
+{
+	static const char *names[PHASE_COUNT] = {"accepted",	  "first_byte_in", "headers", "request",
+											 "handler_start", "task_start",	   "cgi_fork", "cgi_exit",
+											 "handler_end",	  "first_byte_out", "last_byte_out"};
+	std::string out;
+	char buf[64];
+
+	for (int i = FIRST_BYTE_IN; i < PHASE_COUNT; i++)
+	{
+		if (!_at[i])
+			continue;
+		snprintf(buf, sizeof(buf), "%s%s=+%.3fms", out.empty() ? "" : " ", names[i],
+				 (_at[i] - _at[ACCEPTED]) * 1000);
+		out += buf;
+	}
+	return out;
+}
+
+void RequestTrace::setCurrent(RequestTrace *trace)
+{
+	t_current = trace;
+}
+
+void RequestTrace::markCurrent(Phase phase)
+{
+	if (t_current)
+		t_current->mark(phase);
+}
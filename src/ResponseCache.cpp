@@ -0,0 +1,457 @@
+#include "ResponseCache.hpp"
+#include "Log.hpp"
+#include "Metrics.hpp"
+#include "utils.hpp"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/***********************************
+ * Helpers
+ ***********************************/
+
+static std::string lower(std::string str)
+{
+	for (size_t i = 0; i < str.size(); i++)
+		if (str[i] >= 'A' && str[i] <= 'Z')
+			str[i] += 'a' - 'A';
+	return str;
+}
+
+// request header names are matched the way clients spell them
+static const std::string *findHeader(const ResponseCache::Headers &headers, const std::string &name)
+{
+	for (ResponseCache::Headers::const_iterator it = headers.begin(); it != headers.end(); it++)
+		if (!strcasecmp(it->first.c_str(), name.c_str()))
+			return &it->second;
+	return NULL;
+}
+
+// length of the status line and headers with the blank line after them; CGI
+// scripts may end their lines with \n only. npos without a blank line.
+static size_t headLength(const std::string &response)
+{
+	size_t best = std::string::npos;
+	const char *separators[] = {"\r\n\r\n", "\n\r\n", "\n\n"};
+
+	for (size_t i = 0; i < 3; i++)
+	{
+		size_t pos = response.find(separators[i]);
+		if (pos != std::string::npos && (best == std::string::npos || pos + strlen(separators[i]) < best))
+			best = pos + strlen(separators[i]);
+	}
+	return best;
+}
+
+static void count(ResponseCache::Result result)
+{
+	if (result == ResponseCache::HIT)
+		Metrics::add(Metrics::RESPONSE_CACHE_HITS);
+	else if (result == ResponseCache::STALE)
+		Metrics::add(Metrics::RESPONSE_CACHE_STALE);
+	else if (result == ResponseCache::MISS)
+		Metrics::add(Metrics::RESPONSE_CACHE_MISSES);
+	else if (result == ResponseCache::WAIT)
+		Metrics::add(Metrics::RESPONSE_CACHE_COALESCED);
+	else
+		Metrics::add(Metrics::RESPONSE_CACHE_BYPASSES);
+}
+
+/***********************************
+ * Constructors
+ ***********************************/
+
+ResponseCache::ResponseCache() : _path(), _size(0), _map(NULL)
+{
+}
+
+ResponseCache::ResponseCache(const ResponseCache &src) : _path(), _size(0), _map(NULL)
+{
+	(void)src;
+}
+
+ResponseCache &ResponseCache::operator=(const ResponseCache &rhs)
+{
+	(void)rhs;
+	return *this;
+}
+
+/***********************************
+ * Destructors
+ ***********************************/
+
+ResponseCache::~ResponseCache()
+{
+	close();
+}
+
+/***********************************
+ * Configuration
+ ***********************************/
+
+// the store is recreated empty when response_cache_path or its size changes;
+// an empty dir turns the cache off
+void ResponseCache::configure(const std::string &dir, size_t maxSize)
+{
+	std::string path = dir.empty() ? "" : dir + "/" RESPONSE_CACHE_FILE;
+
+	if (path == _path && maxSize == _size)
+		return;
+	close();
+	if (path.empty())
+		return;
+	int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1 || ftruncate(fd, maxSize) == -1)
+	{
+		LOG(LOG_ERROR) << "response_cache_path: cannot create " << path << ": " << strerror(errno);
+		if (fd != -1)
+			::close(fd);
+		return;
+	}
+	void *map = mmap(NULL, maxSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (map == MAP_FAILED)
+	{
+		LOG(LOG_ERROR) << "response_cache_path: cannot map " << path << ": " << strerror(errno);
+		unlink(path.c_str());
+		return;
+	}
+	_map = static_cast<char *>(map);
+	_path = path;
+	_size = maxSize;
+	_free[0] = maxSize;
+	LOG(LOG_INFO) << "Response cache: " << path << " (" << maxSize / 1024 << " KiB)";
+}
+
+void ResponseCache::close()
+{
+	if (_map)
+	{
+		munmap(_map, _size);
+		unlink(_path.c_str());
+	}
+	_map = NULL;
+	_path.clear();
+	_size = 0;
+	_entries.clear();
+	_lru.clear();
+	_free.clear();
+	_vary.clear();
+	_pass.clear();
+}
+
+/***********************************
+ * Getters
+ ***********************************/
+
+bool ResponseCache::isEnabled() const
+{
+	return _map != NULL;
+}
+
+bool ResponseCache::isFetching(const std::string &key) const
+{
+	return _fetches.count(key);
+}
+
+size_t ResponseCache::getMaxEntrySize() const
+{
+	return _size / RESPONSE_CACHE_ENTRY_FRACTION;
+}
+
+/***********************************
+ * Lookups
+ ***********************************/
+
+// requests with credentials or Cache-Control: no-store skip the cache, and
+// no-cache skips the stored entry. HEAD is answered from the GET entry but
+// never starts a fetch. A refresh (the background request of a STALE
+// lookup) is not counted.
+ResponseCache::Result ResponseCache::lookup(const std::string &method, const std::string &uri, const Headers &headers,
+											double now, bool refresh, std::string &key, std::string &response)
+{
+	const std::string *control = findHeader(headers, "Cache-Control");
+	const std::string *host = findHeader(headers, "Host");
+	std::string directives = control ? lower(*control) : "";
+	Result result = MISS;
+
+	key = "GET " + (host ? lower(*host) : "") + uri;
+	std::map<std::string, double>::iterator pass = _pass.find(key);
+	if (pass != _pass.end() && pass->second <= now)
+		_pass.erase(pass);
+	if (!isEnabled() || findHeader(headers, "Authorization") || findHeader(headers, "Cookie") ||
+		directives.find("no-store") != std::string::npos || _pass.count(key))
+		result = BYPASS;
+	else if (!refresh && directives.find("no-cache") == std::string::npos)
+	{
+		std::string variant = variantKey(key, headers);
+		std::map<std::string, Entry>::iterator it = _entries.find(variant);
+		if (it != _entries.end() && now < it->second.stale)
+		{
+			_lru.splice(_lru.begin(), _lru, it->second.lru);
+			result = now < it->second.fresh ? HIT : STALE;
+			response = serve(it->second, result == HIT ? "HIT" : "STALE", now, method == "HEAD");
+		}
+		else if (it != _entries.end())
+			evict(variant);
+	}
+	if (result == MISS && _fetches.count(key))
+		result = WAIT;
+	else if (result == MISS && method != "GET")
+		result = BYPASS;
+	if (!refresh)
+		count(result);
+	return result;
+}
+
+// the request for key goes to its handler; valid is the response_cache_valid
+// of its location
+void ResponseCache::begin(const std::string &key, const Headers &headers, int valid)
+{
+	Fetch &fetch = _fetches[key];
+
+	fetch.headers = headers;
+	fetch.valid = valid;
+}
+
+void ResponseCache::wait(const std::string &key, int fd)
+{
+	std::map<std::string, Fetch>::iterator it = _fetches.find(key);
+
+	if (it != _fetches.end())
+		it->second.waiters.push_back(fd);
+}
+
+// the waiting client went away
+void ResponseCache::forget(int fd)
+{
+	for (std::map<std::string, Fetch>::iterator it = _fetches.begin(); it != _fetches.end(); it++)
+	{
+		std::vector<int> &waiters = it->second.waiters;
+		for (size_t i = 0; i < waiters.size(); i++)
+			if (waiters[i] == fd)
+				waiters.erase(waiters.begin() + i--);
+	}
+}
+
+// the fetch for key is over: its response is stored when it may be, and the
+// waiting clients are returned to look the key up again. A response that
+// cannot be stored (an empty one included) sends the key past the cache for
+// RESPONSE_CACHE_PASS_TTL seconds.
+std::vector<int> ResponseCache::complete(const std::string &key, const std::string &response, double now)
+{
+	std::map<std::string, Fetch>::iterator it = _fetches.find(key);
+	std::vector<int> waiters;
+
+	if (it == _fetches.end())
+		return waiters;
+	waiters.swap(it->second.waiters);
+	if (!store(key, response, it->second, now))
+		_pass[key] = now + RESPONSE_CACHE_PASS_TTL;
+	_fetches.erase(it);
+	return waiters;
+}
+
+// the fetch for key was cut short by its client: one of the waiters fetches
+// it again
+std::vector<int> ResponseCache::abandon(const std::string &key)
+{
+	std::map<std::string, Fetch>::iterator it = _fetches.find(key);
+	std::vector<int> waiters;
+
+	if (it == _fetches.end())
+		return waiters;
+	waiters.swap(it->second.waiters);
+	_fetches.erase(it);
+	return waiters;
+}
+
+/***********************************
+ * Store
+ ***********************************/
+
+// shared caching rules: 200, 203, 301, 404 and 410 without Set-Cookie,
+// Vary: * or a Cache-Control that forbids it. Freshness comes from s-maxage,
+// then max-age, then response_cache_valid; stale-while-revalidate adds the
+// window a stale copy may still be served in.
+bool ResponseCache::store(const std::string &key, const std::string &response, const Fetch &fetch, double now)
+{
+	size_t head = headLength(response);
+
+	if (!isEnabled() || response.size() > getMaxEntrySize() || head == std::string::npos ||
+		response.compare(0, 5, "HTTP/") != 0 || response.size() < 12)
+		return false;
+	int status = std::atoi(response.c_str() + 9);
+	if (status != 200 && status != 203 && status != 301 && status != 404 && status != 410)
+		return false;
+
+	long ttl = -1;
+	long sharedTtl = -1;
+	long staleTtl = 0;
+	std::vector<std::string> vary;
+	for (size_t pos = response.find('\n') + 1; pos < head;)
+	{
+		size_t end = response.find('\n', pos);
+		std::string line = response.substr(pos, end - pos);
+		size_t colon = line.find(':');
+		pos = end + 1;
+		if (colon == std::string::npos)
+			continue;
+		std::string name = lower(line.substr(0, colon));
+		std::string value = utils::trim(line.substr(colon + 1));
+		if (!value.empty() && value[value.size() - 1] == '\r')
+			value = utils::trim(value.substr(0, value.size() - 1));
+		if (name == "set-cookie")
+			return false;
+		if (name == "vary")
+		{
+			std::vector<std::string> names = utils::split(value, ',');
+			for (size_t i = 0; i < names.size(); i++)
+			{
+				std::string field = utils::trim(names[i]);
+				if (field == "*")
+					return false;
+				if (!field.empty())
+					vary.push_back(field);
+			}
+		}
+		if (name != "cache-control")
+			continue;
+		std::vector<std::string> directives = utils::split(lower(value), ',');
+		for (size_t i = 0; i < directives.size(); i++)
+		{
+			std::string directive = utils::trim(directives[i]);
+			if (directive == "no-store" || directive.compare(0, 7, "private") == 0 ||
+				directive.compare(0, 8, "no-cache") == 0)
+				return false;
+			if (directive.compare(0, 9, "s-maxage=") == 0)
+				sharedTtl = std::atol(directive.c_str() + 9);
+			else if (directive.compare(0, 8, "max-age=") == 0)
+				ttl = std::atol(directive.c_str() + 8);
+			else if (directive.compare(0, 23, "stale-while-revalidate=") == 0)
+				staleTtl = std::atol(directive.c_str() + 23);
+		}
+	}
+	if (sharedTtl >= 0)
+		ttl = sharedTtl;
+	if (ttl < 0)
+		ttl = fetch.valid;
+	if (ttl <= 0)
+		return false;
+
+	if (vary.empty())
+		_vary.erase(key);
+	else
+		_vary[key] = vary;
+	std::string variant = variantKey(key, fetch.headers);
+	if (_entries.count(variant))
+		evict(variant);
+	size_t offset;
+	while (!allocate(response.size(), offset))
+	{
+		if (_lru.empty())
+			return false;
+		evict(_lru.back());
+		Metrics::add(Metrics::RESPONSE_CACHE_EVICTIONS);
+	}
+	memcpy(_map + offset, response.data(), response.size());
+
+	Entry entry;
+	entry.offset = offset;
+	entry.length = response.size();
+	entry.headLength = head;
+	entry.stored = now;
+	entry.fresh = now + ttl;
+	entry.stale = entry.fresh + staleTtl;
+	_lru.push_front(variant);
+	entry.lru = _lru.begin();
+	_entries[variant] = entry;
+	return true;
+}
+
+// key plus the values of the request headers its response Varies on
+std::string ResponseCache::variantKey(const std::string &key, const Headers &headers) const
+{
+	std::map<std::string, std::vector<std::string> >::const_iterator vary = _vary.find(key);
+	std::string variant = key;
+
+	if (vary == _vary.end())
+		return variant;
+	for (size_t i = 0; i < vary->second.size(); i++)
+	{
+		const std::string *value = findHeader(headers, vary->second[i]);
+		variant += "\n" + lower(vary->second[i]) + ": " + (value ? *value : "");
+	}
+	return variant;
+}
+
+// first fit over the free extents
+bool ResponseCache::allocate(size_t length, size_t &offset)
+{
+	for (std::map<size_t, size_t>::iterator it = _free.begin(); it != _free.end(); it++)
+	{
+		if (it->second < length)
+			continue;
+		offset = it->first;
+		size_t left = it->second - length;
+		_free.erase(it);
+		if (left)
+			_free[offset + length] = left;
+		return true;
+	}
+	return false;
+}
+
+// gives an extent back, merged with the free ones on either side
+void ResponseCache::release(size_t offset, size_t length)
+{
+	std::map<size_t, size_t>::iterator next = _free.lower_bound(offset);
+
+	if (next != _free.end() && offset + length == next->first)
+	{
+		length += next->second;
+		_free.erase(next++);
+	}
+	if (next != _free.begin())
+	{
+		std::map<size_t, size_t>::iterator prev = next;
+		--prev;
+		if (prev->first + prev->second == offset)
+		{
+			prev->second += length;
+			return;
+		}
+	}
+	_free[offset] = length;
+}
+
+void ResponseCache::evict(const std::string &variant)
+{
+	std::map<std::string, Entry>::iterator it = _entries.find(variant);
+
+	if (it == _entries.end())
+		return;
+	release(it->second.offset, it->second.length);
+	_lru.erase(it->second.lru);
+	_entries.erase(it);
+}
+
+// the stored response with X-Cache and Age after its status line
+std::string ResponseCache::serve(const Entry &entry, const char *status, double now, bool headOnly) const
+{
+	const char *data = _map + entry.offset;
+	size_t line = static_cast<const char *>(memchr(data, '\n', entry.length)) - data + 1;
+	size_t length = headOnly ? entry.headLength : entry.length;
+	std::string response;
+
+	response.reserve(length + 48);
+	response.append(data, line);
+	response.append("X-Cache: ").append(status).append("\r\nAge: ");
+	response.append(utils::to_string((long)(now - entry.stored))).append("\r\n");
+	response.append(data + line, length - line);
+	return response;
+}
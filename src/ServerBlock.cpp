@@ -12,7 +12,9 @@
 #include <utility>
 #include <vector>
 
-ServerBlock::ServerBlock() : ABlock(), _locationBlocks()
+ServerBlock::ServerBlock()
+	: ABlock(), _locationBlocks(), _errorResponses(), _sslPorts(), _sslCertificate(), _sslCertificateKey(),
+	  _sslKtls(false), _sessionApiUrl(), _sessionApiHost()
 {
 }
 
@@ -20,7 +22,7 @@ ServerBlock::~ServerBlock()
 {
 }
 
-ServerBlock::ServerBlock(const ServerBlock &other) : ABlock()
+ServerBlock::ServerBlock(const ServerBlock &other) : ABlock(), _sslKtls(false)
 {
 	*this = other;
 }
@@ -33,6 +35,13 @@ ServerBlock &ServerBlock::operator=(const ServerBlock &other)
 		ABlock::operator=(other);
 
 		this->_locationBlocks = other._locationBlocks;
+		this->_errorResponses = other._errorResponses;
+		this->_sslPorts = other._sslPorts;
+		this->_sslCertificate = other._sslCertificate;
+		this->_sslCertificateKey = other._sslCertificateKey;
+		this->_sslKtls = other._sslKtls;
+		this->_sessionApiUrl = other._sessionApiUrl;
+		this->_sessionApiHost = other._sessionApiHost;
 	}
 	return *this;
 }
@@ -47,11 +56,157 @@ void ServerBlock::addServerName(std::string serverName)
 	this->_serverName.push_back(serverName);
 }
 
+void ServerBlock::addSslPort(std::string port)
+{
+	this->_sslPorts.push_back(port);
+}
+
+void ServerBlock::setSslCertificate(std::string path)
+{
+	this->_sslCertificate = path;
+}
+
+void ServerBlock::setSslCertificateKey(std::string path)
+{
+	this->_sslCertificateKey = path;
+}
+
+void ServerBlock::setSslKtls(bool enabled)
+{
+	this->_sslKtls = enabled;
+}
+
+const std::vector<std::string> &ServerBlock::getSslPorts() const
+{
+	return this->_sslPorts;
+}
+
+const std::string &ServerBlock::getSslCertificate() const
+{
+	return this->_sslCertificate;
+}
+
+const std::string &ServerBlock::getSslCertificateKey() const
+{
+	return this->_sslCertificateKey;
+}
+
+bool ServerBlock::getSslKtls() const
+{
+	return this->_sslKtls;
+}
+
 void ServerBlock::addLocationBlock(std::string path, LocationBlock locationBlock)
 {
 	this->_locationBlocks[path] = locationBlock;
 }
 
+// lets servers without proxy_pass skip the extra location lookup
+bool ServerBlock::hasProxyLocations() const
+{
+	for (std::map<std::string, LocationBlock>::const_iterator it = _locationBlocks.begin(); it != _locationBlocks.end();
+		 it++)
+		if (!it->second.getProxyHost().empty())
+			return true;
+	return false;
+}
+
+// lets servers without websocket skip the upgrade check
+bool ServerBlock::hasWebSocketLocations() const
+{
+	for (std::map<std::string, LocationBlock>::const_iterator it = _locationBlocks.begin(); it != _locationBlocks.end();
+		 it++)
+		if (!it->second.getWebSocket().empty())
+			return true;
+	return false;
+}
+
+bool ServerBlock::hasSessionApiLocations() const
+{
+	for (std::map<std::string, LocationBlock>::const_iterator it = _locationBlocks.begin(); it != _locationBlocks.end();
+		 it++)
+		if (it->second.getSessionApi())
+			return true;
+	return false;
+}
+
+// lets servers without upload_store or PUT buffer every body as before
+bool ServerBlock::hasUploadLocations() const
+{
+	for (std::map<std::string, LocationBlock>::const_iterator it = _locationBlocks.begin(); it != _locationBlocks.end();
+		 it++)
+		if (!it->second.getUploadStore().empty() || utils::find(it->second.getAllowedMethods(), std::string("PUT")))
+			return true;
+	return false;
+}
+
+// lets servers without delete_recursive or delete_status skip both lookups
+bool ServerBlock::hasDeleteJobLocations() const
+{
+	for (std::map<std::string, LocationBlock>::const_iterator it = _locationBlocks.begin(); it != _locationBlocks.end();
+		 it++)
+		if (it->second.getDeleteRecursive() || it->second.getDeleteStatus())
+			return true;
+	return false;
+}
+
+// where a recursive DELETE points its client to; empty without a
+// delete_status location
+std::string ServerBlock::getDeleteStatusLocation() const
+{
+	for (std::map<std::string, LocationBlock>::const_iterator it = _locationBlocks.begin(); it != _locationBlocks.end();
+		 it++)
+		if (it->second.getDeleteStatus())
+			return it->first;
+	return "";
+}
+
+// the location serving the session API; empty without one
+std::string ServerBlock::getSessionApiLocation() const
+{
+	for (std::map<std::string, LocationBlock>::const_iterator it = _locationBlocks.begin(); it != _locationBlocks.end();
+		 it++)
+		if (it->second.getSessionApi())
+			return it->first;
+	return "";
+}
+
+void ServerBlock::setSessionApiAddress(const std::string &url, const std::string &host)
+{
+	this->_sessionApiUrl = url;
+	this->_sessionApiHost = host;
+}
+
+const std::string &ServerBlock::getSessionApiUrl() const
+{
+	return this->_sessionApiUrl;
+}
+
+const std::string &ServerBlock::getSessionApiHost() const
+{
+	return this->_sessionApiHost;
+}
+
+// lets servers without response_cache skip the cache lookup
+bool ServerBlock::hasResponseCacheLocations() const
+{
+	for (std::map<std::string, LocationBlock>::const_iterator it = _locationBlocks.begin(); it != _locationBlocks.end();
+		 it++)
+		if (it->second.getResponseCache())
+			return true;
+	return false;
+}
+
+// lets the event loop skip micro-cache lookups when no server uses it
+bool ServerBlock::hasMicroCacheLocations() const
+{
+	for (std::map<std::string, LocationBlock>::const_iterator it = _locationBlocks.begin(); it != _locationBlocks.end();
+		 it++)
+		if (it->second.getMicroCache())
+			return true;
+	return false;
+}
+
 std::pair<std::string, LocationBlock> ServerBlock::getLocationBlockPair(std::string basePath) const
 {
 	bool isdir = basePath.at(basePath.length() - 1) == '/';
@@ -79,6 +234,26 @@ std::pair<std::string, LocationBlock> ServerBlock::getLocationBlockPair(std::str
 	return std::make_pair("/", a);
 }
 
+void ServerBlock::setErrorResponse(int statusCode, std::string head, std::string body)
+{
+	ErrorResponse &response = this->_errorResponses[statusCode];
+	response.head = head;
+	response.body = body;
+}
+
+void ServerBlock::clearErrorResponses()
+{
+	this->_errorResponses.clear();
+}
+
+const ServerBlock::ErrorResponse *ServerBlock::findErrorResponse(int statusCode) const
+{
+	std::map<int, ErrorResponse>::const_iterator it = this->_errorResponses.find(statusCode);
+	if (it == this->_errorResponses.end())
+		return NULL;
+	return &it->second;
+}
+
 std::ostream &operator<<(std::ostream &os, const ServerBlock &serverBlock)
 {
 	// print ports:
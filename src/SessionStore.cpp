@@ -0,0 +1,435 @@
+#include "SessionStore.hpp"
+#include "Log.hpp"
+#include "Metrics.hpp"
+#include "utils.hpp"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <openssl/rand.h>
+#include <stdio.h>
+#include <strings.h>
+#include <unistd.h>
+
+// bytes of randomness in a session id, sent as hex
+#define SESSION_ID_BYTES 16
+
+/***********************************
+ * Constructors
+ ***********************************/
+
+SessionStore::SessionStore()
+	: _wheelTime(time(NULL)), _count(0), _ttl(DEFAULT_SESSION_TTL), _path(), _fd(-1), _pending(), _records(0)
+{
+	for (size_t i = 0; i < SESSION_SHARDS; i++)
+	{
+		_shards[i].buckets.assign(SESSION_SHARD_BUCKETS, NULL);
+		_shards[i].count = 0;
+	}
+	memset(_wheel, 0, sizeof(_wheel));
+}
+
+SessionStore::SessionStore(const SessionStore &src)
+	: _wheelTime(0), _count(0), _ttl(DEFAULT_SESSION_TTL), _path(), _fd(-1), _pending(), _records(0)
+{
+	(void)src;
+}
+
+SessionStore &SessionStore::operator=(const SessionStore &rhs)
+{
+	(void)rhs;
+	return *this;
+}
+
+/***********************************
+ * Destructors
+ ***********************************/
+
+SessionStore::~SessionStore()
+{
+	flush();
+	closeLog();
+	clear();
+}
+
+/***********************************
+ * Public
+ ***********************************/
+
+// session_store memory | <file> [ttl=seconds]; an empty path keeps the
+// sessions in memory only. A new file is read into the sessions already
+// held, so a reload does not log anyone out.
+void SessionStore::configure(const std::string &path, int ttl)
+{
+	_ttl = ttl;
+	if (path == _path)
+		return;
+	flush();
+	closeLog();
+	_path = path;
+	if (!_path.empty())
+		load(time(NULL));
+}
+
+// a new session for user, with an id nobody can guess; empty if the random
+// generator failed
+std::string SessionStore::create(const std::string &user, time_t now)
+{
+	unsigned char bytes[SESSION_ID_BYTES];
+	static const char hex[] = "0123456789abcdef";
+	std::string id;
+
+	do
+	{
+		if (RAND_bytes(bytes, sizeof(bytes)) != 1)
+			return "";
+		id.clear();
+		for (size_t i = 0; i < sizeof(bytes); i++)
+		{
+			id += hex[bytes[i] >> 4];
+			id += hex[bytes[i] & 0x0F];
+		}
+	} while (*slot(id, hash(id)));
+	Entry *entry = insert(id, user, now + _ttl);
+	append("+ " + id + " " + utils::to_string(entry->expires) + " " + user + "\n");
+	Metrics::add(Metrics::SESSIONS_CREATED);
+	return id;
+}
+
+// the user of a live session; one past its ttl is gone even if the wheel
+// has not reached it yet
+const std::string *SessionStore::find(const std::string &id, time_t now) const
+{
+	Entry *entry = *slot(id, hash(id));
+
+	if (!entry || entry->expires <= now)
+		return NULL;
+	return &entry->user;
+}
+
+bool SessionStore::remove(const std::string &id)
+{
+	Entry **link = slot(id, hash(id));
+
+	if (!*link)
+		return false;
+	erase(link);
+	append("- " + id + "\n");
+	Metrics::add(Metrics::SESSIONS_DELETED);
+	return true;
+}
+
+// called every event loop round: turns the wheel to now, dropping the
+// sessions it passes, writes what was appended since the last round and
+// compacts the log once it is mostly dead records
+void SessionStore::tick(time_t now)
+{
+	if (now - _wheelTime > SESSION_WHEEL_SLOTS)
+		_wheelTime = now - SESSION_WHEEL_SLOTS;
+	while (_wheelTime < now)
+	{
+		_wheelTime++;
+		Entry *entry = _wheel[_wheelTime % SESSION_WHEEL_SLOTS];
+		while (entry)
+		{
+			Entry *next = entry->wheelNext;
+			// the others in the slot are due on a later turn
+			if (entry->expires <= _wheelTime)
+			{
+				erase(slot(entry->id, hash(entry->id)));
+				Metrics::add(Metrics::SESSIONS_EXPIRED);
+			}
+			entry = next;
+		}
+	}
+	flush();
+	if (_fd != -1 && _records > SESSION_COMPACT_MIN && _records > 2 * _count)
+		compact();
+}
+
+size_t SessionStore::size() const
+{
+	return _count;
+}
+
+// a user name fits on one log line and in an environment variable
+bool SessionStore::isValidUser(const std::string &user)
+{
+	return !user.empty() && user.size() <= SESSION_MAX_USER &&
+		   user.find_first_of(std::string("\r\n\0", 3)) == std::string::npos;
+}
+
+// the SESSION_COOKIE value of the Cookie header, empty without one
+std::string SessionStore::cookieId(const std::map<std::string, std::string> &headers)
+{
+	std::map<std::string, std::string>::const_iterator it = headers.begin();
+
+	while (it != headers.end() && strcasecmp(it->first.c_str(), "Cookie"))
+		it++;
+	if (it == headers.end())
+		return "";
+	const std::string &cookies = it->second;
+	size_t pos = 0;
+	while (pos < cookies.size())
+	{
+		size_t end = cookies.find(';', pos);
+		if (end == std::string::npos)
+			end = cookies.size();
+		std::pair<std::string, std::string> cookie = utils::splitPair(cookies.substr(pos, end - pos), "=");
+		if (utils::trim(cookie.first) == SESSION_COOKIE)
+			return utils::trim(cookie.second);
+		pos = end + 1;
+	}
+	return "";
+}
+
+/***********************************
+ * Table
+ ***********************************/
+
+// FNV-1a; the low bits pick the shard, the ones above them the bucket
+unsigned long SessionStore::hash(const std::string &id)
+{
+	unsigned long h = 14695981039346656037UL;
+
+	for (size_t i = 0; i < id.size(); i++)
+	{
+		h ^= (unsigned char)id[i];
+		h *= 1099511628211UL;
+	}
+	return h;
+}
+
+// the link pointing at the entry for id, or the NULL ending its chain
+SessionStore::Entry **SessionStore::slot(const std::string &id, unsigned long h) const
+{
+	const Shard &shard = _shards[h % SESSION_SHARDS];
+	Entry **link = const_cast<Entry **>(&shard.buckets[(h / SESSION_SHARDS) & (shard.buckets.size() - 1)]);
+
+	while (*link && (*link)->id != id)
+		link = &(*link)->next;
+	return link;
+}
+
+// adds the session or renews the one with the same id
+SessionStore::Entry *SessionStore::insert(const std::string &id, const std::string &user, time_t expires)
+{
+	unsigned long h = hash(id);
+	Entry **link = slot(id, h);
+	Entry *entry = *link;
+
+	if (entry)
+		unschedule(entry);
+	else
+	{
+		Shard &shard = _shards[h % SESSION_SHARDS];
+		entry = new Entry();
+		entry->id = id;
+		entry->next = NULL;
+		*link = entry;
+		shard.count++;
+		_count++;
+		if (shard.count > shard.buckets.size())
+			grow(shard);
+	}
+	entry->user = user;
+	entry->expires = expires;
+	schedule(entry);
+	return entry;
+}
+
+void SessionStore::erase(Entry **link)
+{
+	Entry *entry = *link;
+
+	*link = entry->next;
+	unschedule(entry);
+	_shards[hash(entry->id) % SESSION_SHARDS].count--;
+	_count--;
+	delete entry;
+}
+
+// doubles a shard's buckets once it averages more than one entry per bucket
+void SessionStore::grow(Shard &shard)
+{
+	std::vector<Entry *> buckets(shard.buckets.size() * 2, NULL);
+
+	for (size_t i = 0; i < shard.buckets.size(); i++)
+	{
+		Entry *entry = shard.buckets[i];
+		while (entry)
+		{
+			Entry *next = entry->next;
+			Entry *&head = buckets[(hash(entry->id) / SESSION_SHARDS) & (buckets.size() - 1)];
+			entry->next = head;
+			head = entry;
+			entry = next;
+		}
+	}
+	shard.buckets.swap(buckets);
+}
+
+void SessionStore::schedule(Entry *entry)
+{
+	Entry *&head = _wheel[entry->expires % SESSION_WHEEL_SLOTS];
+
+	entry->wheelPrev = NULL;
+	entry->wheelNext = head;
+	if (head)
+		head->wheelPrev = entry;
+	head = entry;
+}
+
+void SessionStore::unschedule(Entry *entry)
+{
+	if (entry->wheelPrev)
+		entry->wheelPrev->wheelNext = entry->wheelNext;
+	else
+		_wheel[entry->expires % SESSION_WHEEL_SLOTS] = entry->wheelNext;
+	if (entry->wheelNext)
+		entry->wheelNext->wheelPrev = entry->wheelPrev;
+}
+
+void SessionStore::clear()
+{
+	for (size_t i = 0; i < SESSION_SHARDS; i++)
+	{
+		for (size_t j = 0; j < _shards[i].buckets.size(); j++)
+		{
+			Entry *entry = _shards[i].buckets[j];
+			while (entry)
+			{
+				Entry *next = entry->next;
+				delete entry;
+				entry = next;
+			}
+			_shards[i].buckets[j] = NULL;
+		}
+		_shards[i].count = 0;
+	}
+	memset(_wheel, 0, sizeof(_wheel));
+	_count = 0;
+}
+
+/***********************************
+ * Log
+ ***********************************/
+
+// replays the log ("+ <id> <expires> <user>" and "- <id>" lines), skipping
+// what has expired and a line cut short by a crash, then rewrites it
+void SessionStore::load(time_t now)
+{
+	std::ifstream file(_path.c_str());
+	std::string line;
+	size_t loaded = 0;
+
+	while (std::getline(file, line))
+	{
+		if (line.size() > 2 && line[0] == '-' && line[1] == ' ')
+		{
+			Entry **link = slot(line.substr(2), hash(line.substr(2)));
+			if (*link)
+				erase(link);
+			continue;
+		}
+		size_t idEnd = line.find(' ', 2);
+		size_t expiresEnd = idEnd == std::string::npos ? idEnd : line.find(' ', idEnd + 1);
+		if (line.size() < 2 || line[0] != '+' || line[1] != ' ' || expiresEnd == std::string::npos)
+			continue;
+		char *end;
+		std::string expiresField = line.substr(idEnd + 1, expiresEnd - idEnd - 1);
+		time_t expires = strtol(expiresField.c_str(), &end, 10);
+		std::string user = line.substr(expiresEnd + 1);
+		if (*end || expiresField.empty() || !isValidUser(user))
+			continue;
+		if (expires > now)
+		{
+			insert(line.substr(2, idEnd - 2), user, expires);
+			loaded++;
+		}
+		else
+		{
+			Entry **link = slot(line.substr(2, idEnd - 2), hash(line.substr(2, idEnd - 2)));
+			if (*link)
+				erase(link);
+		}
+	}
+	LOG(LOG_INFO) << "Sessions: " << _count << " live after reading " << _path;
+	compact();
+}
+
+void SessionStore::append(const std::string &record)
+{
+	if (_fd == -1)
+		return;
+	_pending += record;
+	_records++;
+}
+
+void SessionStore::flush()
+{
+	size_t written = 0;
+
+	while (_fd != -1 && written < _pending.size())
+	{
+		ssize_t n = write(_fd, _pending.data() + written, _pending.size() - written);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+		{
+			LOG(LOG_WARN) << "Sessions: cannot write " << _path << ": " << strerror(errno);
+			break;
+		}
+		written += n;
+	}
+	_pending.clear();
+}
+
+// writes the live sessions to a temporary file and renames it over the log,
+// so a crash leaves either log whole
+void SessionStore::compact()
+{
+	std::string temp = _path + ".tmp";
+	std::string data;
+	int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	size_t written = 0;
+
+	for (size_t i = 0; i < SESSION_SHARDS; i++)
+		for (size_t j = 0; j < _shards[i].buckets.size(); j++)
+			for (Entry *entry = _shards[i].buckets[j]; entry; entry = entry->next)
+				data += "+ " + entry->id + " " + utils::to_string(entry->expires) + " " + entry->user + "\n";
+	while (fd != -1 && written < data.size())
+	{
+		ssize_t n = write(fd, data.data() + written, data.size() - written);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		written += n;
+	}
+	bool ok = fd != -1 && written == data.size() && fsync(fd) == 0;
+	if (fd != -1 && close(fd) == -1)
+		ok = false;
+	// not retried before the log doubles again
+	_records = _count;
+	if (!ok || rename(temp.c_str(), _path.c_str()))
+	{
+		LOG(LOG_ERROR) << "Sessions: cannot rewrite " << _path << ": " << strerror(errno);
+		unlink(temp.c_str());
+		return;
+	}
+	// what was pending is in the new file already
+	_pending.clear();
+	closeLog();
+	_fd = open(_path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+	if (_fd == -1)
+		LOG(LOG_ERROR) << "Sessions: cannot open " << _path << ": " << strerror(errno);
+}
+
+void SessionStore::closeLog()
+{
+	if (_fd != -1)
+		close(_fd);
+	_fd = -1;
+}
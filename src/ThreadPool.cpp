@@ -0,0 +1,164 @@
+#include "ThreadPool.hpp"
+#include "CustomException.hpp"
+#include "Log.hpp"
+#include "Metrics.hpp"
+#include <csignal>
+#include <fcntl.h>
+#include <iostream>
+#include <unistd.h>
+
+/***********************************
+ * Task
+ ***********************************/
+
+Task::Task(void) : _trace()
+{
+}
+
+Task::~Task(void)
+{
+}
+
+Task::Task(const Task &src)
+{
+	(void)src;
+}
+
+Task &Task::operator=(const Task &rhs)
+{
+	(void)rhs;
+	return *this;
+}
+
+// phases reached on the worker (task start, CGI, handler end)
+RequestTrace &Task::getTrace()
+{
+	return _trace;
+}
+
+/***********************************
+ * ThreadPool
+ ***********************************/
+
+ThreadPool::ThreadPool(size_t threads) : _threads(), _queue(), _completed(), _stopping(false)
+{
+	if (pipe(_notify) == -1)
+		throw CustomException("Error: cannot create thread pool pipe");
+	fcntl(_notify[0], F_SETFL, O_NONBLOCK);
+	fcntl(_notify[1], F_SETFL, O_NONBLOCK);
+	fcntl(_notify[0], F_SETFD, FD_CLOEXEC);
+	fcntl(_notify[1], F_SETFD, FD_CLOEXEC);
+	pthread_mutex_init(&_mutex, NULL);
+	pthread_cond_init(&_cond, NULL);
+	for (size_t i = 0; i < threads; i++)
+	{
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, &ThreadPool::worker, this) != 0)
+			throw CustomException("Error: cannot create thread pool worker");
+		_threads.push_back(thread);
+	}
+}
+
+ThreadPool::~ThreadPool(void)
+{
+	pthread_mutex_lock(&_mutex);
+	_stopping = true;
+	pthread_cond_broadcast(&_cond);
+	pthread_mutex_unlock(&_mutex);
+	for (size_t i = 0; i < _threads.size(); i++)
+		pthread_join(_threads[i], NULL);
+	for (size_t i = 0; i < _queue.size(); i++)
+		delete _queue[i].second;
+	for (size_t i = 0; i < _completed.size(); i++)
+		delete _completed[i].second;
+	pthread_cond_destroy(&_cond);
+	pthread_mutex_destroy(&_mutex);
+	close(_notify[0]);
+	close(_notify[1]);
+}
+
+ThreadPool::ThreadPool(const ThreadPool &src)
+{
+	(void)src;
+}
+
+ThreadPool &ThreadPool::operator=(const ThreadPool &rhs)
+{
+	(void)rhs;
+	return *this;
+}
+
+void *ThreadPool::worker(void *arg)
+{
+	ThreadPool *pool = static_cast<ThreadPool *>(arg);
+	sigset_t signals;
+
+	// signals (SIGHUP reloads) are for the event thread only
+	sigfillset(&signals);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	Metrics::registerThread();
+	for (;;)
+	{
+		pthread_mutex_lock(&pool->_mutex);
+		while (pool->_queue.empty() && !pool->_stopping)
+			pthread_cond_wait(&pool->_cond, &pool->_mutex);
+		if (pool->_stopping)
+		{
+			pthread_mutex_unlock(&pool->_mutex);
+			return NULL;
+		}
+		std::pair<int, Task *> job = pool->_queue.front();
+		pool->_queue.pop_front();
+		pthread_mutex_unlock(&pool->_mutex);
+
+		RequestTrace &trace = job.second->getTrace();
+		trace.mark(RequestTrace::TASK_START);
+		RequestTrace::setCurrent(&trace);
+		try
+		{
+			job.second->run();
+		}
+		catch (const std::exception &e)
+		{
+			LOG(LOG_ERROR) << "thread pool task failed: " << e.what();
+		}
+		RequestTrace::setCurrent(NULL);
+		trace.mark(RequestTrace::HANDLER_END);
+		Metrics::add(Metrics::TASKS_RUN);
+
+		pthread_mutex_lock(&pool->_mutex);
+		pool->_completed.push_back(job);
+		pthread_mutex_unlock(&pool->_mutex);
+		// a full pipe already means the loop has a wake-up pending
+		if (write(pool->_notify[1], "", 1) == -1)
+			continue;
+	}
+	return NULL;
+}
+
+void ThreadPool::submit(int fd, Task *task)
+{
+	pthread_mutex_lock(&_mutex);
+	_queue.push_back(std::make_pair(fd, task));
+	pthread_cond_signal(&_cond);
+	pthread_mutex_unlock(&_mutex);
+}
+
+int ThreadPool::getNotifyFd() const
+{
+	return _notify[0];
+}
+
+// called by the event loop when the notify fd is readable
+std::vector<std::pair<int, Task *> > ThreadPool::takeCompleted()
+{
+	std::vector<std::pair<int, Task *> > completed;
+	char buff[256];
+
+	while (read(_notify[0], buff, sizeof(buff)) > 0)
+		;
+	pthread_mutex_lock(&_mutex);
+	completed.swap(_completed);
+	pthread_mutex_unlock(&_mutex);
+	return completed;
+}
@@ -0,0 +1,352 @@
+#include "Tls.hpp"
+#include "CustomException.hpp"
+#include "Log.hpp"
+#include "Metrics.hpp"
+#include "utils.hpp"
+#include <cerrno>
+#include <climits>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <strings.h>
+
+// ALPN protocols we speak, in order of preference (wire format)
+static const unsigned char g_protocols[] = "\x02h2\x08http/1.1";
+
+static std::string lastError()
+{
+	char buff[256];
+	unsigned long error = ERR_get_error();
+
+	if (!error)
+		return "unknown error";
+	ERR_error_string_n(error, buff, sizeof(buff));
+	return buff;
+}
+
+/***********************************
+ * Constructors
+ ***********************************/
+
+Tls::Tls() : _ports(), _connections(), _pending()
+{
+}
+
+Tls::Tls(const Tls &src)
+{
+	(void)src;
+}
+
+Tls &Tls::operator=(const Tls &rhs)
+{
+	(void)rhs;
+	return *this;
+}
+
+/***********************************
+ * Destructors
+ ***********************************/
+
+Tls::~Tls()
+{
+	for (std::map<int, Connection>::iterator it = _connections.begin(); it != _connections.end(); it++)
+		SSL_free(it->second.ssl);
+	freeSites(_ports);
+}
+
+/***********************************
+ * Configuration
+ ***********************************/
+
+// builds the contexts of every ssl port; the current ones are kept if a
+// certificate or key fails to load. Connections hold on to the context they
+// started with.
+void Tls::configure(const std::vector<ServerBlock> &blocks)
+{
+	std::map<std::string, std::vector<Site> > ports;
+
+	try
+	{
+		for (size_t i = 0; i < blocks.size(); i++)
+		{
+			const std::vector<std::string> &secure = blocks[i].getSslPorts();
+			if (secure.empty())
+				continue;
+			SSL_CTX *ctx = createContext(blocks[i]);
+			for (size_t j = 0; j < secure.size(); j++)
+			{
+				Site site;
+				site.ctx = ctx;
+				site.names = blocks[i].getServerName();
+				SSL_CTX_up_ref(ctx);
+				ports[secure[j]].push_back(site);
+			}
+			SSL_CTX_free(ctx);
+		}
+		for (size_t i = 0; i < blocks.size(); i++)
+		{
+			std::vector<std::string> listening = blocks[i].getPortsListeningOn();
+			for (size_t j = 0; j < listening.size(); j++)
+				if (ports.count(listening[j]) && !utils::find(blocks[i].getSslPorts(), listening[j]))
+					throw CustomException("Error: port " + listening[j] + " is listed both with and without ssl");
+		}
+	}
+	catch (...)
+	{
+		freeSites(ports);
+		throw;
+	}
+	freeSites(_ports);
+	_ports.swap(ports);
+}
+
+SSL_CTX *Tls::createContext(const ServerBlock &block)
+{
+	const std::string &certificate = block.getSslCertificate();
+	const std::string &key = block.getSslCertificateKey();
+	SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+
+	if (!ctx)
+		throw CustomException("Error: cannot create a TLS context: " + lastError());
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE |
+								 (block.getSslKtls() ? SSL_OP_ENABLE_KTLS : 0));
+	// writes may be partial and retried from a buffer that has moved
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	if (SSL_CTX_use_certificate_chain_file(ctx, certificate.c_str()) != 1 ||
+		SSL_CTX_use_PrivateKey_file(ctx, key.c_str(), SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(ctx) != 1)
+	{
+		std::string error = lastError();
+		SSL_CTX_free(ctx);
+		throw CustomException("Error: ssl_certificate " + certificate + " / ssl_certificate_key " + key + ": " +
+							  error);
+	}
+	// resumption by session id; tickets are on by default, with keys of
+	// the context's own
+	SSL_CTX_set_session_id_context(ctx, (const unsigned char *)"webserv", 7);
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(ctx, TLS_SESSION_CACHE_SIZE);
+	SSL_CTX_set_timeout(ctx, TLS_SESSION_TIMEOUT);
+	SSL_CTX_set_tlsext_servername_callback(ctx, selectServerName);
+	SSL_CTX_set_tlsext_servername_arg(ctx, this);
+	SSL_CTX_set_alpn_select_cb(ctx, selectProtocol, NULL);
+	return ctx;
+}
+
+void Tls::freeSites(std::map<std::string, std::vector<Site> > &ports)
+{
+	for (std::map<std::string, std::vector<Site> >::iterator it = ports.begin(); it != ports.end(); it++)
+		for (size_t i = 0; i < it->second.size(); i++)
+			SSL_CTX_free(it->second[i].ctx);
+	ports.clear();
+}
+
+// SNI: switches to the context of the port's block named by the client
+int Tls::selectServerName(SSL *ssl, int *alert, void *arg)
+{
+	Tls *tls = (Tls *)arg;
+	const char *name = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+
+	(void)alert;
+	if (!name)
+		return SSL_TLSEXT_ERR_NOACK;
+	std::map<int, Connection>::iterator connection = tls->_connections.find(SSL_get_fd(ssl));
+	if (connection == tls->_connections.end())
+		return SSL_TLSEXT_ERR_NOACK;
+	std::map<std::string, std::vector<Site> >::iterator port = tls->_ports.find(connection->second.port);
+	if (port == tls->_ports.end())
+		return SSL_TLSEXT_ERR_NOACK;
+	for (size_t i = 0; i < port->second.size(); i++)
+	{
+		const std::vector<std::string> &names = port->second[i].names;
+		for (size_t j = 0; j < names.size(); j++)
+		{
+			if (strcasecmp(names[j].c_str(), name) == 0)
+			{
+				if (port->second[i].ctx != SSL_get_SSL_CTX(ssl))
+					SSL_set_SSL_CTX(ssl, port->second[i].ctx);
+				return SSL_TLSEXT_ERR_OK;
+			}
+		}
+	}
+	// an unknown name gets the default block, as Host does
+	return SSL_TLSEXT_ERR_OK;
+}
+
+// ALPN: h2 when the client offers it, else http/1.1, else no ALPN at all
+int Tls::selectProtocol(SSL *ssl, const unsigned char **out, unsigned char *outlen, const unsigned char *in,
+						unsigned int inlen, void *arg)
+{
+	unsigned char *selected;
+
+	(void)ssl;
+	(void)arg;
+	if (SSL_select_next_proto(&selected, outlen, g_protocols, sizeof(g_protocols) - 1, in, inlen) !=
+		OPENSSL_NPN_NEGOTIATED)
+		return SSL_TLSEXT_ERR_NOACK;
+	*out = selected;
+	return SSL_TLSEXT_ERR_OK;
+}
+
+/***********************************
+ * Connections
+ ***********************************/
+
+bool Tls::isSecure(const std::string &port) const
+{
+	return _ports.count(port);
+}
+
+bool Tls::owns(int fd) const
+{
+	return _connections.count(fd);
+}
+
+bool Tls::isHandshaking(int fd) const
+{
+	std::map<int, Connection>::const_iterator it = _connections.find(fd);
+
+	return it != _connections.end() && it->second.handshaking;
+}
+
+// a freshly accepted connection on a secure port; the handshake starts with
+// the first readable event
+bool Tls::open(int fd, const std::string &port)
+{
+	std::map<std::string, std::vector<Site> >::iterator it = _ports.find(port);
+	SSL *ssl;
+
+	if (it == _ports.end() || !(ssl = SSL_new(it->second[0].ctx)))
+		return false;
+	// records go out one by one, each short of a segment: Nagle would hold
+	// every one back for the ACK of the last
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	// OpenSSL has no per-call MSG_DONTWAIT: a record read halfway or a full
+	// socket must not block the loop
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	SSL_set_fd(ssl, fd);
+	SSL_set_accept_state(ssl);
+	Connection &connection = _connections[fd];
+	connection.ssl = ssl;
+	connection.port = port;
+	connection.handshaking = true;
+	return true;
+}
+
+// one step of the handshake: DONE once it completed, or the event to wait for
+Tls::Status Tls::handshake(int fd)
+{
+	Connection &connection = _connections[fd];
+	int result;
+
+	ERR_clear_error();
+	result = SSL_do_handshake(connection.ssl);
+	if (result == 1)
+	{
+		connection.handshaking = false;
+		Metrics::add(Metrics::TLS_HANDSHAKES);
+		if (SSL_session_reused(connection.ssl))
+			Metrics::add(Metrics::TLS_RESUMED);
+		if (BIO_get_ktls_send(SSL_get_wbio(connection.ssl)))
+			Metrics::add(Metrics::TLS_KTLS);
+		if (SSL_has_pending(connection.ssl))
+			_pending.insert(fd);
+		return DONE;
+	}
+	int error = SSL_get_error(connection.ssl, result);
+	if (error == SSL_ERROR_WANT_READ)
+		return WANT_READ;
+	if (error == SSL_ERROR_WANT_WRITE)
+		return WANT_WRITE;
+	Metrics::add(Metrics::TLS_HANDSHAKE_FAILURES);
+	LOG(LOG_DEBUG) << "TLS handshake failed: " << lastError();
+	return FAILED;
+}
+
+// like recv(): the bytes read, 0 once the peer closed (or the connection
+// failed), -1 with errno EAGAIN when nothing can be read yet
+ssize_t Tls::read(int fd, char *buff, size_t size)
+{
+	Connection &connection = _connections[fd];
+	int bytes;
+
+	ERR_clear_error();
+	bytes = SSL_read(connection.ssl, buff, size > INT_MAX ? INT_MAX : size);
+	if (bytes > 0)
+	{
+		if (SSL_has_pending(connection.ssl))
+			_pending.insert(fd);
+		else
+			_pending.erase(fd);
+		return bytes;
+	}
+	_pending.erase(fd);
+	int error = SSL_get_error(connection.ssl, bytes);
+	if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+	return 0;
+}
+
+// like send(): the bytes written (0 when nothing could be yet), -1 once the
+// connection failed. Each SSL_write takes one record, so this goes on until
+// the socket is full. A retry after 0 must offer at least the same bytes.
+ssize_t Tls::write(int fd, const char *data, size_t size)
+{
+	Connection &connection = _connections[fd];
+	size_t written = 0;
+
+	while (written < size)
+	{
+		size_t left = size - written;
+		ERR_clear_error();
+		int bytes = SSL_write(connection.ssl, data + written, left > INT_MAX ? INT_MAX : left);
+		if (bytes > 0)
+		{
+			written += bytes;
+			continue;
+		}
+		int error = SSL_get_error(connection.ssl, bytes);
+		if (error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE)
+			return written ? (ssize_t)written : -1;
+		break;
+	}
+	return written;
+}
+
+bool Tls::hasPending() const
+{
+	return !_pending.empty();
+}
+
+// connections to read again although poll reports nothing: OpenSSL holds
+// the rest of a record that did not fit in the last read
+std::vector<int> Tls::takePending()
+{
+	std::vector<int> pending(_pending.begin(), _pending.end());
+
+	_pending.clear();
+	return pending;
+}
+
+// sends close_notify if it fits in the socket buffer, then frees the
+// connection; the caller closes the socket
+void Tls::close(int fd)
+{
+	std::map<int, Connection>::iterator it = _connections.find(fd);
+
+	if (it == _connections.end())
+		return;
+	if (!it->second.handshaking)
+	{
+		ERR_clear_error();
+		SSL_shutdown(it->second.ssl);
+	}
+	SSL_free(it->second.ssl);
+	_connections.erase(it);
+	_pending.erase(fd);
+}
@@ -0,0 +1,725 @@
+#include "Upload.hpp"
+#include "LocationBlock.hpp"
+#include "Log.hpp"
+#include "MethodIO.hpp"
+#include "Metrics.hpp"
+#include "ServerBlock.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <stdio.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// RFC 2046 5.1.1
+#define MAX_BOUNDARY_LENGTH 70
+
+/***********************************
+ * Constructors
+ ***********************************/
+
+// setBoundary or setTarget says what the body is
+Upload::Upload(const std::string &request, const LocationBlock &location, unsigned long long length)
+	: _request(request), _store(location.getUploadStore()), _target(), _delimiter(),
+	  _maxFileSize(location.getUploadMaxFileSize()), _fsync(FSYNC_OFF),
+	  _direct(location.getUploadDirectio() && length >= location.getUploadDirectio()), _length(length), _received(0),
+	  _state(FAILED), _error(0), _created(false), _input(), _partName(), _partSize(0), _queue(), _queued(0),
+	  _spare(), _opens(0), _writing(false), _abandoned(false), _batch(), _writeError(0), _fd(-1), _buffer(NULL), _buffered(0)
+{
+	if (location.getUploadFsync() == "file")
+		_fsync = FSYNC_FILE;
+	else if (location.getUploadFsync() == "full")
+		_fsync = FSYNC_FULL;
+}
+
+Upload::Upload(const Upload &src)
+	: _maxFileSize(0), _fsync(FSYNC_OFF), _direct(false), _length(0), _received(0), _state(FAILED), _error(0),
+	  _created(false), _partSize(0), _queued(0), _opens(0), _writing(false), _abandoned(false), _writeError(0),
+	  _fd(-1), _buffer(NULL), _buffered(0)
+{
+	(void)src;
+}
+
+Upload &Upload::operator=(const Upload &rhs)
+{
+	(void)rhs;
+	return *this;
+}
+
+/***********************************
+ * Destructors
+ ***********************************/
+
+// whatever was not renamed into place is removed
+Upload::~Upload()
+{
+	if (_fd != -1)
+		close(_fd);
+	for (size_t i = 0; i < _parts.size(); i++)
+		if (!_parts[i].temp.empty())
+			unlink(_parts[i].temp.c_str());
+	free(_buffer);
+}
+
+/***********************************
+ * Public
+ ***********************************/
+
+// multipart/form-data with a usable boundary parameter
+bool Upload::isMultipart(const std::string &contentType, std::string &boundary)
+{
+	std::vector<std::string> params = utils::split(contentType, ';');
+
+	if (params.empty() || strcasecmp(utils::trim(params[0]).c_str(), "multipart/form-data"))
+		return false;
+	for (size_t i = 1; i < params.size(); i++)
+	{
+		std::pair<std::string, std::string> param = utils::splitPair(utils::trim(params[i]), "=");
+		if (strcasecmp(param.first.c_str(), "boundary"))
+			continue;
+		boundary = param.second;
+		if (boundary.size() >= 2 && boundary[0] == '"' && boundary[boundary.size() - 1] == '"')
+			boundary = boundary.substr(1, boundary.size() - 2);
+		return !boundary.empty() && boundary.size() <= MAX_BOUNDARY_LENGTH;
+	}
+	return false;
+}
+
+// a multipart body; it starts right at a boundary with no CRLF before it, so
+// the search starts as if there were one
+void Upload::setBoundary(const std::string &boundary)
+{
+	_delimiter = "\r\n--" + boundary;
+	_input = "\r\n";
+	_state = PREAMBLE;
+}
+
+// a PUT: the whole body is the file at path
+void Upload::setTarget(const std::string &path)
+{
+	size_t slash = path.rfind('/');
+
+	_target = path;
+	_store = slash == std::string::npos ? "." : path.substr(0, slash);
+	_partName = path.substr(slash == std::string::npos ? 0 : slash + 1);
+	_state = DATA;
+	if (_maxFileSize && _length > _maxFileSize)
+		fail(413);
+	else
+		beginPart();
+}
+
+// parses what it can and keeps the rest, as WebSocket::receive does; false
+// once the upload failed
+bool Upload::receive(const char *data, size_t size)
+{
+	const char *bytes = data;
+	size_t length = size;
+
+	if (_state == FAILED)
+		return false;
+	if (size > _length - _received)
+	{
+		fail(400);
+		return false;
+	}
+	_received += size;
+	if (!_target.empty())
+		return queue(data, size);
+	if (!_input.empty())
+	{
+		_input.append(data, size);
+		bytes = _input.data();
+		length = _input.size();
+	}
+	size_t used = parse(bytes, length);
+	if (bytes == data)
+		_input.assign(data + used, length - used);
+	else if (used == length)
+		std::string().swap(_input);
+	else
+		_input.erase(0, used);
+	return _state != FAILED;
+}
+
+unsigned long long Upload::getRemaining() const
+{
+	return _length - _received;
+}
+
+// the body is all in: writes what is still queued, syncs the files as
+// upload_fsync says and gives them their names. It may block, so it runs on
+// the worker pool, once no batch is being written.
+bool Upload::finish()
+{
+	if (!_target.empty() && _state == DATA && !getRemaining())
+		endPart();
+	else if (_target.empty() && _state != EPILOGUE)
+		fail(400);
+	if (_state == FAILED)
+		return false;
+	startWrite();
+	writeBatch();
+	endWrite();
+	if (_target.empty() && _parts.empty())
+		fail(400);
+	if (_state == FAILED)
+		return false;
+	for (size_t i = 0; i < _parts.size() && _fsync != FSYNC_OFF; i++)
+		if (!syncPath(_parts[i].temp))
+		{
+			fail(500);
+			return false;
+		}
+	for (size_t i = 0; i < _parts.size(); i++)
+	{
+		std::string path = _target.empty() ? _store + "/" + _parts[i].name : _target;
+		_created = access(path.c_str(), F_OK) != 0;
+		if (rename(_parts[i].temp.c_str(), path.c_str()))
+		{
+			LOG(LOG_ERROR) << "upload: cannot rename to " << path << ": " << strerror(errno);
+			fail(errno == EISDIR ? 409 : 500);
+			return false;
+		}
+		_parts[i].temp.clear();
+		_files.push_back(_parts[i].name);
+	}
+	// the new names only survive a crash once the directory is synced too
+	if (_fsync == FSYNC_FULL && !syncPath(_store))
+	{
+		fail(500);
+		return false;
+	}
+	Metrics::add(Metrics::UPLOAD_FILES, _files.size());
+	return true;
+}
+
+// the parsed bytes waiting for the writer
+size_t Upload::getQueued() const
+{
+	return _queued;
+}
+
+// enough bytes for a batch, or a file to make: a PUT into a directory that is
+// not there is answered before its body
+bool Upload::isWriteDue() const
+{
+	return _queued >= UPLOAD_WRITE_SIZE || _opens;
+}
+
+bool Upload::isWriting() const
+{
+	return _writing;
+}
+
+// the queue becomes the writer's batch
+void Upload::startWrite()
+{
+	_batch.swap(_queue);
+	_queue.clear();
+	_queued = 0;
+	_opens = 0;
+	_writing = true;
+}
+
+// on the worker: after a failed step the batch and the later ones are dropped
+void Upload::writeBatch()
+{
+	for (size_t i = 0; i < _batch.size() && !_writeError; i++)
+	{
+		if (_batch[i].step == FILE_OPEN)
+			openPart(_batch[i].data);
+		else if (_batch[i].step == FILE_DATA)
+			write(_batch[i].data.data(), _batch[i].data.size());
+		else
+			closePart();
+	}
+}
+
+// back on the event loop, which learns whether the disk failed and keeps
+// the buffers for the bytes to come
+void Upload::endWrite()
+{
+	for (size_t i = 0; i < _batch.size(); i++)
+		if (_batch[i].data.capacity() >= UPLOAD_WRITE_SIZE && _spare.size() < UPLOAD_QUEUE_SIZE / UPLOAD_WRITE_SIZE)
+		{
+			_spare.push_back(std::string());
+			_spare.back().swap(_batch[i].data);
+			_spare.back().clear();
+		}
+	_batch.clear();
+	_writing = false;
+	if (_writeError && _state != FAILED)
+		fail(_writeError);
+}
+
+// the connection went away during a write: the upload is freed after it
+void Upload::abandon()
+{
+	_abandoned = true;
+}
+
+bool Upload::isAbandoned() const
+{
+	return _abandoned;
+}
+
+// the writer made a file, which the destructor removes; only asked between
+// batches
+bool Upload::hasFiles() const
+{
+	return _fd != -1 || !_parts.empty();
+}
+
+// the status to answer a failed upload with
+int Upload::getError() const
+{
+	return _error;
+}
+
+bool Upload::isPut() const
+{
+	return !_target.empty();
+}
+
+// a PUT made the file rather than replacing one
+bool Upload::isCreated() const
+{
+	return _created;
+}
+
+const std::string &Upload::getRequest() const
+{
+	return _request;
+}
+
+const std::vector<std::string> &Upload::getFiles() const
+{
+	return _files;
+}
+
+/***********************************
+ * Parsing
+ ***********************************/
+
+// how many bytes it took; the rest waits for more
+size_t Upload::parse(const char *data, size_t size)
+{
+	size_t used = 0;
+
+	while (used < size && _state != FAILED && _state != EPILOGUE)
+	{
+		if (_state == PREAMBLE || _state == DATA)
+		{
+			const char *hit = (const char *)memmem(data + used, size - used, _delimiter.data(), _delimiter.size());
+			// without a boundary, all but what may be the start of one
+			size_t end = hit ? hit - data : size - partialDelimiter(data + used, size - used);
+			if (_state == DATA && !queue(data + used, end - used))
+				return size;
+			if (!hit)
+				return end;
+			if (_state == DATA)
+				endPart();
+			used = end + _delimiter.size();
+			_state = BOUNDARY;
+		}
+		else if (_state == BOUNDARY)
+		{
+			// "--" after the last one, CRLF before a part
+			if (size - used < 2)
+				return used;
+			if (!memcmp(data + used, "--", 2))
+				_state = EPILOGUE;
+			else if (!memcmp(data + used, "\r\n", 2))
+			{
+				_state = HEADERS;
+				_partName.clear();
+			}
+			else
+				fail(400);
+			used += 2;
+		}
+		else
+		{
+			const char *eol = (const char *)memmem(data + used, size - used, "\r\n", 2);
+			if (!eol)
+			{
+				if (size - used > UPLOAD_MAX_PART_HEADERS)
+					fail(400);
+				return used;
+			}
+			std::string line(data + used, eol);
+			used = eol - data + 2;
+			if (line.empty())
+			{
+				beginPart();
+				_state = DATA;
+			}
+			else if (!parseHeader(line))
+				fail(400);
+		}
+	}
+	return _state == FAILED || _state == EPILOGUE ? size : used;
+}
+
+// the longest end of data that the delimiter starts with; each candidate
+// starts with its CR
+size_t Upload::partialDelimiter(const char *data, size_t size) const
+{
+	size_t window = size < _delimiter.size() - 1 ? size : _delimiter.size() - 1;
+	const char *end = data + size;
+	const char *p = end - window;
+
+	while ((p = (const char *)memchr(p, '\r', end - p)))
+	{
+		if (!memcmp(p, _delimiter.data(), end - p))
+			return end - p;
+		p++;
+	}
+	return 0;
+}
+
+bool Upload::parseHeader(const std::string &line)
+{
+	size_t colon = line.find(':');
+
+	if (colon == std::string::npos)
+		return false;
+	if (!strcasecmp(line.substr(0, colon).c_str(), "Content-Disposition"))
+		_partName = fileName(line.substr(colon + 1));
+	return true;
+}
+
+// the filename parameter without a directory; empty for a field, an empty
+// file input, or a name that cannot be a file in the store
+std::string Upload::fileName(const std::string &disposition)
+{
+	std::vector<std::string> params = utils::split(disposition, ';');
+	std::string name;
+
+	for (size_t i = 1; i < params.size(); i++)
+	{
+		std::pair<std::string, std::string> param = utils::splitPair(utils::trim(params[i]), "=");
+		if (strcasecmp(param.first.c_str(), "filename"))
+			continue;
+		name = param.second;
+		if (name.size() >= 2 && name[0] == '"' && name[name.size() - 1] == '"')
+			name = name.substr(1, name.size() - 2);
+	}
+	// some browsers send the whole client path
+	size_t slash = name.find_last_of("/\\");
+	if (slash != std::string::npos)
+		name.erase(0, slash + 1);
+	for (size_t i = 0; i < name.size(); i++)
+		if ((unsigned char)name[i] < 0x20 || name[i] == 0x7F)
+			return "";
+	if (name == "." || name == "..")
+		return "";
+	return name;
+}
+
+/***********************************
+ * Files
+ ***********************************/
+
+// a file part gets a temporary file in the store once the writer gets to it;
+// other parts are skipped
+void Upload::beginPart()
+{
+	Pending open;
+
+	_partSize = 0;
+	if (_partName.empty())
+		return;
+	open.step = FILE_OPEN;
+	open.data = _partName;
+	_queue.push_back(open);
+	_opens++;
+}
+
+// the bytes fill the last queued buffer, then new ones of UPLOAD_WRITE_SIZE
+bool Upload::queue(const char *data, size_t size)
+{
+	if (_partName.empty() || !size)
+		return true;
+	_partSize += size;
+	if (_maxFileSize && _partSize > _maxFileSize)
+	{
+		fail(413);
+		return false;
+	}
+	Metrics::add(Metrics::UPLOAD_BYTES, size);
+	_queued += size;
+	while (size)
+	{
+		if (_queue.empty() || _queue.back().step != FILE_DATA || _queue.back().data.size() == UPLOAD_WRITE_SIZE)
+		{
+			_queue.push_back(Pending());
+			_queue.back().step = FILE_DATA;
+			// no more than the rest of the body can take
+			if (_spare.empty())
+				_queue.back().data.reserve(std::min<unsigned long long>(UPLOAD_WRITE_SIZE, size + getRemaining()));
+			else
+			{
+				_queue.back().data.swap(_spare.back());
+				_spare.pop_back();
+			}
+		}
+		std::string &bytes = _queue.back().data;
+		size_t n = size < UPLOAD_WRITE_SIZE - bytes.size() ? size : UPLOAD_WRITE_SIZE - bytes.size();
+		bytes.append(data, n);
+		data += n;
+		size -= n;
+	}
+	return true;
+}
+
+void Upload::endPart()
+{
+	Pending close;
+
+	if (_partName.empty())
+		return;
+	close.step = FILE_CLOSE;
+	_queue.push_back(close);
+}
+
+// the writer's files are left to it, or to the destructor
+void Upload::fail(int code)
+{
+	_state = FAILED;
+	_error = code;
+}
+
+void Upload::openPart(const std::string &name)
+{
+	File file;
+
+	file.temp = _store + "/.upload-XXXXXX";
+	file.name = name;
+	if (!openFile(file))
+	{
+		LOG(LOG_ERROR) << "upload: cannot create a file in " << _store << ": " << strerror(errno);
+		// a PUT into a directory that is not there conflicts with the tree
+		if (_target.empty() || (errno != ENOENT && errno != ENOTDIR && errno != EACCES))
+			failWrite(500);
+		else
+			failWrite(errno == EACCES ? 403 : 409);
+		return;
+	}
+	fchmod(_fd, 0644);
+	_parts.push_back(file);
+}
+
+// with upload_directio the file bypasses the page cache, which not every
+// file system allows; a PUT's file is preallocated at its final size
+bool Upload::openFile(File &file)
+{
+	if (_direct)
+	{
+		std::string temp = file.temp;
+		_fd = mkostemp(&temp[0], O_CLOEXEC | O_DIRECT);
+		if (_fd == -1 && errno != EINVAL)
+			return false;
+		if (_fd != -1 && !_buffer && posix_memalign((void **)&_buffer, UPLOAD_DIRECT_ALIGN, UPLOAD_DIRECT_BUFFER))
+		{
+			close(_fd);
+			unlink(temp.c_str());
+			_fd = -1;
+			_buffer = NULL;
+		}
+		_direct = _fd != -1;
+		if (_direct)
+		{
+			file.temp = temp;
+			if (!_target.empty() && _length)
+				fallocate(_fd, 0, 0, _length);
+			return true;
+		}
+	}
+	_fd = mkostemp(&file.temp[0], O_CLOEXEC);
+	return _fd != -1;
+}
+
+void Upload::write(const char *data, size_t size)
+{
+	if (_fd == -1)
+		return;
+	if (!_direct)
+	{
+		writeAll(data, size);
+		return;
+	}
+	while (size)
+	{
+		size_t n = size < UPLOAD_DIRECT_BUFFER - _buffered ? size : UPLOAD_DIRECT_BUFFER - _buffered;
+		memcpy(_buffer + _buffered, data, n);
+		_buffered += n;
+		data += n;
+		size -= n;
+		if (_buffered == UPLOAD_DIRECT_BUFFER && !writeAll(_buffer, _buffered))
+			return;
+		if (_buffered == UPLOAD_DIRECT_BUFFER)
+			_buffered = 0;
+	}
+}
+
+bool Upload::writeAll(const char *data, size_t size)
+{
+	size_t written = 0;
+
+	while (written < size)
+	{
+		ssize_t n = ::write(_fd, data + written, size - written);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+		{
+			LOG(LOG_ERROR) << "upload: cannot write " << _parts.back().temp << ": " << strerror(errno);
+			failWrite(500);
+			return false;
+		}
+		written += n;
+	}
+	return true;
+}
+
+// with O_DIRECT, the whole blocks still buffered go out as they are and the
+// tail without it
+void Upload::closePart()
+{
+	if (_fd == -1)
+		return;
+	if (_direct && _buffered)
+	{
+		size_t aligned = _buffered & ~(size_t)(UPLOAD_DIRECT_ALIGN - 1);
+		if (aligned && !writeAll(_buffer, aligned))
+			return;
+		if (aligned < _buffered &&
+			(fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL) & ~O_DIRECT) == -1 ||
+			 !writeAll(_buffer + aligned, _buffered - aligned)))
+		{
+			failWrite(500);
+			return;
+		}
+		_buffered = 0;
+	}
+	int result = close(_fd);
+	_fd = -1;
+	if (result == -1)
+		failWrite(500);
+}
+
+// fsync through a descriptor of its own: the file's may be long closed
+bool Upload::syncPath(const std::string &path)
+{
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	bool ok = fd != -1 && fsync(fd) == 0;
+
+	if (!ok)
+		LOG(LOG_ERROR) << "upload: cannot sync " << path << ": " << strerror(errno);
+	if (fd != -1)
+		close(fd);
+	return ok;
+}
+
+void Upload::failWrite(int code)
+{
+	if (_fd != -1)
+		close(_fd);
+	_fd = -1;
+	if (!_writeError)
+		_writeError = code;
+}
+
+/***********************************
+ * UploadTask
+ ***********************************/
+
+UploadTask::UploadTask(Upload *upload, const ServerBlock &block)
+	: Task(), _upload(upload), _block(block), _response()
+{
+}
+
+UploadTask::UploadTask(const UploadTask &src) : Task(), _upload(NULL), _block(src._block)
+{
+	(void)src;
+}
+
+UploadTask &UploadTask::operator=(const UploadTask &rhs)
+{
+	(void)rhs;
+	return *this;
+}
+
+// only when the pool is torn down with the task still in it
+UploadTask::~UploadTask(void)
+{
+	delete _upload;
+}
+
+// the files that were not renamed into place are removed here too
+void UploadTask::run()
+{
+	_upload->finish();
+	_response = MethodIO::uploadResponse(*_upload, &_block);
+	delete _upload;
+	_upload = NULL;
+}
+
+std::string UploadTask::complete()
+{
+	return _response;
+}
+
+/***********************************
+ * UploadWriteTask
+ ***********************************/
+
+UploadWriteTask::UploadWriteTask(Upload *upload, bool remove) : Task(), _upload(upload), _remove(remove)
+{
+}
+
+UploadWriteTask::UploadWriteTask(const UploadWriteTask &src) : Task(), _upload(NULL), _remove(false)
+{
+	(void)src;
+}
+
+UploadWriteTask &UploadWriteTask::operator=(const UploadWriteTask &rhs)
+{
+	(void)rhs;
+	return *this;
+}
+
+// only when the pool is torn down with the task still in it
+UploadWriteTask::~UploadWriteTask(void)
+{
+	if (_upload && (_remove || _upload->isAbandoned()))
+		delete _upload;
+}
+
+void UploadWriteTask::run()
+{
+	if (!_remove)
+		return _upload->writeBatch();
+	delete _upload;
+	_upload = NULL;
+}
+
+// the event loop looks at the upload
+std::string UploadWriteTask::complete()
+{
+	return "";
+}
+
+Upload *UploadWriteTask::release()
+{
+	Upload *upload = _upload;
+
+	_upload = NULL;
+	return upload;
+}
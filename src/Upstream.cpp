@@ -0,0 +1,358 @@
+#include "Upstream.hpp"
+#include "Log.hpp"
+#include <algorithm>
+
+/***********************************
+ * Constructors
+ ***********************************/
+
+Upstream::Peer::Peer()
+	: host(), port(), weight(DEFAULT_UPSTREAM_WEIGHT), maxFails(DEFAULT_UPSTREAM_MAX_FAILS),
+	  failTimeout(DEFAULT_UPSTREAM_FAIL_TIMEOUT), fails(0), firstFail(0), downUntil(0), backoff(1), tripped(false),
+	  healthy(true), probeFails(0), probePasses(0), nextProbe(0), active(0), currentWeight(0)
+{
+}
+
+Upstream::HealthCheck::HealthCheck()
+	: enabled(false), uri("/"), interval(DEFAULT_HEALTH_CHECK_INTERVAL), timeout(DEFAULT_HEALTH_CHECK_TIMEOUT),
+	  fails(DEFAULT_HEALTH_CHECK_FAILS), passes(DEFAULT_HEALTH_CHECK_PASSES)
+{
+}
+
+Upstream::Upstream() : _name(), _balance(ROUND_ROBIN), _hashKey(), _check(), _peers(), _ring()
+{
+}
+
+Upstream::Upstream(const std::string &name) : _name(name), _balance(ROUND_ROBIN), _hashKey(), _check(), _peers(), _ring()
+{
+}
+
+Upstream::Upstream(const Upstream &src)
+	: _name(src._name), _balance(src._balance), _hashKey(src._hashKey), _check(src._check), _peers(src._peers),
+	  _ring(src._ring)
+{
+}
+
+Upstream &Upstream::operator=(const Upstream &rhs)
+{
+	if (this != &rhs)
+	{
+		_name = rhs._name;
+		_balance = rhs._balance;
+		_hashKey = rhs._hashKey;
+		_check = rhs._check;
+		_peers = rhs._peers;
+		_ring = rhs._ring;
+	}
+	return *this;
+}
+
+/***********************************
+ * Destructors
+ ***********************************/
+
+Upstream::~Upstream()
+{
+}
+
+/***********************************
+ * Configuration
+ ***********************************/
+
+void Upstream::addPeer(const Peer &peer)
+{
+	_peers.push_back(peer);
+}
+
+void Upstream::setBalance(Balance balance, const std::string &hashKey)
+{
+	_balance = balance;
+	_hashKey = hashKey;
+}
+
+void Upstream::setHealthCheck(const HealthCheck &check)
+{
+	_check = check;
+}
+
+// places UPSTREAM_HASH_POINTS points per unit of weight for every peer on the
+// ring, so adding or removing a peer only moves the keys next to its points
+void Upstream::build()
+{
+	_ring.clear();
+	if (_balance != HASH)
+		return;
+	for (size_t i = 0; i < _peers.size(); i++)
+	{
+		std::string key = getKey(i);
+		for (int point = 0; point < _peers[i].weight * UPSTREAM_HASH_POINTS; point++)
+		{
+			char suffix[16];
+			int len = 0;
+			for (int n = point; len == 0 || n; n /= 10)
+				suffix[len++] = '0' + n % 10;
+			_ring.push_back(std::make_pair(hash(key + "-" + std::string(suffix, len)), (int)i));
+		}
+	}
+	std::sort(_ring.begin(), _ring.end());
+}
+
+// keeps what the running config learnt about the peers that are still
+// listed across a reload
+void Upstream::inherit(const Upstream &old)
+{
+	for (size_t i = 0; i < _peers.size(); i++)
+	{
+		int prev = old.find(getKey(i));
+		if (prev == -1)
+			continue;
+		const Peer &from = old._peers[prev];
+		Peer &to = _peers[i];
+		to.fails = from.fails;
+		to.firstFail = from.firstFail;
+		to.downUntil = from.downUntil;
+		to.backoff = from.backoff;
+		to.tripped = from.tripped;
+		to.healthy = from.healthy;
+		to.active = from.active;
+	}
+}
+
+/***********************************
+ * Getters
+ ***********************************/
+
+const std::string &Upstream::getName() const
+{
+	return _name;
+}
+
+Upstream::Balance Upstream::getBalance() const
+{
+	return _balance;
+}
+
+const std::string &Upstream::getHashKey() const
+{
+	return _hashKey;
+}
+
+const Upstream::HealthCheck &Upstream::getHealthCheck() const
+{
+	return _check;
+}
+
+std::vector<Upstream::Peer> &Upstream::getPeers()
+{
+	return _peers;
+}
+
+const std::vector<Upstream::Peer> &Upstream::getPeers() const
+{
+	return _peers;
+}
+
+int Upstream::find(const std::string &key) const
+{
+	for (size_t i = 0; i < _peers.size(); i++)
+		if (getKey(i) == key)
+			return i;
+	return -1;
+}
+
+std::string Upstream::getKey(int peer) const
+{
+	return _peers[peer].host + ":" + _peers[peer].port;
+}
+
+/***********************************
+ * Scheduling
+ ***********************************/
+
+// the peer for the next attempt of a request, skipping the ones it already
+// tried; when every peer is out after failures they are tried anyway (the
+// health probes still rule out the unhealthy ones), -1 when none is left
+int Upstream::select(const std::string &hashValue, const std::vector<int> &tried, double now)
+{
+	for (int pass = 0; pass < 2; pass++)
+	{
+		int peer;
+		if (_balance == HASH)
+			peer = selectHash(hashValue, tried, now, pass == 1);
+		else if (_balance == LEAST_CONN)
+			peer = selectLeastConn(tried, now, pass == 1);
+		else
+			peer = selectRoundRobin(tried, now, pass == 1);
+		if (peer != -1)
+			return peer;
+	}
+	return -1;
+}
+
+void Upstream::connected(int peer)
+{
+	_peers[peer].active++;
+}
+
+void Upstream::released(int peer)
+{
+	if (_peers[peer].active > 0)
+		_peers[peer].active--;
+}
+
+// passive check: maxFails failures within failTimeout take the peer out for
+// failTimeout times its backoff; failing the first request after that
+// doubles the backoff
+void Upstream::failure(int peer, double now)
+{
+	Peer &p = _peers[peer];
+
+	if (!p.fails || now - p.firstFail > p.failTimeout)
+	{
+		p.fails = 0;
+		p.firstFail = now;
+	}
+	p.fails++;
+	if (!p.tripped && p.fails < p.maxFails)
+		return;
+	if (p.tripped && p.backoff < UPSTREAM_MAX_BACKOFF)
+		p.backoff *= 2;
+	p.tripped = true;
+	p.fails = 0;
+	p.downUntil = now + p.failTimeout * p.backoff;
+	LOG(LOG_WARN) << "upstream " << _name << ": " << getKey(peer) << " is down for " << p.failTimeout * p.backoff
+				  << "s";
+}
+
+void Upstream::success(int peer)
+{
+	Peer &p = _peers[peer];
+
+	if (p.tripped)
+		LOG(LOG_INFO) << "upstream " << _name << ": " << getKey(peer) << " is back up";
+	p.fails = 0;
+	p.backoff = 1;
+	p.tripped = false;
+}
+
+// active check: fails probes in a row mark the peer unhealthy, passes in a
+// row healthy again
+void Upstream::probed(int peer, bool ok, double now)
+{
+	Peer &p = _peers[peer];
+
+	p.nextProbe = now + _check.interval;
+	p.probeFails = ok ? 0 : p.probeFails + 1;
+	p.probePasses = ok ? p.probePasses + 1 : 0;
+	if (p.healthy && p.probeFails >= _check.fails)
+	{
+		p.healthy = false;
+		LOG(LOG_WARN) << "upstream " << _name << ": " << getKey(peer) << " failed its health check";
+	}
+	else if (!p.healthy && p.probePasses >= _check.passes)
+	{
+		p.healthy = true;
+		p.fails = 0;
+		p.downUntil = 0;
+		p.tripped = false;
+		p.backoff = 1;
+		LOG(LOG_INFO) << "upstream " << _name << ": " << getKey(peer) << " passed its health check";
+	}
+}
+
+bool Upstream::isUsable(int peer, const std::vector<int> &tried, double now, bool ignoreDown) const
+{
+	const Peer &p = _peers[peer];
+
+	if (!p.healthy || (!ignoreDown && p.downUntil > now))
+		return false;
+	return std::find(tried.begin(), tried.end(), peer) == tried.end();
+}
+
+int Upstream::selectRoundRobin(const std::vector<int> &tried, double now, bool ignoreDown)
+{
+	std::vector<int> candidates;
+
+	for (size_t i = 0; i < _peers.size(); i++)
+		if (isUsable(i, tried, now, ignoreDown))
+			candidates.push_back(i);
+	return pickWeighted(candidates);
+}
+
+// fewest requests in flight for its weight; ties go round robin
+int Upstream::selectLeastConn(const std::vector<int> &tried, double now, bool ignoreDown)
+{
+	std::vector<int> least;
+
+	for (size_t i = 0; i < _peers.size(); i++)
+	{
+		if (!isUsable(i, tried, now, ignoreDown))
+			continue;
+		if (!least.empty())
+		{
+			const Peer &a = _peers[i];
+			const Peer &b = _peers[least[0]];
+			// a.active / a.weight against b.active / b.weight
+			long lhs = (long)a.active * b.weight;
+			long rhs = (long)b.active * a.weight;
+			if (lhs > rhs)
+				continue;
+			if (lhs < rhs)
+				least.clear();
+		}
+		least.push_back(i);
+	}
+	return pickWeighted(least);
+}
+
+// the first usable peer clockwise from the key's point on the ring
+int Upstream::selectHash(const std::string &hashValue, const std::vector<int> &tried, double now, bool ignoreDown)
+{
+	if (_ring.empty())
+		return -1;
+	std::vector<std::pair<unsigned int, int> >::const_iterator start =
+		std::lower_bound(_ring.begin(), _ring.end(), std::make_pair(hash(hashValue), -1));
+	for (size_t n = 0; n < _ring.size(); n++)
+	{
+		if (start == _ring.end())
+			start = _ring.begin();
+		if (isUsable(start->second, tried, now, ignoreDown))
+			return start->second;
+		++start;
+	}
+	return -1;
+}
+
+// smooth weighted round robin: every candidate gains its weight, the one
+// ahead wins and pays back the total, which interleaves the heavier peers
+// instead of sending them bursts
+int Upstream::pickWeighted(const std::vector<int> &candidates)
+{
+	int best = -1;
+	int total = 0;
+
+	for (size_t i = 0; i < candidates.size(); i++)
+	{
+		Peer &p = _peers[candidates[i]];
+		p.currentWeight += p.weight;
+		total += p.weight;
+		if (best == -1 || p.currentWeight > _peers[best].currentWeight)
+			best = candidates[i];
+	}
+	if (best != -1)
+		_peers[best].currentWeight -= total;
+	return best;
+}
+
+// FNV-1a
+unsigned int Upstream::hash(const std::string &str)
+{
+	unsigned int h = 2166136261u;
+
+	for (size_t i = 0; i < str.size(); i++)
+	{
+		h ^= (unsigned char)str[i];
+		h *= 16777619u;
+	}
+	return h;
+}
@@ -0,0 +1,297 @@
+#include "UringPoller.hpp"
+#include "CustomException.hpp"
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// user_data values below this are reserved for internal requests
+#define URING_IGNORED 0
+#define URING_FIRST_TOKEN 1
+
+/***********************************
+ * Constructors
+ ***********************************/
+
+UringPoller::UringPoller(void)
+	: Poller(), _pending(0), _fds(), _armed(), _listeners(), _accepting(), _accepted(), _multishotAccept(true),
+	  _nextToken(URING_FIRST_TOKEN)
+{
+	struct io_uring_params params;
+
+	memset(&params, 0, sizeof(params));
+	_ringFd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (_ringFd == -1)
+		throw CustomException("Error: io_uring_setup failed (io_uring unavailable?)");
+	_entries = params.sq_entries;
+	_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (_cqRingSize > _sqRingSize)
+			_sqRingSize = _cqRingSize;
+		_cqRingSize = _sqRingSize;
+	}
+	_sqRing = mmap(NULL, _sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringFd, IORING_OFF_SQ_RING);
+	_cqRing = _sqRing;
+	if (_sqRing != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP))
+		_cqRing = mmap(NULL, _cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringFd,
+					   IORING_OFF_CQ_RING);
+	_sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	_sqes = (struct io_uring_sqe *)mmap(NULL, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringFd,
+										IORING_OFF_SQES);
+	if (_sqRing == MAP_FAILED || _cqRing == MAP_FAILED || _sqes == MAP_FAILED)
+	{
+		close(_ringFd);
+		throw CustomException("Error: cannot map the io_uring rings");
+	}
+	char *sq = (char *)_sqRing;
+	char *cq = (char *)_cqRing;
+	_sqHead = (unsigned int *)(sq + params.sq_off.head);
+	_sqTail = (unsigned int *)(sq + params.sq_off.tail);
+	_sqMask = (unsigned int *)(sq + params.sq_off.ring_mask);
+	_sqArray = (unsigned int *)(sq + params.sq_off.array);
+	_cqHead = (unsigned int *)(cq + params.cq_off.head);
+	_cqTail = (unsigned int *)(cq + params.cq_off.tail);
+	_cqMask = (unsigned int *)(cq + params.cq_off.ring_mask);
+	_cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+}
+
+/***********************************
+ * Destructors
+ ***********************************/
+
+UringPoller::~UringPoller(void)
+{
+	munmap(_sqes, _sqesSize);
+	if (_cqRing != _sqRing)
+		munmap(_cqRing, _cqRingSize);
+	munmap(_sqRing, _sqRingSize);
+	close(_ringFd);
+}
+
+/***********************************
+ * Others
+ ***********************************/
+
+int UringPoller::enter(unsigned int toSubmit, unsigned int minComplete)
+{
+	int flags = minComplete ? IORING_ENTER_GETEVENTS : 0;
+	int ret = syscall(__NR_io_uring_enter, _ringFd, toSubmit, minComplete, flags, NULL, 0);
+
+	if (ret >= 0)
+		_pending -= ret;
+	return ret;
+}
+
+// next free submission entry; a full queue is flushed to the kernel first
+struct io_uring_sqe *UringPoller::getSqe()
+{
+	unsigned int tail = *_sqTail;
+
+	if (tail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= _entries)
+	{
+		enter(_pending, 0);
+		if (tail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= _entries)
+			return NULL;
+	}
+	unsigned int index = tail & *_sqMask;
+	struct io_uring_sqe *sqe = &_sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	_sqArray[index] = index;
+	__atomic_store_n(_sqTail, tail + 1, __ATOMIC_RELEASE);
+	_pending++;
+	return sqe;
+}
+
+void UringPoller::arm(int fd, FdState &state)
+{
+	struct io_uring_sqe *sqe = getSqe();
+
+	if (!sqe)
+		return;
+	state.token = _nextToken++;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = state.events;
+	sqe->user_data = state.token;
+	_armed[state.token] = fd;
+}
+
+// one accept that stays armed and completes once per connection
+void UringPoller::armAccept(int fd, unsigned long long &token)
+{
+	struct io_uring_sqe *sqe = getSqe();
+
+	if (!sqe)
+		return;
+	token = _nextToken++;
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = token;
+	_accepting[token] = fd;
+}
+
+// forgets the armed poll; its (cancelled) completion is dropped by token
+void UringPoller::cancel(FdState &state)
+{
+	if (!state.token)
+		return;
+	_armed.erase(state.token);
+	struct io_uring_sqe *sqe = getSqe();
+	if (sqe)
+	{
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->fd = -1;
+		sqe->addr = state.token;
+		sqe->user_data = URING_IGNORED;
+	}
+	state.token = 0;
+}
+
+void UringPoller::cancelAccept(unsigned long long token)
+{
+	if (!token)
+		return;
+	_accepting.erase(token);
+	struct io_uring_sqe *sqe = getSqe();
+	if (sqe)
+	{
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = token;
+		sqe->user_data = URING_IGNORED;
+	}
+}
+
+// a connection, or the end of the accept: it is armed again on the next
+// wait(), unless the kernel has no multishot accept and the socket falls back
+// to readiness
+void UringPoller::completeAccept(std::map<unsigned long long, int>::iterator accepting, struct io_uring_cqe *cqe)
+{
+	int fd = accepting->second;
+
+	if (cqe->res >= 0)
+		_accepted.push_back(std::make_pair(fd, cqe->res));
+	if (cqe->flags & IORING_CQE_F_MORE)
+		return;
+	_accepting.erase(accepting);
+	_listeners[fd] = 0;
+	if (cqe->res == -EINVAL)
+	{
+		_multishotAccept = false;
+		_listeners.erase(fd);
+		add(fd, POLLIN);
+	}
+}
+
+void UringPoller::addListener(int fd)
+{
+	if (_multishotAccept)
+		_listeners[fd] = 0;
+	else
+		add(fd, POLLIN);
+}
+
+std::vector<std::pair<int, int> > UringPoller::takeAccepted()
+{
+	std::vector<std::pair<int, int> > accepted;
+
+	accepted.swap(_accepted);
+	return accepted;
+}
+
+void UringPoller::add(int fd, short events)
+{
+	FdState &state = _fds[fd];
+
+	state.events = events;
+	state.token = 0;
+}
+
+void UringPoller::modify(int fd, short events)
+{
+	std::map<int, FdState>::iterator it = _fds.find(fd);
+	if (it == _fds.end() || it->second.events == events)
+		return;
+	cancel(it->second);
+	it->second.events = events;
+}
+
+void UringPoller::remove(int fd)
+{
+	std::map<int, unsigned long long>::iterator listener = _listeners.find(fd);
+	if (listener != _listeners.end())
+	{
+		cancelAccept(listener->second);
+		_listeners.erase(listener);
+		return;
+	}
+	std::map<int, FdState>::iterator it = _fds.find(fd);
+	if (it == _fds.end())
+		return;
+	cancel(it->second);
+	_fds.erase(it);
+}
+
+int UringPoller::wait(std::vector<struct pollfd> &ready, int timeout)
+{
+	ready.clear();
+	for (std::map<int, unsigned long long>::iterator it = _listeners.begin(); it != _listeners.end(); it++)
+		if (!it->second)
+			armAccept(it->first, it->second);
+	for (std::map<int, FdState>::iterator it = _fds.begin(); it != _fds.end(); it++)
+		if (!it->second.token && it->second.events)
+			arm(it->first, it->second);
+	if (timeout >= 0)
+	{
+		struct io_uring_sqe *sqe = getSqe();
+		if (sqe)
+		{
+			_timeout.tv_sec = timeout / 1000;
+			_timeout.tv_nsec = (timeout % 1000) * 1000000L;
+			sqe->opcode = IORING_OP_TIMEOUT;
+			sqe->fd = -1;
+			sqe->addr = (unsigned long)&_timeout;
+			sqe->len = 1;
+			sqe->user_data = URING_IGNORED;
+		}
+	}
+	if (enter(_pending, 1) == -1 && errno != EBUSY)
+		return -1;
+
+	unsigned int head = *_cqHead;
+	unsigned int tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++)
+	{
+		struct io_uring_cqe *cqe = &_cqes[head & *_cqMask];
+		std::map<unsigned long long, int>::iterator accepting = _accepting.find(cqe->user_data);
+		if (accepting != _accepting.end())
+		{
+			completeAccept(accepting, cqe);
+			continue;
+		}
+		std::map<unsigned long long, int>::iterator armed = _armed.find(cqe->user_data);
+		if (armed == _armed.end())
+			continue;
+		int fd = armed->second;
+		_armed.erase(armed);
+		_fds[fd].token = 0;
+		if (cqe->res < 0)
+			continue;
+		struct pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = 0;
+		pfd.revents = cqe->res;
+		ready.push_back(pfd);
+	}
+	__atomic_store_n(_cqHead, head, __ATOMIC_RELEASE);
+	return ready.size() + _accepted.size();
+}
+
+const char *UringPoller::getName() const
+{
+	return "io_uring";
+}
@@ -1,40 +1,227 @@
 
+#include "AccessLog.hpp"
 #include "IOAdaptor.hpp"
 #include "MethodIO.hpp"
+#include "Log.hpp"
+#include "MethodTask.hpp"
+#include "Metrics.hpp"
 #include "ServerBlock.hpp"
 #include "colors.h"
 #include "utils.hpp"
 #include "webserv.h"
+#include <cerrno>
+#include <cstdlib>
+#include <csignal>
 #include <cstddef>
+#include <ctime>
 #include <iostream>
 #include <map>
 #include <ostream>
 #include <sstream>
 #include <string>
 #include <sys/poll.h>
+#include <sys/socket.h>
 #include <utility>
 #include <vector>
 
-WebServer::WebServer(const std::string &filePath, IOAdaptor &io) : _io(io)
+static volatile sig_atomic_t g_reloadRequested = 0;
+
+static void requestReload(int sig)
+{
+	(void)sig;
+	g_reloadRequested = 1;
+}
+
+static void requestLogReopen(int sig)
+{
+	(void)sig;
+	AccessLog::requestReopen();
+}
+
+static bool usesMicroCache(const std::vector<ServerBlock> &blocks)
+{
+	for (size_t i = 0; i < blocks.size(); i++)
+		if (blocks[i].hasMicroCacheLocations())
+			return true;
+	return false;
+}
+
+static bool usesUploads(const std::vector<ServerBlock> &blocks)
+{
+	for (size_t i = 0; i < blocks.size(); i++)
+		if (blocks[i].hasUploadLocations())
+			return true;
+	return false;
+}
+
+// tells every server where the first session_api location answers, so their
+// CGIs get it as SESSION_API and SESSION_API_HOST instead of hardcoding it. A
+// listen without an address, or on all of them, is reached on loopback.
+static void linkSessionApi(std::vector<ServerBlock> &blocks)
+{
+	std::string url;
+	std::string host;
+
+	for (size_t i = 0; i < blocks.size() && url.empty(); i++)
+	{
+		std::string location = blocks[i].getSessionApiLocation();
+		std::vector<std::string> listen = blocks[i].getPortsListeningOn();
+		std::vector<std::string> names = blocks[i].getServerName();
+		if (location.empty() || listen.empty())
+			continue;
+		std::string address = listen[0];
+		size_t colon = address.find_last_of(':');
+		std::string ip = colon == std::string::npos ? "" : address.substr(0, colon);
+		if (ip.empty() || ip == "0.0.0.0" || ip == "*")
+			address = "127.0.0.1:" + address.substr(colon == std::string::npos ? 0 : colon + 1);
+		else if (ip == "[::]")
+			address = "[::1]:" + address.substr(colon + 1);
+		url = "http://" + address + location + (location[location.size() - 1] == '/' ? "" : "/");
+		host = names.empty() ? address : names[0];
+	}
+	for (size_t i = 0; i < blocks.size(); i++)
+		blocks[i].setSessionApiAddress(url, host);
+}
+
+// WEBSERV_LOG_LEVEL overrides log_level, e.g. for a one-off debug run
+static void applyLogConfig(const Parser &parser)
+{
+	LogLevel level = parser.getLogLevel();
+	const char *env = std::getenv("WEBSERV_LOG_LEVEL");
+
+	if (env && !Log::parseLevel(env, level))
+		LOG(LOG_WARN) << "WEBSERV_LOG_LEVEL: unknown level " << env;
+	Log::setLevel(level);
+	AccessLog::configure(parser.getAccessLogPath(), parser.getAccessLogFormat());
+}
+
+WebServer::WebServer(const std::string &filePath, IOAdaptor &io)
+	: _filePath(filePath), _config(0), _poller(NULL), _io(io), _pool(THREAD_POOL_SIZE), _deferredTask(NULL),
+	  _slowRequestThreshold(0), _proxy(*this), _pendingProxy(NULL), _cacheRevalidate(false),
+	  _revalidating(false), _nextDetached(-1), _microEnabled(false), _upgradeWebSocket(false), _nextSweep(0),
+	  _uploadEnabled(false)
 {
 	Parser parser(filePath);
 
 	parser.parseServerBlocks(this->_serverBlocks);
-	std::cout << GREEN "Server blocks created" RESET << std::endl << std::endl;
+	applyLogConfig(parser);
+	_slowRequestThreshold = parser.getSlowRequestThreshold();
+	_proxy.setUpstreams(parser.getUpstreams());
+	_cache.configure(parser.getResponseCachePath(), parser.getResponseCacheSize());
+	_sessions.configure(parser.getSessionStorePath(), parser.getSessionTtl());
+	_microEnabled = usesMicroCache(_serverBlocks);
+	_uploadEnabled = usesUploads(_serverBlocks);
+	_tls.configure(_serverBlocks);
+	_poller = Poller::create(parser.getEventBackend());
+	LOG(LOG_INFO) << GREEN "Event backend: " << _poller->getName() << RESET;
+	_configs[_config].mimeTypes = MimeTypes(parser.getTypes());
+	MethodIO::setMimeTypes(&_configs[_config].mimeTypes);
+	LOG(LOG_INFO) << GREEN "Server blocks created" RESET;
+	linkSessionApi(_serverBlocks);
+	for (size_t i = 0; i < _serverBlocks.size(); i++)
+		MethodIO::loadErrorPages(_serverBlocks[i]);
+	signal(SIGHUP, requestReload);
+	signal(SIGUSR1, requestLogReopen);
+	// SSL_write has no MSG_NOSIGNAL: a peer gone mid-write is an error, not
+	// the end of the server
+	signal(SIGPIPE, SIG_IGN);
 
 	// printServerBlocksInfo();
 	initSockets();
+	addFd(_pool.getNotifyFd());
+	addFd(_deletes.getNotifyFd());
+}
+
+// re-reads the config file on SIGHUP; the running config is kept if the new
+// one fails to parse. Ports that are no longer listed stay open. New requests
+// get the new config at once, and the old one is kept as long as tasks given
+// it are running.
+void WebServer::reload()
+{
+	std::vector<ServerBlock> serverBlocks;
+	MimeTypes types;
+	std::map<std::string, Upstream> upstreams;
+	std::string cachePath;
+	size_t cacheSize = 0;
+	std::string sessionPath;
+	int sessionTtl = DEFAULT_SESSION_TTL;
+
+	LOG(LOG_INFO) << HYELLOW "Reloading " << _filePath << RESET;
+	try
+	{
+		Parser parser(_filePath);
+		parser.parseServerBlocks(serverBlocks);
+		types = MimeTypes(parser.getTypes());
+		upstreams = parser.getUpstreams();
+		cachePath = parser.getResponseCachePath();
+		cacheSize = parser.getResponseCacheSize();
+		sessionPath = parser.getSessionStorePath();
+		sessionTtl = parser.getSessionTtl();
+		if (parser.getEventBackend() != _poller->getName())
+			LOG(LOG_WARN) << BYELLOW << "event_backend changes need a restart, keeping " << _poller->getName()
+						  << RESET;
+		// the last step that can fail, as it takes effect at once; the log
+		// settings below cannot
+		_tls.configure(serverBlocks);
+		applyLogConfig(parser);
+		_slowRequestThreshold = parser.getSlowRequestThreshold();
+	}
+	catch (const std::exception &e)
+	{
+		LOG(LOG_ERROR) << BRED << "Reload failed, keeping current config: " << e.what() << RESET;
+		return;
+	}
+	unsigned long old = _config++;
+	_configs[_config].mimeTypes = types;
+	// the error pages are typed with the new table
+	MethodIO::setMimeTypes(&_configs[_config].mimeTypes);
+	linkSessionApi(serverBlocks);
+	for (size_t i = 0; i < serverBlocks.size(); i++)
+		MethodIO::loadErrorPages(serverBlocks[i]);
+	_serverBlocks.swap(serverBlocks);
+	// a swap keeps the blocks where the running tasks point to
+	if (_configs[old].tasks)
+	{
+		_configs[old].serverBlocks.swap(serverBlocks);
+		LOG(LOG_INFO) << "previous config kept for " << _configs[old].tasks << " running task(s)";
+	}
+	else
+		_configs.erase(old);
+	_proxy.setUpstreams(upstreams);
+	_cache.configure(cachePath, cacheSize);
+	_sessions.configure(sessionPath, sessionTtl);
+	// cached responses were built with the old headers and locations
+	_microEnabled = usesMicroCache(_serverBlocks);
+	_uploadEnabled = usesUploads(_serverBlocks);
+	_microCache.clear();
+	_microCandidates.clear();
+	initSockets();
+	LOG(LOG_INFO) << GREEN "Server blocks reloaded" RESET;
 }
 
 WebServer::~WebServer()
 {
-	for (size_t i = 0; i < _pfds.size(); i++)
+	for (std::map<int, Http2 *>::iterator it = _http2.begin(); it != _http2.end(); it++)
+		delete it->second;
+	for (std::map<int, WebSocket *>::iterator it = _webSockets.begin(); it != _webSockets.end(); it++)
+		delete it->second;
+	for (std::map<int, Upload *>::iterator it = _uploads.begin(); it != _uploads.end(); it++)
+		releaseUpload(it->first, it->second);
+	for (std::map<int, short>::iterator it = _fds.begin(); it != _fds.end(); it++)
 	{
-		close(_pfds[i].fd);
+		// upstream sockets are closed by _proxy
+		if (it->first != _pool.getNotifyFd() && it->first != _deletes.getNotifyFd() && !_proxy.owns(it->first))
+			close(it->first);
 	}
+	delete _poller;
+	AccessLog::shutdown();
 }
 
-WebServer::WebServer(const WebServer &other) : _io(other._io)
+WebServer::WebServer(const WebServer &other)
+	: _config(0), _poller(NULL), _io(other._io), _pool(0), _deferredTask(NULL), _slowRequestThreshold(0),
+	  _proxy(*this), _pendingProxy(NULL), _cacheRevalidate(false), _revalidating(false), _nextDetached(-1),
+	  _microEnabled(false), _upgradeWebSocket(false), _nextSweep(0),
+	  _uploadEnabled(false)
 {
 	(void)other;
 }
@@ -53,21 +240,28 @@ void WebServer::printServerBlocksInfo()
 	}
 }
 
+// [port] binds every address, [address]:[port] only that one (an IPv6
+// address in brackets)
 int initSocket(std::string port)
 {
 	struct addrinfo hints, *servInfo, *p;
 	int sockfd;
+	size_t colon = port.rfind(':');
+	std::string host = colon == std::string::npos ? "" : port.substr(0, colon);
+
+	if (host.size() > 1 && host[0] == '[' && host[host.size() - 1] == ']')
+		host = host.substr(1, host.size() - 2);
 
 	memset(&hints, 0, sizeof(hints));
 	servInfo = 0;
 	hints.ai_family = AF_UNSPEC;	 // AF_INET or AF_INET6 to force version
 	hints.ai_socktype = SOCK_STREAM; // TCP
 	hints.ai_flags = AI_PASSIVE;
-	std::cout << "port: " << port << std::endl;
+	LOG(LOG_DEBUG) << "port: " << port;
 	// get info of address that can be bind
-	if (getaddrinfo(NULL, port.c_str(), &hints, &servInfo) != 0)
+	if (getaddrinfo(host.empty() ? NULL : host.c_str(), port.substr(colon + 1).c_str(), &hints, &servInfo) != 0)
 	{
-		std::cerr << "getaddrinfo error" << std::endl;
+		LOG(LOG_ERROR) << "getaddrinfo error";
 		throw "error";
 	}
 	// loop through all address and bind to the first
@@ -75,14 +269,14 @@ int initSocket(std::string port)
 	{
 		if ((sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
 		{
-			std::cerr << "socket error" << std::endl;
+			LOG(LOG_ERROR) << "socket error";
 			continue;
 		}
 		fcntl(sockfd, F_SETFL, O_NONBLOCK, FD_CLOEXEC);
 
 		if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &sockfd, sizeof(int)) == -1)
 		{
-			std::cerr << "Error setting socket options" << std::endl;
+			LOG(LOG_ERROR) << "Error setting socket options";
 			close(sockfd); // Don't forget to close the socket in case of an error
 			throw "Error setting socket options";
 		}
@@ -90,7 +284,7 @@ int initSocket(std::string port)
 		if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1)
 		{
 			close(sockfd);
-			std::cerr << "bind error" << std::endl;
+			LOG(LOG_ERROR) << "bind error";
 			continue;
 		}
 		break;
@@ -98,15 +292,18 @@ int initSocket(std::string port)
 	freeaddrinfo(servInfo); // free the linked list
 	if (p == NULL)
 	{
-		std::cerr << "failed to bind" << std::endl;
+		LOG(LOG_ERROR) << "failed to bind";
 		throw "fail to bind";
 	}
-	if (listen(sockfd, 10))
+	// connections arriving in bursts (thousands of websockets reconnecting
+	// at once) would otherwise have their SYNs dropped and retried seconds
+	// later
+	if (listen(sockfd, SOMAXCONN))
 	{
-		std::cerr << "listen error" << std::endl;
+		LOG(LOG_ERROR) << "listen error";
 		throw "fail to listen";
 	}
-	std::cout << HWHITE << "Server: waiting for connections..." << RESET << std::endl << std::endl;
+	LOG(LOG_INFO) << HWHITE << "Server: waiting for connections on port " << port << "..." << RESET;
 	return sockfd;
 }
 
@@ -130,13 +327,14 @@ void WebServer::initSockets()
 				try
 				{
 					int fd = initSocket(ports[i]);
-					addPfd(fd);
+					_fds[fd] = POLLIN;
+					_poller->addListener(fd);
 					_socketPortmap.insert(std::make_pair(fd, ports[i]));
-					std::cout << "fd: " << fd << std::endl;
+					LOG(LOG_DEBUG) << "fd: " << fd;
 				}
 				catch (char const *e)
 				{
-					std::cerr << e << std::endl;
+					LOG(LOG_ERROR) << e;
 				}
 			}
 		}
@@ -153,76 +351,241 @@ static void *get_in_addr(struct sockaddr *sa)
 	return &(((struct sockaddr_in6 *)sa)->sin6_addr);
 }
 
+static Metrics::Gauge connectionState(short events)
+{
+	if (events & POLLIN)
+		return Metrics::CONNECTIONS_READING;
+	if (events & POLLOUT)
+		return Metrics::CONNECTIONS_WRITING;
+	return Metrics::CONNECTIONS_WAITING;
+}
+
+WebServer::RequestRecord::RequestRecord() : status(0), bytes(0), start(0)
+{
+}
+
+WebServer::Config::Config() : serverBlocks(), mimeTypes(), tasks(0)
+{
+}
+
+// status code and body size of a rendered response; status stays 0 while a
+// task is still building it
+void WebServer::RequestRecord::setResponse(const std::string &response)
+{
+	size_t headerEnd = response.find("\r\n\r\n");
+
+	status = 0;
+	if (response.compare(0, 9, "HTTP/1.1 ") == 0)
+		status = std::atoi(response.c_str() + 9);
+	bytes = headerEnd == std::string::npos ? 0 : response.size() - headerEnd - 4;
+}
+
+void WebServer::logAccess(const RequestRecord &record, double seconds)
+{
+	AccessLog::Entry entry;
+
+	entry.remote = record.remote;
+	entry.requestLine = record.requestLine;
+	entry.status = record.status;
+	entry.bytes = record.bytes;
+	entry.referer = record.referer;
+	entry.userAgent = record.userAgent;
+	entry.seconds = seconds;
+	entry.trace = record.trace;
+	AccessLog::log(entry);
+}
+
+// slow_request_log: accept to last byte out, with the time each phase was
+// reached so the slow one stands out
+void WebServer::logIfSlow(const RequestRecord &record)
+{
+	double total = record.trace.between(RequestTrace::ACCEPTED, RequestTrace::LAST_BYTE_OUT);
+
+	if (!_slowRequestThreshold || total < _slowRequestThreshold)
+		return;
+	LOG(LOG_WARN) << "slow request (" << total * 1000 << "ms): " << record.remote << " \"" << record.requestLine
+				  << "\" " << record.status << " " << record.trace.describe();
+}
+
 void WebServer::loop()
 {
 	std::map<int, std::string> buffMap;
 
 	for (;;)
 	{
-		int pollCount = poll(&_pfds[0], _pfds.size(), -1);
+		// running tasks keep the config they were given
+		if (g_reloadRequested)
+		{
+			g_reloadRequested = 0;
+			reload();
+		}
+		std::vector<struct pollfd> ready;
+		// bytes OpenSSL already decrypted must not wait for the socket
+		int pollCount = _poller->wait(ready, _tls.hasPending() ? 0 : getTimeout(Metrics::now()));
+		if (pollCount == -1 && errno == EINTR)
+			continue;
 		if (pollCount == -1)
 		{
-			std::cerr << "poll error" << std::endl;
+			LOG(LOG_ERROR) << "poll error";
 			return;
 		}
+		_proxy.expire(Metrics::now(), buffMap);
+		handleProxyResults(buffMap);
+		handleAccepted(buffMap);
 
-		for (size_t i = 0; i < _pfds.size(); i++)
+		for (size_t i = 0; i < ready.size(); i++)
 		{
-			if (!(_pfds[i].revents & POLLIN || _pfds[i].revents & POLLOUT))
+			int fd = ready[i].fd;
+
+			// an earlier event in this batch may have closed the fd
+			if (_fds.find(fd) == _fds.end())
 				continue;
 
+			if (fd == _pool.getNotifyFd())
+			{
+				handleCompletions(buffMap);
+				continue;
+			}
+			if (fd == _deletes.getNotifyFd())
+			{
+				_deletes.collect();
+				continue;
+			}
+
 			// find if socket exist
-			std::map<int, std::string>::iterator port = _socketPortmap.find(_pfds[i].fd);
+			std::map<int, std::string>::iterator port = _socketPortmap.find(fd);
 
 			if (port != _socketPortmap.end())
-				acceptConnection(i, buffMap, port->second);
+				acceptConnection(fd, buffMap, port->second);
+			else if (_proxy.owns(fd))
+			{
+				_proxy.handle(fd, ready[i].revents, buffMap);
+				handleProxyResults(buffMap);
+			}
+			else if (_http2.count(fd))
+				handleHttp2(fd, ready[i].revents, buffMap);
+			else if (_webSockets.count(fd))
+				handleWebSocket(fd, ready[i].revents, buffMap);
+			else if (_proxy.isTunnel(fd))
+				handleTunnel(fd, ready[i].revents, buffMap);
 			else
-				handleIO(i, buffMap);
+				handleIO(fd, ready[i].revents, buffMap);
 		}
+		handlePendingTls(buffMap);
+		pumpHttp2(buffMap);
+		sweepWebSockets(buffMap);
+		_sessions.tick(time(NULL));
 	}
 }
 
-void WebServer::acceptConnection(int index, std::map<int, std::string> &buffMap, std::string port)
+// milliseconds poll may sleep: until the proxy's next deadline, and at most
+// until the next websocket sweep
+int WebServer::getTimeout(double now) const
+{
+	int timeout = _proxy.getTimeout(now);
+
+	if (_webSockets.empty())
+		return timeout;
+	int sweep = _nextSweep <= now ? 0 : (int)((_nextSweep - now) * 1000) + 1;
+	return timeout < 0 || sweep < timeout ? sweep : timeout;
+}
+
+void WebServer::acceptConnection(int listenFd, std::map<int, std::string> &buffMap, std::string port)
 {
 	struct sockaddr_storage theiraddr;
 	socklen_t addrSize = sizeof(theiraddr);
-	char s[INET6_ADDRSTRLEN];
-	int newFd = accept(_pfds[index].fd, (struct sockaddr *)&theiraddr, &addrSize);
+	int newFd = accept(listenFd, (struct sockaddr *)&theiraddr, &addrSize);
 	if (newFd == -1)
 	{
-		std::cerr << "accept error" << std::endl;
+		LOG(LOG_ERROR) << "accept error";
 		return;
 	}
+	startConnection(newFd, theiraddr, buffMap, port);
+}
+
+// the connections the event backend accepted itself; their peer is asked for
+void WebServer::handleAccepted(std::map<int, std::string> &buffMap)
+{
+	std::vector<std::pair<int, int> > accepted = _poller->takeAccepted();
+
+	for (size_t i = 0; i < accepted.size(); i++)
+	{
+		std::map<int, std::string>::iterator port = _socketPortmap.find(accepted[i].first);
+		struct sockaddr_storage theiraddr;
+		socklen_t addrSize = sizeof(theiraddr);
+		if (port == _socketPortmap.end() ||
+			getpeername(accepted[i].second, (struct sockaddr *)&theiraddr, &addrSize) == -1)
+		{
+			close(accepted[i].second);
+			continue;
+		}
+		startConnection(accepted[i].second, theiraddr, buffMap, port->second);
+	}
+}
+
+void WebServer::startConnection(int newFd, const struct sockaddr_storage &theiraddr,
+								std::map<int, std::string> &buffMap, const std::string &port)
+{
+	char s[INET6_ADDRSTRLEN];
+
 	inet_ntop(theiraddr.ss_family, get_in_addr((struct sockaddr *)&theiraddr), s, sizeof(s));
-	std::cout << HGREEN << "Server: got connection from: " << RESET << s << std::endl;
+	LOG(LOG_DEBUG) << HGREEN << "Server: got connection from: " << RESET << s;
 	buffMap.insert(std::pair<int, std::string>(newFd, ""));
 	_connectionsPortMap.insert(std::make_pair(newFd, port));
-	addPfd(newFd);
+	_requests[newFd].remote = s;
+	_requests[newFd].trace.mark(RequestTrace::ACCEPTED);
+	Metrics::add(Metrics::CONNECTIONS_ACCEPTED);
+	addFd(newFd);
+	if (_tls.isSecure(port) && !_tls.open(newFd, port))
+	{
+		LOG(LOG_ERROR) << "cannot start TLS on a connection";
+		closeConnection(newFd, buffMap);
+	}
 }
 
 #define BUFFSIZE 4096
 // #define BUFFSIZE 512
 
-void WebServer::handleIO(int index, std::map<int, std::string> &buffMap)
+void WebServer::handleIO(int fd, short revents, std::map<int, std::string> &buffMap)
 {
+	if (_uploads.count(fd))
+	{
+		handleUpload(fd, revents, buffMap);
+		return;
+	}
 	char buff[BUFFSIZE] = {0};
-	int fd = _pfds[index].fd;
 	MethodIO::rInfo info = parseHeader(buffMap[fd]);
 
-	if (_pfds[index].revents & POLLIN)
+	if (_tls.isHandshaking(fd))
+		handshake(fd, buffMap);
+	else if (revents & (POLLIN | POLLHUP | POLLERR) && _fds[fd] & POLLIN)
 	{
 		std::map<std::string, std::string>::iterator it = info.headers.find("Content-Length");
 		if (it == info.headers.end() || info.body.size() < (size_t)utils::stoi(it->second, -1))
 		{
-			int bytes = recv(fd, buff, sizeof(buff), MSG_DONTWAIT);
-			std::cout << bytes << std::endl;
+			int bytes = receive(fd, buff, sizeof(buff));
 			if (bytes < 0)
-				std::cerr << "recv error" << std::endl;
-			buffMap[fd].append(buff, bytes);
+			{
+				// a TLS record that is not complete yet
+				if (errno != EAGAIN)
+					LOG(LOG_ERROR) << "recv error";
+				return;
+			}
 			if (bytes == 0)
 			{
-				removePfd(index);
-				std::cerr << BRED << "connection closed" << RESET << std::endl;
+				closeConnection(fd, buffMap);
+				LOG(LOG_DEBUG) << BRED << "connection closed" << RESET;
+				return;
+			}
+			buffMap[fd].append(buff, bytes);
+			Metrics::add(Metrics::BYTES_RECEIVED, bytes);
+			RequestRecord &record = _requests[fd];
+			record.trace.mark(RequestTrace::FIRST_BYTE_IN);
+			if (Http2::isPreface(buffMap[fd]))
+			{
+				// h2c with prior knowledge
+				if (buffMap[fd].size() >= HTTP2_PREFACE_SIZE)
+					startHttp2(fd, false, "", buffMap);
 				return;
 			}
 			bool isFirst = false;
@@ -233,58 +596,1131 @@ void WebServer::handleIO(int index, std::map<int, std::string> &buffMap)
 				isFirst = true;
 			}
 			if (it != info.headers.end())
-				std::cout << "read: " << bytes << ", found: " << info.body.size()
-						  << ", total: " << utils::stoi(it->second, -1) << std::endl;
-			info.exist = -1ul != buffMap[fd].find("\r\n\r\n");
+				LOG(LOG_DEBUG) << "read: " << bytes << ", found: " << info.body.size()
+							   << ", total: " << utils::stoi(it->second, -1);
+			size_t headerEnd = buffMap[fd].find("\r\n\r\n");
+			info.exist = -1ul != headerEnd;
+			if (info.exist)
+				record.trace.mark(RequestTrace::HEADERS_COMPLETE);
+			// checked once, as the headers complete
+			if (info.exist && _uploadEnabled && headerEnd + 4 > buffMap[fd].size() - bytes &&
+				startUpload(fd, headerEnd, buffMap))
+				return;
 			if (info.exist && (it == info.headers.end() ||
 							   (int)info.body.size() + (isFirst ? 0 : bytes) == utils::stoi(it->second, -1)))
 			{
-				_pfds[index].events = POLLOUT;
-				_io.receiveMessage(buffMap[fd]);
-				buffMap[fd] = _io.getMessageToSend(*this, _connectionsPortMap[fd]);
+				std::string settings;
+				// h2c is for cleartext only; TLS connections negotiate h2 by ALPN
+				if (it == info.headers.end() && !_tls.owns(fd) && Http2::isUpgrade(info.headers, settings))
+				{
+					startHttp2(fd, true, settings, buffMap);
+					return;
+				}
+				setEvents(fd, POLLOUT);
+				beginRequest(fd, info, buffMap[fd]);
+				if (!microLookup(fd, info, buffMap))
+					dispatch(fd, buffMap);
 			}
 		}
 	}
-	else if (_pfds[index].revents & POLLOUT)
+	else if (revents & (POLLOUT | POLLHUP | POLLERR) && _fds[fd] & POLLOUT)
 	{
-		std::string toSend = buffMap[fd];
+		if (_microSends.count(fd) && !sendMicro(fd, buffMap))
+			return;
+		std::string &toSend = buffMap[fd];
 		if (toSend.length())
 		{
-			int byteSent = send(fd, toSend.c_str(), toSend.length(), 0);
-			std::cout << "byteSent: " << byteSent << std::endl;
-			buffMap[fd] = buffMap[fd].substr(byteSent);
+			int byteSent = transmit(fd, toSend.c_str(), toSend.length());
+			if (byteSent < 0)
+				closeConnection(fd, buffMap);
+			else
+			{
+				toSend.erase(0, byteSent);
+				Metrics::add(Metrics::BYTES_SENT, byteSent);
+				_requests[fd].trace.mark(RequestTrace::FIRST_BYTE_OUT);
+				if (toSend.size() < PROXY_BUFFER_SIZE)
+					_proxy.resume(fd);
+			}
 		}
+		else if (_proxy.isProxying(fd))
+			// drained faster than the upstream answers
+			setEvents(fd, 0);
 		else
 		{
-			buffMap.erase(buffMap.find(fd));
-			_connectionsPortMap.erase(_connectionsPortMap.find(fd));
-			close(fd);
+			finishRequest(fd);
+			Metrics::add(Metrics::CONNECTIONS_HANDLED);
+			closeConnection(fd, buffMap);
 			_io.receiveMessage("");
-			removePfd(index);
 		}
 	}
 }
 
-void WebServer::addPfd(int fd)
+// one step of a TLS handshake, waiting for what OpenSSL asks for
+void WebServer::handshake(int fd, std::map<int, std::string> &buffMap)
+{
+	switch (_tls.handshake(fd))
+	{
+	case Tls::FAILED:
+		closeConnection(fd, buffMap);
+		break;
+	case Tls::WANT_WRITE:
+		setEvents(fd, POLLOUT);
+		break;
+	default:
+		setEvents(fd, POLLIN);
+	}
+}
+
+// reads the TLS connections whose next bytes are already decrypted, as poll
+// cannot report them
+void WebServer::handlePendingTls(std::map<int, std::string> &buffMap)
+{
+	std::vector<int> pending = _tls.takePending();
+
+	for (size_t i = 0; i < pending.size(); i++)
+	{
+		int fd = pending[i];
+		if (_http2.count(fd))
+			handleHttp2(fd, POLLIN, buffMap);
+		else if (_webSockets.count(fd))
+			handleWebSocket(fd, POLLIN, buffMap);
+		else if (_proxy.isTunnel(fd))
+			handleTunnel(fd, POLLIN, buffMap);
+		else if (_fds.count(fd) && _fds[fd] & POLLIN)
+			handleIO(fd, POLLIN, buffMap);
+	}
+}
+
+// recv() and send() for the client connections, through TLS on ssl ports
+ssize_t WebServer::receive(int fd, char *buff, size_t size)
+{
+	if (_tls.owns(fd))
+		return _tls.read(fd, buff, size);
+	return recv(fd, buff, size, MSG_DONTWAIT);
+}
+
+ssize_t WebServer::transmit(int fd, const char *data, size_t size)
+{
+	if (_tls.owns(fd))
+		return _tls.write(fd, data, size);
+	// websockets write without waiting for POLLOUT: a full socket sends 0
+	ssize_t sent = send(fd, data, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+	return sent;
+}
+
+// the request on fd is complete: its clock starts
+void WebServer::beginRequest(int fd, const MethodIO::rInfo &info, const std::string &request)
+{
+	RequestRecord &record = _requests[fd];
+
+	record.trace.mark(RequestTrace::REQUEST_COMPLETE);
+	record.start = Metrics::now();
+	record.method = request.substr(0, request.find(' '));
+	if (AccessLog::isEnabled() || _slowRequestThreshold)
+	{
+		std::map<std::string, std::string>::const_iterator header;
+		record.requestLine = request.substr(0, request.find("\r\n"));
+		if ((header = info.headers.find("Referer")) != info.headers.end())
+			record.referer = header->second;
+		if ((header = info.headers.find("User-Agent")) != info.headers.end())
+			record.userAgent = header->second;
+	}
+}
+
+// runs the handler for the request in buffMap[fd] and starts what it left
+// pending: an upstream request, a task for the pool, a fetch for the response
+// cache or a wait for one
+void WebServer::dispatch(int fd, std::map<int, std::string> &buffMap)
+{
+	RequestRecord &record = _requests[fd];
+	std::string request = _cache.isEnabled() ? buffMap[fd] : "";
+
+	record.trace.mark(RequestTrace::HANDLER_START);
+	RequestTrace::setCurrent(&record.trace);
+	_io.receiveMessage(buffMap[fd]);
+	buffMap[fd] = _io.getMessageToSend(*this, _connectionsPortMap[fd]);
+	RequestTrace::setCurrent(NULL);
+	_revalidating = false;
+	if (!_cacheWait.empty())
+	{
+		// handled again once the response it waits for is in
+		setEvents(fd, 0);
+		_cache.wait(_cacheWait, fd);
+		_parked[fd] = request;
+		_cacheWait.clear();
+		return;
+	}
+	if (!_cacheFetch.empty())
+	{
+		_fetching[fd] = _cacheFetch;
+		_cacheFetch.clear();
+	}
+	bool refresh = _cacheRevalidate;
+	_cacheRevalidate = false;
+	record.setResponse(buffMap[fd]);
+	if (_upgradeWebSocket)
+		startWebSocket(fd, buffMap);
+	else if (_pendingProxy)
+	{
+		// woken up by the proxy as the upstream answers
+		setEvents(fd, 0);
+		_pendingProxy->capture = _fetching.count(fd) || isDetached(fd);
+		_pendingProxy->captureLimit = _fetching.count(fd) ? _cache.getMaxEntrySize() : 0;
+		_proxy.start(fd, *_pendingProxy, record.remote, buffMap);
+		delete _pendingProxy;
+		_pendingProxy = NULL;
+		handleProxyResults(buffMap);
+	}
+	else if (!_deferredTask)
+	{
+		record.trace.mark(RequestTrace::HANDLER_END);
+		if (_fetching.count(fd) || isDetached(fd))
+			finishFetch(fd, buffMap[fd], buffMap);
+	}
+	else
+	{
+		submitTask(fd, _deferredTask);
+		_deferredTask = NULL;
+	}
+	if (refresh)
+		revalidate(fd, request, buffMap);
+}
+
+// its response is all out: counted, logged
+void WebServer::finishRequest(int fd)
+{
+	std::map<int, RequestRecord>::iterator record = _requests.find(fd);
+
+	if (record == _requests.end())
+		return;
+	double seconds = Metrics::now() - record->second.start;
+	record->second.trace.mark(RequestTrace::LAST_BYTE_OUT);
+	record->second.trace.observe();
+	Metrics::countRequest(record->second.method, record->second.status, seconds);
+	if (AccessLog::isEnabled())
+		logAccess(record->second, seconds);
+	logIfSlow(record->second);
+}
+
+// answers a plain GET from the micro-cache; on a miss the connection is
+// noted so its response can be kept once built
+bool WebServer::microLookup(int fd, const MethodIO::rInfo &request, std::map<int, std::string> &buffMap)
+{
+	if (!_microEnabled || request.request.size() != 3 || request.request[0] != "GET" ||
+		request.request[2] != "HTTP/1.1" || request.request[1].find('?') != std::string::npos ||
+		request.headers.count("Range") || request.headers.count("If-None-Match") ||
+		request.headers.count("If-Modified-Since") || request.headers.count("If-Range") ||
+		request.headers.count("Upgrade"))
+		return false;
+	std::map<std::string, std::string>::const_iterator host = request.headers.find("Host");
+	std::string key = _connectionsPortMap[fd] + " " + (host == request.headers.end() ? "" : host->second) + " " +
+					  request.request[1];
+	MicroCache::Buffer *buffer = _microCache.find(key, Metrics::now());
+	if (!buffer)
+	{
+		_microCandidates[fd] = key;
+		return false;
+	}
+	RequestRecord &record = _requests[fd];
+	record.trace.mark(RequestTrace::HANDLER_START);
+	record.trace.mark(RequestTrace::HANDLER_END);
+	record.status = 200;
+	record.bytes = buffer->bodyLength;
+	if (_tls.owns(fd))
+	{
+		MicroCache::render(*buffer, buffMap[fd]);
+		MicroCache::release(buffer);
+		return true;
+	}
+	buffMap[fd].clear();
+	_microSends[fd] = std::make_pair(buffer, 0);
+	return true;
+}
+
+// false until the whole cached response is out, or the connection is gone
+bool WebServer::sendMicro(int fd, std::map<int, std::string> &buffMap)
+{
+	std::pair<MicroCache::Buffer *, size_t> &micro = _microSends[fd];
+	ssize_t sent = MicroCache::send(fd, *micro.first, micro.second);
+
+	if (sent < 0)
+	{
+		closeConnection(fd, buffMap);
+		return false;
+	}
+	micro.second += sent;
+	Metrics::add(Metrics::BYTES_SENT, sent);
+	_requests[fd].trace.mark(RequestTrace::FIRST_BYTE_OUT);
+	if (micro.second < micro.first->bytes.size())
+		return false;
+	MicroCache::release(micro.first);
+	_microSends.erase(fd);
+	return true;
+}
+
+void WebServer::closeConnection(int fd, std::map<int, std::string> &buffMap)
+{
+	std::map<int, Http2 *>::iterator session = _http2.find(fd);
+	if (session != _http2.end())
+	{
+		std::map<int, Http2Stream>::iterator it = _streams.begin();
+		while (it != _streams.end())
+		{
+			int stream = it->first;
+			bool owned = it->second.connection == fd;
+			it++;
+			if (owned)
+				releaseRequest(stream, buffMap);
+		}
+		delete session->second;
+		_http2.erase(session);
+	}
+	closeWebSocket(fd);
+	std::map<int, Upload *>::iterator upload = _uploads.find(fd);
+	if (upload != _uploads.end())
+	{
+		releaseUpload(fd, upload->second);
+		_uploads.erase(upload);
+	}
+	releaseRequest(fd, buffMap);
+	removeFd(fd);
+	_connectionsPortMap.erase(fd);
+	_tls.close(fd);
+	close(fd);
+}
+
+// drops what the request on fd left behind: its cached response being sent,
+// the cache fetch it does or waits for, its upstream session
+void WebServer::releaseRequest(int fd, std::map<int, std::string> &buffMap)
 {
-	struct pollfd pfd;
-	pfd.fd = fd;
-	pfd.events = POLLIN;
-	_pfds.push_back(pfd);
+	std::map<int, std::pair<MicroCache::Buffer *, size_t> >::iterator micro = _microSends.find(fd);
+	if (micro != _microSends.end())
+	{
+		MicroCache::release(micro->second.first);
+		_microSends.erase(micro);
+	}
+	_microCandidates.erase(fd);
+	std::map<int, std::string>::iterator fetch = _fetching.find(fd);
+	if (fetch != _fetching.end())
+	{
+		// one of the clients waiting for it fetches the response instead
+		std::string key = fetch->second;
+		_fetching.erase(fetch);
+		wakeWaiters(_cache.abandon(key), buffMap);
+	}
+	if (_parked.erase(fd))
+		_cache.forget(fd);
+	_proxy.abort(fd);
+	handleProxyResults(buffMap);
+	buffMap.erase(fd);
+	_requests.erase(fd);
+	// a stream's fd is only its own
+	if (_streams.erase(fd))
+		_connectionsPortMap.erase(fd);
 }
 
-void WebServer::addPfds(std::vector<int> fds)
+// nothing to poll for on fd until the task completes
+void WebServer::submitTask(int fd, Task *task)
+{
+	setEvents(fd, 0);
+	_taskConfigs[task] = _config;
+	_configs[_config].tasks++;
+	_pool.submit(fd, task);
+}
+
+// a config a reload replaced goes with the last task given it
+void WebServer::releaseConfig(Task *task)
+{
+	std::map<Task *, unsigned long>::iterator it = _taskConfigs.find(task);
+	std::map<unsigned long, Config>::iterator config = _configs.find(it->second);
+
+	if (!--config->second.tasks && config->first != _config)
+	{
+		LOG(LOG_INFO) << "previous config released";
+		_configs.erase(config);
+	}
+	_taskConfigs.erase(it);
+}
+
+// hands each finished task's response to its connection
+void WebServer::handleCompletions(std::map<int, std::string> &buffMap)
+{
+	std::vector<std::pair<int, Task *> > completed = _pool.takeCompleted();
+
+	for (size_t i = 0; i < completed.size(); i++)
+	{
+		int fd = completed[i].first;
+		Task *task = completed[i].second;
+		UploadWriteTask *write = dynamic_cast<UploadWriteTask *>(task);
+
+		if (write)
+		{
+			wroteUpload(fd, write->release(), buffMap);
+			delete task;
+			continue;
+		}
+		if (_fds.find(fd) != _fds.end() || _streams.count(fd))
+		{
+			buffMap[fd] = task->complete();
+			_requests[fd].setResponse(buffMap[fd]);
+			_requests[fd].trace.merge(task->getTrace());
+			setEvents(fd, POLLOUT);
+			if (_fetching.count(fd))
+				finishFetch(fd, buffMap[fd], buffMap);
+			std::map<int, std::string>::iterator candidate = _microCandidates.find(fd);
+			if (candidate != _microCandidates.end())
+			{
+				MethodTask *methodTask = dynamic_cast<MethodTask *>(task);
+				std::string path;
+				struct stat st;
+				if (methodTask && methodTask->getStaticFile(path, st))
+					_microCache.insert(candidate->second, path, st, buffMap[fd], Metrics::now());
+				_microCandidates.erase(candidate);
+			}
+		}
+		else if (isDetached(fd))
+			finishFetch(fd, task->complete(), buffMap);
+		// complete() may still use the config
+		releaseConfig(task);
+		delete task;
+	}
+}
+
+// switches the connection to HTTP/2, after the client preface (which is in
+// buffMap[fd]) or after an Upgrade: h2c request, which becomes stream 1
+void WebServer::startHttp2(int fd, bool upgrade, const std::string &settings, std::map<int, std::string> &buffMap)
+{
+	Http2 *session = new Http2();
+	std::string input;
+
+	input.swap(buffMap[fd]);
+	_http2[fd] = session;
+	Metrics::add(Metrics::HTTP2_CONNECTIONS);
+	if (upgrade)
+		session->upgrade(settings, input);
+	else
+		session->receive(input.data(), input.size());
+	startStreams(fd, buffMap);
+	setEvents(fd, POLLIN | POLLOUT);
+}
+
+void WebServer::handleHttp2(int fd, short revents, std::map<int, std::string> &buffMap)
+{
+	Http2 *session = _http2[fd];
+
+	if (revents & (POLLIN | POLLHUP | POLLERR))
+	{
+		char buff[HTTP2_FRAME_SIZE];
+		int bytes = receive(fd, buff, sizeof(buff));
+		if (bytes == 0 || (bytes < 0 && revents & (POLLHUP | POLLERR)))
+		{
+			closeConnection(fd, buffMap);
+			return;
+		}
+		if (bytes > 0)
+		{
+			Metrics::add(Metrics::BYTES_RECEIVED, bytes);
+			session->receive(buff, bytes);
+			startStreams(fd, buffMap);
+		}
+	}
+	std::string &output = session->getOutput();
+	if (revents & POLLOUT && !output.empty())
+	{
+		int sent = transmit(fd, output.data(), output.size());
+		if (sent < 0)
+		{
+			closeConnection(fd, buffMap);
+			return;
+		}
+		output.erase(0, sent);
+		Metrics::add(Metrics::BYTES_SENT, sent);
+	}
+}
+
+// hands each new request of the connection to the handlers as if it came on
+// a connection of its own, and drops the work of the streams that were reset
+void WebServer::startStreams(int fd, std::map<int, std::string> &buffMap)
+{
+	Http2 *session = _http2[fd];
+	std::vector<Http2::Request> requests = session->takeRequests();
+
+	for (size_t i = 0; i < requests.size(); i++)
+	{
+		int stream = _nextDetached--;
+		Http2Stream &entry = _streams[stream];
+		entry.connection = fd;
+		entry.id = requests[i].stream;
+		entry.events = 0;
+
+		RequestRecord &record = _requests[stream];
+		record.remote = _requests[fd].remote;
+		record.trace.mark(RequestTrace::ACCEPTED);
+		record.trace.mark(RequestTrace::FIRST_BYTE_IN);
+		record.trace.mark(RequestTrace::HEADERS_COMPLETE);
+		buffMap[stream] = requests[i].message;
+		_connectionsPortMap[stream] = _connectionsPortMap[fd];
+		beginRequest(stream, parseHeader(buffMap[stream]), buffMap[stream]);
+		setEvents(stream, POLLOUT);
+		dispatch(stream, buffMap);
+	}
+
+	std::vector<unsigned int> resets = session->takeResets();
+	for (size_t i = 0; i < resets.size(); i++)
+	{
+		for (std::map<int, Http2Stream>::iterator it = _streams.begin(); it != _streams.end(); it++)
+		{
+			if (it->second.connection == fd && it->second.id == resets[i])
+			{
+				releaseRequest(it->first, buffMap);
+				break;
+			}
+		}
+	}
+}
+
+// moves the responses of the streams that have output into their
+// connection's frames, then sets each connection's events for what it has
+// to send. Runs once per loop iteration.
+void WebServer::pumpHttp2(std::map<int, std::string> &buffMap)
+{
+	std::map<int, Http2Stream>::iterator it = _streams.begin();
+	while (it != _streams.end())
+	{
+		int fd = it->first;
+		Http2Stream stream = it->second;
+		it++;
+		if (stream.events != POLLOUT)
+			continue;
+		std::string &response = buffMap[fd];
+		size_t size = response.size();
+		bool proxying = _proxy.isProxying(fd);
+		bool done = _http2[stream.connection]->respond(stream.id, response, !proxying);
+		if (response.size() != size)
+			_requests[fd].trace.mark(RequestTrace::FIRST_BYTE_OUT);
+		if (done)
+		{
+			finishRequest(fd);
+			releaseRequest(fd, buffMap);
+			continue;
+		}
+		// drained faster than the upstream answers
+		if (proxying && response.empty())
+			setEvents(fd, 0);
+		if (response.size() < PROXY_BUFFER_SIZE)
+			_proxy.resume(fd);
+	}
+
+	std::map<int, Http2 *>::iterator session = _http2.begin();
+	while (session != _http2.end())
+	{
+		int fd = session->first;
+		Http2 *http2 = session->second;
+		session++;
+		http2->schedule();
+		if (http2->getOutput().empty() && http2->isFinished())
+		{
+			closeConnection(fd, buffMap);
+			continue;
+		}
+		short events = http2->getOutput().empty() ? POLLIN : POLLIN | POLLOUT;
+		if (getEvents(fd) != events)
+			setEvents(fd, events);
+	}
+}
+
+// switches the connection to the WebSocket protocol once the request was
+// answered with a 101 (which is in buffMap[fd]). Only the websocket state
+// stays: the request's record and buffer are dropped, as the connection may
+// stay open for days.
+void WebServer::startWebSocket(int fd, std::map<int, std::string> &buffMap)
+{
+	WebSocket *socket = new WebSocket(Metrics::now());
+
+	_upgradeWebSocket = false;
+	socket->getOutput().swap(buffMap[fd]);
+	buffMap.erase(fd);
+	_webSockets[fd] = socket;
+	if (!_webSocketChannel.empty())
+	{
+		_channels[_webSocketChannel].insert(fd);
+		_webSocketChannels[fd] = _webSocketChannel;
+		_webSocketChannel.clear();
+	}
+	Metrics::add(Metrics::WEBSOCKET_UPGRADES);
+	finishRequest(fd);
+	_requests.erase(fd);
+	_microCandidates.erase(fd);
+	flushWebSocket(fd, buffMap);
+}
+
+void WebServer::handleWebSocket(int fd, short revents, std::map<int, std::string> &buffMap)
+{
+	WebSocket *socket = _webSockets[fd];
+
+	if (revents & (POLLIN | POLLHUP | POLLERR) && _fds[fd] & POLLIN)
+	{
+		char buff[WEBSOCKET_READ_SIZE];
+		int bytes = receive(fd, buff, sizeof(buff));
+		if (bytes == 0 || (bytes < 0 && errno != EAGAIN))
+		{
+			closeConnection(fd, buffMap);
+			return;
+		}
+		if (bytes > 0)
+		{
+			Metrics::add(Metrics::BYTES_RECEIVED, bytes);
+			socket->receive(buff, bytes);
+			deliver(fd, socket, buffMap);
+			if (!_webSockets.count(fd))
+				return;
+		}
+	}
+	// answers go out at once instead of after another poll
+	flushWebSocket(fd, buffMap);
+}
+
+// echoes each message received on fd, or sends it to every connection of its
+// channel (fd included); a frame is built once for all of them. Listeners
+// WEBSOCKET_OUTPUT_LIMIT behind are dropped rather than buffered for.
+void WebServer::deliver(int fd, WebSocket *socket, std::map<int, std::string> &buffMap)
+{
+	std::vector<WebSocket::Message> messages = socket->takeMessages();
+	std::map<int, std::string>::iterator channel = _webSocketChannels.find(fd);
+	std::set<int> touched;
+
+	for (size_t i = 0; i < messages.size(); i++)
+	{
+		const WebSocket::Message &message = messages[i];
+		Metrics::add(Metrics::WEBSOCKET_MESSAGES);
+		if (channel == _webSocketChannels.end())
+		{
+			WebSocket::frame(message.opcode, message.data.data(), message.data.size(), socket->getOutput());
+			continue;
+		}
+		std::string frame;
+		WebSocket::frame(message.opcode, message.data.data(), message.data.size(), frame);
+		const std::set<int> &members = _channels[channel->second];
+		for (std::set<int>::const_iterator it = members.begin(); it != members.end(); it++)
+		{
+			_webSockets[*it]->send(frame);
+			touched.insert(*it);
+		}
+	}
+	touched.erase(fd);
+	for (std::set<int>::iterator it = touched.begin(); it != touched.end(); it++)
+	{
+		if (_webSockets[*it]->getOutput().size() > WEBSOCKET_OUTPUT_LIMIT)
+		{
+			LOG(LOG_DEBUG) << "websocket " << *it << " too far behind, closing";
+			closeConnection(*it, buffMap);
+		}
+		else
+			flushWebSocket(*it, buffMap);
+	}
+}
+
+// sends what the connection has queued, then polls it for what comes next:
+// reading while its output is under WEBSOCKET_OUTPUT_LIMIT, writing while
+// there is output. False once it was closed.
+bool WebServer::flushWebSocket(int fd, std::map<int, std::string> &buffMap)
+{
+	WebSocket *socket = _webSockets[fd];
+	std::string &output = socket->getOutput();
+
+	if (!output.empty())
+	{
+		int sent = transmit(fd, output.data(), output.size());
+		if (sent < 0)
+		{
+			closeConnection(fd, buffMap);
+			return false;
+		}
+		Metrics::add(Metrics::BYTES_SENT, sent);
+		if ((size_t)sent == output.size())
+			std::string().swap(output);
+		else
+			output.erase(0, sent);
+	}
+	if (socket->isFinished() && output.empty())
+	{
+		closeConnection(fd, buffMap);
+		return false;
+	}
+	short events = output.empty() ? 0 : POLLOUT;
+	if (!socket->isFinished() && output.size() < WEBSOCKET_OUTPUT_LIMIT)
+		events |= POLLIN;
+	if (getEvents(fd) != events)
+		setEvents(fd, events);
+	return true;
+}
+
+// once a second: pings the quiet connections and closes the ones that did
+// not answer
+void WebServer::sweepWebSockets(std::map<int, std::string> &buffMap)
+{
+	double now = Metrics::now();
+	std::vector<int> expired;
+	std::vector<int> pinged;
+
+	if (_webSockets.empty() || now < _nextSweep)
+		return;
+	_nextSweep = now + 1;
+	for (std::map<int, WebSocket *>::iterator it = _webSockets.begin(); it != _webSockets.end(); it++)
+	{
+		bool idle = it->second->getOutput().empty();
+		if (!it->second->tick(now))
+			expired.push_back(it->first);
+		else if (idle && !it->second->getOutput().empty())
+			pinged.push_back(it->first);
+	}
+	for (size_t i = 0; i < expired.size(); i++)
+	{
+		LOG(LOG_DEBUG) << "websocket " << expired[i] << " did not answer a ping, closing";
+		closeConnection(expired[i], buffMap);
+	}
+	for (size_t i = 0; i < pinged.size(); i++)
+		flushWebSocket(pinged[i], buffMap);
+}
+
+void WebServer::closeWebSocket(int fd)
+{
+	std::map<int, WebSocket *>::iterator socket = _webSockets.find(fd);
+
+	if (socket == _webSockets.end())
+		return;
+	delete socket->second;
+	_webSockets.erase(socket);
+	std::map<int, std::string>::iterator channel = _webSocketChannels.find(fd);
+	if (channel == _webSocketChannels.end())
+		return;
+	std::set<int> &members = _channels[channel->second];
+	members.erase(fd);
+	if (members.empty())
+		_channels.erase(channel->second);
+	_webSocketChannels.erase(channel);
+}
+
+// a proxied connection the upstream switched protocols on: bytes are passed
+// both ways as they come, each side paced by the other
+void WebServer::handleTunnel(int fd, short revents, std::map<int, std::string> &buffMap)
+{
+	if (revents & (POLLIN | POLLHUP | POLLERR) && _fds[fd] & POLLIN)
+	{
+		char buff[PROXY_READ_SIZE];
+		int bytes = receive(fd, buff, sizeof(buff));
+		if (bytes == 0 || (bytes < 0 && errno != EAGAIN))
+		{
+			finishRequest(fd);
+			closeConnection(fd, buffMap);
+			return;
+		}
+		if (bytes > 0)
+		{
+			Metrics::add(Metrics::BYTES_RECEIVED, bytes);
+			_proxy.forward(fd, buff, bytes, buffMap);
+		}
+	}
+	std::string &toSend = buffMap[fd];
+	if (revents & POLLOUT && !toSend.empty())
+	{
+		int sent = transmit(fd, toSend.data(), toSend.size());
+		if (sent < 0)
+		{
+			finishRequest(fd);
+			closeConnection(fd, buffMap);
+			return;
+		}
+		toSend.erase(0, sent);
+		Metrics::add(Metrics::BYTES_SENT, sent);
+		if (toSend.size() < PROXY_BUFFER_SIZE)
+			_proxy.resume(fd);
+	}
+	_proxy.updateTunnel(fd, buffMap);
+}
+
+void WebServer::webSocket(const std::string &channel)
+{
+	_upgradeWebSocket = true;
+	_webSocketChannel = channel;
+}
+
+void WebServer::defer(Task *task)
+{
+	_deferredTask = task;
+}
+
+void WebServer::proxy(const Proxy::Request &request)
+{
+	_pendingProxy = new Proxy::Request(request);
+}
+
+// a multipart POST to an upload_store location or a PUT: the body is
+// streamed to disk from here on instead of collected in buffMap
+bool WebServer::startUpload(int fd, size_t headerEnd, std::map<int, std::string> &buffMap)
+{
+	MethodIO::rInfo request;
+	std::string boundary;
+	const std::string *contentType = NULL;
+	const std::string *contentLength = NULL;
+	bool expectContinue = false;
+	bool put = !buffMap[fd].compare(0, 4, "PUT ");
+
+	if (!put && buffMap[fd].compare(0, 5, "POST "))
+		return false;
+	request = parseHeader(buffMap[fd].substr(0, headerEnd + 4));
+	for (std::map<std::string, std::string>::const_iterator it = request.headers.begin();
+		 it != request.headers.end(); it++)
+	{
+		if (!strcasecmp(it->first.c_str(), "Content-Type"))
+			contentType = &it->second;
+		else if (!strcasecmp(it->first.c_str(), "Content-Length"))
+			contentLength = &it->second;
+		else if (!strcasecmp(it->first.c_str(), "Expect"))
+			expectContinue = !strcasecmp(utils::trim(it->second).c_str(), "100-continue");
+	}
+	if (request.request.size() != 3 || request.request[2] != "HTTP/1.1" || !contentLength ||
+		contentLength->empty() || contentLength->find_first_not_of("0123456789") != std::string::npos ||
+		(!put && (!contentType || !Upload::isMultipart(*contentType, boundary))))
+		return false;
+	request.port = _connectionsPortMap[fd];
+	ServerBlock *block;
+	try
+	{
+		block = &MethodIO::getServerBlock(request, *this);
+	}
+	catch (const std::exception &e)
+	{
+		return false;
+	}
+	std::string path = request.request[1].substr(0, request.request[1].find('?'));
+	std::pair<std::string, LocationBlock> location = block->getLocationBlockPair(path);
+	std::vector<std::string> allowed = location.second.getAllowedMethods();
+	// the usual handlers answer anything else, 405 included
+	if (put ? !utils::find(allowed, std::string("PUT"))
+			: location.second.getUploadStore().empty() || (!allowed.empty() && !utils::find(allowed, std::string("POST"))))
+		return false;
+
+	unsigned long long length = strtoull(contentLength->c_str(), NULL, 10);
+	int maxBodySize = location.second.getClientMaxBodySize();
+	std::string head = buffMap[fd].substr(0, headerEnd + 4);
+	std::string body = buffMap[fd].substr(headerEnd + 4);
+	std::string target = put ? MethodIO::putTarget(path, location) : "";
+	int refused = maxBodySize > 0 && length > (unsigned long long)maxBodySize ? 413 : put && target.empty() ? 409 : 0;
+	if (refused)
+	{
+		// before the body is sent
+		buffMap[fd] = MethodIO::errorResponse(refused, block);
+		beginRequest(fd, request, head);
+		_requests[fd].setResponse(buffMap[fd]);
+		setEvents(fd, POLLOUT);
+		return true;
+	}
+	buffMap[fd].clear();
+	Upload *upload = new Upload(head, location.second, length);
+	_uploads[fd] = upload;
+	if (put)
+		upload->setTarget(target);
+	else
+		upload->setBoundary(boundary);
+	if (expectContinue && !body.size() && !upload->getError())
+		transmit(fd, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+	setEvents(fd, POLLIN);
+	feedUpload(fd, body.data(), body.size(), buffMap);
+	return true;
+}
+
+void WebServer::handleUpload(int fd, short revents, std::map<int, std::string> &buffMap)
+{
+	char buff[UPLOAD_READ_SIZE];
+	Upload *upload = _uploads[fd];
+
+	if (!(revents & (POLLIN | POLLHUP | POLLERR)))
+		return;
+	size_t size = upload->getRemaining() < sizeof(buff) ? upload->getRemaining() : sizeof(buff);
+	ssize_t bytes = receive(fd, buff, size);
+	if (bytes < 0)
+	{
+		if (errno != EAGAIN)
+			closeConnection(fd, buffMap);
+		return;
+	}
+	if (bytes == 0)
+	{
+		// the client gave up: the files written so far are removed
+		closeConnection(fd, buffMap);
+		return;
+	}
+	Metrics::add(Metrics::BYTES_RECEIVED, bytes);
+	feedUpload(fd, buff, bytes, buffMap);
+}
+
+// the body is parsed here and written on the pool, one batch at a time; the
+// connection is no longer read while the disk is UPLOAD_QUEUE_SIZE behind
+void WebServer::feedUpload(int fd, const char *data, size_t size, std::map<int, std::string> &buffMap)
+{
+	Upload *upload = _uploads[fd];
+
+	if (size && !upload->getError())
+		upload->receive(data, size);
+	if (!upload->isWriting() && (upload->getError() || !upload->getRemaining()))
+	{
+		finishUpload(fd, buffMap);
+		return;
+	}
+	if (!upload->isWriting() && upload->isWriteDue())
+	{
+		upload->startWrite();
+		_pool.submit(fd, new UploadWriteTask(upload, false));
+	}
+	short events = !upload->getError() && upload->getRemaining() && upload->getQueued() < UPLOAD_QUEUE_SIZE ? POLLIN : 0;
+	if (_fds[fd] != events)
+		setEvents(fd, events);
+}
+
+// a batch is on disk: the next one goes, or the upload is answered. A task
+// that freed an upload gives none back.
+void WebServer::wroteUpload(int fd, Upload *upload, std::map<int, std::string> &buffMap)
+{
+	if (!upload)
+		return;
+	upload->endWrite();
+	if (upload->isAbandoned())
+	{
+		releaseUpload(fd, upload);
+		return;
+	}
+	bool paused = !(_fds[fd] & POLLIN);
+	feedUpload(fd, NULL, 0, buffMap);
+	// OpenSSL may hold the next bytes, which poll cannot report
+	if (paused && _uploads.count(fd) && _fds[fd] & POLLIN && _tls.owns(fd))
+		handleUpload(fd, POLLIN, buffMap);
+}
+
+// an upload that will not be finished: its temporary files are removed on
+// the pool, after the batch being written if there is one
+void WebServer::releaseUpload(int fd, Upload *upload)
+{
+	if (upload->isWriting())
+		upload->abandon();
+	else if (upload->hasFiles())
+		_pool.submit(fd, new UploadWriteTask(upload, true));
+	else
+		delete upload;
+}
+
+// the body is in: the files are synced and renamed on the pool, which
+// answers. A failed upload is answered with its error right away, and its
+// files are removed on the pool.
+void WebServer::finishUpload(int fd, std::map<int, std::string> &buffMap)
+{
+	Upload *upload = _uploads[fd];
+	MethodIO::rInfo info = parseHeader(upload->getRequest());
+	ServerBlock *block = NULL;
+
+	_uploads.erase(fd);
+	beginRequest(fd, info, upload->getRequest());
+	RequestRecord &record = _requests[fd];
+	record.trace.mark(RequestTrace::HANDLER_START);
+	info.port = _connectionsPortMap[fd];
+	try
+	{
+		block = &MethodIO::getServerBlock(info, *this);
+	}
+	catch (const std::exception &e)
+	{
+	}
+	if (block && !upload->getError())
+	{
+		submitTask(fd, new UploadTask(upload, *block));
+		return;
+	}
+	buffMap[fd] = MethodIO::errorResponse(upload->getError() ? upload->getError() : 500, block);
+	releaseUpload(fd, upload);
+	record.trace.mark(RequestTrace::HANDLER_END);
+	record.setResponse(buffMap[fd]);
+	setEvents(fd, POLLOUT);
+}
+
+// the sessions behind session_api locations and the SESSION_* variables of
+// CGI scripts
+SessionStore &WebServer::getSessions()
+{
+	return _sessions;
+}
+
+DeleteJobs &WebServer::getDeletes()
+{
+	return _deletes;
+}
+
+// the response cache in front of the proxy_pass and CGI handlers of
+// response_cache locations. True when response is the answer: a cached copy,
+// or nothing while the request waits for the same response to be fetched.
+bool WebServer::cacheLookup(const MethodIO::rInfo &request, const ServerBlock &block, std::string &response)
+{
+	if (!_cache.isEnabled())
+		return false;
+	std::pair<std::string, LocationBlock> location = block.getLocationBlockPair(request.queryPath);
+	std::string ext = request.queryPath.substr(request.queryPath.find_last_of('.') + 1);
+	if (!location.second.getResponseCache() ||
+		(location.second.getProxyHost().empty() && ext != "py" && ext != "cgi"))
+		return false;
+
+	std::string key;
+	ResponseCache::Result result = _cache.lookup(request.request[0], request.request[1], request.headers,
+												 Metrics::now(), _revalidating, key, response);
+	if (result == ResponseCache::STALE)
+		_cacheRevalidate = !_cache.isFetching(key);
+	else if (result == ResponseCache::WAIT)
+		_cacheWait = key;
+	else if (result == ResponseCache::MISS)
+	{
+		_cache.begin(key, request.headers, location.second.getResponseCacheValid());
+		_cacheFetch = key;
+	}
+	return result == ResponseCache::HIT || result == ResponseCache::STALE || result == ResponseCache::WAIT;
+}
+
+// refreshes a stale entry in the background: the request is handled again
+// under a detached fd, like a client that never reads its answer
+void WebServer::revalidate(int fd, const std::string &request, std::map<int, std::string> &buffMap)
+{
+	int detached = _nextDetached--;
+
+	buffMap[detached] = request;
+	_connectionsPortMap[detached] = _connectionsPortMap[fd];
+	_requests[detached].remote = _requests[fd].remote;
+	_revalidating = true;
+	dispatch(detached, buffMap);
+}
+
+// the request on fd got its whole response (empty when it failed): the cache
+// stores it if it may and the clients waiting for it are handled again
+void WebServer::finishFetch(int fd, const std::string &response, std::map<int, std::string> &buffMap)
+{
+	std::map<int, std::string>::iterator fetch = _fetching.find(fd);
+
+	if (fetch != _fetching.end())
+	{
+		std::string key = fetch->second;
+		_fetching.erase(fetch);
+		wakeWaiters(_cache.complete(key, response, Metrics::now()), buffMap);
+	}
+	if (isDetached(fd))
+		dropDetached(fd, buffMap);
+}
+
+void WebServer::wakeWaiters(const std::vector<int> &waiters, std::map<int, std::string> &buffMap)
+{
+	for (size_t i = 0; i < waiters.size(); i++)
+	{
+		std::map<int, std::string>::iterator parked = _parked.find(waiters[i]);
+		if (parked == _parked.end())
+			continue;
+		buffMap[waiters[i]] = parked->second;
+		_parked.erase(parked);
+		setEvents(waiters[i], POLLOUT);
+		dispatch(waiters[i], buffMap);
+	}
+}
+
+void WebServer::dropDetached(int fd, std::map<int, std::string> &buffMap)
+{
+	buffMap.erase(fd);
+	_connectionsPortMap.erase(fd);
+	_requests.erase(fd);
+}
+
+// status and body size of proxied responses, as they reach the client
+// buffer, and the end of the ones fetched for the response cache
+void WebServer::handleProxyResults(std::map<int, std::string> &buffMap)
+{
+	std::vector<Proxy::Result> results = _proxy.takeResults();
+
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		if (results[i].done)
+		{
+			finishFetch(results[i].client, results[i].response, buffMap);
+			continue;
+		}
+		std::map<int, RequestRecord>::iterator record = _requests.find(results[i].client);
+		if (record == _requests.end())
+			continue;
+		if (results[i].status)
+		{
+			record->second.status = results[i].status;
+			record->second.trace.mark(RequestTrace::HANDLER_END);
+		}
+		record->second.bytes += results[i].bytes;
+	}
+}
+
+short WebServer::getEvents(int fd) const
+{
+	if (fd < 0)
+	{
+		std::map<int, Http2Stream>::const_iterator stream = _streams.find(fd);
+		return stream == _streams.end() ? 0 : stream->second.events;
+	}
+	std::map<int, short>::const_iterator it = _fds.find(fd);
+
+	return it == _fds.end() ? 0 : it->second;
+}
+
+// a background refresh: a negative fd that is not an HTTP/2 stream
+bool WebServer::isDetached(int fd) const
+{
+	return fd < 0 && !_streams.count(fd);
+}
+
+void WebServer::addFd(int fd)
+{
+	_fds[fd] = POLLIN;
+	_poller->add(fd, POLLIN);
+	if (_connectionsPortMap.count(fd))
+		Metrics::adjust(Metrics::CONNECTIONS_READING, 1);
+}
+
+void WebServer::addFds(std::vector<int> fds)
 {
 	for (std::vector<int>::iterator it = fds.begin(); it != fds.end(); it++)
 	{
-		addPfd(*it);
-		std::cout << "fd: " << *it << std::endl;
+		addFd(*it);
+		LOG(LOG_DEBUG) << "fd: " << *it;
+	}
+}
+
+void WebServer::setEvents(int fd, short events)
+{
+	// background refreshes and HTTP/2 streams have no socket; a stream
+	// remembers its events for pumpHttp2
+	if (fd < 0)
+	{
+		std::map<int, Http2Stream>::iterator stream = _streams.find(fd);
+		if (stream != _streams.end())
+			stream->second.events = events;
+		return;
+	}
+	if (_connectionsPortMap.count(fd))
+	{
+		Metrics::adjust(connectionState(_fds[fd]), -1);
+		Metrics::adjust(connectionState(events), 1);
 	}
+	_fds[fd] = events;
+	_poller->modify(fd, events);
 }
 
-void WebServer::removePfd(int index)
+void WebServer::removeFd(int fd)
 {
-	_pfds.erase(_pfds.begin() + index);
+	std::map<int, short>::iterator it = _fds.find(fd);
+	if (it != _fds.end() && _connectionsPortMap.count(fd))
+		Metrics::adjust(connectionState(it->second), -1);
+	_fds.erase(fd);
+	_poller->remove(fd);
 }
 
 std::vector<ServerBlock> &WebServer::getServers()
@@ -0,0 +1,365 @@
+#include "WebSocket.hpp"
+#include "utils.hpp"
+#include <cctype>
+#include <cstring>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#include <strings.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+#define FLAG_FIN 0x80
+#define FLAG_RSV 0x70
+#define FLAG_MASK 0x80
+
+// the largest payload a control frame may carry
+#define CONTROL_MAX_PAYLOAD 125
+
+/***********************************
+ * Constructors
+ ***********************************/
+
+WebSocket::WebSocket(double now)
+	: _input(), _message(), _output(), _messages(), _messageOpcode(OP_CONTINUATION), _closing(false), _seen(false),
+	  _pinged(false), _idleSince(now)
+{
+}
+
+WebSocket::WebSocket(const WebSocket &src)
+{
+	(void)src;
+}
+
+WebSocket &WebSocket::operator=(const WebSocket &rhs)
+{
+	(void)rhs;
+	return *this;
+}
+
+/***********************************
+ * Destructors
+ ***********************************/
+
+WebSocket::~WebSocket()
+{
+}
+
+/***********************************
+ * Handshake
+ ***********************************/
+
+// a GET asking for websocket (RFC 6455 4.2.1); key is its Sec-WebSocket-Key
+bool WebSocket::isUpgrade(const std::map<std::string, std::string> &headers, std::string &key)
+{
+	std::string upgrade, connection, version;
+
+	for (std::map<std::string, std::string>::const_iterator it = headers.begin(); it != headers.end(); it++)
+	{
+		if (!strcasecmp(it->first.c_str(), "Upgrade"))
+			upgrade = utils::trim(it->second);
+		else if (!strcasecmp(it->first.c_str(), "Connection"))
+			connection = it->second;
+		else if (!strcasecmp(it->first.c_str(), "Sec-WebSocket-Version"))
+			version = utils::trim(it->second);
+		else if (!strcasecmp(it->first.c_str(), "Sec-WebSocket-Key"))
+			key = utils::trim(it->second);
+	}
+	for (size_t i = 0; i < connection.size(); i++)
+		connection[i] = std::tolower(connection[i]);
+	return !strcasecmp(upgrade.c_str(), "websocket") && connection.find("upgrade") != std::string::npos &&
+		   version == "13" && !key.empty();
+}
+
+// the 101 accepting the upgrade
+std::string WebSocket::handshake(const std::string &key)
+{
+	std::string input = key + WEBSOCKET_GUID;
+	unsigned char digest[SHA_DIGEST_LENGTH];
+	unsigned char accept[4 * ((SHA_DIGEST_LENGTH + 2) / 3) + 1];
+
+	SHA1((const unsigned char *)input.data(), input.size(), digest);
+	EVP_EncodeBlock(accept, digest, SHA_DIGEST_LENGTH);
+	return std::string("HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+					   "Sec-WebSocket-Accept: ") +
+		   (const char *)accept + "\r\n\r\n";
+}
+
+/***********************************
+ * Frames in
+ ***********************************/
+
+// XORs the payload with the 4 byte masking key, 16 bytes at a time with SSE2
+// and 8 at a time otherwise; the payload starts at key byte 0
+void WebSocket::unmask(char *data, size_t size, const unsigned char *key)
+{
+	unsigned int key32;
+	size_t i = 0;
+
+	memcpy(&key32, key, 4);
+#ifdef __SSE2__
+	__m128i mask = _mm_set1_epi32((int)key32);
+	for (; i + 16 <= size; i += 16)
+	{
+		__m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+		_mm_storeu_si128((__m128i *)(data + i), _mm_xor_si128(block, mask));
+	}
+#endif
+	unsigned long long key64 = (unsigned long long)key32 << 32 | key32;
+	for (; i + 8 <= size; i += 8)
+	{
+		unsigned long long block;
+		memcpy(&block, data + i, 8);
+		block ^= key64;
+		memcpy(data + i, &block, 8);
+	}
+	for (; i < size; i++)
+		data[i] ^= key[i & 3];
+}
+
+// parses every complete frame; the rest waits in _input for more bytes. Most
+// reads hold whole frames, which are then taken straight from data.
+void WebSocket::receive(const char *data, size_t size)
+{
+	const char *bytes = data;
+	size_t length = size;
+	size_t used = 0;
+
+	_seen = true;
+	if (!_input.empty())
+	{
+		_input.append(data, size);
+		bytes = _input.data();
+		length = _input.size();
+	}
+	while (!_closing && used < length)
+	{
+		size_t consumed = parseFrame(bytes + used, length - used);
+		if (!consumed)
+			break;
+		used += consumed;
+	}
+	if (_closing)
+		used = length;
+	if (bytes == data)
+		_input.assign(data + used, length - used);
+	else if (used == length)
+		std::string().swap(_input);
+	else
+		_input.erase(0, used);
+}
+
+// one frame: how many bytes it took, 0 while incomplete
+size_t WebSocket::parseFrame(const char *data, size_t size)
+{
+	if (size < 2)
+		return 0;
+	unsigned char first = data[0];
+	unsigned char second = data[1];
+	Opcode opcode = (Opcode)(first & 0x0F);
+	bool fin = first & FLAG_FIN;
+	unsigned long long length = second & 0x7F;
+	size_t header = 2;
+
+	// clients must mask, and no extension was negotiated to use the RSV bits
+	if (first & FLAG_RSV || !(second & FLAG_MASK))
+		return close(STATUS_PROTOCOL_ERROR), size;
+	if (length == 126)
+	{
+		if (size < 4)
+			return 0;
+		length = (unsigned char)data[2] << 8 | (unsigned char)data[3];
+		header = 4;
+	}
+	else if (length == 127)
+	{
+		if (size < 10)
+			return 0;
+		length = 0;
+		for (int i = 2; i < 10; i++)
+			length = length << 8 | (unsigned char)data[i];
+		header = 10;
+	}
+	if (opcode & 0x8 ? !fin || length > CONTROL_MAX_PAYLOAD : length > WEBSOCKET_MAX_MESSAGE - _message.size())
+	{
+		close(opcode & 0x8 ? STATUS_PROTOCOL_ERROR : STATUS_TOO_BIG);
+		return size;
+	}
+	if (size < header + 4 + length)
+		return 0;
+	const unsigned char *key = (const unsigned char *)data + header;
+	const char *payload = data + header + 4;
+
+	if (opcode & 0x8)
+	{
+		char buff[CONTROL_MAX_PAYLOAD];
+		memcpy(buff, payload, length);
+		unmask(buff, length, key);
+		control(opcode, buff, length);
+		return header + 4 + length;
+	}
+	if (opcode == OP_CONTINUATION ? _messageOpcode == OP_CONTINUATION
+								  : (opcode != OP_TEXT && opcode != OP_BINARY) || _messageOpcode != OP_CONTINUATION)
+		return close(STATUS_PROTOCOL_ERROR), size;
+	if (opcode != OP_CONTINUATION)
+		_messageOpcode = opcode;
+	size_t start = _message.size();
+	_message.append(payload, length);
+	if (length)
+		unmask(&_message[0] + start, length, key);
+	if (fin)
+	{
+		if (_messageOpcode == OP_TEXT && !isUtf8(_message))
+			return close(STATUS_INVALID_DATA), size;
+		Message message;
+		message.opcode = _messageOpcode;
+		_messages.push_back(message);
+		_messages.back().data.swap(_message);
+		_messageOpcode = OP_CONTINUATION;
+	}
+	return header + 4 + length;
+}
+
+void WebSocket::control(Opcode opcode, char *payload, size_t size)
+{
+	if (opcode == OP_PING)
+		frame(OP_PONG, payload, size, _output);
+	else if (opcode == OP_CLOSE)
+	{
+		// the status the client sent is echoed back
+		int status = size >= 2 ? (unsigned char)payload[0] << 8 | (unsigned char)payload[1] : STATUS_NORMAL;
+		close(size == 1 ? STATUS_PROTOCOL_ERROR : status);
+	}
+	else if (opcode != OP_PONG)
+		close(STATUS_PROTOCOL_ERROR);
+}
+
+// RFC 3629: no overlong forms, surrogates or code points above U+10FFFF
+bool WebSocket::isUtf8(const std::string &data)
+{
+	const unsigned char *s = (const unsigned char *)data.data();
+	size_t size = data.size();
+	size_t i = 0;
+
+	while (i < size)
+	{
+		// ASCII runs are the common case
+		if (s[i] < 0x80)
+		{
+			i++;
+			continue;
+		}
+		size_t count;
+		unsigned int code;
+		if ((s[i] & 0xE0) == 0xC0)
+			count = 1, code = s[i] & 0x1F;
+		else if ((s[i] & 0xF0) == 0xE0)
+			count = 2, code = s[i] & 0x0F;
+		else if ((s[i] & 0xF8) == 0xF0)
+			count = 3, code = s[i] & 0x07;
+		else
+			return false;
+		if (i + count >= size)
+			return false;
+		for (size_t j = 1; j <= count; j++)
+		{
+			if ((s[i + j] & 0xC0) != 0x80)
+				return false;
+			code = code << 6 | (s[i + j] & 0x3F);
+		}
+		if ((count == 1 && code < 0x80) || (count == 2 && code < 0x800) || (count == 3 && code < 0x10000) ||
+			code > 0x10FFFF || (code >= 0xD800 && code <= 0xDFFF))
+			return false;
+		i += count + 1;
+	}
+	return true;
+}
+
+/***********************************
+ * Frames out
+ ***********************************/
+
+// a server frame, unmasked and unfragmented
+void WebSocket::frame(Opcode opcode, const char *data, size_t size, std::string &out)
+{
+	out += (char)(FLAG_FIN | opcode);
+	if (size < 126)
+		out += (char)size;
+	else if (size <= 0xFFFF)
+	{
+		out += (char)126;
+		out += (char)(size >> 8);
+		out += (char)size;
+	}
+	else
+	{
+		out += (char)127;
+		for (int shift = 56; shift >= 0; shift -= 8)
+			out += (char)((unsigned long long)size >> shift);
+	}
+	out.append(data, size);
+}
+
+// queues a frame made by frame(), so a broadcast is framed once
+void WebSocket::send(const std::string &frame)
+{
+	if (!_closing)
+		_output += frame;
+}
+
+// sends the close frame; nothing is read or sent after it, and the
+// connection ends once it is out
+void WebSocket::close(int status)
+{
+	char payload[2];
+
+	if (_closing)
+		return;
+	payload[0] = (char)(status >> 8);
+	payload[1] = (char)status;
+	frame(OP_CLOSE, payload, 2, _output);
+	_closing = true;
+}
+
+// called about once a second: pings a connection silent for
+// WEBSOCKET_PING_INTERVAL, false once the pong is WEBSOCKET_PONG_TIMEOUT late
+bool WebSocket::tick(double now)
+{
+	if (_seen)
+	{
+		_seen = false;
+		_pinged = false;
+		_idleSince = now;
+		return true;
+	}
+	if (_pinged)
+		return now - _idleSince < WEBSOCKET_PING_INTERVAL + WEBSOCKET_PONG_TIMEOUT;
+	if (now - _idleSince >= WEBSOCKET_PING_INTERVAL && !_closing)
+	{
+		frame(OP_PING, "", 0, _output);
+		_pinged = true;
+	}
+	return true;
+}
+
+std::vector<WebSocket::Message> WebSocket::takeMessages()
+{
+	std::vector<Message> messages;
+
+	messages.swap(_messages);
+	return messages;
+}
+
+std::string &WebSocket::getOutput()
+{
+	return _output;
+}
+
+// the close frame went out (or is queued); the connection ends once the
+// output is empty
+bool WebSocket::isFinished() const
+{
+	return _closing;
+}
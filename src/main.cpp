@@ -50,6 +50,6 @@ argument (./webserv [.conf])");
 	}
 	catch (const std::exception &e)
 	{
-		std::cout << BRED << e.what() << RESET << std::endl;
+		LOG(LOG_ERROR) << BRED << e.what() << RESET;
 	}
 }
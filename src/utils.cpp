@@ -1,10 +1,12 @@
 #include "utils.hpp"
 #include "CustomException.hpp"
 #include <cstddef>
+#include <ctime>
 #include <sstream>
 #include <string>
 #include <vector>
 #include <iostream>
+#include <string.h>
 
 std::vector<std::string> utils::split(std::string s, char c)
 {
@@ -58,13 +60,6 @@ int utils::stoi(std::string s, int lineNum)
 	return value;
 }
 
-std::string utils::to_string(int value)
-{
-	std::stringstream ss;
-	ss << value;
-	return ss.str();
-}
-
 std::string utils::join(std::vector<std::string> strs, std::string sep, size_t n)
 {
 	std::ostringstream ss;
@@ -73,3 +68,34 @@ std::string utils::join(std::vector<std::string> strs, std::string sep, size_t n
 		ss << sep << strs[i];
 	return ss.str();
 }
+
+std::string utils::trim(const std::string &s)
+{
+	size_t start = s.find_first_not_of(" \t");
+	if (start == std::string::npos)
+		return "";
+	size_t end = s.find_last_not_of(" \t");
+	return s.substr(start, end - start + 1);
+}
+
+// IMF-fixdate, the only format HTTP/1.1 servers generate (RFC 9110 5.6.7)
+std::string utils::httpDate(time_t t)
+{
+	char date[64];
+	struct tm tm;
+
+	gmtime_r(&t, &tm);
+	std::strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	return date;
+}
+
+time_t utils::parseHttpDate(const std::string &s)
+{
+	struct tm tm;
+
+	memset(&tm, 0, sizeof(tm));
+	const char *end = strptime(s.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	if (!end || *end != '\0')
+		return -1;
+	return timegm(&tm);
+}